@@ -1,6 +1,7 @@
 
 #include <list>
 #include <sstream>
+#include <algorithm>
 
 #include "flame/base.h"
 
@@ -127,6 +128,11 @@ struct confval : public boost::static_visitor<PyRef<> >
     }
 };
 
+struct entry_name_less {
+    bool operator()(const Config::entry_t *lhs, const Config::entry_t *rhs) const
+    { return lhs->first.name()<rhs->first.name(); }
+};
+
 } // namespace
 
 PyObject* conf2dict(const Config *conf)
@@ -135,11 +141,16 @@ PyObject* conf2dict(const Config *conf)
         return NULL;
     PyRef<> list(PyList_New(0));
 
-    for(Config::const_iterator it=conf->begin(), end=conf->end();
-        it!=end; ++it)
+    // in order of name
+    std::vector<const Config::entry_t*> entries;
+    for(Config::const_iterator it=conf->begin(), end=conf->end(); it!=end; ++it)
+        entries.push_back(&*it);
+    std::sort(entries.begin(), entries.end(), entry_name_less());
+
+    for(size_t i=0; i<entries.size(); i++)
     {
-        PyRef<> val(boost::apply_visitor(confval(), it->second));
-        PyRef<> tup(Py_BuildValue("sO", it->first.c_str(), val.py()));
+        PyRef<> val(boost::apply_visitor(confval(), entries[i]->second));
+        PyRef<> tup(Py_BuildValue("sO", entries[i]->first.name().c_str(), val.py()));
         if(PyList_Append(list.py(), tup.py()))
             throw std::runtime_error("Failed to insert into dictionary from conf2dict");
     }
@@ -1,9 +1,21 @@
 #include <climits>
+#include <algorithm>
 #include <sstream>
 
 #include "flame/base.h"
+#include "flame/moment_sup.h"
+#include "flame/rf_cavity.h"
+#include "flame/response.h"
+#include "flame/scan.h"
+#include "flame/match.h"
+#include "flame/pipeline.h"
+#include "flame/chargestates.h"
 #include "pyflame.h"
 
+#define NO_IMPORT_ARRAY
+#define PY_ARRAY_UNIQUE_SYMBOL FLAME_PyArray_API
+#include <numpy/ndarrayobject.h>
+
 
 #define TRY PyMachine *machine = reinterpret_cast<PyMachine*>(raw); try
 
@@ -14,6 +26,8 @@ struct PyMachine {
 
     PyObject *weak;
     Machine *machine;
+    // for propagateChargeStates().  Created on first use
+    ChargeStatePropagator *chargestates;
 };
 
 static
@@ -36,6 +50,8 @@ static
 void PyMachine_free(PyObject *raw)
 {
     TRY {
+        delete machine->chargestates;
+        machine->chargestates = NULL;
         std::auto_ptr<Machine> S(machine->machine);
         machine->machine = NULL;
 
@@ -150,6 +166,20 @@ struct PyScopedObserver
         observed.push_back(i);
         (*machine)[i]->set_observer(o);
     }
+    //! observe each index in the python iterable 'list', unless None
+    void observe(PyObject *list, Observer *o)
+    {
+        if(list==Py_None)
+            return;
+        PyRef<> iter(PyObject_GetIter(list)), item;
+
+        while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+            Py_ssize_t num = PyNumber_AsSsize_t(item.py(), PyExc_ValueError);
+            if(PyErr_Occurred())
+                throw std::runtime_error(""); // caller will get active python exception
+            observe(num, o);
+        }
+    }
 };
 
 static
@@ -169,17 +199,7 @@ PyObject *PyMachine_propagate(PyObject *raw, PyObject *args, PyObject *kws)
         PyStoreObserver observer;
         PyScopedObserver observing(machine->machine);
 
-        if(toobserv!=Py_None) {
-            PyRef<> iter(PyObject_GetIter(toobserv)), item;
-
-            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
-                Py_ssize_t num = PyNumber_AsSsize_t(item.py(), PyExc_ValueError);
-                if(PyErr_Occurred())
-                    throw std::runtime_error(""); // caller will get active python exception
-                observing.observe(num, &observer);
-
-            }
-        }
+        observing.observe(toobserv, &observer);
 
         machine->machine->propagate(unwrapstate(state), start, max);
         if(toobserv) {
@@ -191,6 +211,240 @@ PyObject *PyMachine_propagate(PyObject *raw, PyObject *args, PyObject *kws)
     CATCH()
 }
 
+static
+PyObject *PyMachine_propagatePipeline(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *pystates;
+        unsigned nsegments = 0;
+        unsigned long start = 0, depth = 64;
+        int max = INT_MAX;
+        const char *pnames[] = {"states", "nsegments", "start", "max", "depth", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|Ikik", (char**)pnames, &pystates, &nsegments, &start, &max, &depth))
+            return NULL;
+
+        // keep a reference to each State while propagating
+        PyRef<> seq(PySequence_Fast(pystates, "propagatePipeline() expects a sequence of State"));
+        const Py_ssize_t N = PySequence_Fast_GET_SIZE(seq.py());
+        std::vector<StateBase*> states(N);
+        for(Py_ssize_t i=0; i<N; i++)
+            states[i] = unwrapstate(PySequence_Fast_GET_ITEM(seq.py(), i));
+        {
+            // one State can't be in two segments at once
+            std::vector<StateBase*> sorted(states);
+            std::sort(sorted.begin(), sorted.end());
+            if(std::adjacent_find(sorted.begin(), sorted.end())!=sorted.end())
+                return PyErr_Format(PyExc_ValueError, "propagatePipeline() given the same State more than once");
+        }
+
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            Pipeline P(*machine->machine, nsegments, start, max, depth);
+            P.propagate(states);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        Py_RETURN_NONE;
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_propagateChargeStates(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state, *toobserv = Py_None;
+        unsigned long start = 0, max = (unsigned long)-1;
+        unsigned nthreads = 0;
+        const char *pnames[] = {"state", "start", "max", "observe", "nthreads", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|kkOI", (char**)pnames, &state, &start, &max, &toobserv, &nthreads))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        if(machine->chargestates && nthreads && machine->chargestates->nthreads()!=nthreads) {
+            delete machine->chargestates;
+            machine->chargestates = NULL;
+        }
+        if(!machine->chargestates)
+            machine->chargestates = new ChargeStatePropagator(*machine->machine, nthreads);
+
+        PyStoreObserver observer;
+        PyScopedObserver observing(machine->machine);
+
+        observing.observe(toobserv, &observer);
+
+        machine->chargestates->propagate(*ST, start, max);
+
+        return observer.list.release();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_repeats(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        const char *pnames[] = {NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "", (char**)pnames))
+            return NULL;
+
+        const Machine::repeats_t& R = machine->machine->repeats();
+
+        PyRef<> ret(PyList_New(R.size()));
+        for(size_t i=0; i<R.size(); i++) {
+            PyObject *tup = Py_BuildValue("kkk", (unsigned long)R[i].first,
+                                          (unsigned long)R[i].length, (unsigned long)R[i].count);
+            if(!tup)
+                return NULL;
+            PyList_SET_ITEM(ret.py(), i, tup);
+        }
+        return ret.release();
+    } CATCH()
+}
+
+static
+PyObject *PyMachine_propagateRepeats(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state;
+        unsigned long start = 0, max = (unsigned long)-1;
+        const char *pnames[] = {"state", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|kk", (char**)pnames, &state, &start, &max))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        size_t nmapped = propagate_repeats(*machine->machine, *ST, start, max);
+
+        return PyInt_FromSize_t(nmapped);
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_propagateTurns(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state, *toobserv = Py_None;
+        unsigned long nturns, start = 0, every = 1;
+        const char *pnames[] = {"state", "nturns", "start", "every", "observe", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "Ok|kkO", (char**)pnames, &state, &nturns, &start, &every, &toobserv))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        PyStoreObserver observer;
+        PyScopedObserver observing(machine->machine);
+
+        observing.observe(toobserv, &observer);
+
+        propagate_turns(*machine->machine, *ST, nturns, start, every);
+
+        return observer.list.release();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_propagateLong(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state;
+        unsigned long start = 0, max = (unsigned long)-1;
+        const char *pnames[] = {"state", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|kk", (char**)pnames, &state, &start, &max))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        std::vector<ParticleSet> inputs;
+        propagate_long(*machine->machine, *ST, start, max, &inputs);
+
+        // output of each element is the input of the next
+        npy_intp dims[1] = {(npy_intp)inputs.size()};
+        PyRef<> pyek(PyArray_SimpleNew(1, dims, NPY_DOUBLE)),
+                pyphis(PyArray_SimpleNew(1, dims, NPY_DOUBLE));
+        double *ek = (double*)PyArray_DATA(pyek.py()),
+               *phis = (double*)PyArray_DATA(pyphis.py());
+        for(size_t i=0; i<inputs.size(); i++) {
+            const Particle& P = i+1<inputs.size() ? inputs[i+1].ref : ST->ref;
+            ek[i]   = P.IonEk;
+            phis[i] = P.phis;
+        }
+
+        return Py_BuildValue("(OO)", pyek.py(), pyphis.py());
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_warmup(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state;
+        unsigned long start = 0, max = (unsigned long)-1;
+        const char *pnames[] = {"state", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|kk", (char**)pnames, &state, &start, &max))
+            return NULL;
+
+        const MomentState *ST = dynamic_cast<const MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        // worker threads may log, which needs the interpreter lock
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            warmup(*machine->machine, *ST, start, max);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        Py_RETURN_NONE;
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_cacheMisses(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        const char *pnames[] = {NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "", (char**)pnames))
+            return NULL;
+
+        const Machine& M = *machine->machine;
+        PyRef<> ret(PyList_New(M.size()));
+        for(size_t i=0; i<M.size(); i++) {
+            const MomentElementBase *E = dynamic_cast<const MomentElementBase*>(M[i]);
+            PyObject *val;
+            if(E) {
+                val = PyInt_FromSize_t(E->cache_misses);
+                if(!val)
+                    return NULL;
+            } else {
+                val = Py_None;
+                Py_INCREF(val);
+            }
+            PyList_SET_ITEM(ret.py(), i, val);
+        }
+        return ret.release();
+    } CATCH()
+}
+
 static
 PyObject *PyMachine_reconfigure(PyObject *raw, PyObject *args, PyObject *kws)
 {
@@ -218,6 +472,549 @@ PyObject *PyMachine_reconfigure(PyObject *raw, PyObject *args, PyObject *kws)
     CATCH()
 }
 
+static
+PyObject *PyMachine_setParam(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        unsigned long idx;
+        const char *name;
+        double value;
+        const char *pnames[] = {"index", "name", "value", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "ksd", (char**)pnames, &idx, &name, &value))
+            return NULL;
+
+        machine->machine->setParam(idx, name, value);
+
+        Py_RETURN_NONE;
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_setParams(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *pyupdates;
+        const char *pnames[] = {"updates", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O", (char**)pnames, &pyupdates))
+            return NULL;
+
+        PyRef<> iter(PyObject_GetIter(pyupdates)), item;
+        std::vector<Machine::ParamUpdate> updates;
+
+        while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+            unsigned long idx;
+            const char *name;
+            double value;
+            if(!PyArg_ParseTuple(item.py(), "ksd;setParams() expects a sequence of (index, name, value)", &idx, &name, &value))
+                return NULL;
+
+            updates.push_back(Machine::ParamUpdate(idx, name, value));
+        }
+        if(PyErr_Occurred())
+            return NULL;
+
+        machine->machine->setParams(updates);
+
+        Py_RETURN_NONE;
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_responseMatrix(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyknobs, *pyobserve;
+        double step = 1e-6;
+        unsigned nthreads = 0;
+        const char *pnames[] = {"state", "knobs", "observe", "step", "nthreads", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OOO|dI", (char**)pnames, &state, &pyknobs, &pyobserve, &step, &nthreads))
+            return NULL;
+
+        const MomentState *ST = dynamic_cast<const MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        ResponseMatrix R;
+        R.nthreads = nthreads;
+
+        PyRef<> iter(PyObject_GetIter(pyknobs)), item;
+        while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+            unsigned long idx;
+            const char *name;
+            double kstep = step;
+            if(!PyArg_ParseTuple(item.py(), "ks|d;responseMatrix() expects knobs as a sequence of (index, name) or (index, name, step)", &idx, &name, &kstep))
+                return NULL;
+            R.knobs.push_back(ResponseMatrix::Knob(idx, name, kstep));
+        }
+        if(PyErr_Occurred())
+            return NULL;
+
+        PyRef<> obs(PyArray_ContiguousFromAny(pyobserve, NPY_ULONG, 1, 1));
+        const unsigned long *buf = (const unsigned long*)PyArray_DATA(obs.py());
+        R.observe.assign(buf, buf+PyArray_SIZE(obs.py()));
+
+        // worker threads may log, which needs the interpreter lock
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            R.compute(*machine->machine, *ST);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        npy_intp dims[3] = {(npy_intp)R.observe.size(), MomentState::maxsize, (npy_intp)R.knobs.size()};
+        PyRef<> resp(PyArray_SimpleNew(3, dims, NPY_DOUBLE));
+        std::copy(R.response.begin(), R.response.end(), (double*)PyArray_DATA(resp.py()));
+
+        return resp.release();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_gradient(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyparams;
+        unsigned long start = 0;
+        int max = INT_MAX;
+        const char *pnames[] = {"state", "params", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OO|ki", (char**)pnames, &state, &pyparams, &start, &max))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        MomentGradient G;
+
+        PyRef<> iter(PyObject_GetIter(pyparams)), item;
+        while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+            unsigned long idx;
+            const char *name;
+            if(!PyArg_ParseTuple(item.py(), "ks;gradient() expects params as a sequence of (index, name)", &idx, &name))
+                return NULL;
+            G.params.push_back(MomentGradient::Param(idx, name));
+        }
+        if(PyErr_Occurred())
+            return NULL;
+
+        G.compute(*machine->machine, *ST, start, max);
+
+        const size_t N = MomentState::maxsize;
+        npy_intp dims[3] = {(npy_intp)G.params.size(), (npy_intp)N, (npy_intp)N};
+        PyRef<> dm0(PyArray_SimpleNew(2, dims, NPY_DOUBLE)),
+                dm1(PyArray_SimpleNew(3, dims, NPY_DOUBLE));
+        double *p0 = (double*)PyArray_DATA(dm0.py()),
+               *p1 = (double*)PyArray_DATA(dm1.py());
+        for(size_t j=0; j<G.params.size(); j++) {
+            std::copy(G.dmoment0_env[j].begin(), G.dmoment0_env[j].end(), p0+j*N);
+            for(size_t r=0; r<N; r++)
+                for(size_t c=0; c<N; c++)
+                    p1[(j*N + r)*N + c] = G.dmoment1_env[j](r, c);
+        }
+
+        return Py_BuildValue("(OO)", dm0.py(), dm1.py());
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_adjoint(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyparams, *pyw0 = Py_None, *pyw1 = Py_None;
+        unsigned long start = 0;
+        int max = INT_MAX;
+        const char *pnames[] = {"state", "params", "dmoment0_env", "dmoment1_env", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OO|OOki", (char**)pnames, &state, &pyparams, &pyw0, &pyw1, &start, &max))
+            return NULL;
+
+        MomentState *ST = dynamic_cast<MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        const size_t N = MomentState::maxsize;
+        MomentAdjoint A;
+
+        PyRef<> iter(PyObject_GetIter(pyparams)), item;
+        while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+            unsigned long idx;
+            const char *name;
+            if(!PyArg_ParseTuple(item.py(), "ks;adjoint() expects params as a sequence of (index, name)", &idx, &name))
+                return NULL;
+            A.params.push_back(MomentGradient::Param(idx, name));
+        }
+        if(PyErr_Occurred())
+            return NULL;
+
+        if(pyw0!=Py_None) {
+            PyRef<> arr(PyArray_ContiguousFromAny(pyw0, NPY_DOUBLE, 1, 1));
+            if(PyArray_DIM(arr.py(), 0)!=(npy_intp)N)
+                return PyErr_Format(PyExc_ValueError, "dmoment0_env must have shape [7]");
+            const double *buf = (const double*)PyArray_DATA(arr.py());
+            std::copy(buf, buf+N, A.weight0.begin());
+        }
+        if(pyw1!=Py_None) {
+            PyRef<> arr(PyArray_ContiguousFromAny(pyw1, NPY_DOUBLE, 2, 2));
+            if(PyArray_DIM(arr.py(), 0)!=(npy_intp)N || PyArray_DIM(arr.py(), 1)!=(npy_intp)N)
+                return PyErr_Format(PyExc_ValueError, "dmoment1_env must have shape [7, 7]");
+            const double *buf = (const double*)PyArray_DATA(arr.py());
+            for(size_t r=0; r<N; r++)
+                for(size_t c=0; c<N; c++)
+                    A.weight1(r, c) = buf[r*N + c];
+        }
+
+        A.compute(*machine->machine, *ST, start, max);
+
+        npy_intp dims[1] = {(npy_intp)A.params.size()};
+        PyRef<> grad(PyArray_SimpleNew(1, dims, NPY_DOUBLE));
+        std::copy(A.gradient.begin(), A.gradient.end(), (double*)PyArray_DATA(grad.py()));
+
+        return grad.release();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_scan(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyaxes, *pyobserve, *pyfields = Py_None, *pyzip = Py_False;
+        unsigned nthreads = 0;
+        const char *pnames[] = {"state", "axes", "observe", "fields", "zip", "nthreads", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OOO|OOI", (char**)pnames, &state, &pyaxes, &pyobserve, &pyfields, &pyzip, &nthreads))
+            return NULL;
+
+        Scan S;
+        S.nthreads = nthreads;
+        S.zip = PyObject_IsTrue(pyzip);
+
+        {
+            PyRef<> iter(PyObject_GetIter(pyaxes)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                unsigned long idx;
+                const char *name;
+                PyObject *pyvals;
+                if(!PyArg_ParseTuple(item.py(), "ksO;scan() expects axes as a sequence of (index, name, values)", &idx, &name, &pyvals))
+                    return NULL;
+                S.axes.push_back(Scan::Axis(idx, name));
+
+                PyRef<> vals(PyArray_ContiguousFromAny(pyvals, NPY_DOUBLE, 1, 1));
+                const double *buf = (const double*)PyArray_DATA(vals.py());
+                S.axes.back().values.assign(buf, buf+PyArray_SIZE(vals.py()));
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        PyRef<> obs(PyArray_ContiguousFromAny(pyobserve, NPY_ULONG, 1, 1));
+        const unsigned long *obuf = (const unsigned long*)PyArray_DATA(obs.py());
+        S.observe.assign(obuf, obuf+PyArray_SIZE(obs.py()));
+
+        if(pyfields==Py_None) {
+            S.fields.push_back("moment0_env");
+        } else {
+            PyRef<> iter(PyObject_GetIter(pyfields)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                PyCString fname;
+                S.fields.push_back(fname.c_str(item.py()));
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        const StateBase *ST = unwrapstate(state);
+
+        // worker threads may log, which needs the interpreter lock
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            S.compute(*machine->machine, *ST);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        PyRef<> ret(PyDict_New());
+        for(size_t f=0; f<S.fields.size(); f++) {
+            std::vector<npy_intp> dims;
+            dims.push_back(S.npoints());
+            dims.push_back(S.observe.size());
+            dims.insert(dims.end(), S.shapes[f].begin(), S.shapes[f].end());
+
+            PyRef<> arr(PyArray_SimpleNew(dims.size(), &dims[0], NPY_DOUBLE));
+            std::copy(S.results[f].begin(), S.results[f].end(), (double*)PyArray_DATA(arr.py()));
+
+            if(PyDict_SetItemString(ret.py(), S.fields[f].c_str(), arr.py()))
+                return NULL;
+        }
+
+        return ret.release();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_errorStudy(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyerrors, *pyobserve, *pyfields = Py_None, *pyprob = Py_None;
+        unsigned long nsamples, seed = 0;
+        unsigned nthreads = 0;
+        const char *pnames[] = {"state", "errors", "observe", "nsamples", "fields", "quantiles", "seed", "nthreads", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OOOk|OOkI", (char**)pnames, &state, &pyerrors, &pyobserve, &nsamples,
+                                        &pyfields, &pyprob, &seed, &nthreads))
+            return NULL;
+
+        ErrorStudy S;
+        S.nsamples = nsamples;
+        S.seed = seed;
+        S.nthreads = nthreads;
+
+        {
+            PyRef<> iter(PyObject_GetIter(pyerrors)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                unsigned long idx;
+                const char *name, *dist = "gaussian";
+                double width, cut = 0.0;
+                if(!PyArg_ParseTuple(item.py(), "ksd|sd;errorStudy() expects errors as a sequence of (index, name, width[, dist[, cut]])",
+                                     &idx, &name, &width, &dist, &cut))
+                    return NULL;
+                ErrorStudy::Error::dist_t D;
+                if(strcmp(dist, "gaussian")==0)
+                    D = ErrorStudy::Error::Gaussian;
+                else if(strcmp(dist, "uniform")==0)
+                    D = ErrorStudy::Error::Uniform;
+                else
+                    return PyErr_Format(PyExc_ValueError, "unknown error distribution '%s'", dist);
+                S.errors.push_back(ErrorStudy::Error(idx, name, width, D, cut));
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        PyRef<> obs(PyArray_ContiguousFromAny(pyobserve, NPY_ULONG, 1, 1));
+        const unsigned long *obuf = (const unsigned long*)PyArray_DATA(obs.py());
+        S.observe.assign(obuf, obuf+PyArray_SIZE(obs.py()));
+
+        if(pyfields==Py_None) {
+            S.fields.push_back("moment0_env");
+        } else {
+            PyRef<> iter(PyObject_GetIter(pyfields)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                PyCString fname;
+                S.fields.push_back(fname.c_str(item.py()));
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        if(pyprob==Py_None) {
+            S.probabilities.push_back(0.05);
+            S.probabilities.push_back(0.5);
+            S.probabilities.push_back(0.95);
+        } else {
+            PyRef<> arr(PyArray_ContiguousFromAny(pyprob, NPY_DOUBLE, 1, 1));
+            const double *buf = (const double*)PyArray_DATA(arr.py());
+            S.probabilities.assign(buf, buf+PyArray_SIZE(arr.py()));
+        }
+
+        const StateBase *ST = unwrapstate(state);
+
+        // worker threads may log, which needs the interpreter lock
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            S.compute(*machine->machine, *ST);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        npy_intp ndims[1] = {(npy_intp)S.observe.size()};
+        PyRef<> count(PyArray_SimpleNew(1, ndims, NPY_ULONG));
+        std::copy(S.count.begin(), S.count.end(), (unsigned long*)PyArray_DATA(count.py()));
+
+        PyRef<> ret(PyDict_New());
+        for(size_t f=0; f<S.fields.size(); f++) {
+            const ErrorStudy::Stats& R = S.stats[f];
+
+            std::vector<npy_intp> dims;
+            dims.push_back(S.probabilities.size());
+            dims.push_back(S.observe.size());
+            dims.insert(dims.end(), S.shapes[f].begin(), S.shapes[f].end());
+
+            PyRef<> mean(PyArray_SimpleNew(dims.size()-1, &dims[1], NPY_DOUBLE)),
+                    var (PyArray_SimpleNew(dims.size()-1, &dims[1], NPY_DOUBLE)),
+                    min (PyArray_SimpleNew(dims.size()-1, &dims[1], NPY_DOUBLE)),
+                    max (PyArray_SimpleNew(dims.size()-1, &dims[1], NPY_DOUBLE)),
+                    quantile(PyArray_SimpleNew(dims.size(), &dims[0], NPY_DOUBLE));
+            std::copy(R.mean.begin(), R.mean.end(), (double*)PyArray_DATA(mean.py()));
+            std::copy(R.var.begin(), R.var.end(), (double*)PyArray_DATA(var.py()));
+            std::copy(R.min.begin(), R.min.end(), (double*)PyArray_DATA(min.py()));
+            std::copy(R.max.begin(), R.max.end(), (double*)PyArray_DATA(max.py()));
+            std::copy(R.quantile.begin(), R.quantile.end(), (double*)PyArray_DATA(quantile.py()));
+
+            PyRef<> stats(Py_BuildValue("{sOsOsOsOsO}", "mean", mean.py(), "var", var.py(),
+                                        "min", min.py(), "max", max.py(), "quantile", quantile.py()));
+
+            if(PyDict_SetItemString(ret.py(), S.fields[f].c_str(), stats.py()))
+                return NULL;
+        }
+
+        return Py_BuildValue("(OO)", count.py(), ret.py());
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_match(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyknobs, *pytargets;
+        const char *jac = "auto";
+        unsigned maxiter = 100, nthreads = 0;
+        double tol = 1e-10;
+        const char *pnames[] = {"state", "knobs", "targets", "jacobian", "maxiter", "tol", "nthreads", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OOO|sIdI", (char**)pnames, &state, &pyknobs, &pytargets,
+                                        &jac, &maxiter, &tol, &nthreads))
+            return NULL;
+
+        Matcher X;
+        X.maxiter = maxiter;
+        X.tol = tol;
+        X.nthreads = nthreads;
+        if(strcmp(jac, "auto")==0)
+            X.jacobian = Matcher::Auto;
+        else if(strcmp(jac, "analytic")==0)
+            X.jacobian = Matcher::Analytic;
+        else if(strcmp(jac, "fd")==0)
+            X.jacobian = Matcher::FiniteDifference;
+        else
+            return PyErr_Format(PyExc_ValueError, "unknown jacobian '%s'", jac);
+
+        {
+            PyRef<> iter(PyObject_GetIter(pyknobs)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                Matcher::Knob K;
+                unsigned long idx;
+                const char *name;
+                if(!PyArg_ParseTuple(item.py(), "ks|ddd;match() expects knobs as a sequence of (index, name[, lower, upper[, step]])",
+                                     &idx, &name, &K.lower, &K.upper, &K.step))
+                    return NULL;
+                K.index = idx;
+                K.name = name;
+                X.knobs.push_back(K);
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        {
+            PyRef<> iter(PyObject_GetIter(pytargets)), item;
+            while(item.reset(PyIter_Next(iter.py()), PyRef<>::allow_null())) {
+                Matcher::Target T;
+                unsigned long idx;
+                const char *field;
+                PyObject *pyat;
+                if(!PyArg_ParseTuple(item.py(), "ksOd|d;match() expects targets as a sequence of (index, field, at, value[, weight])",
+                                     &idx, &field, &pyat, &T.value, &T.weight))
+                    return NULL;
+                T.index = idx;
+                T.field = field;
+
+                if(PySequence_Check(pyat)) {
+                    PyRef<> aiter(PyObject_GetIter(pyat)), aitem;
+                    while(aitem.reset(PyIter_Next(aiter.py()), PyRef<>::allow_null())) {
+                        Py_ssize_t i = PyNumber_AsSsize_t(aitem.py(), PyExc_IndexError);
+                        if(i==-1 && PyErr_Occurred())
+                            return NULL;
+                        T.at.push_back(i);
+                    }
+                    if(PyErr_Occurred())
+                        return NULL;
+                } else {
+                    Py_ssize_t i = PyNumber_AsSsize_t(pyat, PyExc_IndexError);
+                    if(i==-1 && PyErr_Occurred())
+                        return NULL;
+                    T.at.push_back(i);
+                }
+                X.targets.push_back(T);
+            }
+            if(PyErr_Occurred())
+                return NULL;
+        }
+
+        const StateBase *ST = unwrapstate(state);
+
+        // worker threads may log, which needs the interpreter lock
+        PyThreadState *save = PyEval_SaveThread();
+        try {
+            X.compute(*machine->machine, *ST);
+        } catch(...) {
+            PyEval_RestoreThread(save);
+            throw;
+        }
+        PyEval_RestoreThread(save);
+
+        npy_intp xdims[1] = {(npy_intp)X.x.size()},
+                 rdims[1] = {(npy_intp)X.residual.size()};
+        PyRef<> x(PyArray_SimpleNew(1, xdims, NPY_DOUBLE)),
+                residual(PyArray_SimpleNew(1, rdims, NPY_DOUBLE));
+        std::copy(X.x.begin(), X.x.end(), (double*)PyArray_DATA(x.py()));
+        std::copy(X.residual.begin(), X.residual.end(), (double*)PyArray_DATA(residual.py()));
+
+        return Py_BuildValue("{sOsOsdsIsOsOsO}", "x", x.py(), "residual", residual.py(),
+                             "cost", X.cost, "iterations", X.iterations,
+                             "converged", X.converged ? Py_True : Py_False,
+                             "stalled", X.stalled ? Py_True : Py_False,
+                             "analytic", X.analytic ? Py_True : Py_False);
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyMachine_scanPhase(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY{
+        PyObject *state, *pyphases;
+        unsigned long idx;
+        const char *pnames[] = {"state", "index", "phases", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "OkO", (char**)pnames, &state, &idx, &pyphases))
+            return NULL;
+
+        if(idx>=machine->machine->size())
+            return PyErr_Format(PyExc_ValueError, "invalid element index %lu", idx);
+
+        const ElementRFCavity *cav = dynamic_cast<const ElementRFCavity*>((*machine->machine)[idx]);
+        if(!cav)
+            return PyErr_Format(PyExc_ValueError, "element %lu is not an rfcavity", idx);
+
+        const MomentState *ST = dynamic_cast<const MomentState*>(unwrapstate(state));
+        if(!ST)
+            return PyErr_Format(PyExc_ValueError, "State is not a MomentMatrix state");
+
+        PyRef<> arr(PyArray_ContiguousFromAny(pyphases, NPY_DOUBLE, 1, 1));
+        const double *buf = (const double*)PyArray_DATA(arr.py());
+        std::vector<double> phases(buf, buf+PyArray_SIZE(arr.py())), IonEk, phis;
+
+        cav->scanPhase(ST->ref, phases, IonEk, phis);
+
+        npy_intp dims[1] = {(npy_intp)phases.size()};
+        PyRef<> pyek(PyArray_SimpleNew(1, dims, NPY_DOUBLE)),
+                pyphis(PyArray_SimpleNew(1, dims, NPY_DOUBLE));
+        std::copy(IonEk.begin(), IonEk.end(), (double*)PyArray_DATA(pyek.py()));
+        std::copy(phis.begin(), phis.end(), (double*)PyArray_DATA(pyphis.py()));
+
+        return Py_BuildValue("(OO)", pyek.py(), pyphis.py());
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
 static
 PyObject *PyMachine_find(PyObject *raw, PyObject *args, PyObject *kws)
 {
@@ -262,6 +1059,142 @@ Py_ssize_t PyMachine_len(PyObject *raw)
     }CATCH1(-1)
 }
 
+// Python wrapper of Propagation, created by Machine.propagation()
+struct PyPropagation {
+    PyObject_HEAD
+
+    PyObject *machine; // strong references, which must outlive prop
+    PyObject *state;
+    CancelToken *token;
+    Propagation *prop;
+};
+
+#define PTRY PyPropagation *P = reinterpret_cast<PyPropagation*>(raw); try
+
+static
+void PyPropagation_free(PyObject *raw)
+{
+    PTRY {
+        delete P->prop;
+        delete P->token;
+        Py_XDECREF(P->state);
+        Py_XDECREF(P->machine);
+
+        Py_TYPE(raw)->tp_free(raw);
+    } CATCH2V(std::exception, RuntimeError)
+}
+
+static
+PyObject *PyPropagation_step(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    PTRY {
+        unsigned long n = 1;
+        const char *pnames[] = {"n", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "|k", (char**)pnames, &n))
+            return NULL;
+
+        return PyBool_FromLong(P->prop->step(n));
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
+static
+PyObject *PyPropagation_cancel(PyObject *raw)
+{
+    PTRY {
+        P->token->cancel();
+        Py_RETURN_NONE;
+    } CATCH()
+}
+
+static
+PyObject *PyPropagation_done(PyObject *raw)
+{
+    PTRY {
+        return PyBool_FromLong(P->prop->done());
+    } CATCH()
+}
+
+static
+PyObject *PyPropagation_cancelled(PyObject *raw)
+{
+    PTRY {
+        return PyBool_FromLong(P->prop->cancelled());
+    } CATCH()
+}
+
+static
+PyObject *PyPropagation_count(PyObject *raw)
+{
+    PTRY {
+        return PyInt_FromSize_t(P->prop->count());
+    } CATCH()
+}
+
+#undef PTRY
+
+static PyMethodDef PyPropagation_methods[] = {
+    {"step", (PyCFunction)&PyPropagation_step, METH_VARARGS|METH_KEYWORDS,
+     "step(n=1) -> bool\n"
+     "Pass the State through at most n more elements.\n"
+     "Returns True if elements remain, False when finished or cancelled."},
+    {"cancel", (PyCFunction)&PyPropagation_cancel, METH_NOARGS,
+     "cancel()\n"
+     "Stop before the next element."},
+    {"done", (PyCFunction)&PyPropagation_done, METH_NOARGS,
+     "done() -> bool\n"
+     "True when finished or cancelled."},
+    {"cancelled", (PyCFunction)&PyPropagation_cancelled, METH_NOARGS,
+     "cancelled() -> bool\n"
+     "True if stopped by cancel()."},
+    {"count", (PyCFunction)&PyPropagation_count, METH_NOARGS,
+     "count() -> int\n"
+     "Number of elements passed so far."},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject PyPropagationType = {
+#if PY_MAJOR_VERSION >= 3
+    PyVarObject_HEAD_INIT(NULL, 0)
+#else
+    PyObject_HEAD_INIT(NULL)
+    0,
+#endif
+    "flame._internal.Propagation",
+    sizeof(PyPropagation),
+};
+
+static
+PyObject *PyMachine_propagation(PyObject *raw, PyObject *args, PyObject *kws)
+{
+    TRY {
+        PyObject *state;
+        unsigned long start = 0;
+        int max = INT_MAX;
+        const char *pnames[] = {"state", "start", "max", NULL};
+        if(!PyArg_ParseTupleAndKeywords(args, kws, "O|ki", (char**)pnames, &state, &start, &max))
+            return NULL;
+
+        StateBase *ST = unwrapstate(state);
+
+        PyRef<PyPropagation> P(PyPropagationType.tp_alloc(&PyPropagationType, 0));
+        P->machine = P->state = NULL;
+        P->token = NULL;
+        P->prop = NULL;
+
+        P->token = new CancelToken;
+        P->prop = new Propagation(*machine->machine, ST, start, max, P->token);
+
+        Py_INCREF(raw);
+        P->machine = raw;
+        Py_INCREF(state);
+        P->state = state;
+
+        return P.releasePy();
+    } CATCH2(std::invalid_argument, ValueError)
+    CATCH()
+}
+
 static PyMethodDef PyMachine_methods[] = {
     {"conf", (PyCFunction)&PyMachine_conf, METH_VARARGS|METH_KEYWORDS,
      "conf() -> {} Machine config\n"
@@ -281,9 +1214,141 @@ static PyMethodDef PyMachine_methods[] = {
      "observe may be None or an iterable yielding element indicies.\n"
      "In the second form propagate() returns a list of tuples with the output State of the selected elements."
     },
+    {"propagation", (PyCFunction)&PyMachine_propagation, METH_VARARGS|METH_KEYWORDS,
+     "propagation(State, start=0, max=INT_MAX) -> Propagation\n"
+     "Prepare to propagate the provided State in steps, as by propagate().\n"
+     "\n"
+     "Nothing is done until Propagation.step() is called.\n"
+     "The Machine must not be otherwise propagated between steps."
+    },
+    {"propagatePipeline", (PyCFunction)&PyMachine_propagatePipeline, METH_VARARGS|METH_KEYWORDS,
+     "propagatePipeline([State, ...], nsegments=0, start=0, max=INT_MAX, depth=64)\n"
+     "Propagate each of the provided States, as by propagate(), with the elements divided into\n"
+     "nsegments contiguous segments (0 for the number of cores), each handled by one thread.\n"
+     "\n"
+     "States are handed between segments through lock-free queues of capacity depth,\n"
+     "so that each element is only used by one thread while segments work on successive States.\n"
+     "Raises RuntimeError for the first failed propagation, after all States have been processed."
+    },
+    {"propagateChargeStates", (PyCFunction)&PyMachine_propagateChargeStates, METH_VARARGS|METH_KEYWORDS,
+     "propagateChargeStates(State, start=0, max=INT_MAX, observe=None, nthreads=0) -> [(index, State)]\n"
+     "Propagate the provided State, as by propagate(), with the charge states divided between nthreads threads\n"
+     "(0 for the number of cores) between source, stripper, observed and aperture elements.\n"
+     "\n"
+     "Each thread uses a private copy of the elements, kept for following calls\n"
+     "and rebuilt after the Machine is changed."
+    },
+    {"repeats", (PyCFunction)&PyMachine_repeats, METH_VARARGS|METH_KEYWORDS,
+     "repeats() -> [(first, length, count)]\n"
+     "Sections of repeated cells.  Element first+r*length+j is the j'th element of the r'th repetition."
+    },
+    {"propagateRepeats", (PyCFunction)&PyMachine_propagateRepeats, METH_VARARGS|METH_KEYWORDS,
+     "propagateRepeats(State, start=0, max=INT_MAX) -> int\n"
+     "Propagate the provided State as propagate(), reusing the map of each repeated linear cell.\n"
+     "\n"
+     "Returns the number of cell repetitions for which a map was applied."
+    },
+    {"propagateTurns", (PyCFunction)&PyMachine_propagateTurns, METH_VARARGS|METH_KEYWORDS,
+     "propagateTurns(State, nturns, start=0, every=1, observe=None) -> [(index, State)]\n"
+     "Propagate the provided State nturns times through elements [start, len(M)), as a ring.\n"
+     "\n"
+     "If all elements are linear, the one-turn map found from the first turn is reused for the others.\n"
+     "Observers are called only during every 'every'th turn, or never if every=0."
+    },
+    {"propagateLong", (PyCFunction)&PyMachine_propagateLong, METH_VARARGS|METH_KEYWORDS,
+     "propagateLong(State, start=0, max=INT_MAX) -> (IonEk, phis)\n"
+     "Propagate only the reference and charge state particles of the provided State.\n"
+     "\n"
+     "Only the longitudinal model of each element is evaluated.  The moments are not changed.\n"
+     "Returns arrays of the reference kinetic energy [eV] and absolute phase [rad] at the exit of each element passed."
+    },
+    {"warmup", (PyCFunction)&PyMachine_warmup, METH_VARARGS|METH_KEYWORDS,
+     "warmup(State, start=0, max=INT_MAX)\n"
+     "Pre-compute element transfer matrices in parallel for the provided input State.\n"
+     "\n"
+     "A following propagate() of the same State will reuse the results.  The State is not modified."
+    },
+    {"cacheMisses", (PyCFunction)&PyMachine_cacheMisses, METH_VARARGS|METH_KEYWORDS,
+     "cacheMisses() -> [int|None]\n"
+     "For each element, the number of times propagate() has recomputed its transfer matrices\n"
+     "because the input particles changed.  None for elements without a cache.  Not counted by warmup()."
+    },
     {"reconfigure", (PyCFunction)&PyMachine_reconfigure, METH_VARARGS|METH_KEYWORDS,
      "reconfigure(index, {'variable':int|str})\n"
      "Change the configuration of an element."},
+    {"setParam", (PyCFunction)&PyMachine_setParam, METH_VARARGS|METH_KEYWORDS,
+     "setParam(index, name, value)\n"
+     "Change one numeric parameter of an element.\n"
+     "\n"
+     "Parameters bound by the element are updated in place, which avoids re-loading\n"
+     "any data files.  Others are changed as by reconfigure()."},
+    {"setParams", (PyCFunction)&PyMachine_setParams, METH_VARARGS|METH_KEYWORDS,
+     "setParams([(index, name, value), ...])\n"
+     "Change several numeric parameters, as by setParam()."},
+    {"responseMatrix", (PyCFunction)&PyMachine_responseMatrix, METH_VARARGS|METH_KEYWORDS,
+     "responseMatrix(State, [(index, name), ...], observe, step=1e-6, nthreads=0) -> ndarray\n"
+     "Response of moment0_env at the exit of the observe elements to changes of element parameters.\n"
+     "\n"
+     "Knobs are given as (index, name) or (index, name, step) where step is the change used for differences.\n"
+     "Returns an array of shape [len(observe), 7, len(knobs)].\n"
+     "eg. R[:,0,:] is the horizontal orbit response matrix.\n"
+     "\n"
+     "Linear segments are handled with cached transfer matrices.  Other knobs by finite differences\n"
+     "computed in parallel with nthreads (0 for all cores).  The State is not modified."},
+    {"gradient", (PyCFunction)&PyMachine_gradient, METH_VARARGS|METH_KEYWORDS,
+     "gradient(State, [(index, name), ...], start=0, max=INT_MAX) -> (dmoment0_env, dmoment1_env)\n"
+     "Propagate the State, as by propagate(), and compute the derivatives of the final\n"
+     "moment0_env and moment1_env with respect to element parameters,\n"
+     "as arrays of shape [len(params), 7] and [len(params), 7, 7].\n"
+     "\n"
+     "Uses forward mode automatic differentiation.  Elements after the first parameter must be linear, or rfcavity with EmitGrowth=0."},
+    {"adjoint", (PyCFunction)&PyMachine_adjoint, METH_VARARGS|METH_KEYWORDS,
+     "adjoint(State, [(index, name), ...], dmoment0_env=None, dmoment1_env=None, start=0, max=INT_MAX) -> ndarray\n"
+     "Propagate the State, as by propagate(), and compute the derivatives of the objective\n"
+     "  J = sum(dmoment0_env*moment0_env) + sum(dmoment1_env*moment1_env)\n"
+     "at the final state with respect to element parameters, in one backward sweep.\n"
+     "\n"
+     "The weights are the partial derivatives of a figure of merit w.r.t. the final envelope.\n"
+     "Parameters and elements are restricted as for gradient()."},
+    {"scan", (PyCFunction)&PyMachine_scan, METH_VARARGS|METH_KEYWORDS,
+     "scan(State, [(index, name, values), ...], observe, fields=['moment0_env'], zip=False, nthreads=0) -> dict\n"
+     "Propagate the State with each combination of parameter values (or, if zip=True, each n'th value of all axes)\n"
+     "and collect state fields at the exit of the observe elements.\n"
+     "\n"
+     "Returns a dict of arrays of shape [npoints, len(observe), field shape] keyed by field name.\n"
+     "With zip=False the last axis changes fastest.  Points are computed in parallel with nthreads (0 for all cores).\n"
+     "Parameters are restored before return.  The State is not modified."},
+    {"errorStudy", (PyCFunction)&PyMachine_errorStudy, METH_VARARGS|METH_KEYWORDS,
+     "errorStudy(State, [(index, name, width[, dist[, cut]]), ...], observe, nsamples,\n"
+     "           fields=['moment0_env'], quantiles=[0.05, 0.5, 0.95], seed=0, nthreads=0) -> (count, dict)\n"
+     "Propagate the State for nsamples sets of random parameter errors, added to the nominal values,\n"
+     "and accumulate statistics of state fields at the exit of the observe elements.\n"
+     "dist is 'gaussian' (width is the standard deviation, truncated at cut*width if cut>0) or 'uniform' (in +-width).\n"
+     "\n"
+     "Returns the number of samples reaching each observation, and for each field a dict with\n"
+     "'mean', 'var', 'min', 'max' of shape [len(observe), field shape], and 'quantile' of shape\n"
+     "[len(quantiles), len(observe), field shape].\n"
+     "Parameters are restored before return.  The State is not modified."},
+    {"match", (PyCFunction)&PyMachine_match, METH_VARARGS|METH_KEYWORDS,
+     "match(State, [(index, name[, lower, upper[, step]]), ...], [(index, field, at, value[, weight]), ...],\n"
+     "      jacobian='auto', maxiter=100, tol=1e-10, nthreads=0) -> dict\n"
+     "Adjust element parameters (knobs) within [lower, upper] so that state fields at the exit of elements\n"
+     "approach target values, minimizing sum((weight*(field[at]-value))**2) with a bounded Levenberg-Marquardt solver.\n"
+     "at is an index, or a tuple of indices, into the field.  eg. (idx, 'moment1_env', (0,0), 1e-6)\n"
+     "\n"
+     "jacobian is 'analytic' (see gradient(), only for moment0_env and moment1_env targets),\n"
+     "'fd' (forward differences with step, computed in parallel with nthreads (0 for all cores)),\n"
+     "or 'auto' (analytic when possible).\n"
+     "The Machine is left with the final knob values.  The State is not modified.\n"
+     "Returns a dict with 'x' (knob values), 'residual' (weighted), 'cost' (half the sum of squared residuals),\n"
+     "'iterations', 'converged', 'stalled' and 'analytic'."},
+    {"scanPhase", (PyCFunction)&PyMachine_scanPhase, METH_VARARGS|METH_KEYWORDS,
+     "scanPhase(State, index, phases) -> (IonEk, phis)\n"
+     "Scan the driven phase [deg] of the rfcavity at index.\n"
+     "\n"
+     "The reference particle of the State is taken as the cavity input.\n"
+     "Only the longitudinal model is evaluated, and neither the Machine nor the State is modified.\n"
+     "Returns arrays of output reference kinetic energy [eV] and absolute phase [rad]."},
     {"find", (PyCFunction)&PyMachine_find, METH_VARARGS|METH_KEYWORDS,
     "find(name=None, type=None) -> [int]\n"
     "Return a list of element indices for element name or type matching the given string."},
@@ -340,6 +1405,14 @@ int registerModMachine(PyObject *mod)
     if(PyType_Ready(&PyMachineType))
         return -1;
 
+    PyPropagationType.tp_doc = "Step-wise propagation.  Can't be constructed from python, see Machine.propagation()";
+    PyPropagationType.tp_dealloc = &PyPropagation_free;
+    PyPropagationType.tp_flags = Py_TPFLAGS_DEFAULT;
+    PyPropagationType.tp_methods = PyPropagation_methods;
+
+    if(PyType_Ready(&PyPropagationType))
+        return -1;
+
     Py_INCREF((PyObject*)&PyMachineType);
     if(PyModule_AddObject(mod, "Machine", (PyObject*)&PyMachineType)) {
         Py_DECREF((PyObject*)&PyMachineType);
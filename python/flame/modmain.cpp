@@ -12,14 +12,23 @@ namespace {
 
 #define FLAME_LOGGER_NAME "flame.machine"
 
+// Acquire the interpreter lock for the lifetime of this object
+struct PyGIL {
+    PyGILState_STATE state;
+    PyGIL() :state(PyGILState_Ensure()) {}
+    ~PyGIL() { PyGILState_Release(state); }
+};
+
 // redirect flame logging to python logger
-// Assumes interpreter lock is held
+// May be called from any thread.  Worker threads (eg. Machine.warmup())
+// log while the calling thread has released the interpreter lock.
 struct PyLogger : public Machine::Logger
 {
     PyRef<> logger;
     virtual void log(const Machine::LogRecord &r)
     {
         if(logger.py()) {
+            PyGIL G;
             std::string msg(r.strm.str());
             size_t pos = msg.find_last_not_of('\n');
             if(pos!=msg.npos)
@@ -97,6 +106,11 @@ init_internal(void)
         if (_import_array() < 0)
             throw std::runtime_error("Failed to import numpy");
 
+#if PY_VERSION_HEX < 0x03070000
+        // needed before PyGILState_Ensure() from other threads
+        PyEval_InitThreads();
+#endif
+
         try {
             PyRef<> logging(PyImport_ImportModule("logging"));
             PyLogger::singleton.logger.reset(PyObject_CallMethod(logging.py(), "getLogger", "s", FLAME_LOGGER_NAME));
@@ -0,0 +1,4 @@
+import os
+
+# tests must not use, or fill, a developer's lattice cache.  testCache sets its own.
+os.environ['FLAME_LATTICE_CACHE'] = ''
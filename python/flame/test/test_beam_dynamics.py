@@ -955,6 +955,41 @@ class TestArc(unittest.TestCase, MomentTest):
             ])
         }, max=None)
 
+    def test_sextupole_adaptive(self):
+        "Adaptive sub-steps agree with a fine fixed step count"
+        misa ={'dx':-0.01, 'dy':-0.01, 'pitch':0.001, 'yaw':0.001, 'roll':0.001, 'dstkick':1}
+
+        misa['step'] = 4096
+        self.M.reconfigure(16, misa)
+        S1 = self.M.allocState({})
+        self.M.propagate(S1)
+
+        misa['step'] = 1
+        misa['step_tol'] = 1e-3
+        self.M.reconfigure(16, misa)
+        S2 = self.M.allocState({})
+        self.M.propagate(S2)
+        self.assertConsistent(S2)
+
+        self.assertIn('Steps used: 256', str(self.M))
+        self.assertStateEqual({'moment0_env':S1.moment0_env}, S2, decimal=2)
+        self.assertStateEqual({'moment1_env':S1.moment1_env}, S2, decimal=3)
+
+    def test_sextupole_adaptive_limit(self):
+        "The initial adaptive step number is limited by step_max"
+        conf = {'dx':-0.01, 'dy':-0.01, 'pitch':0.001, 'yaw':0.001, 'roll':0.001, 'dstkick':1,
+                'step':4096, 'step_tol':1e-3, 'step_max':64}
+        self.M.reconfigure(16, conf)
+        S = self.M.allocState({})
+        self.M.propagate(S)
+        self.assertIn('Steps used: 64', str(self.M))
+
+        conf['step_max'] = 1
+        self.M.reconfigure(16, conf)
+        S = self.M.allocState({})
+        self.M.propagate(S)
+        self.assertIn('Steps used: 1\n', str(self.M))
+
 
 class TestGenCavi_glps(unittest.TestCase, MomentTest):
     """Strategy is to test the state after the first instance of each element type.
@@ -1053,6 +1088,33 @@ class TestGenStripper(unittest.TestCase, MomentTest):
                 [  0.000000000000e+00,   0.000000000000e+00,   0.000000000000e+00, 0.000000000000e+00,   0.000000000000e+00,   0.000000000000e+00, 0.000000000000e+00]])
         }, max=None)
 
+    def test_stripper_cache(self):
+        "Stripper output is recomputed when only the input moments change"
+        idx = self.M.find(type='stripper')[0]
+
+        # fill cache
+        S = self.M.allocState({})
+        self.M.propagate(S)
+
+        for M in (self.ICM, self.M):
+            S = M.allocState({})
+            M.propagate(S, 0, idx)
+            M0, M1 = S.moment0, S.moment1
+            M0[0,:] += 0.1
+            M1[0,:,:] *= 1.1
+            M1[:,0,:] *= 1.1
+            S.moment0, S.moment1 = M0, M1
+            M.propagate(S, idx)
+            self.assertConsistent(S)
+            if M is self.ICM:
+                expect = {
+                    'IonEk':S.IonEk,
+                    'moment0_env':S.moment0_env,
+                    'moment1_env':S.moment1_env,
+                }
+
+        self.assertStateEqual(expect, S)
+
 
 class TestTmOrbTrim(unittest.TestCase, MomentTest):
 
@@ -1232,6 +1294,977 @@ class TestCavityComplex(unittest.TestCase, MomentTest):
         }, max=4)
 
 
+class TestPhaseScan(unittest.TestCase):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+
+    def test_scan(self):
+        "Phase scan matches reconfigure() and propagate() for each point"
+        # ls1_ca01_cav1_d1127  cavtype = "0.041QWR"
+        idx = self.M.find(name='ls1_ca01_cav1_d1127')[0]
+        S = self.M.allocState({})
+        self.M.propagate(S, 0, idx)
+
+        phases = numpy.linspace(-180.0, 180.0, 64)
+        IonEk, phis = self.M.scanPhase(S, idx, phases)
+        self.assertEqual(IonEk.shape, (64,))
+        self.assertEqual(phis.shape, (64,))
+
+        for i in range(0, 64, 9):
+            self.M.reconfigure(idx, {'syncflag':0.0, 'phi':phases[i]})
+            S2 = S.clone()
+            self.M.propagate(S2, idx, 1)
+            self.assertAlmostEqual(IonEk[i], S2.ref_IonEk, places=6)
+            self.assertAlmostEqual(phis[i], S2.ref_phis, places=10)
+
+    def test_invalid(self):
+        S = self.M.allocState({})
+        self.assertRaises(ValueError, self.M.scanPhase, S, 1, [0.0])
+
+
+class TestPropagateLong(unittest.TestCase):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+
+    def test_profile(self):
+        "Reference energy and phase profile matches full propagate()"
+        S1 = self.M.allocState({})
+        S2 = self.M.allocState({})
+
+        R = self.M.propagate(S1, observe=range(len(self.M)))
+        IonEk, phis = self.M.propagateLong(S2)
+
+        assert_aequal(IonEk, asfarray([S.ref_IonEk for i,S in R]))
+        assert_aequal(phis, asfarray([S.ref_phis for i,S in R]))
+        self.assertEqual(S1.ref_IonEk, S2.ref_IonEk)
+        self.assertEqual(S1.ref_phis, S2.ref_phis)
+        # charge states after the last stripper
+        assert_aequal(S1.IonZ, S2.IonZ)
+
+    def test_partial(self):
+        S1 = self.M.allocState({})
+        S2 = self.M.allocState({})
+
+        self.M.propagate(S1, 0, 10)
+        IonEk, phis = self.M.propagateLong(S2, 0, 10)
+        self.assertEqual(IonEk.shape, (10,))
+        self.assertEqual(S1.ref_IonEk, S2.ref_IonEk)
+        self.assertEqual(S1.ref_phis, S2.ref_phis)
+        assert_aequal(S1.IonEk, S2.IonEk)
+
+
+class TestWarmup(unittest.TestCase, MomentTest):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+            F.seek(0)
+            self.M2 = Machine(F)
+
+    def test_warmup(self):
+        "propagate() after warmup() gives the same result"
+        S1 = self.M.allocState({})
+        S2 = self.M2.allocState({})
+
+        self.M2.warmup(S2)
+        self.M.propagate(S1)
+        self.M2.propagate(S2)
+        self.assertConsistent(S2)
+
+        self.assertStateEqual({
+            'ref_IonEk':S1.ref_IonEk,
+            'ref_phis':S1.ref_phis,
+            'IonEk':S1.IonEk,
+            'phis':S1.phis,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+    def test_hits(self):
+        "propagate() after warmup() recomputes nothing"
+        misses = lambda M: sum(n or 0 for n in M.cacheMisses())
+
+        S1 = self.M.allocState({})
+        self.M.propagate(S1)
+        self.assertGreater(misses(self.M), 0)
+
+        # including the charge states downstream of the bends and the stripper
+        self.assertTrue(len(self.M2.find(type='sbend'))>0)
+        self.assertTrue(len(self.M2.find(type='stripper'))>0)
+
+        S2 = self.M2.allocState({})
+        self.M2.warmup(S2)
+        self.assertEqual(misses(self.M2), 0)
+        self.M2.propagate(S2)
+        self.assertEqual(misses(self.M2), 0)
+
+    def test_warmup_changed(self):
+        "warmup() after setParams() of quadrupoles gives the same result"
+        quads = self.M.find(type='quadrupole')
+        changes = [(i, 'B2', self.M.conf(i)['B2']*1.01) for i in quads]
+
+        S1 = self.M.allocState({})
+        S2 = self.M2.allocState({})
+        self.M.propagate(S1)
+        self.M2.propagate(S2)
+
+        for idx, name, val in changes:
+            conf = self.M.conf(idx)
+            conf[name] = val
+            self.M.reconfigure(idx, conf)
+        self.M2.setParams(changes)
+
+        S1 = self.M.allocState({})
+        S2 = self.M2.allocState({})
+        self.M2.warmup(S2)
+        self.M.propagate(S1)
+        self.M2.propagate(S2)
+        self.assertConsistent(S2)
+
+        self.assertStateEqual({
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+
+class TestTurns(unittest.TestCase, MomentTest):
+
+    # a stable linear ring, using the beam and bends of Arc_Ds.lat
+    ring = b'''
+ring_qf: quadrupole, L=0.25, B2=2.0;
+ring_qd: quadrupole, L=0.25, B2=-2.0;
+ring_d: drift, L=1.0;
+ring: LINE = (S, ring_qf, ring_d, arc_bend1, ring_d, ring_qd, ring_d, arc_bend1, ring_d);
+USE: ring;
+'''
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            self.arc = F.read()
+        self.lattice = self.arc.replace(b'USE: cell;', self.ring)
+
+    def track(self, M, nturns, every=None, observe=None):
+        'Reference result, tracking each turn with propagate()'
+        S = M.allocState({})
+        M.propagate(S, max=1)
+        obs = []
+        for t in range(1, nturns+1):
+            R = M.propagate(S, start=1, observe=observe if every and t%every==0 else None)
+            obs.extend(R or [])
+        return S, obs
+
+    def assertTurns(self, S1, S2):
+        self.assertConsistent(S2)
+        self.assertStateEqual({
+            'ref_phis':S1.ref_phis,
+            'phis':S1.phis,
+            'pos':S1.pos,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2, decimal=8)
+
+    def test_linear(self):
+        "One-turn map of a linear ring agrees with tracking"
+        M1, M2 = Machine(self.lattice, path=datadir), Machine(self.lattice, path=datadir)
+        S1, _ = self.track(M1, 50)
+
+        S2 = M2.allocState({})
+        M2.propagate(S2, max=1)
+        self.assertEqual(M2.propagateTurns(S2, 50, start=1, every=0), [])
+        self.assertTurns(S1, S2)
+
+    def test_observe(self):
+        "Observers are called every Nth turn"
+        M1, M2 = Machine(self.lattice, path=datadir), Machine(self.lattice, path=datadir)
+        S1, obs1 = self.track(M1, 25, every=10, observe=[3, 8])
+
+        S2 = M2.allocState({})
+        M2.propagate(S2, max=1)
+        obs2 = M2.propagateTurns(S2, 25, start=1, every=10, observe=[3, 8])
+        self.assertTurns(S1, S2)
+
+        self.assertEqual([i for i,_ in obs1], [3, 8, 3, 8])
+        self.assertEqual([i for i,_ in obs2], [i for i,_ in obs1])
+        for (_,A), (_,B) in zip(obs1, obs2):
+            self.assertTurns(A, B)
+
+    def test_nonlinear(self):
+        "Lattice with sextupoles and cavities is tracked"
+        M1, M2 = Machine(self.arc, path=datadir), Machine(self.arc, path=datadir)
+        S1, _ = self.track(M1, 2)
+
+        S2 = M2.allocState({})
+        M2.propagate(S2, max=1)
+        M2.propagateTurns(S2, 2, start=1)
+        self.assertStateEqual({
+            'ref_IonEk':S1.ref_IonEk,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+
+class TestRepeats(unittest.TestCase, MomentTest):
+
+    # 20 repetitions of a linear cell, using the beam and bends of Arc_Ds.lat
+    line = b'''
+rep_qf: quadrupole, L=0.25, B2=2.0;
+rep_qd: quadrupole, L=0.25, B2=-2.0;
+rep_d: drift, L=1.0;
+rep_cell: LINE = (rep_qf, rep_d, arc_bend1, rep_d, rep_qd, rep_d, arc_bend1, rep_d);
+rep: LINE = (S, 20*rep_cell, rep_d);
+USE: rep;
+'''
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            self.arc = F.read()
+        self.lattice = self.arc.replace(b'USE: cell;', self.line)
+
+    def assertSame(self, S1, S2):
+        self.assertConsistent(S2)
+        self.assertStateEqual({
+            'next_elem':S1.next_elem,
+            'ref_phis':S1.ref_phis,
+            'phis':S1.phis,
+            'pos':S1.pos,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2, decimal=8)
+
+    def test_repeats(self):
+        "Repeated cells are found, and split by setParam()"
+        M = Machine(self.lattice, path=datadir)
+        self.assertEqual(len(M), 1+20*8+1)
+        self.assertEqual(M.repeats(), [(1, 8, 20)])
+
+        # the following cells begin after the changed quadrupole, leaving the last rep_d twice
+        M.setParam(1+5*8, 'B2', 2.5)
+        self.assertEqual(M.repeats(), [(1, 8, 5), (1+5*8+1, 8, 14), (len(M)-2, 1, 2)])
+
+    def test_linear(self):
+        "Maps of repeated linear cells agree with propagate()"
+        M1, M2 = Machine(self.lattice, path=datadir), Machine(self.lattice, path=datadir)
+        S1, S2 = M1.allocState({}), M2.allocState({})
+        M1.propagate(S1)
+        self.assertEqual(M2.propagateRepeats(S2), 19)
+        self.assertSame(S1, S2)
+
+    def test_partial(self):
+        "Only whole cells within [start, start+max) are mapped"
+        M1, M2 = Machine(self.lattice, path=datadir), Machine(self.lattice, path=datadir)
+        S1, S2 = M1.allocState({}), M2.allocState({})
+        M1.propagate(S1, max=5)
+        M2.propagate(S2, max=5)
+
+        M1.propagate(S1, start=5, max=100)
+        self.assertEqual(M2.propagateRepeats(S2, start=5, max=100), 11)
+        self.assertSame(S1, S2)
+
+    def test_nonlinear(self):
+        "Cells with sextupoles and cavities are tracked"
+        lattice = self.arc.replace(b'USE: cell;', b'arc_ds: LINE = (arc, ds); arc3: LINE = (S, 3*arc_ds); USE: arc3;')
+        M1, M2 = Machine(lattice, path=datadir), Machine(lattice, path=datadir)
+        self.assertEqual(M2.repeats(), [(1, (len(M2)-1)//3, 3)])
+        S1, S2 = M1.allocState({}), M2.allocState({})
+        M1.propagate(S1)
+        self.assertEqual(M2.propagateRepeats(S2), 0)
+        self.assertSame(S1, S2)
+
+
+class TestResponse(unittest.TestCase):
+
+    # a linear line, using the beam and bends of Arc_Ds.lat
+    line = b'''
+orm_qf: quadrupole, L=0.25, B2=2.0;
+orm_qd: quadrupole, L=0.25, B2=-2.0;
+orm_d: drift, L=1.0;
+orm_cx: orbtrim, theta_x=1e-4;
+orm_cy: orbtrim;
+orm_bpm: bpm;
+orm: LINE = (S, orm_cx, orm_cy, orm_qf, orm_d, orm_bpm, arc_bend1, orm_d, orm_cx, orm_qd, orm_d, orm_bpm, arc_bend1, orm_d, orm_bpm);
+USE: orm;
+'''
+
+    def reference(self, M, knobs, observe, step=1e-6):
+        'Central differences with setParam() and propagate()'
+        R = numpy.zeros((len(observe), 7, len(knobs)))
+        for j, (idx, name) in enumerate(knobs):
+            base = M.conf(idx).get(name, 0.0)
+            env = []
+            for delta in (step, -step):
+                M.setParam(idx, name, base+delta)
+                S = M.allocState({})
+                env.append(numpy.asarray([S.moment0_env for _,S in M.propagate(S, observe=observe)]))
+            M.setParam(idx, name, base)
+            R[:,:,j] = (env[0]-env[1])/(2*step)
+        return R
+
+    def test_linear(self):
+        "Response through linear elements agrees with finite differences"
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            M = Machine(F.read().replace(b'USE: cell;', self.line), path=datadir)
+        bpms = M.find(type='bpm')
+        knobs = [(i, 'theta_x') for i in M.find(type='orbtrim')] + \
+                [(i, 'theta_y') for i in M.find(type='orbtrim')] + \
+                [(M.find(type='quadrupole')[0], 'B2')]
+
+        S = M.allocState({})
+        R = M.responseMatrix(S, knobs, bpms)
+        self.assertEqual(R.shape, (3, 7, 7))
+
+        assert_aequal(R, self.reference(M, knobs, bpms), decimal=5)
+        self.assertNotEqual(R[0,0,0], 0.0)
+        self.assertEqual(R[0,0,4], 0.0) # second theta_x is after the first bpm
+
+    def test_nonlinear(self):
+        "Knobs upstream of rfcavity elements use finite differences"
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            M = Machine(F)
+        bpms = [i for i in M.find(type='bpm') if i<80]
+        knobs = [(i, 'theta_x') for i in M.find(type='orbtrim') if i<60]
+
+        S0 = M.allocState({})
+        M.propagate(S0)
+
+        for nthreads in (1, 2):
+            R = M.responseMatrix(M.allocState({}), knobs, bpms, nthreads=nthreads)
+            assert_aequal(R, self.reference(M, knobs, bpms), decimal=5)
+
+        # parameters are restored
+        S1 = M.allocState({})
+        M.propagate(S1)
+        assert_aequal(S0.moment0_env, S1.moment0_env, decimal=12)
+
+    def test_invalid(self):
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            M = Machine(F)
+        S = M.allocState({})
+        self.assertRaises(ValueError, M.responseMatrix, S, [(len(M), 'theta_x')], [5])
+        self.assertRaises(ValueError, M.responseMatrix, S, [(1, 'theta_x')], [len(M)])
+        self.assertRaises(ValueError, M.responseMatrix, S, [(1, 'nonesuch')], [5])
+
+
+class TestGradient(unittest.TestCase):
+
+    # a linear line with misalignments, using the beam and bends of Arc_Ds.lat
+    line = b'''
+grd_qf: quadrupole, L=0.25, B2=2.0, dx=1e-3, roll=0.01;
+grd_qd: quadrupole, L=0.25, B2=-2.0, dy=-5e-4;
+grd_sol: solenoid, L=0.3, B=1.5, pitch=2e-3;
+grd_d: drift, L=1.0;
+grd_cx: orbtrim, theta_x=1e-4, xyrotate=3.0;
+grd: LINE = (S, grd_cx, grd_qf, grd_d, arc_bend1, grd_d, grd_qd, grd_sol, grd_d);
+USE: grd;
+'''
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            self.M = Machine(F.read().replace(b'USE: cell;', self.line), path=datadir)
+
+    def reference(self, params, step=1e-6):
+        'Central differences with setParam() and propagate()'
+        M = self.M
+        dm0, dm1 = numpy.zeros((len(params), 7)), numpy.zeros((len(params), 7, 7))
+        for j, (idx, name) in enumerate(params):
+            base = M.conf(idx).get(name, 0.0)
+            env = []
+            for delta in (step, -step):
+                M.setParam(idx, name, base+delta)
+                S = M.allocState({})
+                M.propagate(S)
+                env.append((S.moment0_env, S.moment1_env))
+            M.setParam(idx, name, base)
+            dm0[j] = (env[0][0]-env[1][0])/(2*step)
+            dm1[j] = (env[0][1]-env[1][1])/(2*step)
+        return dm0, dm1
+
+    def test_gradient(self):
+        "Derivatives agree with finite differences"
+        M = self.M
+        quad = M.find(type='quadrupole')[0]
+        sol = M.find(type='solenoid')[0]
+        bend = M.find(type='sbend')[0]
+        trim = M.find(type='orbtrim')[0]
+        params = [(quad, 'B2'), (quad, 'L'), (quad, 'dx'), (quad, 'roll'),
+                  (sol, 'B'), (sol, 'pitch'), (bend, 'phi'), (bend, 'phi1'),
+                  (trim, 'theta_x'), (trim, 'xyrotate'), (M.find(type='drift')[0], 'L')]
+
+        S0 = M.allocState({})
+        M.propagate(S0)
+
+        S = M.allocState({})
+        dm0, dm1 = M.gradient(S, params)
+        self.assertEqual(dm0.shape, (len(params), 7))
+        self.assertEqual(dm1.shape, (len(params), 7, 7))
+
+        # the state is propagated
+        assert_aequal(S.moment0_env, S0.moment0_env, decimal=12)
+        assert_aequal(S.moment1_env, S0.moment1_env, decimal=12)
+
+        ref0, ref1 = self.reference(params)
+        for j in range(len(params)):
+            scale = max(1.0, numpy.abs(ref1[j]).max())
+            assert_aequal(dm0[j], ref0[j], decimal=5)
+            assert_aequal(dm1[j]/scale, ref1[j]/scale, decimal=5)
+        self.assertNotEqual(dm0[0,0], 0.0)
+
+    def test_invalid(self):
+        M = self.M
+        S = M.allocState({})
+        quad = M.find(type='quadrupole')[0]
+        self.assertRaises(ValueError, M.gradient, S, [(quad, 'nonesuch')])
+        self.assertRaises(ValueError, M.gradient, M.allocState({}), [(len(M), 'B2')])
+
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            M = Machine(F)
+        # the charge stripper follows
+        self.assertRaises(ValueError, M.gradient, M.allocState({}), [(M.find(type='orbtrim')[0], 'theta_x')])
+        # a cavity follows a change of length
+        self.assertRaises(ValueError, M.gradient, M.allocState({}), [(M.find(type='solenoid')[0], 'L')], max=800)
+        # a cavity follows an orbit change through the bends after the stripper
+        S = M.allocState({})
+        M.propagate(S, max=900)
+        trim = [i for i in M.find(type='orbtrim') if i>900][0]
+        self.assertRaises(ValueError, M.gradient, S, [(trim, 'theta_x')], start=900)
+
+    def test_cavity(self):
+        "Derivatives through rfcavity elements agree with finite differences"
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            M = Machine(F)
+        sol = M.find(type='solenoid')[0]
+        trim = M.find(type='orbtrim')[0]
+        self.assertTrue(any(sol<i<800 for i in M.find(type='rfcavity')))
+        params = [(sol, 'B'), (sol, 'dx'), (trim, 'theta_x'), (trim, 'theta_y')]
+
+        dm0, dm1 = M.gradient(M.allocState({}), params, max=800)
+
+        step = 1e-6
+        for j, (idx, name) in enumerate(params):
+            base = M.conf(idx).get(name, 0.0)
+            env = []
+            for delta in (step, -step):
+                M.setParam(idx, name, base+delta)
+                S = M.allocState({})
+                M.propagate(S, max=800)
+                env.append((S.moment0_env, S.moment1_env))
+            M.setParam(idx, name, base)
+            ref0 = (env[0][0]-env[1][0])/(2*step)
+            ref1 = (env[0][1]-env[1][1])/(2*step)
+            scale0 = max(1e-3, numpy.abs(ref0).max())
+            scale1 = max(1e-3, numpy.abs(ref1).max())
+            assert_aequal(dm0[j]/scale0, ref0/scale0, decimal=5)
+            assert_aequal(dm1[j]/scale1, ref1/scale1, decimal=5)
+
+        w0 = numpy.linspace(0.1, 0.7, 7)
+        w1 = numpy.arange(49.0).reshape((7,7))/49.0
+        w1[6,:] = 0.0
+        G = M.adjoint(M.allocState({}), params, w0, w1, max=800)
+        expect = numpy.dot(dm0, w0) + (dm1*w1).sum(axis=(1,2))
+        assert_aequal(G/abs(expect).max(), expect/abs(expect).max(), decimal=10)
+
+    def test_adjoint(self):
+        "Adjoint gradient agrees with forward mode"
+        M = self.M
+        params = [(i, 'B2') for i in M.find(type='quadrupole')] + \
+                 [(i, 'dx') for i in M.find(type='quadrupole')] + \
+                 [(i, 'B') for i in M.find(type='solenoid')] + \
+                 [(M.find(type='sbend')[0], 'phi'), (M.find(type='orbtrim')[0], 'theta_x')]
+
+        S = M.allocState({})
+        dm0, dm1 = M.gradient(S, params)
+
+        w0 = numpy.linspace(0.1, 0.7, 7)
+        w1 = numpy.arange(49.0).reshape((7,7))/49.0
+        w1[6,:] = 1.0 # ignored, as moment1_env[6,:] is always zero
+
+        S = M.allocState({})
+        G = M.adjoint(S, params, w0, w1)
+        self.assertEqual(G.shape, (len(params),))
+
+        w1[6,:] = 0.0
+        expect = numpy.dot(dm0, w0) + (dm1*w1).sum(axis=(1,2))
+        assert_aequal(G/abs(expect).max(), expect/abs(expect).max(), decimal=10)
+
+        # final rms size squared
+        w1 = numpy.zeros((7,7))
+        w1[0,0] = 1.0
+        G = M.adjoint(M.allocState({}), params, dmoment1_env=w1)
+        assert_aequal(G, dm1[:,0,0], decimal=8)
+
+        self.assertRaises(ValueError, M.adjoint, M.allocState({}), params, numpy.zeros(6))
+        self.assertRaises(TypeError, M.adjoint, M.allocState({}), params, max='x')
+        self.assertRaises(OverflowError, M.adjoint, M.allocState({}), params, max=2**40)
+
+
+class TestScan(unittest.TestCase):
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            self.M = Machine(F)
+
+    def reference(self, points, observe):
+        'Loop over setParam() and propagate()'
+        M = self.M
+        env, ek = [], []
+        for updates in points:
+            base = [(i, n, M.conf(i).get(n, 0.0)) for i, n, _v in updates]
+            M.setParams(updates)
+            S = M.allocState({})
+            obs = M.propagate(S, observe=observe)
+            env.append([s.moment0_env for _i, s in obs])
+            ek.append([s.ref_IonEk for _i, s in obs])
+            M.setParams(base)
+        return numpy.asarray(env), numpy.asarray(ek)
+
+    def test_grid(self):
+        M = self.M
+        quad, trim = M.find(type='quadrupole')[3], M.find(type='orbtrim')[2]
+        observe = M.find(type='bpm')[:10]
+        B2, theta = [5.0, 5.5, 6.0], [0.0, 1e-3]
+
+        S0 = M.allocState({})
+        M.propagate(S0)
+
+        for nthreads in (1, 2):
+            R = M.scan(M.allocState({}), [(quad, 'B2', B2), (trim, 'theta_x', theta)], observe,
+                       fields=['moment0_env', 'ref_IonEk'], nthreads=nthreads)
+            self.assertEqual(R['moment0_env'].shape, (6, 10, 7))
+            self.assertEqual(R['ref_IonEk'].shape, (6, 10))
+
+            env, ek = self.reference([[(quad, 'B2', b), (trim, 'theta_x', t)] for b in B2 for t in theta], observe)
+            assert_aequal(R['moment0_env'], env, decimal=12)
+            assert_aequal(R['ref_IonEk'], ek, decimal=6)
+
+        # parameters are restored
+        S1 = M.allocState({})
+        M.propagate(S1)
+        assert_aequal(S0.moment0_env, S1.moment0_env, decimal=12)
+
+    def test_zip(self):
+        M = self.M
+        quad, trim = M.find(type='quadrupole')[3], M.find(type='orbtrim')[2]
+        observe = M.find(type='bpm')[:10]
+        B2, theta = [5.0, 5.5, 6.0], [0.0, 1e-3, 2e-3]
+
+        R = M.scan(M.allocState({}), [(quad, 'B2', B2), (trim, 'theta_x', theta)], observe, zip=True)
+        self.assertEqual(R['moment0_env'].shape, (3, 10, 7))
+
+        env, _ek = self.reference([[(quad, 'B2', b), (trim, 'theta_x', t)] for b, t in zip(B2, theta)], observe)
+        assert_aequal(R['moment0_env'], env, decimal=12)
+
+    def test_invalid(self):
+        M = self.M
+        S = M.allocState({})
+        self.assertRaises(ValueError, M.scan, S, [(1, 'theta_x', [0.0, 1.0]), (2, 'B2', [1.0])], [5], zip=True)
+        self.assertRaises(ValueError, M.scan, S, [(1, 'theta_x', [0.0])], [5], fields=['nonesuch'])
+        self.assertRaises(ValueError, M.scan, S, [(1, 'nonesuch', [0.0])], [5])
+        self.assertRaises(ValueError, M.scan, S, [(len(M), 'theta_x', [0.0])], [5])
+
+
+class TestErrorStudy(unittest.TestCase):
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            self.M = Machine(F.read().replace(b'USE: cell;', TestResponse.line), path=datadir)
+
+    def test_stats(self):
+        "Statistics of orbit errors from quadrupole offsets"
+        M = self.M
+        quads, bpms = M.find(type='quadrupole'), M.find(type='bpm')
+        errors = [(i, 'dx', 1e-4) for i in quads] + [(i, 'dy', 2e-4, 'uniform') for i in quads]
+
+        S0 = M.allocState({})
+        nominal = numpy.asarray([S.moment0_env for _i, S in M.propagate(S0, observe=bpms)])
+
+        # orbit is linear in offsets
+        R = M.responseMatrix(M.allocState({}), [(i, 'dx') for i in quads] + [(i, 'dy') for i in quads], bpms)
+        sigma = numpy.asarray([1e-4]*len(quads) + [2e-4/numpy.sqrt(3)]*len(quads))
+        var = (R**2*sigma**2).sum(axis=2)
+
+        count, stats = M.errorStudy(M.allocState({}), errors, bpms, 2000, seed=3, nthreads=1)
+        env = stats['moment0_env']
+        self.assertEqual(list(count), [2000]*len(bpms))
+        self.assertEqual(env['mean'].shape, (len(bpms), 7))
+        self.assertEqual(env['quantile'].shape, (3, len(bpms), 7))
+
+        for j in (0, 2):
+            assert_aequal(env['var'][:,j]/var[:,j], numpy.ones(len(bpms)), decimal=1)
+            self.assertTrue(numpy.all(abs(env['mean'][:,j]-nominal[:,j]) < 4*numpy.sqrt(var[:,j]/2000)))
+            self.assertTrue(numpy.all(env['min'][:,j] < env['quantile'][0,:,j]))
+            self.assertTrue(numpy.all(env['quantile'][0,:,j] < env['quantile'][1,:,j]))
+            self.assertTrue(numpy.all(env['quantile'][1,:,j] < env['quantile'][2,:,j]))
+            self.assertTrue(numpy.all(env['quantile'][2,:,j] < env['max'][:,j]))
+
+        # gaussian in x
+        spread = (env['quantile'][2,:,0]-env['quantile'][0,:,0])/(2*numpy.sqrt(var[:,0]))
+        assert_aequal(spread/1.645, numpy.ones(len(bpms)), decimal=1)
+
+        # reproducible, regardless of threads
+        count2, stats2 = M.errorStudy(M.allocState({}), errors, bpms, 2000, seed=3, nthreads=2)
+        for key in ('mean', 'var', 'min', 'max', 'quantile'):
+            assert_aequal(stats2['moment0_env'][key], env[key], decimal=15)
+
+        _count, stats3 = M.errorStudy(M.allocState({}), errors, bpms, 2000, seed=4)
+        self.assertNotEqual(stats3['moment0_env']['mean'][0,0], env['mean'][0,0])
+
+        # parameters are restored
+        S1 = M.allocState({})
+        M.propagate(S1)
+        assert_aequal(S0.moment0_env, S1.moment0_env, decimal=12)
+
+    def test_invalid(self):
+        M = self.M
+        S = M.allocState({})
+        quad = M.find(type='quadrupole')[0]
+        self.assertRaises(ValueError, M.errorStudy, S, [(quad, 'dx', 1e-4, 'nonesuch')], [5], 10)
+        self.assertRaises(ValueError, M.errorStudy, S, [(quad, 'dx', 1e-4)], [5], 10, quantiles=[1.5])
+        self.assertRaises(ValueError, M.errorStudy, S, [(quad, 'nonesuch', 1e-4)], [5], 10)
+        self.assertRaises(ValueError, M.errorStudy, S, [(quad, 'dx', 1e-4)], [len(M)], 10)
+
+
+class TestMatch(unittest.TestCase):
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            self.M = Machine(F.read().replace(b'USE: cell;', TestResponse.line), path=datadir)
+
+    def test_orbit(self):
+        "Steer the orbit to zero at two BPMs"
+        M = self.M
+        bpm, trim = M.find(type='bpm'), M.find(name='orm_cx')
+        knobs = [(i, 'theta_x') for i in trim]
+        targets = [(i, 'moment0_env', 0, 0.0) for i in bpm[1:]]
+
+        for jac in ('analytic', 'fd'):
+            M.setParams([(trim[0], 'theta_x', 1e-4), (trim[1], 'theta_x', 0.0)])
+            R = M.match(M.allocState({}), knobs, targets, jacobian=jac)
+            self.assertTrue(R['converged'])
+            self.assertEqual(R['analytic'], jac=='analytic')
+            assert_aequal(R['residual'], [0, 0], decimal=12)
+
+            # Machine is left with the matched values
+            self.assertEqual([M.conf(i)['theta_x'] for i in trim], list(R['x']))
+            obs = M.propagate(M.allocState({}), observe=bpm[1:])
+            assert_aequal([S.moment0_env[0] for _i, S in obs], [0, 0], decimal=12)
+
+    def test_envelope(self):
+        "Recover quadrupole strengths from beam sizes, and stop at a bound"
+        M = self.M
+        quad, last = M.find(type='quadrupole'), len(M)-1
+
+        M.setParams([(quad[0], 'B2', 2.2), (quad[1], 'B2', -1.9)])
+        S = M.allocState({})
+        M.propagate(S)
+        targets = [(last, 'moment1_env', (0, 0), S.moment1_env[0,0]),
+                   (last, 'moment1_env', (2, 2), S.moment1_env[2,2])]
+
+        for jac in ('analytic', 'fd'):
+            M.setParams([(quad[0], 'B2', 2.0), (quad[1], 'B2', -2.0)])
+            R = M.match(M.allocState({}), [(quad[0], 'B2', 0.0, 5.0), (quad[1], 'B2', -5.0, 0.0)], targets,
+                        jacobian=jac, nthreads=2)
+            self.assertTrue(R['converged'])
+            assert_aequal(R['x'], [2.2, -1.9], decimal=6)
+
+        M.setParams([(quad[0], 'B2', 2.0), (quad[1], 'B2', -2.0)])
+        R = M.match(M.allocState({}), [(quad[0], 'B2', 0.0, 2.1), (quad[1], 'B2', -5.0, 0.0)], targets)
+        self.assertEqual(R['x'][0], 2.1)
+        self.assertGreater(R['cost'], 0.0)
+
+    def test_stalled(self):
+        "A knob with no effect on the targets stalls, and is not converged"
+        M = self.M
+        trim, last = M.find(name='orm_cy')[0], len(M)-1
+        for jac in ('analytic', 'fd'):
+            R = M.match(M.allocState({}), [(trim, 'theta_y')], [(last, 'moment0_env', 0, 1e-3)], jacobian=jac)
+            self.assertTrue(R['stalled'])
+            self.assertFalse(R['converged'])
+            self.assertEqual(R['iterations'], 1)
+            self.assertGreater(R['cost'], 0.0)
+
+    def test_invalid(self):
+        M = self.M
+        quad, last = M.find(type='quadrupole'), len(M)-1
+        S = M.allocState({})
+        self.assertRaises(ValueError, M.match, S, [(quad[0], 'B2')], [(last, 'moment1_env', 0, 1.0)])
+        self.assertRaises(ValueError, M.match, S, [(quad[0], 'B2')], [(last, 'moment0_env', 7, 1.0)])
+        self.assertRaises(ValueError, M.match, S, [(quad[0], 'B2', 1.0, 0.0)], [(last, 'moment0_env', 0, 1.0)])
+        self.assertRaises(ValueError, M.match, S, [(quad[0], 'B2')], [(last, 'ref_IonEk', (), 1.0)], jacobian='analytic')
+        self.assertRaises(ValueError, M.match, S, [], [(last, 'moment0_env', 0, 1.0)])
+
+class TestPipeline(unittest.TestCase):
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            self.M = Machine(F)
+
+    def test_stream(self):
+        "Same result as propagate() for each State"
+        M = self.M
+        S0 = M.allocState({})
+        M.propagate(S0, max=100)
+
+        for nseg in (1, 3, 16):
+            S1 = [S0.clone() for _i in range(20)]
+            M.propagatePipeline(S1, nsegments=nseg, start=100, max=1000, depth=4)
+            S2 = S0.clone()
+            M.propagate(S2, start=100, max=1000)
+            for S in S1:
+                assert_aequal(S.moment0_env, S2.moment0_env, decimal=14)
+                assert_aequal(S.moment1_env, S2.moment1_env, decimal=14)
+                self.assertEqual(S.ref_IonEk, S2.ref_IonEk)
+
+    def test_invalid(self):
+        M = self.M
+        S = M.allocState({})
+        self.assertRaises(ValueError, M.propagatePipeline, [S, S])
+        self.assertRaises(ValueError, M.propagatePipeline, [S], start=len(M))
+        self.assertRaises(ValueError, M.propagatePipeline, [S], max=-1)
+        self.assertRaises(ValueError, M.propagatePipeline, [S], depth=0)
+        self.assertRaises(ValueError, M.propagatePipeline, [S, None])
+
+class TestChargeStates(unittest.TestCase):
+
+    def setUp(self):
+        with open(os.path.join(datadir, 'to_strl.lat'), 'rb') as F:
+            self.M = Machine(F)
+
+    def check(self, nthreads, observe):
+        M = self.M
+        S0, S1 = M.allocState({}), M.allocState({})
+        obs0 = M.propagate(S0, observe=observe)
+        obs1 = M.propagateChargeStates(S1, observe=observe, nthreads=nthreads)
+
+        self.assertEqual([i for i, _S in obs0], [i for i, _S in obs1])
+        for (_i, A), (_j, B) in zip(obs0+[(None, S0)], obs1+[(None, S1)]):
+            assert_aequal(A.moment0, B.moment0, decimal=14)
+            assert_aequal(A.moment1, B.moment1, decimal=14)
+            assert_aequal(A.moment1_env, B.moment1_env, decimal=14)
+            self.assertEqual(A.ref_IonEk, B.ref_IonEk)
+            self.assertEqual(A.pos, B.pos)
+
+    def test_same(self):
+        "Same result as propagate(), before and after the stripper"
+        observe = self.M.find(type='bpm')[::20]
+        for nthreads in (1, 2, 5):
+            self.check(nthreads, observe)
+
+    def test_change(self):
+        "Private element copies follow parameter changes"
+        M = self.M
+        quad = M.find(type='quadrupole')[-3]
+        self.check(3, [])
+        M.setParam(quad, 'B2', M.conf(quad)['B2']*1.1)
+        self.check(3, [])
+
+class TestPropagation(unittest.TestCase, MomentTest):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+
+    def test_steps(self):
+        "Step-wise propagation gives the same result as propagate()"
+        S1 = self.M.allocState({})
+        self.M.propagate(S1, max=500)
+
+        S2 = self.M.allocState({})
+        P = self.M.propagation(S2, max=500)
+        self.assertEqual(P.count(), 0)
+        nsteps = 0
+        while P.step(64):
+            nsteps += 1
+        self.assertEqual(nsteps, 7)
+        self.assertTrue(P.done())
+        self.assertFalse(P.cancelled())
+        self.assertEqual(P.count(), 500)
+        self.assertFalse(P.step())
+
+        self.assertStateEqual({
+            'next_elem':S1.next_elem,
+            'pos':S1.pos,
+            'ref_IonEk':S1.ref_IonEk,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+    def test_args(self):
+        "Invalid start or max are rejected"
+        S = self.M.allocState({})
+        self.assertRaises(TypeError, self.M.propagation, S, max='x')
+        self.assertRaises(TypeError, self.M.propagation, S, max=1.5)
+        self.assertRaises(OverflowError, self.M.propagation, S, max=2**40)
+        self.assertRaises(TypeError, self.M.propagation, S, start='x')
+
+    def test_cancel(self):
+        "A cancelled propagation stops before the next element"
+        S = self.M.allocState({})
+        P = self.M.propagation(S)
+        self.assertTrue(P.step(10))
+        P.cancel()
+        self.assertFalse(P.step(10))
+        self.assertTrue(P.done())
+        self.assertTrue(P.cancelled())
+        self.assertEqual(P.count(), 10)
+        self.assertEqual(S.next_elem, 10)
+
+    def test_interleave(self):
+        "Time-slice two propagations on one Machine"
+        S1 = self.M.allocState({})
+        self.M.propagate(S1)
+
+        S2, S3 = self.M.allocState({}), self.M.allocState({})
+        P2, P3 = self.M.propagation(S2), self.M.propagation(S3)
+        while P2.step(100) | P3.step(100):
+            pass
+
+        for S in (S2, S3):
+            self.assertStateEqual({
+                'moment0_env':S1.moment0_env,
+                'moment1_env':S1.moment1_env,
+            }, S)
+
+
+class TestAperture(unittest.TestCase, MomentTest):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+
+    def test_disabled(self):
+        "No aperture check by default"
+        self.M.setParam(100, 'aper', 0.001)
+        S = self.M.allocState({})
+        self.M.propagate(S)
+        self.assertEqual(S.lost, 0)
+        self.assertEqual(S.next_elem, len(self.M))
+
+    def test_lost(self):
+        "Propagation stops at the element where the beam is lost"
+        self.M.setParam(100, 'aper', 0.001)
+
+        S1 = self.M.allocState({})
+        self.M.propagate(S1, max=101)
+
+        S2 = self.M.allocState({'aper_nsigma':1.0})
+        self.M.propagate(S2)
+        self.assertEqual(S2.lost, 1)
+        self.assertEqual(S2.lost_elem, 100)
+        self.assertEqual(S2.next_elem, 101)
+        self.assertStateEqual({
+            'pos':S1.pos,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+        # a new beam from the source is not lost
+        self.M.setParam(100, 'aper', 1.0)
+        self.M.propagate(S2)
+        self.assertEqual(S2.lost, 0)
+        self.assertEqual(S2.next_elem, len(self.M))
+
+    def test_turns(self):
+        "Multi-turn propagation stops when the beam is lost"
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            M = Machine(F)
+        S = M.allocState({'aper_nsigma':1.0})
+        M.propagate(S, max=1)
+        M.propagateTurns(S, 100, start=1)
+        self.assertEqual(S.lost, 1)
+        self.assertLess(S.pos, 100*31.75)
+
+
+class TestSetParam(unittest.TestCase, MomentTest):
+
+    lattice = 'to_strl.lat'
+
+    def setUp(self):
+        with open(os.path.join(datadir, self.lattice), 'rb') as F:
+            self.M = Machine(F)
+            F.seek(0)
+            self.M2 = Machine(F)
+
+    def check(self, changes):
+        S1 = self.M.allocState({})
+        S2 = self.M2.allocState({})
+        # populate caches first
+        self.M.propagate(S1)
+        self.M2.propagate(S2)
+
+        for idx, name, val in changes:
+            conf = self.M.conf(idx)
+            conf[name] = val
+            self.M.reconfigure(idx, conf)
+        self.M2.setParams(changes)
+
+        for idx, name, val in changes:
+            self.assertEqual(self.M2.conf(idx)[name], val)
+
+        S1 = self.M.allocState({})
+        S2 = self.M2.allocState({})
+        self.M.propagate(S1)
+        self.M2.propagate(S2)
+        self.assertConsistent(S2)
+
+        self.assertStateEqual({
+            'ref_IonEk':S1.ref_IonEk,
+            'ref_phis':S1.ref_phis,
+            'IonEk':S1.IonEk,
+            'phis':S1.phis,
+            'moment0_env':S1.moment0_env,
+            'moment1_env':S1.moment1_env,
+        }, S2)
+
+    def test_quad(self):
+        "setParam() of a quadrupole matches reconfigure()"
+        idx = self.M.find(type='quadrupole')[0]
+        self.check([(idx, 'B2', 1.5*self.M.conf(idx)['B2']),
+                    (idx, 'dx', 1e-4)])
+
+    def test_cavity(self):
+        "setParam() of an rfcavity matches reconfigure()"
+        idx = self.M.find(type='rfcavity')[0]
+        self.check([(idx, 'scl_fac', 0.9*self.M.conf(idx)['scl_fac']),
+                    (idx, 'phi', self.M.conf(idx)['phi']+5.0)])
+
+    def test_length(self):
+        "setParam() of L matches reconfigure(), and leaves zero length elements unchanged"
+        drift = self.M.find(type='drift')[0]
+        mark = self.M.find(type='marker')[0]
+        bpm = self.M.find(type='bpm')[0]
+        self.check([(drift, 'L', 1.5*self.M.conf(drift)['L']),
+                    (mark, 'L', 0.5),
+                    (bpm, 'L', 0.5)])
+
+        S = self.M2.allocState({})
+        self.M2.propagate(S, max=mark)
+        pos = S.pos
+        self.M2.propagate(S, start=mark, max=1)
+        self.assertEqual(S.pos, pos)
+
+    def test_fallback(self):
+        "Parameters not bound by the element are applied by reconfigure()"
+        idx = self.M.find(type='sbend')[0]
+        self.check([(idx, 'HdipoleFitMode', 0.0), (idx, 'bg', 0.19)])
+
+    def test_invalid(self):
+        self.assertRaises(ValueError, self.M2.setParam, len(self.M2), 'L', 1.0)
+        self.assertRaises(TypeError, self.M2.setParams, [(0, 'L')])
+
+
 class TestBackward(unittest.TestCase, MomentTest):
 
     lattice = 'LS1FS1_latticeE.lat'
@@ -1294,3 +2327,18 @@ class TestCurveInput(unittest.TestCase, MomentTest):
                 [ -2.1932146321312507e-02,  2.1525392693324587e-04, -1.2253464948681923e-01,  1.1861719478129362e-03, -8.2086821605540894e-01,  2.6354149009268438e-06,  0.0000000000000000e+00],
                 [  0.0000000000000000e+00,  0.0000000000000000e+00,  0.0000000000000000e+00,  0.0000000000000000e+00,  0.0000000000000000e+00,  0.0000000000000000e+00,  0.0000000000000000e+00]])
         }, max=None)
+
+    def test_curve_flat(self):
+        "Flat curve is equivalent to hard-edge element"
+        B2 = self.M.conf(15)['B2']
+        self.M.reconfigure(15, {'ncurve':1, 'scl_fac0':B2, 'curve0':asfarray([1.0]*20)})
+
+        S1 = self.M.allocState({})
+        S2 = self.ICM.allocState({})
+        self.M.propagate(S1, 0, 16)
+        self.ICM.propagate(S2, 0, 16)
+
+        self.assertStateEqual({
+            'moment0_env':S2.moment0_env,
+            'moment1_env':S2.moment1_env,
+        }, S1)
@@ -304,6 +304,57 @@ foo: LINE = (x1);
             ('name', 'foo'),
         ])
 
+class testCache(unittest.TestCase):
+    def setUp(self):
+        import tempfile
+        self.prev = os.environ.get('FLAME_LATTICE_CACHE')
+        self.dir = tempfile.mkdtemp()
+        os.environ['FLAME_LATTICE_CACHE'] = self.dir
+
+    def tearDown(self):
+        import shutil
+        if self.prev is None:
+            del os.environ['FLAME_LATTICE_CACHE']
+        else:
+            os.environ['FLAME_LATTICE_CACHE'] = self.prev
+        shutil.rmtree(self.dir)
+
+    def test_reload(self):
+        """A large lattice is stored in the cache, and loaded from it unchanged
+        """
+        P = GLPSParser()
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            C1 = P.parse(F)
+        self.assertEqual(len(os.listdir(self.dir)), 1)
+
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            C2 = P.parse(F)
+        self.assertEqual(len(os.listdir(self.dir)), 1)
+        self.assertEqual(repr(C1), repr(C2))
+
+        with open(os.path.join(datadir, 'Arc_Ds.lat'), 'rb') as F:
+            M = Machine(F)
+        self.assertEqual(len(M), len(dict(C1)['elements']))
+
+    def test_var_order(self):
+        """The key of extra definitions doesn't depend on the order in which names were first used
+        """
+        import subprocess, sys
+        code = '''
+import sys
+from flame import GLPSParser
+P = GLPSParser()
+for name in sys.argv[1:]:
+    P.parse(name.encode()+b' = 1; d: drift, L=1; l: LINE = (d);') # small, not cached
+with open(%r, 'rb') as F:
+    P.parse(F, extra={'zvar_a':1.0, 'zvar_b':2.0})
+''' % os.path.join(datadir, 'Arc_Ds.lat')
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.path.dirname(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+        subprocess.check_call([sys.executable, '-c', code, 'zvar_a', 'zvar_b'], env=env)
+        subprocess.check_call([sys.executable, '-c', code, 'zvar_b', 'zvar_a'], env=env)
+        self.assertEqual(len(os.listdir(self.dir)), 1)
+
 class testLog(unittest.TestCase):
     class CaptureHandler(logging.Handler):
         def __init__(self, *args, **kws):
@@ -161,6 +161,25 @@ class TestMatrix(unittest.TestCase):
       [0, 0, 0, 0, 0, 1],
     ])
 
+  def test_setparam(self):
+    "setParam() of L rebuilds the transfer matrix of a drift"
+    self.M.setParam(0, 'L', 2.0e-3)
+    self.assertEqual(self.M.conf(0)['L'], 2.0e-3)
+
+    M2 = Machine({
+      'sim_type':'TransferMatrix',
+      'elements':[
+        {'name':'elem0', 'type':'drift', 'L':2.0e-3},
+        {'name':'elem1', 'type':'drift', 'L':1.0e-3},
+      ],
+    })
+
+    S1, S2 = self.M.allocState({}), M2.allocState({})
+    self.M.propagate(S1)
+    M2.propagate(S2)
+    assert_aequal(S1.state, S2.state)
+    self.assertEqual(S1.state[0,1], 3.0)
+
 class TestObserve(unittest.TestCase):
     def setUp(self):
         self.M = Machine(b"""
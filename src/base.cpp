@@ -1,7 +1,11 @@
 
+#include <algorithm>
 #include <list>
 #include <sstream>
 
+#include <string.h>
+
+#include <boost/functional/hash.hpp>
 #include <boost/thread/mutex.hpp>
 
 #include "flame/base.h"
@@ -53,10 +57,15 @@ bool StateBase::getArray(unsigned idx, ArrayInfo& Info)
     return false;
 }
 
+namespace {
+// looked up for every element
+const ConfigKey key_name("name"), key_type("type"), key_L("L");
+}
+
 ElementVoid::ElementVoid(const Config& conf)
-    :name(conf.get<std::string>("name"))
+    :name(conf.get<std::string>(key_name))
     ,index(0)
-    ,length(conf.get<double>("L",0.0))
+    ,length(conf.get<double>(key_L,0.0))
     ,p_observe(NULL)
     ,p_conf(conf)
 {}
@@ -71,6 +80,8 @@ void ElementVoid::show(std::ostream& strm, int level) const
     strm<<"Element "<<index<<": "<<name<<" ("<<type_name()<<")\n";
 }
 
+void ElementVoid::bind(ParamBinder& P) {}
+
 void ElementVoid::assign(const ElementVoid *other)
 {
     p_conf = other->p_conf;
@@ -79,13 +90,9 @@ void ElementVoid::assign(const ElementVoid *other)
     *const_cast<size_t*>(&index) = other->index;
 }
 
-Machine::Machine(const Config& c)
-    :p_elements()
-    ,p_trace(NULL)
-    ,p_conf(c)
-    ,p_info()
+void Machine::p_init()
 {
-    std::string type(c.get<std::string>("sim_type"));
+    std::string type(p_conf.get<std::string>("sim_type"));
     p_simtype = type;
     FLAME_LOG(INFO)<<"Constructing Machine w/ sim_type='"<<type<<'\'';
 
@@ -99,62 +106,89 @@ Machine::Machine(const Config& c)
     }
 
     p_info = it->second;
+}
 
-    typedef Config::vector_t elements_t;
-    elements_t Es(c.get<elements_t>("elements"));
+void Machine::p_append(const Config& EC)
+{
+    const size_t idx = p_elements.size();
 
-    p_elements_t result;
-    p_lookup_t result_l, result_t;
-    result.reserve(Es.size());
+    const std::string& etype(EC.get<std::string>(key_type));
 
-    size_t idx=0;
-    for(elements_t::iterator it=Es.begin(), end=Es.end(); it!=end; ++it)
-    {
-        const Config& EC = *it;
-
-        const std::string& etype(EC.get<std::string>("type"));
-
-        state_info::elements_t::iterator eit = p_info.elements.find(etype);
-        if(eit==p_info.elements.end())
-            throw key_error(etype);
-
-        element_builder_t* builder = eit->second;
-
-        ElementVoid *E;
-        try{
-            E = builder->build(EC);
-        }catch(key_error& e){
-            std::ostringstream strm;
-            strm<<"Error while initializing element "<<idx<<" '"<<EC.get<std::string>("name", "<invalid>")
-               <<"' : missing required parameter '"<<e.what()<<"'";
-            throw key_error(strm.str());
-
-        }catch(std::exception& e){
-            std::ostringstream strm;
-            strm<<"Error while constructing element "<<idx<<" '"<<EC.get<std::string>("name", "<invalid>")
-               <<"' : "<<typeid(e).name()<<" : "<<e.what();
-            throw std::runtime_error(strm.str());
-        }
+    info_mutex_t::scoped_lock G(info_mutex);
 
-        if(E->type_name()!=etype) {
-            std::ostringstream strm;
-            strm<<"Element type inconsistent "<<etype<<" "<<E->type_name();
-            throw std::logic_error(strm.str());
-        }
+    state_info::elements_t::iterator eit = p_info.elements.find(etype);
+    if(eit==p_info.elements.end())
+        throw key_error(etype);
 
-        *const_cast<size_t*>(&E->index) = idx++; // ugly
+    element_builder_t* builder = eit->second;
+
+    std::auto_ptr<ElementVoid> E;
+    try{
+        E.reset(builder->build(EC));
+    }catch(key_error& e){
+        std::ostringstream strm;
+        strm<<"Error while initializing element "<<idx<<" '"<<EC.get<std::string>("name", "<invalid>")
+           <<"' : missing required parameter '"<<e.what()<<"'";
+        throw key_error(strm.str());
 
-        result.push_back(E);
-        result_l.insert(std::make_pair(LookupKey(E->name, E->index), E));
-        result_t.insert(std::make_pair(LookupKey(etype, E->index), E));
+    }catch(std::exception& e){
+        std::ostringstream strm;
+        strm<<"Error while constructing element "<<idx<<" '"<<EC.get<std::string>("name", "<invalid>")
+           <<"' : "<<typeid(e).name()<<" : "<<e.what();
+        throw std::runtime_error(strm.str());
     }
 
     G.unlock();
 
-    p_elements.swap(result);
-    p_lookup.swap(result_l);
-    p_lookup_type.swap(result_t);
-    FLAME_LOG(DEBUG)<<"Complete constructing Machine w/ sim_type='"<<type<<'\'';
+    if(E->type_name()!=etype) {
+        std::ostringstream strm;
+        strm<<"Element type inconsistent "<<etype<<" "<<E->type_name();
+        throw std::logic_error(strm.str());
+    }
+
+    *const_cast<size_t*>(&E->index) = idx; // ugly
+
+    p_elements.push_back(E.get());
+    ElementVoid *R = E.release();
+    p_lookup.insert(std::make_pair(LookupKey(R->name, R->index), R));
+    p_lookup_type.insert(std::make_pair(LookupKey(etype, R->index), R));
+}
+
+Machine::Machine(const Config& c)
+    :p_elements()
+    ,p_trace(NULL)
+    ,p_revision(0)
+    ,p_conf(c)
+    ,p_repeats_revision(0)
+    ,p_info()
+{
+    p_init();
+
+    typedef Config::vector_t elements_t;
+    const elements_t& Es(c.get<elements_t>("elements"));
+
+    try {
+        p_elements.reserve(Es.size());
+        for(elements_t::const_iterator it=Es.begin(), end=Es.end(); it!=end; ++it)
+            p_append(*it);
+    } catch(...) {
+        for(p_elements_t::iterator it=p_elements.begin(), end=p_elements.end(); it!=end; ++it)
+            delete *it;
+        throw;
+    }
+
+    FLAME_LOG(DEBUG)<<"Complete constructing Machine w/ sim_type='"<<p_simtype<<'\'';
+}
+
+Machine::Machine(const Config& c, no_elements_t)
+    :p_elements()
+    ,p_trace(NULL)
+    ,p_revision(0)
+    ,p_conf(c)
+    ,p_repeats_revision(0)
+    ,p_info()
+{
+    p_init();
 }
 
 Machine::~Machine()
@@ -165,30 +199,49 @@ Machine::~Machine()
     }
 }
 
-void
-Machine::propagate(StateBase* S, size_t start, int max) const
+MachineBuilder::MachineBuilder() {}
+MachineBuilder::~MachineBuilder() {}
+
+void MachineBuilder::begin(const Config& top, size_t count)
 {
-    const size_t nelem = p_elements.size();
+    building.reset(new Machine(top, Machine::no_elements_t()));
+    building->p_elements.reserve(count);
+}
 
-    S->next_elem = start;
-    S->retreat = std::signbit(max);
+void MachineBuilder::element(const Config& conf)
+{
+    if(!building.get())
+        throw std::logic_error("MachineBuilder::element() before begin()");
+    building->p_append(conf);
+}
 
-    for(int i=0; S->next_elem<nelem && i<abs(max); i++)
-    {
-        size_t n = S->next_elem;
-        ElementVoid* E = p_elements[n];
-        if(S->retreat) {
-            S->next_elem--;
-        } else {
-            S->next_elem++;
-        }
-        E->advance(*S);
+void MachineBuilder::end()
+{
+    if(!building.get())
+        throw std::logic_error("MachineBuilder::end() before begin()");
 
-        if(E->p_observe)
-            E->p_observe->view(E, S);
-        if(p_trace)
-            (*p_trace) << "After ["<< n<< "] " << E->name << " " << *S << "\n";
-    }
+    Config::vector_t elements;
+    elements.reserve(building->size());
+    for(size_t i=0; i<building->size(); i++)
+        elements.push_back(building->p_elements[i]->conf());
+    building->p_conf.swap<Config::vector_t>("elements", elements);
+
+    FLAME_LOG(DEBUG)<<"Complete constructing Machine w/ sim_type='"<<building->p_simtype<<'\'';
+    complete = building;
+}
+
+Machine* MachineBuilder::release()
+{
+    if(!complete.get())
+        throw std::logic_error("MachineBuilder has no complete Machine");
+    return complete.release();
+}
+
+void
+Machine::propagate(StateBase* S, size_t start, int max) const
+{
+    Propagation P(*this, S, start, max);
+    P.step((size_t)-1);
 }
 
 StateBase*
@@ -202,7 +255,7 @@ void Machine::reconfigure(size_t idx, const Config& c)
     if(idx>=p_elements.size())
         throw std::invalid_argument("element index out of range");
 
-    const std::string& etype(c.get<std::string>("type"));
+    const std::string& etype(c.get<std::string>(key_type));
 
     state_info::elements_t::iterator eit = p_info.elements.find(etype);
     if(eit==p_info.elements.end())
@@ -211,6 +264,205 @@ void Machine::reconfigure(size_t idx, const Config& c)
     element_builder_t *builder = eit->second;
 
     builder->rebuild(p_elements[idx], c, idx);
+    p_revision++;
+}
+
+void Machine::setParam(size_t idx, const std::string& name, double value)
+{
+    std::vector<ParamUpdate> updates(1, ParamUpdate(idx, name, value));
+    setParams(updates);
+}
+
+double Machine::getParam(size_t idx, const std::string& name) const
+{
+    if(idx>=p_elements.size())
+        throw std::invalid_argument(SB()<<"element index out of range: "<<idx);
+    ElementVoid *E = p_elements[idx];
+
+    ParamBinder decl;
+    E->bind(decl);
+    const ParamBinder::ParamInfo *info = decl.find(name);
+    if(info && strcmp(info->type, "double")==0)
+        return info->value;
+
+    // not bound, so setParam() will reconfigure()
+    double val;
+    if(E->p_conf.tryGet<double>(name, val))
+        return val;
+
+    throw std::invalid_argument(SB()<<"Element "<<idx<<" has no numeric parameter '"<<name<<"'");
+}
+
+void Machine::setParams(const std::vector<ParamUpdate>& updates)
+{
+    std::vector<bool> inplace(updates.size());
+
+    for(size_t i=0; i<updates.size(); i++) {
+        const ParamUpdate& U = updates[i];
+        if(U.index>=p_elements.size())
+            throw std::invalid_argument(SB()<<"element index out of range: "<<U.index);
+
+        ParamBinder decl;
+        p_elements[U.index]->bind(decl);
+        const ParamBinder::ParamInfo *info = decl.find(U.name);
+        inplace[i] = info && strcmp(info->type, "double")==0;
+    }
+
+    for(size_t i=0; i<updates.size(); i++) {
+        const ParamUpdate& U = updates[i];
+        ElementVoid *E = p_elements[U.index];
+
+        if(inplace[i]) {
+            E->p_conf.set<double>(U.name, U.value);
+            ParamBinder P(E->p_conf, ConfigKey(U.name));
+            E->bind(P);
+            E->invalidate();
+        } else {
+            // not bound, so the element may depend on it in other ways.  eg. curve scaling
+            Config conf(E->p_conf);
+            conf.set<double>(U.name, U.value);
+            reconfigure(U.index, conf);
+        }
+    }
+    p_revision++;
+}
+
+namespace {
+
+bool same_scope(const Config& A, const Config& B);
+
+struct same_value : public boost::static_visitor<bool>
+{
+    template<typename T, typename U>
+    bool operator()(const T&, const U&) const { return false; }
+    template<typename T>
+    bool operator()(const T& a, const T& b) const { return a==b; }
+    bool operator()(const Config::vector_t& a, const Config::vector_t& b) const
+    {
+        if(a.size()!=b.size())
+            return false;
+        for(size_t i=0; i<a.size(); i++)
+            if(!same_scope(a[i], b[i]))
+                return false;
+        return true;
+    }
+};
+
+// compare inner scopes
+bool same_scope(const Config& A, const Config& B)
+{
+    Config::const_iterator a(A.begin()), aend(A.end()),
+                           b(B.begin()), bend(B.end());
+    if(a!=aend && b!=bend && &*a==&*b)
+        return true; // shared, as when copied from the same definition
+    for(; a!=aend && b!=bend; ++a, ++b) {
+        if(a->first!=b->first || !boost::apply_visitor(same_value(), a->second, b->second))
+            return false;
+    }
+    return a==aend && b==bend;
+}
+
+size_t hash_scope(const Config& C);
+
+struct hash_value : public boost::static_visitor<size_t>
+{
+    size_t operator()(double v) const { return boost::hash<double>()(v); }
+    size_t operator()(const std::vector<double>& v) const { return boost::hash_range(v.begin(), v.end()); }
+    size_t operator()(const std::string& v) const { return boost::hash<std::string>()(v); }
+    size_t operator()(const Config::vector_t& v) const
+    {
+        size_t seed = v.size();
+        for(size_t i=0; i<v.size(); i++)
+            boost::hash_combine(seed, hash_scope(v[i]));
+        return seed;
+    }
+};
+
+// consistent with same_scope()
+size_t hash_scope(const Config& C)
+{
+    size_t seed = 0;
+    for(Config::const_iterator it(C.begin()), end(C.end()); it!=end; ++it) {
+        boost::hash_combine(seed, it->first.id());
+        boost::hash_combine(seed, boost::apply_visitor(hash_value(), it->second));
+    }
+    return seed;
+}
+
+// Number of repetitions of the cell [i, i+p), at least 1
+size_t count_cells(const std::vector<size_t>& def, size_t i, size_t p)
+{
+    size_t n = 1;
+    while(i+(n+1)*p<=def.size() && std::equal(def.begin()+i, def.begin()+i+p, def.begin()+i+n*p))
+        n++;
+    return n;
+}
+
+} // namespace
+
+const Machine::repeats_t& Machine::repeats() const
+{
+    if(p_repeats_revision==p_revision+1)
+        return p_repeats;
+
+    const size_t nelem = p_elements.size();
+
+    // number each distinct definition.
+    // Keyed by name, type, and hash of the inner scope, so that only equal hashes are compared.
+    typedef std::pair<std::pair<std::string, std::string>, size_t> defkey_t;
+    typedef std::map<defkey_t, std::vector<size_t> > defs_t;
+    defs_t defs;
+    std::vector<const Config*> confs; // by definition number
+    std::vector<size_t> def(nelem);
+
+    for(size_t i=0; i<nelem; i++) {
+        const ElementVoid *E = p_elements[i];
+        std::vector<size_t>& cands = defs[defkey_t(std::make_pair(E->name, std::string(E->type_name())),
+                                                   hash_scope(E->conf()))];
+        size_t d = 0;
+        for(; d<cands.size(); d++) {
+            if(same_scope(*confs[cands[d]], E->conf()))
+                break;
+        }
+        if(d==cands.size()) {
+            cands.push_back(confs.size());
+            confs.push_back(&E->conf());
+        }
+        def[i] = cands[d];
+    }
+
+    // next[i] is the index of the next occurrence of def[i], or nelem
+    std::vector<size_t> next(nelem), last(confs.size(), nelem);
+    for(size_t i=nelem; i>0; i--) {
+        next[i-1] = last[def[i-1]];
+        last[def[i-1]] = i-1;
+    }
+
+    // Each cell starting at i begins with def[i], so its length is the distance to a later occurrence.
+    // Try the nearest few, keeping the cell which covers the most elements.
+    static const size_t ncandidates = 16;
+    repeats_t R;
+    for(size_t i=0; i<nelem; ) {
+        size_t best = 0, bestcount = 1;
+        size_t j = next[i];
+        for(size_t c=0; c<ncandidates && j<nelem && 2*(j-i)<=nelem-i; c++, j=next[j]) {
+            const size_t n = count_cells(def, i, j-i);
+            if(n>1 && n*(j-i)>bestcount*best) {
+                best = j-i;
+                bestcount = n;
+            }
+        }
+        if(best) {
+            R.push_back(Repeat(i, best, bestcount));
+            i += best*bestcount;
+        } else {
+            i++;
+        }
+    }
+
+    p_repeats.swap(R);
+    p_repeats_revision = p_revision+1;
+    return p_repeats;
 }
 
 Machine::p_state_infos_t Machine::p_state_infos;
@@ -315,3 +567,78 @@ Machine::LogRecord::~LogRecord()
     }
     logger->log(*this);
 }
+
+void CancelToken::cancel()
+{
+    boost::mutex::scoped_lock L(lock);
+    flag = true;
+}
+
+bool CancelToken::cancelled() const
+{
+    boost::mutex::scoped_lock L(lock);
+    return flag;
+}
+
+void CancelToken::reset()
+{
+    boost::mutex::scoped_lock L(lock);
+    flag = false;
+}
+
+Propagation::Propagation(const Machine& M, StateBase* S,
+                         size_t start, int max,
+                         const CancelToken *token)
+    :p_machine(M)
+    ,p_state(S)
+    ,p_token(token)
+    ,p_remaining(abs(max))
+    ,p_count(0)
+    ,p_done(false)
+    ,p_cancelled(false)
+{
+    S->next_elem = start;
+    S->retreat = std::signbit(max);
+
+    p_done = p_remaining==0 || S->next_elem>=M.p_elements.size();
+}
+
+bool Propagation::step(size_t n)
+{
+    const size_t nelem = p_machine.p_elements.size();
+    StateBase *S = p_state;
+
+    for(size_t i=0; !p_done && i<n; i++)
+    {
+        if(p_token && p_token->cancelled()) {
+            p_done = p_cancelled = true;
+            break;
+        }
+
+        size_t idx = S->next_elem;
+        ElementVoid* E = p_machine.p_elements[idx];
+        if(S->retreat) {
+            S->next_elem--;
+        } else {
+            S->next_elem++;
+        }
+        p_remaining--;
+        p_count++;
+
+        try {
+            E->advance(*S);
+
+            if(E->p_observe)
+                E->p_observe->view(E, S);
+        } catch(...) {
+            p_done = true;
+            throw;
+        }
+        if(p_machine.p_trace)
+            (*p_machine.p_trace) << "After ["<< idx<< "] " << E->name << " " << *S << "\n";
+
+        p_done = E->check_loss(*S) || p_remaining==0 || S->next_elem>=nelem;
+    }
+
+    return !p_done;
+}
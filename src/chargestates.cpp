@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstring>
+
+#include <boost/thread/thread.hpp>
+
+#include "flame/chargestates.h"
+
+namespace {
+
+typedef boost::shared_ptr<MomentState> state_ptr;
+
+// Pass ST through one element, as Propagation::step() would.  Returns true if the beam is lost.
+bool advance_one(const Machine& M, ElementVoid *E, MomentState& ST)
+{
+    ST.next_elem = E->index+1;
+    E->advance(ST);
+
+    if(E->observer())
+        E->observer()->view(E, &ST);
+    if(M.trace())
+        (*M.trace()) << "After ["<< E->index<< "] " << E->name << " " << ST << "\n";
+
+    return E->check_loss(ST);
+}
+
+// Charge states k with k%nsub==w
+void select(MomentState& sub, const MomentState& ST, size_t w, size_t nsub)
+{
+    sub.real.clear();
+    sub.moment0.clear();
+    sub.moment1.clear();
+    sub.transmat.clear();
+    for(size_t k=w; k<ST.size(); k+=nsub) {
+        sub.real.push_back(ST.real[k]);
+        sub.moment0.push_back(ST.moment0[k]);
+        sub.moment1.push_back(ST.moment1[k]);
+        sub.transmat.push_back(ST.transmat[k]);
+    }
+}
+
+struct SectionWorker {
+    Machine *M;
+    MomentState *ST;
+    size_t first, last;
+    std::string *error;
+
+    void operator()() const
+    {
+        try {
+            const size_t nstates = ST->size();
+            ST->next_elem = first;
+            for(size_t i=first; i<last; i++) {
+                ElementVoid *E = (*M)[i];
+                ST->next_elem = i+1;
+                E->advance(*ST);
+                if(ST->size()!=nstates)
+                    throw std::runtime_error("Number of charge states changed");
+            }
+        } catch(std::exception& e) {
+            *error = SB()<<"Element "<<(ST->next_elem-1)<<" : "<<e.what();
+        }
+    }
+};
+
+} // namespace
+
+ChargeStatePropagator::ChargeStatePropagator(Machine& M, unsigned nthreads)
+    :machine(M)
+    ,nworkers(nthreads ? nthreads : std::max(1u, boost::thread::hardware_concurrency()))
+    ,revision(0)
+{}
+
+ChargeStatePropagator::~ChargeStatePropagator() {}
+
+bool ChargeStatePropagator::is_join(const ElementVoid *E, const MomentState& ST) const
+{
+    const MomentElementBase *ME = dynamic_cast<const MomentElementBase*>(E);
+    if(!ME)
+        throw std::invalid_argument(SB()<<"Element "<<E->index<<" is not a MomentMatrix element");
+
+    return strcmp(E->type_name(), "source")==0
+            || strcmp(E->type_name(), "stripper")==0
+            || E->observer()
+            || (ST.aper_nsigma>0e0 && ME->aper>0e0);
+}
+
+void ChargeStatePropagator::run_section(MomentState& ST, size_t first, size_t last)
+{
+    const size_t nstates = ST.size(),
+                 nsub = std::min(size_t(nworkers), nstates);
+
+    if(copies.empty() || revision!=machine.revision()) {
+        // copy the current element configurations
+        copies.clear();
+        Config::vector_t elems(machine.size());
+        for(size_t i=0; i<machine.size(); i++)
+            elems[i] = machine[i]->conf();
+        Config conf(machine.conf());
+        conf.set<Config::vector_t>("elements", elems);
+
+        for(unsigned w=0; w<nworkers; w++)
+            copies.push_back(boost::shared_ptr<Machine>(new Machine(conf)));
+        revision = machine.revision();
+    }
+
+    std::vector<state_ptr> subs(nsub);
+    std::vector<std::string> errors(nsub);
+    std::vector<SectionWorker> W(nsub);
+    for(size_t w=0; w<nsub; w++) {
+        subs[w].reset(ST.clone());
+        select(*subs[w], ST, w, nsub);
+
+        W[w].M = copies[w].get();
+        W[w].ST = subs[w].get();
+        W[w].first = first;
+        W[w].last = last;
+        W[w].error = &errors[w];
+    }
+
+    boost::thread_group workers;
+    try {
+        for(size_t w=1; w<nsub; w++)
+            workers.create_thread(W[w]);
+    } catch(...) {
+        workers.join_all();
+        throw;
+    }
+    W[0](); // calling thread
+    workers.join_all();
+
+    for(size_t w=0; w<nsub; w++) {
+        if(!errors[w].empty())
+            throw std::runtime_error(errors[w]);
+    }
+
+    // combine
+    for(size_t k=0; k<nstates; k++) {
+        const MomentState& S = *subs[k%nsub];
+        const size_t j = k/nsub;
+        ST.real[k] = S.real[j];
+        ST.moment0[k] = S.moment0[j];
+        ST.moment1[k] = S.moment1[j];
+        ST.transmat[k] = S.transmat[j];
+    }
+    ST.ref = subs[0]->ref;
+    ST.pos = subs[0]->pos;
+    ST.last_caviphi0 = subs[0]->last_caviphi0;
+    ST.next_elem = last;
+    ST.calc_rms();
+}
+
+void ChargeStatePropagator::propagate(MomentState& ST, size_t start, size_t max)
+{
+    const size_t nelem = machine.size(),
+                 end = start + std::min(max, nelem>start ? nelem-start : 0);
+
+    ST.next_elem = start;
+    ST.retreat = false;
+
+    size_t i = start;
+    while(i<end) {
+        // the section [i, j) is followed by a join element, or the end
+        size_t j = i;
+        while(j<end && !is_join(machine[j], ST))
+            j++;
+
+        if(j-i>1 && nworkers>1 && ST.size()>1) {
+            run_section(ST, i, j);
+        } else {
+            for(size_t n=i; n<j; n++)
+                advance_one(machine, machine[n], ST);
+        }
+
+        if(j<end && advance_one(machine, machine[j], ST))
+            return; // lost
+        i = j+1;
+    }
+}
@@ -51,8 +51,55 @@ void ElementStripper::Stripper_Propagate_ref(Particle &ref)
     ref.recalc();
 }
 
-void ElementStripper::Stripper_GetMat(const Config &conf,
-                     MomentState &ST)
+namespace {
+// parameters bound by elements
+const ConfigKey key_Stripper_IonZ("Stripper_IonZ"), key_Stripper_IonMass("Stripper_IonMass"),
+                key_Stripper_IonProton("Stripper_IonProton"), key_Stripper_E1Para("Stripper_E1Para"),
+                key_Stripper_lambda("Stripper_lambda"), key_Stripper_upara("Stripper_upara"),
+                key_Stripper_Para("Stripper_Para"), key_Stripper_E0Para("Stripper_E0Para"),
+                key_IonChargeStates("IonChargeStates"), key_NCharge("NCharge"),
+                key_charge_model("charge_model");
+}
+
+void ElementStripper::bind(ParamBinder& P)
+{
+    base_t::bind(P);
+    length = 0e0;
+
+    P(key_Stripper_IonZ,      Stripper_IonZ,      Stripper_IonZ_default);
+    P(key_Stripper_IonMass,   Stripper_IonMass,   Stripper_IonMass_default);
+    P(key_Stripper_IonProton, Stripper_IonProton, Stripper_IonProton_default);
+    P(key_Stripper_E1Para,    Stripper_E1Para,    Stripper_E1Para_default);
+    P(key_Stripper_lambda,    Stripper_lambda,    Stripper_lambda_default);
+    P(key_Stripper_upara,     Stripper_upara,     Stripper_upara_default);
+
+    const std::vector<double> p1_default(Stripper_Para_default, Stripper_Para_default+3),
+                              p2_default(Stripper_E0Para_default, Stripper_E0Para_default+3);
+
+    P(key_Stripper_Para,   Stripper_Para,   p1_default);
+    P(key_Stripper_E0Para, Stripper_E0Para, p2_default);
+
+    // Get new charge states.
+    P(key_IonChargeStates, ChgState);
+    P(key_NCharge,         NCharge);
+    P(key_charge_model,    charge_model, "baron");
+
+    if(charge_model!="off" && charge_model!="baron")
+        throw std::runtime_error("charge_model key word unknown, only \"baron\" and \"off\" supported by now");
+    if(charge_model=="off" && ChgState.size()!=NCharge.size())
+        throw std::runtime_error("charge stripper requires that IonChargeStates[] and NCharge[] have the same length");
+}
+
+void ElementStripper::Stripper_GetCharge(const double beta, std::vector<double>& chargeAmount_Set)
+{
+    chargeAmount_Set.clear();
+    if(charge_model=="off")
+        chargeAmount_Set = NCharge;
+    else
+        ChargeStripper(beta, ChgState, chargeAmount_Set);
+}
+
+void ElementStripper::Stripper_GetMat(MomentState &ST)
 {
     unsigned               k, n;
     double                 tmptotCharge, Fy_abs_recomb, Ek_recomb, stdEkFoilVariation, ZpAfStr, growthRate;
@@ -64,41 +111,11 @@ void ElementStripper::Stripper_GetMat(const Config &conf,
 
     //std::cout<<"In "<<__FUNCTION__<<"\n";
 
-    // Get new charge states and stripper parameters.
-    const std::vector<double>& ChgState = conf.get<std::vector<double> >("IonChargeStates");
-    const std::vector<double>& NChg = conf.get<std::vector<double> >("NCharge");
-    const std::string chrgmdl = conf.get<std::string>("charge_model", "baron");
-
-    if(chrgmdl=="off" && ChgState.size()!=NChg.size())
-        throw std::runtime_error("charge stripper requires that IonChargeStates[] and NCharge[] have the same length");
-    if(chrgmdl!="off" && chrgmdl!="baron")
-        throw std::runtime_error("charge_model key word unknown, only \"baron\" and \"off\" supported by now");
-
-    Stripper_IonZ = conf.get<double>("Stripper_IonZ", Stripper_IonZ_default);
-    Stripper_IonMass = conf.get<double>("Stripper_IonMass", Stripper_IonMass_default);
-    Stripper_IonProton = conf.get<double>("Stripper_IonProton", Stripper_IonProton_default);
-    Stripper_E1Para = conf.get<double>("Stripper_E1Para", Stripper_E1Para_default);
-    Stripper_lambda = conf.get<double>("Stripper_lambda", Stripper_lambda_default);
-    Stripper_upara = conf.get<double>("Stripper_upara", Stripper_upara_default);
-
-    const std::vector<double> p1_default(Stripper_Para_default, Stripper_Para_default+3),
-                              p2_default(Stripper_E0Para_default, Stripper_E0Para_default+3);
-
-    Stripper_Para = conf.get<std::vector<double> >("Stripper_Para", p1_default);
-    Stripper_E0Para = conf.get<std::vector<double> >("Stripper_E0Para", p2_default);
+    // Get new charge amounts.
+    Stripper_GetCharge(StatePtr->real[0].beta, chargeAmount_Set);
 
     n = ChgState.size();
 
-    if(chrgmdl=="off" )
-        if (ChgState.size()!=NChg.size())
-            throw std::runtime_error("charge stripper requires that IonChargeStates[] and NCharge[] have the same length");
-        else{
-            for (k = 0; k < n; k++) chargeAmount_Set.push_back(NChg[k]);
-        }
-    else
-        ChargeStripper(StatePtr->real[0].beta, ChgState, chargeAmount_Set);
-
-
     // Evaluate beam parameter recombination.
 
     tmptotCharge  = 0e0;
@@ -193,6 +210,96 @@ void ElementStripper::advance(StateBase &s)
     if(ST.retreat) throw std::runtime_error(SB()<<
         "Backward propagation error: Backward propagation does not support charge stripper.");
 
+    if(check_cache(ST)) {
+        ST.ref = last_ref_out;
+        ST.real = last_real_out;
+        ST.moment0 = last_moment0_out;
+        ST.moment1 = last_moment1_out;
+        ST.transmat.resize(ST.real.size());
+        for (size_t k = 0; k < ST.transmat.size(); k++)
+            ST.transmat[k] = boost::numeric::ublas::identity_matrix<double>(PS_Dim);
+        ST.calc_rms();
+        return;
+    }
+
+    cache_misses++;
+    last_ref_in     = ST.ref;
+    last_real_in    = ST.real;
+    last_moment0_in = ST.moment0;
+    last_moment1_in = ST.moment1;
+
+    Stripper_GetMat(ST);
 
-    Stripper_GetMat(conf(), ST);
+    last_ref_out     = ST.ref;
+    last_real_out    = ST.real;
+    last_moment0_out = ST.moment0;
+    last_moment1_out = ST.moment1;
+}
+
+static
+bool same_storage(const state_t::vector_t& lhs, const state_t::vector_t& rhs)
+{
+    return lhs.size()==rhs.size() && std::equal(lhs.data().begin(), lhs.data().end(), rhs.data().begin());
+}
+
+static
+bool same_storage(const state_t::matrix_t& lhs, const state_t::matrix_t& rhs)
+{
+    return lhs.size1()==rhs.size1() && lhs.size2()==rhs.size2()
+            && std::equal(lhs.data().begin(), lhs.data().end(), rhs.data().begin());
+}
+
+bool ElementStripper::check_cache(const state_t& ST) const
+{
+    if(!base_t::check_cache(ST)
+            || last_moment0_in.size()!=ST.size()
+            || last_moment1_in.size()!=ST.size())
+        return false;
+    for (size_t k = 0; k < ST.size(); k++) {
+        if(!same_storage(last_moment0_in[k], ST.moment0[k])
+                || !same_storage(last_moment1_in[k], ST.moment1[k]))
+            return false;
+    }
+    return true;
+}
+
+bool ElementStripper::advance_long(Particle& ref, std::vector<Particle>& real)
+{
+    double              tmptotCharge, Fy_abs_recomb, Ek_recomb;
+    std::vector<double> chargeAmount_Set;
+
+    ref.recalc();
+    for (size_t k = 0; k < real.size(); k++)
+        real[k].recalc();
+
+    Stripper_GetCharge(real[0].beta, chargeAmount_Set);
+
+    // Same recombination as Stripper_GetMat(), without the moments.
+    tmptotCharge  = 0e0;
+    Fy_abs_recomb = 0e0;
+    Ek_recomb     = 0e0;
+    for (size_t k = 0; k < real.size(); k++) {
+        const double Q = real[k].IonQ;
+        tmptotCharge  += Q;
+        Fy_abs_recomb += Q*real[k].phis;
+        Ek_recomb     += Q*real[k].IonEk;
+    }
+
+    Fy_abs_recomb /= tmptotCharge;
+    Ek_recomb     /= tmptotCharge;
+    Ek_recomb      = (Ek_recomb-Stripper_Para[2])*Stripper_E0Para[1] + Stripper_E0Para[0];
+
+    Stripper_Propagate_ref(ref);
+
+    real.resize(ChgState.size());
+    for (size_t k = 0; k < ChgState.size(); k++) {
+        real[k].IonZ  = ChgState[k];
+        real[k].IonQ  = chargeAmount_Set[k];
+        real[k].SampleFreq = ref.SampleFreq;
+        real[k].IonEs = ref.IonEs;
+        real[k].IonEk = Ek_recomb;
+        real[k].recalc();
+        real[k].phis  = Fy_abs_recomb;
+    }
+    return true;
 }
@@ -2,12 +2,135 @@
 #include <iostream>
 #include <sstream>
 #include <set>
+#include <deque>
+#include <limits>
+#include <algorithm>
+#include <iterator>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/atomic.hpp>
+#include <boost/functional/hash.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <flame/config.h>
+#include <flame/latcache.h>
 #include <flame/util.h>
 
 #include "glps_parser.h"
 
+namespace {
+// global table of interned names.
+// An insert-only hash table.  Nodes are never modified after being published
+// in a bucket, so lookups need no lock.  Insertion is serialized by 'lock'.
+struct AtomNode {
+    AtomNode(const std::string& name, const AtomNode *next) :name(name), key(NULL), next(next) {}
+    const std::string name;
+    const ConfigKey *key;
+    const AtomNode * const next;
+};
+
+struct AtomTable {
+    enum {nbuckets = 1024};
+    boost::mutex lock;
+    std::deque<ConfigKey> keys; // stable addresses.  guarded by lock
+    std::vector<AtomNode*> nodes; // guarded by lock
+    boost::atomic<const AtomNode*> buckets[nbuckets];
+
+    AtomTable()
+    {
+        for(size_t i=0; i<nbuckets; i++)
+            buckets[i].store(NULL, boost::memory_order_relaxed);
+    }
+    ~AtomTable()
+    {
+        for(size_t i=0; i<nodes.size(); i++)
+            delete nodes[i];
+    }
+
+    static size_t bucket(const std::string& name)
+    {
+        return boost::hash<std::string>()(name)%nbuckets;
+    }
+
+    const AtomNode* lookup(size_t b, const std::string& name) const
+    {
+        // pairs with store() in ConfigKey::intern()
+        for(const AtomNode *N = buckets[b].load(boost::memory_order_acquire); N; N = N->next) {
+            if(N->name==name)
+                return N;
+        }
+        return NULL;
+    }
+};
+
+AtomTable& atoms()
+{
+    static AtomTable table;
+    return table;
+}
+
+// order entries by atom
+struct entry_less {
+    bool operator()(const Config::entry_t& lhs, const Config::entry_t& rhs) const
+    { return lhs.first.id()<rhs.first.id(); }
+    bool operator()(const Config::entry_t& lhs, unsigned rhs) const
+    { return lhs.first.id()<rhs; }
+};
+
+// inner, with entries of outer not in inner.  both sorted
+void merge_scopes(const Config::values_t& inner, const Config::values_t& outer, Config::values_t& out)
+{
+    Config::values_t temp;
+    temp.reserve(inner.size()+outer.size());
+    // set_union() takes equivalent entries from the first range
+    std::set_union(inner.begin(), inner.end(),
+                   outer.begin(), outer.end(),
+                   std::back_inserter(temp), entry_less());
+    out.swap(temp);
+}
+} // namespace
+
+ConfigKey::ConfigKey(const std::string& name)
+{
+    *this = intern(name);
+}
+
+ConfigKey::ConfigKey(const char *name)
+{
+    *this = intern(name);
+}
+
+ConfigKey ConfigKey::intern(const std::string& name)
+{
+    AtomTable& T = atoms();
+    const size_t b = AtomTable::bucket(name);
+    const AtomNode *N = T.lookup(b, name);
+    if(N)
+        return *N->key;
+
+    boost::mutex::scoped_lock L(T.lock);
+    N = T.lookup(b, name); // may have been added since
+    if(N)
+        return *N->key;
+
+    std::auto_ptr<AtomNode> node(new AtomNode(name, T.buckets[b].load(boost::memory_order_relaxed)));
+    T.keys.push_back(ConfigKey(T.keys.size(), &node->name));
+    node->key = &T.keys.back();
+    T.nodes.push_back(node.get());
+    N = node.release();
+    // complete before being visible to lookup()
+    T.buckets[b].store(N, boost::memory_order_release);
+    return *N->key;
+}
+
+const ConfigKey* ConfigKey::find(const std::string& name)
+{
+    AtomTable& T = atoms();
+    const AtomNode *N = T.lookup(AtomTable::bucket(name), name);
+    // nodes are never removed, so the pointer remains valid
+    return N ? N->key : NULL;
+}
+
 Config::Config()
     :values(new values_t)
 {}
@@ -27,7 +150,7 @@ Config::operator=(const Config& O)
     return *this;
 }
 
-//! Ensure we have a unique reference to our values std::map by making a copy if necessary
+//! Ensure we have a unique reference to our values by making a copy if necessary
 void Config::_cow()
 {
     if(!values.unique()) {
@@ -36,90 +159,130 @@ void Config::_cow()
     }
 }
 
+namespace {
+const Config::value_t* find_in(const Config::values_t& V, const ConfigKey& key)
+{
+    Config::values_t::const_iterator it = std::lower_bound(V.begin(), V.end(), key.id(), entry_less());
+    return it!=V.end() && it->first==key ? &it->second : NULL;
+}
+}
+
+const Config::value_t* Config::_find(const ConfigKey& key) const
+{
+    const value_t *ret = find_in(*values, key);
+    for(const Frame *F = implicit_values.get(); !ret && F; F = F->next.get())
+        ret = find_in(*F->values, key);
+    return ret;
+}
+
+const Config::value_t* Config::_find(const std::string& name) const
+{
+    const ConfigKey *key = ConfigKey::find(name);
+    return key ? _find(*key) : NULL;
+}
+
+Config::value_t& Config::_slot(const ConfigKey& key)
+{
+    _cow();
+    values_t::iterator it = std::lower_bound(values->begin(), values->end(), key.id(), entry_less());
+    if(it==values->end() || it->first!=key)
+        it = values->insert(it, entry_t(key, value_t()));
+    return it->second;
+}
+
 bool
 Config::tryGetAny(const std::string& name, value_t& ret) const
 {
-    values_t::const_iterator it=values->find(name);
-    if(it!=values->end()) {
-        ret = it->second;
-        return true;
-    }
-    if(implicit_values) {
-        it = implicit_values->find(name);
-        if(it!=implicit_values->end()) {
-            ret = it->second;
-            return true;
-        }
-    }
-    return false;
+    const value_t *val = _find(name);
+    if(val)
+        ret = *val;
+    return !!val;
+}
+
+bool
+Config::tryGetAny(const ConfigKey& name, value_t& ret) const
+{
+    const value_t *val = _find(name);
+    if(val)
+        ret = *val;
+    return !!val;
 }
 
 const Config::value_t&
 Config::getAny(const std::string& name) const
 {
-    values_t::const_iterator it=values->find(name);
-    if(it!=values->end()) return it->second;
-    if(implicit_values) {
-        it = implicit_values->find(name);
-        if(it!=implicit_values->end()) return it->second;
-    }
-    throw key_error(SB()<<"Missing parameter '"<<name<<"'");
+    const value_t *val = _find(name);
+    if(!val)
+        throw key_error(SB()<<"Missing parameter '"<<name<<"'");
+    return *val;
+}
+
+const Config::value_t&
+Config::getAny(const ConfigKey& name) const
+{
+    const value_t *val = _find(name);
+    if(!val)
+        throw key_error(SB()<<"Missing parameter '"<<name<<"'");
+    return *val;
 }
+
 void
 Config::setAny(const std::string& name, const value_t& val)
 {
-    _cow();
-    (*values)[name] = val;
+    _slot(ConfigKey(name)) = val;
+}
+
+void
+Config::setAny(const ConfigKey& name, const value_t& val)
+{
+    _slot(name) = val;
 }
 
 void
 Config::swapAny(const std::string& name, value_t& val)
+{
+    _slot(ConfigKey(name)).swap(val);
+}
+
+void
+Config::swapAny(const ConfigKey& name, value_t& val)
+{
+    _slot(name).swap(val);
+}
+
+void Config::reserve(size_t n)
 {
     _cow();
-    {
-        values_t::iterator it = values->find(name);
-        if(it!=values->end()) {
-            it->second.swap(val);
-            return;
-        }
-    }
-    std::pair<values_t::iterator, bool> ret = values->insert(std::make_pair(name,value_t()));
-    assert(ret.second);
-    ret.first->second.swap(val);
+    values->reserve(n);
 }
 
 Config Config::new_scope() const
 {
     Config ret;
-    // return new Config with empty 'values' and 'implicit_values' containing our 'implicit_values'+'values'
-    if(values->empty()) {
+    // return new Config with empty 'values', enclosed by our 'values' and 'implicit_values'
+    if(values->empty())
         ret.implicit_values = implicit_values;
-    } else if(!implicit_values || implicit_values->empty()) {
-        ret.implicit_values = values; // _cow() makes this safe
-    } else {
-        values_pointer ptr(new values_t(*values)); // copy
-        ptr->insert(implicit_values->begin(),
-                    implicit_values->end());
-        // note that insert() will not overwrite existing keys
-        ret.implicit_values = ptr;
-    }
+    else
+        ret.implicit_values.reset(new Frame(values, implicit_values)); // _cow() makes sharing 'values' safe
     return ret;
 }
 
 void Config::push_scope()
 {
-    flatten();
-    implicit_values = values; // _cow() makes this safe
-    values.reset(new values_t);
+    if(!values->empty()) {
+        implicit_values.reset(new Frame(values, implicit_values)); // _cow() makes this safe
+        values.reset(new values_t);
+    }
 }
 
 void Config::flatten()
 {
     if(implicit_values) {
-        values->insert(implicit_values->begin(),
-                       implicit_values->end());
+        _cow();
+        // innermost first, so existing entries take precedence
+        for(const Frame *F = implicit_values.get(); F; F = F->next.get())
+            merge_scopes(*values, *F->values, *values);
         implicit_values.reset();
-        // note that insert() will not overwrite existing keys
     }
 }
 
@@ -184,16 +347,152 @@ struct show_value : public boost::static_visitor<void>
 };
 }
 
+namespace {
+struct entry_name_less {
+    bool operator()(const Config::entry_t *lhs, const Config::entry_t *rhs) const
+    { return lhs->first.name()<rhs->first.name(); }
+};
+
+// entries of the inner scope of conf, in order of name
+void sorted_entries(const Config& conf, std::vector<const Config::entry_t*>& out)
+{
+    out.clear();
+    for(Config::const_iterator it=conf.begin(), end=conf.end(); it!=end; ++it)
+        out.push_back(&*it);
+    std::sort(out.begin(), out.end(), entry_name_less());
+}
+}
+
 void
 Config::show(std::ostream& strm, unsigned indent) const
 {
-    for(Config::values_t::const_iterator it=values->begin(), end=values->end();
-        it!=end; ++it)
+    std::vector<const entry_t*> entries;
+    sorted_entries(*this, entries);
+    for(size_t i=0; i<entries.size(); i++)
     {
-        boost::apply_visitor(show_value(strm, it->first, indent), it->second);
+        boost::apply_visitor(show_value(strm, entries[i]->first.name(), indent), entries[i]->second);
+    }
+}
+
+bool ParamBinder::declare(const ConfigKey& name, const char *type, bool required, const double *value)
+{
+    // when binding, the variable may not be initialized yet
+    const double cur = value && !conf ? *value : std::numeric_limits<double>::quiet_NaN();
+    bool found = false;
+    for(params_t::iterator it=decls.begin(), end=decls.end(); it!=end; ++it) {
+        if(it->key==name) {
+            // re-declared, eg. optional in a base class and required in a sub-class
+            it->type = type;
+            it->required |= required;
+            it->value = cur;
+            found = true;
+            break;
+        }
+    }
+    if(!found) {
+        ParamInfo info(name);
+        info.type = type;
+        info.required = required;
+        info.value = cur;
+        decls.push_back(info);
+    }
+    return conf && (only==all || only==name.id());
+}
+
+const ParamBinder::ParamInfo* ParamBinder::find(const std::string& name) const
+{
+    const ConfigKey *key = ConfigKey::find(name);
+    if(!key)
+        return NULL; // never interned, so never declared
+    for(params_t::const_iterator it=decls.begin(), end=decls.end(); it!=end; ++it) {
+        if(it->key==*key)
+            return &*it;
     }
+    return NULL;
+}
+
+void ParamBinder::operator()(const ConfigKey& name, double& var)
+{
+    if(declare(name, "double", true, &var))
+        var = conf->get<double>(name);
 }
 
+void ParamBinder::operator()(const ConfigKey& name, double& var, double def)
+{
+    if(declare(name, "double", false, &var))
+        var = conf->get<double>(name, def);
+}
+
+void ParamBinder::operator()(const ConfigKey& name, std::vector<double>& var)
+{
+    if(declare(name, "vector", true))
+        var = conf->get<std::vector<double> >(name);
+}
+
+void ParamBinder::operator()(const ConfigKey& name, std::vector<double>& var, const std::vector<double>& def)
+{
+    if(declare(name, "vector", false))
+        var = conf->get<std::vector<double> >(name, def);
+}
+
+void ParamBinder::operator()(const ConfigKey& name, std::string& var)
+{
+    if(declare(name, "string", true))
+        var = conf->get<std::string>(name);
+}
+
+void ParamBinder::operator()(const ConfigKey& name, std::string& var, const std::string& def)
+{
+    if(declare(name, "string", false))
+        var = conf->get<std::string>(name, def);
+}
+
+void ParamBinder::flag(const ConfigKey& name, unsigned& var, unsigned def)
+{
+    if(!declare(name, "flag", false))
+        return;
+
+    double check_value;
+    std::string sval;
+    if(conf->tryGet<std::string>(name, sval)) {
+        try {
+            check_value = boost::lexical_cast<double>(sval);
+        } catch(boost::bad_lexical_cast&) {
+            throw std::runtime_error(SB()<< name << " must be an unsigned integer");
+        }
+    } else if(!conf->tryGet<double>(name, check_value)) {
+        var = def;
+        return;
+    }
+
+    //Check the value is an unsigned integer
+    if(!(check_value>=0.0) || check_value>double(std::numeric_limits<unsigned>::max())
+            || double(unsigned(check_value))!=check_value)
+        throw std::runtime_error(SB()<< name << " must be an unsigned integer");
+    var = unsigned(check_value);
+}
+
+void ParamBinder::operator()(const std::string& name, double& var)
+{ (*this)(ConfigKey(name), var); }
+
+void ParamBinder::operator()(const std::string& name, double& var, double def)
+{ (*this)(ConfigKey(name), var, def); }
+
+void ParamBinder::operator()(const std::string& name, std::vector<double>& var)
+{ (*this)(ConfigKey(name), var); }
+
+void ParamBinder::operator()(const std::string& name, std::vector<double>& var, const std::vector<double>& def)
+{ (*this)(ConfigKey(name), var, def); }
+
+void ParamBinder::operator()(const std::string& name, std::string& var)
+{ (*this)(ConfigKey(name), var); }
+
+void ParamBinder::operator()(const std::string& name, std::string& var, const std::string& def)
+{ (*this)(ConfigKey(name), var, def); }
+
+void ParamBinder::flag(const std::string& name, unsigned& var, unsigned def)
+{ flag(ConfigKey(name), var, def); }
+
 namespace {
 // store variable definitions in parser context
 struct store_ctxt_var : public boost::static_visitor<void>
@@ -246,11 +545,13 @@ void assign_expr_to_Config(Config& conf, const std::string& name, const expr_t&
 }
 
 struct GLPSParser::Pvt {
-    typedef Config::values_t values_t;
+    typedef std::map<std::string, Config::value_t> values_t;
     values_t vars;
     std::ostream *printer;
+    std::string cache_dir;
+    std::vector<std::string> depends;
 
-    Pvt() :printer(&std::cerr) {}
+    Pvt() :printer(&std::cerr), cache_dir(LatticeCache::default_dir()) {}
 
     void fill_vars(parse_context& ctxt)
     {
@@ -261,62 +562,133 @@ struct GLPSParser::Pvt {
         }
     }
 
-    Config* fill_context(parse_context& ctxt, const bool lattice=true)
+    // parse from a buffer, or load from the lattice cache
+    Config* parse(const char* s, size_t len, const char *path, const bool lattice)
     {
-        std::auto_ptr<Config> ret(new Config);
-        ret->reserve(ctxt.vars.size()+2);
+        parse_context ctxt(path);
+        LatticeCache cache(len>=LatticeCache::min_size ? cache_dir : std::string());
+        boost::uint64_t key = 0;
+
+        if(cache.enabled()) {
+            Config defs;
+            for(values_t::const_iterator it=vars.begin(), end=vars.end(); it!=end; ++it)
+                defs.setAny(it->first, it->second);
+            key = LatticeCache::key(s, len, ctxt.cwd.native(), lattice, defs);
+
+            std::string output;
+            std::auto_ptr<Config> ret(cache.load(key, depends, output));
+            if(ret.get()) {
+                if(printer)
+                    (*printer)<<output;
+                return ret.release();
+            }
+        }
+
+        // capture output of print() to be replayed from the cache
+        std::ostringstream output;
+        ctxt.printer = cache.enabled() ? &output : printer;
+        fill_vars(ctxt);
+
+        std::auto_ptr<Config> ret;
+        try {
+            ctxt.parse(s, len);
+            ret.reset(fill_context(ctxt, lattice));
+        } catch(...) {
+            if(printer && cache.enabled())
+                (*printer)<<output.str();
+            throw;
+        }
+        if(printer && cache.enabled())
+            (*printer)<<output.str();
+
+        std::sort(ctxt.depends.begin(), ctxt.depends.end());
+        ctxt.depends.erase(std::unique(ctxt.depends.begin(), ctxt.depends.end()), ctxt.depends.end());
+        depends.swap(ctxt.depends);
+
+        if(cache.enabled())
+            cache.store(key, *ret, depends, output.str()); // best effort
+        return ret.release();
+    }
+
+    // copy ctxt.vars to top level Config
+    void fill_globals(parse_context& ctxt, Config& top)
+    {
+        top.reserve(ctxt.vars.size()+2);
 
-        // copy ctxt.vars to top level Config
         for(parse_context::vars_t::iterator it=ctxt.vars.begin(), end=ctxt.vars.end();
             it!=end; ++it)
         {
-            assign_expr_to_Config(*ret, it->name, it->expr);
+            assign_expr_to_Config(top, it->name, it->expr);
         }
+    }
 
-        if(lattice){
-            if(ctxt.line.size()==0)
-                throw std::runtime_error("No beamlines defined by this file");
-
-            parse_line *line = NULL;
-
-            {
-                // find the magic "USE" element.  eg "USE: linename;"
-                parse_context::map_idx_t::const_iterator it=ctxt.element_idx.find("USE");
-                if(it!=ctxt.element_idx.end()) {
-                    parse_element &elem = ctxt.elements[it->second];
-                    parse_context::map_idx_t::const_iterator lit = ctxt.line_idx.find(elem.etype);
-
-                    if(lit!=ctxt.line_idx.end()) {
-                        line = &ctxt.line[lit->second];
-                    } else {
-                        std::ostringstream strm;
-                        strm<<"\"USE: "<<elem.etype<<";\" references undefined beamline";
-                        throw std::runtime_error(strm.str());
-                    }
+    // the beamline to expand
+    const parse_line& find_line(parse_context& ctxt)
+    {
+        if(ctxt.line.size()==0)
+            throw std::runtime_error("No beamlines defined by this file");
+
+        const parse_line *line = NULL;
+
+        {
+            // find the magic "USE" element.  eg "USE: linename;"
+            parse_context::map_idx_t::const_iterator it=ctxt.element_idx.find("USE");
+            if(it!=ctxt.element_idx.end()) {
+                parse_element &elem = ctxt.elements[it->second];
+                parse_context::map_idx_t::const_iterator lit = ctxt.line_idx.find(elem.etype);
+
+                if(lit!=ctxt.line_idx.end()) {
+                    line = &ctxt.line[lit->second];
                 } else {
-                    // no magic USE, default to last line
-                    line = &ctxt.line.back();
+                    std::ostringstream strm;
+                    strm<<"\"USE: "<<elem.etype<<";\" references undefined beamline";
+                    throw std::runtime_error(strm.str());
                 }
+            } else {
+                // no magic USE, default to last line
+                line = &ctxt.line.back();
             }
+        }
 
-            assert(line);
+        assert(line);
 
-            if(line->names.size()==0) {
-                std::ostringstream strm;
-                strm<<"Beamline '"<<line->label<<"' has no elements";
-                throw std::runtime_error(strm.str());
-            }
+        if(line->line->size==0) {
+            std::ostringstream strm;
+            strm<<"Beamline '"<<line->label<<"' has no elements";
+            throw std::runtime_error(strm.str());
+        }
+        return *line;
+    }
 
-            Config::vector_t elements;
-            elements.resize(line->names.size());
+    struct resolve_names {
+        parse_context& ctxt;
+        std::vector<size_t>& order;
+        resolve_names(parse_context& ctxt, std::vector<size_t>& order) :ctxt(ctxt), order(order) {}
+        void operator()(const std::string& name) { order.push_back(ctxt.element_idx[name]); }
+    };
 
-            // copy in elements
-            size_t i = 0;
-            for(strlist_t::list_t::const_iterator it=line->names.begin(), end=line->names.end();
-                it!=end; ++it)
-            {
-                Config next(ret->new_scope()); // inhiert global scope
-                const parse_element& elem = ctxt.elements[ctxt.element_idx[*it]];
+    // definition (index in ctxt.elements) of each element of 'line'
+    void resolve(parse_context& ctxt, const parse_line& line, std::vector<size_t>& order)
+    {
+        order.clear();
+        order.reserve(line.line->size);
+        resolve_names R(ctxt, order);
+        line.line->expand(R);
+    }
+
+    // pass each element to 'sink'
+    void fill_elements(parse_context& ctxt, const Config& globals, const std::vector<size_t>& order, GLPSParser::Sink& sink)
+    {
+        // Each definition is converted once.  Repeated elements share its values (copy on write)
+        std::vector<Config> defs(ctxt.elements.size());
+        std::vector<bool> done(ctxt.elements.size(), false);
+
+        for(size_t i=0; i<order.size(); i++)
+        {
+            const size_t idx = order[i];
+            if(!done[idx]) {
+                Config next(globals.new_scope()); // inhiert global scope
+                const parse_element& elem = ctxt.elements[idx];
 
                 next.reserve(elem.props.size()+2);
 
@@ -331,15 +703,63 @@ struct GLPSParser::Pvt {
                 assert(!elem.etype.empty() && !elem.label.empty());
                 next.set<std::string>("type", elem.etype);
                 next.set<std::string>("name", elem.label);
-                elements[i++].swap(next);
+                defs[idx].swap(next);
+                done[idx] = true;
             }
 
-            ret->swap<std::string>("name", line->label);
-            ret->swap<Config::vector_t>("elements", elements);
+            sink.element(defs[idx]);
+        }
+    }
+
+    struct Collect : public GLPSParser::Sink {
+        Config::vector_t elements;
+        virtual ~Collect() {}
+        virtual void begin(const Config&, size_t count) { elements.reserve(count); }
+        virtual void element(const Config& conf) { elements.push_back(conf); }
+        virtual void end() {}
+    };
+
+    Config* fill_context(parse_context& ctxt, const bool lattice=true)
+    {
+        std::auto_ptr<Config> ret(new Config);
+        fill_globals(ctxt, *ret);
+
+        if(lattice){
+            const parse_line& line = find_line(ctxt);
+
+            std::vector<size_t> order;
+            resolve(ctxt, line, order);
+
+            Collect C;
+            C.begin(*ret, order.size());
+            fill_elements(ctxt, *ret, order, C);
+
+            ret->set<std::string>("name", line.label);
+            ret->swap<Config::vector_t>("elements", C.elements);
         }
 
         return ret.release();
     }
+
+    void fill_sink(parse_context& ctxt, GLPSParser::Sink& sink)
+    {
+        Config globals;
+        fill_globals(ctxt, globals);
+
+        const parse_line& line = find_line(ctxt);
+
+        Config top(globals);
+        top.set<std::string>("name", line.label);
+
+        // the expanded beamlines are no longer needed
+        std::vector<size_t> order;
+        resolve(ctxt, line, order);
+        parse_context::line_t().swap(ctxt.line);
+
+        sink.begin(top, order.size());
+        fill_elements(ctxt, globals, order, sink);
+        sink.end();
+    }
 };
 
 GLPSParser::GLPSParser()
@@ -360,6 +780,18 @@ GLPSParser::setPrinter(std::ostream* strm)
     priv->printer = strm;
 }
 
+void
+GLPSParser::setCacheDir(const std::string& dir)
+{
+    priv->cache_dir = dir;
+}
+
+const std::vector<std::string>&
+GLPSParser::dependencies() const
+{
+    return priv->depends;
+}
+
 Config*
 GLPSParser::parse_file(const char *fname, const bool have_lattice)
 {
@@ -382,7 +814,20 @@ GLPSParser::parse_file(const char *fname, const bool have_lattice)
         throw std::runtime_error(strm.str());
     }
     try{
-        Config *ret = parse_file(have_lattice, fp, fpath.native().c_str());
+        Config *ret;
+        if(closeme && !priv->cache_dir.empty()) {
+            // read the whole file to compute the cache key
+            std::vector<char> buf;
+            char chunk[4096];
+            size_t n;
+            while((n=fread(chunk, 1, sizeof(chunk), fp))>0)
+                buf.insert(buf.end(), chunk, chunk+n);
+            if(ferror(fp))
+                throw std::runtime_error(SB()<<"Failed to read file for parsing '"<<fname<<"'");
+            ret = priv->parse(buf.empty() ? "" : &buf[0], buf.size(), fpath.native().c_str(), have_lattice);
+        } else {
+            ret = parse_file(have_lattice, fp, fpath.native().c_str());
+        }
         if(closeme) fclose(fp);
         return ret;
     }catch(...){
@@ -398,27 +843,70 @@ GLPSParser::parse_file(const bool have_lattice, FILE *fp, const char *path)
     ctxt.printer = priv->printer;
     priv->fill_vars(ctxt);
     ctxt.parse(fp);
-    return priv->fill_context(ctxt, have_lattice);
+    Config *ret = priv->fill_context(ctxt, have_lattice);
+    priv->depends.swap(ctxt.depends);
+    return ret;
 }
 
-Config*
-GLPSParser::parse_byte(const char* s, size_t len, const char *path)
+void
+GLPSParser::parse_stream(Sink& sink, const char* s, size_t len, const char *path)
 {
     parse_context ctxt(path);
     ctxt.printer = priv->printer;
     priv->fill_vars(ctxt);
     ctxt.parse(s, len);
-    return priv->fill_context(ctxt);
+    priv->fill_sink(ctxt, sink);
+    priv->depends.swap(ctxt.depends);
+}
+
+void
+GLPSParser::parse_stream(Sink& sink, const char *fname)
+{
+    boost::filesystem::path fpath;
+    if(fname) {
+        fpath = boost::filesystem::canonical(fname).parent_path();
+    } else {
+        fpath = boost::filesystem::current_path();
+    }
+
+    FILE *fp;
+    bool closeme = fname!=NULL && strcmp(fname,"-")!=0;
+    if(closeme)
+        fp = fopen(fname, "r");
+    else
+        fp = stdin;
+    if(!fp) {
+        std::ostringstream strm;
+        strm<<"Failed to open file for parsing '"<<fname<<"'";
+        throw std::runtime_error(strm.str());
+    }
+    try{
+        parse_context ctxt(fpath.native().c_str());
+        ctxt.printer = priv->printer;
+        priv->fill_vars(ctxt);
+        ctxt.parse(fp);
+        if(closeme) {
+            fclose(fp);
+            closeme = false;
+        }
+        priv->fill_sink(ctxt, sink);
+        priv->depends.swap(ctxt.depends);
+    }catch(...){
+        if(closeme) fclose(fp);
+        throw;
+    }
+}
+
+Config*
+GLPSParser::parse_byte(const char* s, size_t len, const char *path)
+{
+    return priv->parse(s, len, path, true);
 }
 
 Config*
 GLPSParser::parse_byte(const std::string& s, const char *path)
 {
-    parse_context ctxt(path);
-    ctxt.printer = priv->printer;
-    priv->fill_vars(ctxt);
-    ctxt.parse(s);
-    return priv->fill_context(ctxt);
+    return priv->parse(s.c_str(), s.size(), path, true);
 }
 
 namespace {
@@ -498,11 +986,13 @@ struct glps_show : public boost::static_visitor<void>
 
 void GLPSPrint(std::ostream& strm, const Config& conf)
 {
+    std::vector<const Config::entry_t*> entries;
+
     // print variables
-    for(Config::const_iterator it=conf.begin(), end=conf.end();
-        it!=end; ++it)
+    sorted_entries(conf, entries);
+    for(size_t i=0; i<entries.size(); i++)
     {
-        boost::apply_visitor(glps_show(strm, it->first), it->second);
+        boost::apply_visitor(glps_show(strm, entries[i]->first.name()), entries[i]->second);
     }
 
     const Config::vector_t *v;
@@ -545,12 +1035,13 @@ void GLPSPrint(std::ostream& strm, const Config& conf)
         if(!ok)
             strm<<"# <malformed element>";
 
-        for(Config::const_iterator itx=it->begin(), endx=it->end();
-            itx!=endx; ++itx)
+        sorted_entries(*it, entries);
+        for(size_t i=0; i<entries.size(); i++)
         {
-            if(itx->first=="name" || itx->first=="type")
+            const std::string& pname = entries[i]->first.name();
+            if(pname=="name" || pname=="type")
                 continue;
-            boost::apply_visitor(glps_show_props(strm, itx->first), itx->second);
+            boost::apply_visitor(glps_show_props(strm, pname), entries[i]->second);
         }
 
         strm<<";\n";
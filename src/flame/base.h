@@ -14,6 +14,7 @@
 #include <boost/any.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/call_traits.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "config.h"
 #include "util.h"
@@ -210,6 +211,24 @@ struct ElementVoid : public boost::noncopyable
     //! level is a hint as to the verbosity expected by the caller.
     virtual void show(std::ostream&, int level) const;
 
+    /** Declare and bind the parameters of this element.
+     *
+     * Sub-classes which cache their parameters should override,
+     * and must call base class bind().
+     * ElementVoid binds nothing.  "L" should be bound only by elements
+     * which read length each time their matrix is recomputed.
+     */
+    virtual void bind(ParamBinder& P);
+
+    //! Discard any results cached from previous calls to advance().
+    //! Called by Machine::setParam() after a parameter is changed.
+    virtual void invalidate() {}
+
+    /** Called by Machine::propagate() after advance() and any Observer.
+     * @returns true if the state has been lost in this element, which ends propagation.
+     */
+    virtual bool check_loss(StateBase& s) const { return false; }
+
     //! Used by Machine::reconfigure() to avoid re-alloc (and iterator invalidation)
     //! Assumes other has the same type.
     //! Sub-classes must call base class assign()
@@ -219,6 +238,7 @@ private:
     Observer *p_observe;
     Config p_conf;
     friend class Machine;
+    friend class Propagation;
 };
 
 /**
@@ -246,6 +266,7 @@ struct Machine : public boost::noncopyable
      * @param max The maximum number of elements through which the state will be passed
      * @throws std::exception sub-classes for various errors.
      *         If an exception is thrown then the state of S is undefined.
+     * @see Propagation to pass a State through in several steps.
      */
     void propagate(StateBase* S,
                    size_t start=0,
@@ -286,6 +307,50 @@ struct Machine : public boost::noncopyable
      */
     void reconfigure(size_t idx, const Config& c);
 
+    /**
+     * @brief Change a single numeric parameter of one element
+     * @param idx The index of this element
+     * @param name Parameter name
+     * @param value New value
+     *
+     * If the element binds this parameter (see ElementVoid::bind()),
+     * then the element is updated in place and only its cached results are discarded.
+     * Otherwise this is equivalent to reconfigure() with a copy of the element Config
+     * where 'name' is set to 'value'.
+     *
+     * @code
+     * Machine M(...);
+     * M.setParam(5, "B2", 1.2);
+     * @endcode
+     */
+    void setParam(size_t idx, const std::string& name, double value);
+
+    /**
+     * @brief The current value of a numeric parameter of one element
+     * @param idx The index of this element
+     * @param name Parameter name
+     * @throws std::invalid_argument if the element has no such numeric parameter
+     *
+     * The value as bound by the element, or else as found in its Config.
+     */
+    double getParam(size_t idx, const std::string& name) const;
+
+    //! One change for setParams()
+    struct ParamUpdate {
+        size_t index;
+        std::string name;
+        double value;
+        ParamUpdate() :index(0), value(0.0) {}
+        ParamUpdate(size_t index, const std::string& name, double value)
+            :index(index), name(name), value(value) {}
+    };
+    /**
+     * @brief Change several numeric parameters, as by setParam()
+     *
+     * All indices are checked before any change is made.
+     */
+    void setParams(const std::vector<ParamUpdate>& updates);
+
     //! Return the sim_type string found during construction.
     inline const std::string& simtype() const {return p_simtype;}
 
@@ -300,6 +365,31 @@ struct Machine : public boost::noncopyable
      */
     void set_trace(std::ostream* v) {p_trace=v;}
 
+    //! Incremented by each reconfigure() and setParams().  Used to find out of date copies of elements.
+    inline size_t revision() const { return p_revision; }
+
+    /** @brief A section of the beamline made of repetitions of one cell
+     *
+     * Element first+r*length+j is the j'th element of the r'th repetition.
+     */
+    struct Repeat {
+        size_t first,  //!< index of the first element of the section
+               length, //!< number of elements in one cell
+               count;  //!< number of repetitions, at least 2
+        Repeat(size_t first, size_t length, size_t count) :first(first), length(length), count(count) {}
+    };
+    typedef std::vector<Repeat> repeats_t;
+    /** @brief The repeated cells of this beamline, in order of index
+     *
+     * Elements with the same name, type, and inner scope Config are taken to be occurrences of the same definition.
+     * eg. "cell: LINE = (B, C, D); L: LINE = (A, 10*cell);" gives one Repeat {1, 3, 10}.
+     * Where cells could be chosen in several ways, the one covering the most elements is kept.
+     * Sections do not overlap.
+     *
+     * Found on first use, and again after reconfigure() or setParams().
+     */
+    const repeats_t& repeats() const;
+
 private:
     typedef std::vector<ElementVoid*> p_elements_t;
 
@@ -388,12 +478,25 @@ public:
 
 
 private:
+    friend class Propagation;
+    friend class MachineBuilder;
+
+    struct no_elements_t {};
+    //! Construct without elements, which MachineBuilder appends
+    Machine(const Config& c, no_elements_t);
+    void p_init();
+    void p_append(const Config& EC);
+
     p_elements_t p_elements;
     p_lookup_t p_lookup; //!< lookup by element instance name
     p_lookup_t p_lookup_type; //!< lookup by element type name
     std::string p_simtype;
     std::ostream* p_trace;
+    size_t p_revision;
     Config p_conf;
+    // cache of repeats(), valid when p_repeats_revision==p_revision+1
+    mutable repeats_t p_repeats;
+    mutable size_t p_repeats_revision;
 
     typedef StateBase* (*state_builder_t)(const Config& c);
     template<typename State>
@@ -524,6 +627,116 @@ private:
     static boost::shared_ptr<Logger> p_logger;
 };
 
+/** @brief Cooperative cancellation flag for Propagation
+ *
+ * May be shared by several Propagation instances, and cancel()'d from any thread.
+ */
+class CancelToken : public boost::noncopyable
+{
+    mutable boost::mutex lock;
+    bool flag;
+public:
+    CancelToken() :flag(false) {}
+
+    //! Request that Propagations using this token stop before their next element
+    void cancel();
+    //! Has cancel() been called since construction, or the last reset()?
+    bool cancelled() const;
+    //! Clear the flag, so that the token may be re-used
+    void reset();
+};
+
+/** @brief Resumable equivalent of Machine::propagate()
+ *
+ * Passes a State through the same elements as Machine::propagate(),
+ * but only a bounded number of elements on each call to step().
+ * Several simulations may be time-sliced on one thread,
+ * and an obsolete simulation may be abandoned by cancel()ing its CancelToken.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> S(M.allocState());
+ CancelToken token;
+ Propagation P(M, S.get(), 0, INT_MAX, &token);
+ while(P.step(100)) {
+     // do other work.  may call token.cancel()
+ }
+ if(P.cancelled()) ...
+ @endcode
+ *
+ * The Machine, State, and CancelToken must outlive the Propagation.
+ * The State should not be otherwise changed between calls to step().
+ */
+class Propagation : public boost::noncopyable
+{
+public:
+    /** Prepare to propagate.  No elements are passed until step()
+     *
+     * @param M The Machine
+     * @param S The initial state, will be updated with the final state
+     * @param start The index of the first Element the state will pass through
+     * @param max The maximum number of elements through which the state will be passed.  Negative to retreat.
+     * @param token If not NULL, checked before each element
+     */
+    Propagation(const Machine& M, StateBase* S,
+                size_t start=0, int max=INT_MAX,
+                const CancelToken *token=NULL);
+
+    /** Pass the state through at most n more elements.
+     *
+     * @returns true if more elements remain.  false when finished or cancelled.
+     * @throws std::exception sub-classes for various errors (cf. Machine::propagate()).
+     *         The Propagation is then done().
+     */
+    bool step(size_t n=1);
+
+    //! true when no elements remain, or when cancelled
+    inline bool done() const { return p_done; }
+    //! true if step() stopped because the CancelToken was cancelled
+    inline bool cancelled() const { return p_cancelled; }
+    //! Number of elements passed so far
+    inline size_t count() const { return p_count; }
+
+private:
+    const Machine& p_machine;
+    StateBase *p_state;
+    const CancelToken *p_token;
+    size_t p_remaining, p_count;
+    bool p_done, p_cancelled;
+};
+
+/** @brief Construct a Machine from a beamline passed one element at a time
+ *
+ * Each element is constructed as it is parsed, so no list of element Configs
+ * is built before the Machine.  Machine::conf() of the result holds the
+ * "elements" of the Machine, which share values with ElementVoid::conf().
+ *
+ @code
+ GLPSParser P;
+ MachineBuilder B;
+ P.parse_stream(B, "lattice.lat");
+ std::auto_ptr<Machine> M(B.release());
+ @endcode
+ */
+class MachineBuilder : public GLPSParser::Sink
+{
+public:
+    MachineBuilder();
+    virtual ~MachineBuilder();
+
+    virtual void begin(const Config& top, size_t count);
+    virtual void element(const Config& conf);
+    virtual void end();
+
+    /** Take the Machine completed by end().  The caller must delete it.
+     * @throws std::logic_error if no Machine has been completed
+     */
+    Machine* release();
+
+private:
+    std::auto_ptr<Machine> building, complete;
+};
+
 #define FLAME_ERROR 40
 #define FLAME_WARN  30
 #define FLAME_INFO  20
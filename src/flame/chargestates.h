@@ -0,0 +1,75 @@
+#ifndef FLAME_CHARGESTATES_H
+#define FLAME_CHARGESTATES_H
+
+#include <vector>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "moment.h"
+
+/** @brief Propagate the charge states of a MomentState on separate threads
+ *
+ * Away from strippers, each charge state evolves independently, and only the envelope
+ * (MomentState::calc_rms()) combines them.  So the elements are divided into sections
+ * between "join" elements, which are:
+ *
+ * - "source" and "stripper" elements, which change the charge states,
+ * - elements with an Observer, which may need the envelope,
+ * - elements with an aperture (MomentElementBase::aper) when MomentState::aper_nsigma is set,
+ *   as MomentElementBase::check_loss() uses the envelope.
+ *
+ * Within a section, the charge states are divided between threads.  Each thread passes
+ * a MomentState holding only its charge states through a private copy of the elements,
+ * whose cached transfer matrices are kept for the next call.
+ * The charge states are then combined, the envelope is computed, and the join element
+ * is passed on the calling thread with the Machine itself.
+ *
+ * Results are the same as Machine::propagate().
+ * Machine::set_trace() output is not written for elements within sections.
+ *
+ * Private copies are rebuilt when Machine::revision() changes.
+ *
+ @code
+ Machine M(...);
+ ChargeStatePropagator P(M);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ P.propagate(static_cast<MomentState&>(*ST));
+ @endcode
+ */
+class ChargeStatePropagator : public boost::noncopyable
+{
+public:
+    /**
+     * @param M The Machine.  Must out live this object.
+     * @param nthreads Number of threads.  0 selects boost::thread::hardware_concurrency()
+     */
+    explicit ChargeStatePropagator(Machine& M, unsigned nthreads=0);
+    ~ChargeStatePropagator();
+
+    /** Pass ST through elements [start, start+max)
+     *
+     * @param ST The initial state, will be updated with the final state
+     * @param start The index of the first Element the state will pass through
+     * @param max The maximum number of elements through which the state will be passed
+     * @throws std::invalid_argument if an element is not a MomentMatrix element
+     * @throws std::runtime_error if an element fails, or changes the number of charge states within a section.
+     * @note No other thread may use the Machine during this call.
+     */
+    void propagate(MomentState& ST, size_t start=0, size_t max=(size_t)-1);
+
+    //! Number of threads
+    inline unsigned nthreads() const { return nworkers; }
+
+private:
+    Machine& machine;
+    unsigned nworkers;
+    // private copies, one for each thread.  Built on first use
+    std::vector<boost::shared_ptr<Machine> > copies;
+    size_t revision;
+
+    bool is_join(const ElementVoid* E, const MomentState& ST) const;
+    void run_section(MomentState& ST, size_t first, size_t last);
+};
+
+#endif // FLAME_CHARGESTATES_H
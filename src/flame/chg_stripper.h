@@ -73,24 +73,62 @@ struct ElementStripper : public MomentElementBase
     // E0 after stripper [eV/u], energy dependance, gap dependance. Unit for last parameter ???
     std::vector<double> Stripper_Para, Stripper_E0Para;
 
+    // Charge states and amounts after the stripper.  NCharge is used if charge_model=="off".
+    std::vector<double> ChgState, NCharge;
+    std::string charge_model;
+
+    // Input and output moments of the last advance().
+    // Along with last_ref_*, last_real_* these are reused if the input doesn't change.
+    std::vector<state_t::vector_t> last_moment0_in, last_moment0_out;
+    std::vector<state_t::matrix_t> last_moment1_in, last_moment1_out;
 
     ElementStripper(const Config& c)
         :base_t(c)
     {
-        length = 0e0;
+        ParamBinder P(c);
+        bind(P);
     }
     virtual ~ElementStripper() {}
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    virtual void bind(ParamBinder& P);
+
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        Stripper_IonZ      = O->Stripper_IonZ;
+        Stripper_IonMass   = O->Stripper_IonMass;
+        Stripper_IonProton = O->Stripper_IonProton;
+        Stripper_E1Para    = O->Stripper_E1Para;
+        Stripper_lambda    = O->Stripper_lambda;
+        Stripper_upara     = O->Stripper_upara;
+        Stripper_Para      = O->Stripper_Para;
+        Stripper_E0Para    = O->Stripper_E0Para;
+        ChgState           = O->ChgState;
+        NCharge            = O->NCharge;
+        charge_model       = O->charge_model;
+        last_moment0_in    = O->last_moment0_in;
+        last_moment0_out   = O->last_moment0_out;
+        last_moment1_in    = O->last_moment1_in;
+        last_moment1_out   = O->last_moment1_out;
+    }
 
     virtual void advance(StateBase &s);
 
+    //! true if the input particles and moments of ST match the last advance()
+    virtual bool check_cache(const state_t& ST) const;
+
+    //! No-op.  The output depends on the input moments, so is only computed by advance()
+    virtual void update_cache(state_t& ST) {}
+
+    virtual bool advance_long(Particle& ref, std::vector<Particle>& real);
+
     virtual const char* type_name() const {return "stripper";}
 
     void StripperCharge(const double beta, double &Q_ave, double &d);
     void ChargeStripper(const double beta, const std::vector<double>& ChgState, std::vector<double>& chargeAmount_Baron);
     void Stripper_Propagate_ref(Particle &ref);
-    void Stripper_GetMat(const Config &conf, MomentState &ST);
+    void Stripper_GetCharge(const double beta, std::vector<double>& chargeAmount_Set);
+    void Stripper_GetMat(MomentState &ST);
 };
 
 #endif // CHG_STRIPPER_H
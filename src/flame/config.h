@@ -49,6 +49,58 @@ IS_CONFIG_VALUE(double)
 IS_CONFIG_VALUE(std::string)
 IS_CONFIG_VALUE(std::vector<double>)
 
+/** @brief Interned Config parameter name
+ *
+ * Each distinct name is assigned a small integer (an atom) from a global table
+ * the first time it is interned.  Config stores and compares atoms instead of strings.
+ *
+ * Code which looks up the same name repeatedly may resolve it once.
+ @code
+ static const ConfigKey key_L("L");
+ double L = conf.get<double>(key_L, 0.0);
+ @endcode
+ *
+ * Atoms are never released.  The table is safe to use from any thread.
+ * Looking up a name which has already been interned does not take a lock.
+ */
+class ConfigKey
+{
+public:
+    //! Intern 'name'
+    explicit ConfigKey(const std::string& name);
+    //! Intern 'name'
+    explicit ConfigKey(const char *name);
+
+    //! The atom
+    inline unsigned id() const { return p_id; }
+    inline const std::string& name() const { return *p_name; }
+
+    inline bool operator==(const ConfigKey& o) const { return p_id==o.p_id; }
+    inline bool operator!=(const ConfigKey& o) const { return p_id!=o.p_id; }
+    //! Order of atoms, not of names
+    inline bool operator<(const ConfigKey& o) const { return p_id<o.p_id; }
+
+    /** Lookup a name without interning it.
+     * @returns NULL if 'name' has never been interned, in which case no Config contains it.
+     */
+    static const ConfigKey* find(const std::string& name);
+
+private:
+    ConfigKey(unsigned id, const std::string *name) :p_id(id), p_name(name) {}
+    static ConfigKey intern(const std::string& name);
+
+    unsigned p_id;
+    const std::string *p_name;
+};
+
+inline std::ostream& operator<<(std::ostream& strm, const ConfigKey& key)
+{
+    strm<<key.name();
+    return strm;
+}
+
+class LatticeCache;
+
 /** @brief Associative configuration container
  *
  * Typed key/value storage.
@@ -60,6 +112,15 @@ IS_CONFIG_VALUE(std::vector<double>)
  *
  * Most common usage is get<>() and set<>() to fetch and store typed values.
  * Generic code might also use getAny() or setAny().
+ * Names may be given as strings, or as pre-resolved ConfigKey.
+ *
+ * Each scope is stored as a vector of (ConfigKey, value) sorted by atom,
+ * so that lookups are a binary search of integers.
+ * Iteration (begin() and end()) visits only the inner scope, in this order, not in order of name.
+ *
+ * Enclosing scopes are a chain of shared, immutable, frames.  So new_scope() and push_scope()
+ * take constant time, and lookups fall through the chain.  flatten() merges the chain
+ * into the inner scope.
  *
  * Also has the notion
  */
@@ -76,15 +137,33 @@ public:
 
     typedef std::vector<Config> vector_t;
 
-    typedef std::map<std::string, value_t> values_t;
+    //! One parameter
+    typedef std::pair<ConfigKey, value_t> entry_t;
+    //! A scope.  Sorted by ConfigKey::id()
+    typedef std::vector<entry_t> values_t;
 private:
     typedef boost::shared_ptr<values_t> values_pointer;
     typedef boost::shared_ptr<const values_t> const_values_pointer;
 
+    //! An immutable enclosing scope, linked to the scope which encloses it
+    struct Frame;
+    typedef boost::shared_ptr<const Frame> frame_pointer;
+    struct Frame {
+        const_values_pointer values;
+        frame_pointer next;
+        Frame(const const_values_pointer& values, const frame_pointer& next) :values(values), next(next) {}
+    };
+
     values_pointer values;
-    const_values_pointer implicit_values;
+    //! Enclosing scopes, innermost first.  May be NULL
+    frame_pointer implicit_values;
 
     void _cow();
+    const value_t* _find(const ConfigKey& key) const;
+    const value_t* _find(const std::string& name) const;
+    value_t& _slot(const ConfigKey& key);
+
+    friend class LatticeCache;
 public:
     //! New empty config
     Config();
@@ -99,15 +178,19 @@ public:
      * @returns true if 'ret' updates, and false if no parameter with 'name'.
      */
     bool tryGetAny(const std::string& name, value_t& ret) const;
+    bool tryGetAny(const ConfigKey& name, value_t& ret) const;
     /** lookup untyped.
      * @throws key_error if name doesn't refer to an existing parameter
      */
     const value_t& getAny(const std::string& name) const;
+    const value_t& getAny(const ConfigKey& name) const;
     /** add/replace with a new value, untyped
      */
     void setAny(const std::string& name, const value_t& val);
+    void setAny(const ConfigKey& name, const value_t& val);
     //! Exchange a single parameter untyped
     void swapAny(const std::string& name, value_t& val);
+    void swapAny(const ConfigKey& name, value_t& val);
 
     /** lookup typed.
      * @throws key_error if name doesn't refer to an existing parameter, or the parameter has other
@@ -127,6 +210,15 @@ public:
             throw key_error(SB()<<"Wrong type for '"<<name<<"'.  should be "<<typeid(T).name());
         }
     }
+    template<typename T>
+    typename detail::RT<T>::type
+    get(const ConfigKey& name) const {
+        try {
+            return boost::get<typename detail::is_config_value<T>::type>(getAny(name));
+        } catch(boost::bad_get&) {
+            throw key_error(SB()<<"Wrong type for '"<<name<<"'.  should be "<<typeid(T).name());
+        }
+    }
     /** lookup typed with default.
      * If 'name' doesn't refer to a parameter, or it has the wrong type,
      * then 'def' is returned instead.
@@ -139,12 +231,16 @@ public:
     template<typename T>
     typename detail::RT<T>::type
     get(const std::string& name, typename boost::call_traits<T>::param_type def) const {
-        try{
-            return boost::get<typename detail::is_config_value<T>::type>(getAny(name));
-        } catch(boost::bad_get&) {
-        } catch(key_error&) {
-        }
-        return def;
+        const value_t *val = _find(name);
+        const T *ret = val ? boost::get<typename detail::is_config_value<T>::type>(val) : NULL;
+        return ret ? *ret : def;
+    }
+    template<typename T>
+    typename detail::RT<T>::type
+    get(const ConfigKey& name, typename boost::call_traits<T>::param_type def) const {
+        const value_t *val = _find(name);
+        const T *ret = val ? boost::get<typename detail::is_config_value<T>::type>(val) : NULL;
+        return ret ? *ret : def;
     }
 
     /** lookup where missing parameters returns false
@@ -154,15 +250,20 @@ public:
     template<typename T>
     bool
     tryGet(const std::string& name, T& val) const {
-        value_t ret;
-        if(tryGetAny(name, ret)) {
-            try{
-                val = boost::get<typename detail::is_config_value<T>::type>(ret);
-                return true;
-            } catch(boost::bad_get&) {
-            }
-        }
-        return false;
+        const value_t *ret = _find(name);
+        const T *V = ret ? boost::get<typename detail::is_config_value<T>::type>(ret) : NULL;
+        if(V)
+            val = *V;
+        return !!V;
+    }
+    template<typename T>
+    bool
+    tryGet(const ConfigKey& name, T& val) const {
+        const value_t *ret = _find(name);
+        const T *V = ret ? boost::get<typename detail::is_config_value<T>::type>(ret) : NULL;
+        if(V)
+            val = *V;
+        return !!V;
     }
 
     /** add/replace with a new value
@@ -175,8 +276,13 @@ public:
     void set(const std::string& name,
              typename boost::call_traits<typename detail::is_config_value<T>::type>::param_type val)
     {
-        _cow();
-        (*values)[name] = val;
+        _slot(ConfigKey(name)) = val;
+    }
+    template<typename T>
+    void set(const ConfigKey& name,
+             typename boost::call_traits<typename detail::is_config_value<T>::type>::param_type val)
+    {
+        _slot(name) = val;
     }
 
     /** Exchange a single parameter typed
@@ -206,7 +312,7 @@ public:
         implicit_values.swap(c.implicit_values);
     }
 
-    //! Print listing of inner scope
+    //! Print listing of inner scope, in order of name
     void show(std::ostream&, unsigned indent=0) const;
 
     //! iterator
@@ -219,11 +325,14 @@ public:
     //! one after the last element
     inline const_iterator end() const { return values->end(); }
 
-    inline void reserve(size_t) {}
-    //! Create a new inner scope
+    //! Reserve space in the inner scope for n parameters
+    void reserve(size_t n);
+    //! Create a new, empty, Config enclosed by this one.  Constant time.
     Config new_scope() const;
+    //! Make the inner scope an enclosing scope, and start a new, empty, inner scope.  Constant time.
     void push_scope();
 
+    //! Merge all enclosing scopes into the inner scope.  Inner values take precedence.
     void flatten();
 };
 
@@ -236,6 +345,111 @@ std::ostream& operator<<(std::ostream& strm, const Config& c)
     return strm;
 }
 
+/** @brief Bind Config parameters to typed variables
+ *
+ * Used by Elements to parse their parameters once, at construction,
+ * instead of looking them up by name on each use.
+ * Each call declares one parameter, which is also recorded for introspection.
+ *
+ @code
+ static const ConfigKey key_L("L"), key_B("B"), key_ncurve("ncurve");
+ struct MyElement {
+     double L, B;
+     unsigned ncurve;
+     void bind(ParamBinder& P) {
+         P(key_L, L);           // required
+         P(key_B, B, 0.0);      // optional with default
+         P.flag(key_ncurve, ncurve, 0);
+     }
+ };
+ Config C;
+ ParamBinder P(C);
+ elem.bind(P); // throws key_error since "L" is not set
+ @endcode
+ *
+ * A ParamBinder constructed without a Config only records declarations,
+ * and leaves variables unchanged.
+ * One constructed with a parameter name binds only that parameter.
+ *
+ * Names may be given as strings, or as pre-resolved ConfigKey.
+ * bind() is called for each element of a Machine, and again by Machine::setParam(),
+ * so element code should prefer a ConfigKey.
+ */
+class ParamBinder
+{
+public:
+    //! Description of one declared parameter
+    struct ParamInfo {
+        ParamInfo(const ConfigKey& key) :key(key), name(key.name()) {}
+        ConfigKey key;
+        std::string name;
+        //! "double", "vector" (of double), "string", or "flag" (unsigned integer)
+        const char *type;
+        bool required;
+        //! When only recording declarations, the current value of a "double" parameter.  Otherwise NaN.
+        double value;
+    };
+    typedef std::vector<ParamInfo> params_t;
+
+    //! Bind parameters from c, which must outlive this ParamBinder
+    explicit ParamBinder(const Config& c) :conf(&c), only(all) {}
+    //! Bind only the parameter 'only' from c.  Others are only recorded.
+    ParamBinder(const Config& c, const ConfigKey& only) :conf(&c), only(only.id()) {}
+    //! Record declarations only
+    ParamBinder() :conf(NULL), only(all) {}
+
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const ConfigKey& name, double& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const ConfigKey& name, double& var, double def);
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const ConfigKey& name, std::vector<double>& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const ConfigKey& name, std::vector<double>& var, const std::vector<double>& def);
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const ConfigKey& name, std::string& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const ConfigKey& name, std::string& var, const std::string& def);
+    /** Optional unsigned integer, which may be given as a number or a string.
+     * @throws std::runtime_error if present, but not an unsigned integer
+     */
+    void flag(const ConfigKey& name, unsigned& var, unsigned def);
+
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const std::string& name, double& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const std::string& name, double& var, double def);
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const std::string& name, std::vector<double>& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const std::string& name, std::vector<double>& var, const std::vector<double>& def);
+    //! Required parameter.  @throws key_error if missing or of the wrong type
+    void operator()(const std::string& name, std::string& var);
+    //! Optional parameter.  def is used if missing or of the wrong type (cf. Config::get())
+    void operator()(const std::string& name, std::string& var, const std::string& def);
+    /** Optional unsigned integer, which may be given as a number or a string.
+     * @throws std::runtime_error if present, but not an unsigned integer
+     */
+    void flag(const std::string& name, unsigned& var, unsigned def);
+
+    //! true if binding, false if only recording declarations
+    inline bool binding() const { return !!conf; }
+
+    //! Parameters declared so far, in order of first declaration
+    inline const params_t& params() const { return decls; }
+    //! Lookup a declaration by name, or NULL
+    const ParamInfo* find(const std::string& name) const;
+
+private:
+    //! record declaration, and return true if this parameter should be bound
+    bool declare(const ConfigKey& name, const char *type, bool required, const double *value=NULL);
+
+    static const unsigned all = ~0u;
+    const Config *conf;
+    const unsigned only; //!< atom of the only parameter to bind, or all
+    params_t decls;
+};
+
 //! @brief Interface to lattice file parser
 class GLPSParser
 {
@@ -254,10 +468,19 @@ public:
     void setVar(const std::string& name, const Config::value_t& v);
     //! @brief Set output for lexer/parser error messages
     void setPrinter(std::ostream*);
+    /** @brief Set the directory of the binary lattice cache (see LatticeCache)
+     *
+     * Used by parse_byte() and parse_file(const char*, bool).
+     * Defaults to LatticeCache::default_dir(), $FLAME_LATTICE_CACHE.  Empty disables the cache.
+     */
+    void setCacheDir(const std::string& dir);
+    //! @brief Files referenced by parse(), file(), or h5file() during the last successful parse
+    const std::vector<std::string>& dependencies() const;
 
     /** @brief Open and parse a file
      *
-     * A wrapper around parse_file(FILE*, const char*).
+     * Reads the whole file, which is loaded from the lattice cache if possible.
+     * Otherwise a wrapper around parse_file(FILE*, const char*).
      *
      * @arg fname File name to open.  If NULL or '-' then parse stdin     *
      *            If stdin is parsed then it is not closed.
@@ -288,6 +511,39 @@ public:
      * @returns New Config or NULL
      */
     Config *parse_byte(const std::string& s, const char *path=NULL);
+
+    //! @brief Receives a beamline one element at a time.  See parse_stream()
+    struct Sink {
+        virtual ~Sink() {}
+        /** Called first with the top level scope: variables, and the "name" of the beamline
+         * @param count The number of elements which will follow
+         */
+        virtual void begin(const Config& top, size_t count) =0;
+        //! Called for each element of the beamline, in order.  Enclosed by the variables.
+        virtual void element(const Config& conf) =0;
+        //! Called after the last element
+        virtual void end() =0;
+    };
+
+    /** @brief Parse from byte buffer, passing the beamline to a Sink
+     *
+     * As parse_byte(), except that elements are passed to 'sink' as they are expanded,
+     * and no list ("elements") is built.  The lattice cache is not used.
+     *
+     * @arg sink Receives the result
+     * @arg s Byte array
+     * @arg len Length of byte array (in bytes)
+     * @args path A directory to use to expand relative paths when parsing
+     * @throws std::runtime_error For various error conditions, or as thrown by 'sink'
+     */
+    void parse_stream(Sink& sink, const char* s, size_t len, const char *path=NULL);
+    /** @brief Open and parse a file, passing the beamline to a Sink
+     *
+     * As parse_stream(Sink&, const char*, size_t, const char*).
+     *
+     * @arg fname File name to open.  If NULL or '-' then parse stdin
+     */
+    void parse_stream(Sink& sink, const char *fname);
 };
 
 //! Print a previously parsed, or constructed, Config
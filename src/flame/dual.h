@@ -0,0 +1,84 @@
+#ifndef FLAME_DUAL_H
+#define FLAME_DUAL_H
+
+#include <ostream>
+#include <math.h>
+
+/** @brief Dual number for forward mode automatic differentiation
+ *
+ * A value 'v', and its derivative 'd' with respect to one parameter.
+ * Arithmetic and the math functions below apply the chain rule.
+ *
+ * Comparisons with a double consider only the value, so that branches
+ * in code templated on the scalar type (eg. "if(K==0e0)") select the same
+ * case as they would for a double.  Comparisons between two Dual require
+ * both parts to match.
+ *
+ @code
+ Dual x(2.0, 1.0); // seed d/dx
+ Dual y = x*sin(x);
+ // y.v == 2*sin(2), y.d == sin(2)+2*cos(2)
+ @endcode
+ */
+struct Dual
+{
+    double v, //!< value
+           d; //!< derivative
+    Dual(double v=0e0, double d=0e0) :v(v), d(d) {}
+
+    inline Dual& operator+=(const Dual& o) { v+=o.v; d+=o.d; return *this; }
+    inline Dual& operator-=(const Dual& o) { v-=o.v; d-=o.d; return *this; }
+    inline Dual& operator*=(const Dual& o) { d = d*o.v + v*o.d; v*=o.v; return *this; }
+    inline Dual& operator/=(const Dual& o) { d = (d*o.v - v*o.d)/(o.v*o.v); v/=o.v; return *this; }
+};
+
+inline Dual operator-(const Dual& a) { return Dual(-a.v, -a.d); }
+
+inline Dual operator+(const Dual& a, const Dual& b) { return Dual(a.v+b.v, a.d+b.d); }
+inline Dual operator-(const Dual& a, const Dual& b) { return Dual(a.v-b.v, a.d-b.d); }
+inline Dual operator*(const Dual& a, const Dual& b) { return Dual(a.v*b.v, a.d*b.v + a.v*b.d); }
+inline Dual operator/(const Dual& a, const Dual& b) { return Dual(a.v/b.v, (a.d*b.v - a.v*b.d)/(b.v*b.v)); }
+
+inline Dual operator+(const Dual& a, double b) { return Dual(a.v+b, a.d); }
+inline Dual operator-(const Dual& a, double b) { return Dual(a.v-b, a.d); }
+inline Dual operator*(const Dual& a, double b) { return Dual(a.v*b, a.d*b); }
+inline Dual operator/(const Dual& a, double b) { return Dual(a.v/b, a.d/b); }
+
+inline Dual operator+(double a, const Dual& b) { return Dual(a+b.v, b.d); }
+inline Dual operator-(double a, const Dual& b) { return Dual(a-b.v, -b.d); }
+inline Dual operator*(double a, const Dual& b) { return Dual(a*b.v, a*b.d); }
+inline Dual operator/(double a, const Dual& b) { return Dual(a/b.v, -a*b.d/(b.v*b.v)); }
+
+inline bool operator==(const Dual& a, const Dual& b) { return a.v==b.v && a.d==b.d; }
+inline bool operator!=(const Dual& a, const Dual& b) { return !(a==b); }
+
+inline bool operator==(const Dual& a, double b) { return a.v==b; }
+inline bool operator!=(const Dual& a, double b) { return a.v!=b; }
+inline bool operator< (const Dual& a, double b) { return a.v<b; }
+inline bool operator> (const Dual& a, double b) { return a.v>b; }
+inline bool operator<=(const Dual& a, double b) { return a.v<=b; }
+inline bool operator>=(const Dual& a, double b) { return a.v>=b; }
+
+inline Dual sqrt(const Dual& a) { const double r = ::sqrt(a.v); return Dual(r, a.d/(2e0*r)); }
+inline Dual sin (const Dual& a) { return Dual(::sin(a.v),   a.d*::cos(a.v)); }
+inline Dual cos (const Dual& a) { return Dual(::cos(a.v),  -a.d*::sin(a.v)); }
+inline Dual tan (const Dual& a) { const double t = ::tan(a.v); return Dual(t, a.d*(1e0+t*t)); }
+inline Dual sinh(const Dual& a) { return Dual(::sinh(a.v),  a.d*::cosh(a.v)); }
+inline Dual cosh(const Dual& a) { return Dual(::cosh(a.v),  a.d*::sinh(a.v)); }
+inline Dual fabs(const Dual& a) { return a.v<0e0 ? -a : a; }
+
+inline std::ostream& operator<<(std::ostream& strm, const Dual& a)
+{
+    strm<<'('<<a.v<<", "<<a.d<<')';
+    return strm;
+}
+
+//! A parameter as scalar type T.  For Dual, seeded with derivative 1 if 'active'
+template<typename T>
+inline T dual_param(double v, bool active);
+template<>
+inline double dual_param<double>(double v, bool) { return v; }
+template<>
+inline Dual dual_param<Dual>(double v, bool active) { return Dual(v, active ? 1e0 : 0e0); }
+
+#endif // FLAME_DUAL_H
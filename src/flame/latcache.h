@@ -0,0 +1,109 @@
+#ifndef FLAME_LATCACHE_H
+#define FLAME_LATCACHE_H
+
+#include <string>
+#include <vector>
+
+#include <boost/cstdint.hpp>
+
+#include "config.h"
+
+/** @brief Binary cache of parsed lattice files
+ *
+ * A parsed Config is stored in a compact binary form.  Keys and string values
+ * are each written once, in tables, and referenced by index.  Numeric arrays are
+ * stored contiguously, 8 byte aligned.  Enclosing scopes (Config::new_scope())
+ * shared by many element Configs are written once.  Entries are memory mapped when loaded.
+ *
+ * An entry is named for a hash of the lattice source, the directory used to expand relative paths,
+ * and any GLPSParser::setVar() definitions.  The entry also records the size, modification time,
+ * and hash of each file referenced by parse(), file() or h5file(), and is used only while these
+ * are unchanged.  A file is hashed again only if its modification time differs, or is too close
+ * to the time the entry was written to tell apart later changes.
+ * Output of print() statements is kept and replayed.
+ *
+ * Used by GLPSParser::parse_byte() and GLPSParser::parse_file(const char*, bool)
+ * for sources of at least min_size bytes, when a cache directory is set.
+ *
+ * When the entries in the directory exceed max_bytes, store() removes those least recently
+ * stored or loaded.
+ */
+class LatticeCache
+{
+public:
+    //! Smaller sources are always parsed
+    static const size_t min_size = 4096;
+    //! Default limit of the total size of entries
+    static const boost::uint64_t default_max_bytes = 256*1024*1024;
+
+    /**
+     * @param dir Cache directory, created when needed.  Empty disables the cache.
+     * @param max_bytes Limit of the total size of entries in dir
+     */
+    explicit LatticeCache(const std::string& dir = default_dir(), boost::uint64_t max_bytes = default_max_bytes);
+
+    //! The default cache directory, $FLAME_LATTICE_CACHE.  Empty, disabling the cache, if this is not set.
+    static std::string default_dir();
+
+    inline const std::string& dir() const { return p_dir; }
+    inline bool enabled() const { return !p_dir.empty(); }
+    inline boost::uint64_t max_bytes() const { return p_max_bytes; }
+
+    /** Key for a source
+     *
+     * @param src Lattice source
+     * @param len Length of src in bytes
+     * @param cwd Directory used to expand relative paths
+     * @param have_lattice As GLPSParser::parse_file()
+     * @param vars Pre-defined variables (GLPSParser::setVar())
+     */
+    static boost::uint64_t key(const char *src, size_t len, const std::string& cwd,
+                               bool have_lattice, const Config& vars);
+
+    /** Load an entry
+     *
+     * @param key From key()
+     * @param depends Set to the files on which the entry depends
+     * @param output Set to the output of print() statements
+     * @returns A new Config, or NULL if there is no valid entry
+     */
+    Config* load(boost::uint64_t key, std::vector<std::string>& depends, std::string& output) const;
+
+    /** Store an entry, replacing any existing entry
+     *
+     * @param key From key()
+     * @param conf The parsed Config
+     * @param depends Files on which the entry depends
+     * @param output Output of print() statements
+     * @returns false if the entry could not be written.  The cache is left unchanged.
+     */
+    bool store(boost::uint64_t key, const Config& conf,
+               const std::vector<std::string>& depends, const std::string& output) const;
+
+    //! File name of an entry
+    std::string entry(boost::uint64_t key) const;
+
+private:
+    std::string p_dir;
+    boost::uint64_t p_max_bytes;
+
+    struct Depend {
+        std::string path;
+        boost::uint64_t size, hash;
+        boost::int64_t mtime;
+    };
+    typedef std::vector<Depend> depends_t;
+
+    struct Writer;
+    struct Reader;
+
+    static void encode(std::string& out, boost::uint64_t key, const Config& conf,
+                       const depends_t& depends, const std::string& output, boost::int64_t stored=0);
+    static Config* decode(const char *buf, size_t len, boost::uint64_t key,
+                          depends_t& depends, std::string& output, boost::int64_t& stored);
+    static bool stat_file(const std::string& path, boost::uint64_t& size, boost::int64_t& mtime);
+    static bool hash_file(const std::string& path, boost::uint64_t& size, boost::uint64_t& hash);
+    void prune(const std::string& keep) const;
+};
+
+#endif // FLAME_LATCACHE_H
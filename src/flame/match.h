@@ -0,0 +1,104 @@
+#ifndef FLAME_MATCH_H
+#define FLAME_MATCH_H
+
+#include <vector>
+#include <string>
+
+#include "base.h"
+
+/** @brief Match state fields to target values by adjusting element parameters
+ *
+ * Minimizes the sum of squared weighted residuals weight*(field - value) of the targets
+ * with a Levenberg-Marquardt solver, keeping each knob within its bounds
+ * (trial steps are projected onto the bounds).
+ *
+ * The Jacobian is found either with MomentGradient (analytic transfer matrix derivatives),
+ * when all knobs can be differentiated and all targets are "moment0_env" or "moment1_env",
+ * or by forward differences evaluated in parallel as a Scan.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ Matcher X;
+ X.knobs.push_back(Matcher::Knob(5, "B2", 0.0, 10.0));
+ X.targets.push_back(Matcher::Target(20, "moment1_env", 0, 0, 1.0)); // moment1_env(0,0) == 1.0
+ X.compute(M, *ST);
+ // M now has the matched value of B2
+ @endcode
+ */
+struct Matcher
+{
+    //! A numeric element parameter to adjust, as by Machine::setParam()
+    struct Knob {
+        size_t index;
+        std::string name;
+        double lower, upper;
+        //! Change of the parameter for finite differences
+        double step;
+        Knob();
+        Knob(size_t index, const std::string& name, double lower, double upper, double step=1e-6);
+    };
+
+    //! One value of a state field at the exit of an element
+    struct Target {
+        size_t index;
+        //! State field name, as for Scan
+        std::string field;
+        //! Indices within the field.  Empty for a scalar field
+        std::vector<size_t> at;
+        double value, weight;
+        Target() :index(0), value(0e0), weight(1e0) {}
+        //! 1-d field, eg. moment0_env[i]
+        Target(size_t index, const std::string& field, size_t i, double value, double weight=1e0)
+            :index(index), field(field), at(1, i), value(value), weight(weight) {}
+        //! 2-d field, eg. moment1_env(i, j)
+        Target(size_t index, const std::string& field, size_t i, size_t j, double value, double weight=1e0)
+            :index(index), field(field), at(2), value(value), weight(weight) { at[0] = i; at[1] = j; }
+    };
+
+    enum jacobian_t {
+        Auto,             //!< Analytic if possible, otherwise FiniteDifference
+        Analytic,         //!< MomentGradient, or throw std::invalid_argument
+        FiniteDifference, //!< Always finite differences
+    };
+
+    std::vector<Knob> knobs;
+    std::vector<Target> targets;
+    jacobian_t jacobian;
+    //! Maximum number of iterations (Jacobian evaluations)
+    unsigned maxiter;
+    //! Stop when the relative decrease of the cost, or the relative step, is less than this
+    double tol;
+    //! Number of threads for finite differences.  0 selects boost::thread::hardware_concurrency()
+    unsigned nthreads;
+
+    //! Result of compute().  The final knob values
+    std::vector<double> x;
+    //! Result of compute().  The final residual of each target
+    std::vector<double> residual;
+    //! Result of compute().  Half the sum of squared residuals
+    double cost;
+    //! Result of compute().  Number of iterations
+    unsigned iterations;
+    //! Result of compute().  true if stopped by 'tol', or with zero cost
+    bool converged;
+    //! Result of compute().  true if stopped because no step reduces the cost.  'converged' is then false.
+    bool stalled;
+    //! Result of compute().  true if the Jacobian was analytic
+    bool analytic;
+
+    Matcher() :jacobian(Auto), maxiter(100), tol(1e-10), nthreads(0), cost(0e0), iterations(0), converged(false), stalled(false), analytic(false) {}
+
+    /** Adjust the knobs of M
+     *
+     * @param M The Machine.  Left with the final knob values.
+     * @param ST The state at the entrance of element 0.  Not modified.
+     * @throws std::invalid_argument for an out of range index, an unknown parameter or field,
+     *         an invalid target index, empty bounds, or no knobs or targets.
+     * @throws std::runtime_error if a propagation fails
+     * @note No other thread may use M during this call.
+     */
+    void compute(Machine& M, const StateBase& ST);
+};
+
+#endif // FLAME_MATCH_H
@@ -10,6 +10,7 @@
 #include <boost/numeric/ublas/io.hpp>
 
 #include "base.h"
+#include "dual.h"
 
 #include "constants.h"
 
@@ -122,6 +123,13 @@ struct MomentState : public StateBase
 
     double last_caviphi0;
 
+    //! Aperture checks (see MomentElementBase::aper) use moment0_env +- aper_nsigma*moment0_rms.
+    //! 0 disables.  Config "aper_nsigma"
+    double aper_nsigma;
+    //! Set to 1 when the beam is lost on an aperture, in element lost_elem.
+    //! Cleared only by the source element
+    size_t lost, lost_elem;
+
     virtual bool getArray(unsigned idx, ArrayInfo& Info);
 
     virtual MomentState* clone() const {
@@ -141,6 +149,26 @@ protected:
     MomentState(const MomentState& o, clone_tag);
 };
 
+//! A MomentState::matrix_t with elements of scalar type T.  eg. Dual
+template<typename T>
+struct moment_matrix {
+    typedef boost::numeric::ublas::matrix<T,
+                    boost::numeric::ublas::row_major,
+                    boost::numeric::ublas::bounded_array<T, MomentState::maxsize*MomentState::maxsize>
+    > type;
+};
+
+struct ParticleSet;
+struct MomentElementBase;
+
+/** Batched equivalent of MomentElementBase::update_cache() for n elements of the same type.
+ *
+ * elems[i] is given the input particles inputs[i].
+ * ST is scratch space, and its contents are undefined on return.
+ */
+typedef void (*batch_update_t)(MomentElementBase* const *elems, const ParticleSet* const *inputs,
+                               size_t n, MomentState& ST);
+
 /** @brief An Element which propagates the statistical moments of a bunch
  */
 struct MomentElementBase : public ElementVoid
@@ -153,11 +181,26 @@ struct MomentElementBase : public ElementVoid
     virtual ~MomentElementBase();
 
     void get_misalign(const state_t& ST, const Particle& real, value_t& M, value_t& IM) const;
+    //! get_misalign() for scalar type T.  The misalignment parameter named 'active' (eg. "dx") is seeded, if not NULL.
+    template<typename T>
+    void get_misalign_t(const Particle& ref, const Particle& real, const char *active,
+                        typename moment_matrix<T>::type& M, typename moment_matrix<T>::type& IM) const;
+    //! true for the misalignment parameters: dx, dy, pitch, yaw, and roll
+    static bool is_misalign_param(const std::string& name);
 
     unsigned get_flag(const Config& c, const std::string& name, const unsigned& def_value);
 
+    //! Binds the misalignment parameters and "skipcache".  Sub-classes must call this.
+    virtual void bind(ParamBinder& P);
+
+    //! Clears last_*, so the next advance() will recompute 'transfer'
+    virtual void invalidate();
+
     virtual void advance(StateBase& s);
 
+    //! Test the aperture, if ST.aper_nsigma and aper are non-zero.  Sets ST.lost and ST.lost_elem
+    virtual bool check_loss(StateBase& s) const;
+
     //! Return true if previously calculated 'transfer' matricies may be reused
     //! Should compare new input state against values used when 'transfer' was
     //! last computed
@@ -173,6 +216,48 @@ struct MomentElementBase : public ElementVoid
     //! recalculate 'transfer' taking into consideration the provided input state
     virtual void recompute_matrix(state_t& ST);
 
+    //! Cache miss path of advance().  Recompute 'transfer' etc. for the input particles of ST,
+    //! update ST.ref and ST.real[] to the output particles, and store both in last_*.
+    virtual void update_cache(state_t& ST);
+
+    //! If not NULL, a function which may be used instead of update_cache() for
+    //! a group of elements which all return the same function.  Used by warmup().
+    virtual batch_update_t batch_update() const { return NULL; }
+
+    //! How advance() acts on a state.  Used by propagate_turns()
+    enum linearity_t {
+        //! Anything other than the following (the default)
+        NonLinear,
+        //! moment0 and moment1 are changed only by transfer[], which depends only on particle energies.
+        //! Energies are not changed, and real[].phis is advanced by a constant.
+        Linear,
+        //! As Linear, and the change of moment0[PS_S] is also added to real[].phis (eg. bends)
+        LinearPhase
+    };
+    virtual linearity_t linearity() const { return NonLinear; }
+
+    /** Derivative of transfer[] with respect to the parameter 'name'.
+     *
+     * Evaluated for the input particles of the last update_cache() (last_ref_in and last_real_in).
+     * Uses the Dual scalar type.
+     *
+     * @returns false if this element can't differentiate 'name' (the default)
+     */
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT);
+
+    /** Longitudinal only propagation of the reference and charge state particles.
+     *
+     * Applies the energy gain and phase advance which advance() would,
+     * without computing transfer matrices or moments.
+     * Cached matrices are not changed.
+     *
+     * @returns true if ref and real[] are exactly those which advance() would give.
+     *          false if advance() also depends on the moments.  The default is false for
+     *          LinearPhase elements (eg. bends), where the phase shift of charge states due to
+     *          dispersion (the change of moment0[PS_S]) is not included.
+     */
+    virtual bool advance_long(Particle& ref, std::vector<Particle>& real);
+
     virtual void show(std::ostream& strm, int level) const;
 
     Particle last_ref_in, last_ref_out;
@@ -181,18 +266,138 @@ struct MomentElementBase : public ElementVoid
     std::vector<value_t> transfer;
     std::vector<value_t> misalign, misalign_inv;
 
-    //! constituents of misalign
+    //! constituents of misalign.  dx and dy in [m]
     double dx, dy, pitch, yaw, roll;
 
     //! If set, check_cache() will always return false
     bool skipcache;
 
+    //! Number of calls to advance() which did not find a usable cache, and recomputed 'transfer'.
+    //! Not counted for warmup().  Never reset.
+    size_t cache_misses;
+
+    //! Radius of the horizontal and vertical aperture in [m], or 0 for none
+    double aper;
+
     virtual void assign(const ElementVoid *other) =0;
 
 protected:
+    //! For batch_update_t implementations.  Store the input particles in last_*_in, and resize_cache()
+    void batch_begin(const ParticleSet& in);
+    //! For batch_update_t implementations.  Store the output particles in last_*_out,
+    //! as update_cache() would after recompute_matrix()
+    void batch_end();
+
     // scratch space to avoid temp. allocation in advance()
     // An Element can't be shared between multiple threads
     state_t::matrix_t scratch;
 };
 
+//! Reference and charge state particles at one point in a lattice
+struct ParticleSet {
+    Particle ref;
+    std::vector<Particle> real;
+};
+
+/** Longitudinal only propagation through a MomentMatrix Machine.
+ *
+ * Passes ST.ref and ST.real[] through elements [start, start+max) using
+ * MomentElementBase::advance_long().  Only ref, real[] and next_elem are changed.
+ * Much faster than Machine::propagate() when only the energy and phase profiles are needed.
+ *
+ * ST.ref is always exact.  ST.real[].phis is not, after an element whose
+ * MomentElementBase::advance_long() returns false (eg. a bend).
+ *
+ * @param M The Machine
+ * @param ST The initial state, ref and real[] are updated with the final values
+ * @param start The index of the first Element the state will pass through
+ * @param max The maximum number of elements through which the state will be passed
+ * @param inputs If not NULL, cleared and then filled with the particles at the entrance of each element passed
+ * @param stop_inexact If true, stop after the first element whose output is not exact
+ * @returns true if ST.ref and ST.real[] are exactly those which Machine::propagate() would give
+ * @throws std::invalid_argument if an element is not a MomentMatrix element
+ */
+bool propagate_long(Machine& M, MomentState& ST,
+                    size_t start=0, size_t max=(size_t)-1,
+                    std::vector<ParticleSet>* inputs=NULL,
+                    bool stop_inexact=false);
+
+/** Pre-compute the cached transfer matrices of a MomentMatrix Machine.
+ *
+ * Runs propagate_long() to find the input particles of each element,
+ * then calls MomentElementBase::update_cache() for all elements
+ * concurrently on a pool of threads.  Elements which provide
+ * MomentElementBase::batch_update() are grouped by type, and updated
+ * in batches instead.  A following Machine::propagate()
+ * of the same state will then find the caches already filled.
+ *
+ * The elements are taken in runs, each ending with the first element whose output
+ * propagate_long() can't predict exactly (eg. a bend).  After a run is updated,
+ * the full state is passed through it, hitting the new caches, to find the exact input
+ * of the next run.  Elements whose cache depends on the moments (eg. the charge stripper)
+ * are filled by this pass.
+ *
+ * @param M The Machine
+ * @param ST The state at the entrance of element 'start'.  Not modified.
+ * @param start The index of the first Element
+ * @param max The maximum number of elements
+ * @throws std::runtime_error if any element fails
+ * @note No other thread may use M during this call.
+ */
+void warmup(Machine& M, const MomentState& ST,
+            size_t start=0, size_t max=(size_t)-1);
+
+/** Multi-turn propagation through a MomentMatrix Machine treated as a ring.
+ *
+ * Each turn passes ST through elements [start, M.size()).
+ *
+ * If all of these elements are MomentElementBase::Linear (or LinearPhase),
+ * then only the first turn is tracked element by element, and is used to find the one-turn map
+ * of each charge state.  Following turns apply powers of this map, computed by repeated squaring.
+ * Otherwise, or if the energy of any particle changes during the first turn,
+ * all turns are tracked element by element.
+ *
+ * Aperture checks (MomentState::aper_nsigma) are only made while tracking, so they also disable the one-turn map.
+ * Propagation stops when the beam is lost.
+ *
+ * Element Observers are called only during every 'observe_every'th turn, which is always tracked element by element.
+ * If observe_every==0 then no Observers are called.
+ * Machine::set_trace() output is not written.
+ *
+ * When the one-turn map is used, ST.transmat[] is left with the one-turn map of each charge state.
+ *
+ * @param M The Machine
+ * @param ST The initial state, will be updated with the final state
+ * @param nturns Number of turns
+ * @param start The index of the first Element of each turn
+ * @param observe_every Call Observers during turns observe_every, 2*observe_every, ...
+ * @returns true if the one-turn map was used
+ * @throws std::invalid_argument if an element is not a MomentMatrix element
+ */
+bool propagate_turns(Machine& M, MomentState& ST, size_t nturns,
+                     size_t start=0, size_t observe_every=1);
+
+/** @brief Pass ST through elements [start, start+max), reusing the maps of repeated cells
+ *
+ * For each section of Machine::repeats() whose cell has only Linear and LinearPhase elements
+ * (see propagate_turns()), without Observers, and without apertures when MomentState::aper_nsigma is set,
+ * only the first repetition is tracked element by element.  The map of this cell is then applied
+ * to the following repetitions, using repeated squaring.  Sections which start or end outside
+ * [start, start+max) are limited to the whole cells within.  If the energy of any particle changes
+ * in the first repetition, all are tracked.  Other elements are tracked as by Machine::propagate().
+ *
+ * Results are the same as Machine::propagate(), up to rounding.
+ * ST.transmat[] is left with the transfer matrix of the last element passed.
+ * Propagation stops when the beam is lost.
+ * Machine::set_trace() output is not written.
+ *
+ * @param M The Machine
+ * @param ST The initial state, will be updated with the final state
+ * @param start The index of the first Element the state will pass through
+ * @param max The maximum number of elements through which the state will be passed
+ * @returns The number of cell repetitions for which a map was applied
+ * @throws std::invalid_argument if an element is not a MomentMatrix element
+ */
+size_t propagate_repeats(Machine& M, MomentState& ST, size_t start=0, size_t max=(size_t)-1);
+
 #endif // FLAME_MOMENT_H
@@ -5,28 +5,70 @@
 #include "base.h"
 #include "moment.h"
 
-static std::map<std::string,boost::shared_ptr<Config> > CurveMap;
-
 void inverse(MomentElementBase::value_t& out, const MomentElementBase::value_t& in);
+//! inverse() of a Dual matrix.  d(A^-1) = -A^-1 dA A^-1
+void inverse(moment_matrix<Dual>::type& out, const moment_matrix<Dual>::type& in);
+
+//! Extract the derivative part of a Dual matrix
+void dual_deriv(const moment_matrix<Dual>::type& in, MomentElementBase::value_t& out);
+
+// The following kernels are templated on the scalar type, and instantiated for double and Dual.
+
+template<typename T>
+void RotMat(const T dx, const T dy,
+            const T theta_x, const T theta_y, const T theta_z,
+            typename moment_matrix<T>::type &R);
 
-void RotMat(const double dx, const double dy,
-            const double theta_x, const double theta_y, const double theta_z,
-            typename MomentElementBase::value_t &R);
+//! 2x2 block of the quadrupole transport matrix for one plane
+template<typename T>
+inline
+void GetQuadBlock(const T L, const T K, T &M11, T &M12, T &M21)
+{
+    T sqrtK, psi, cs, sn;
 
-void GetQuadMatrix(const double L, const double K, const unsigned ind, typename MomentElementBase::value_t &M);
+    if (K == 0e0) {
+        // Drift.  Written in terms of K for the derivative.
+        M11 = 1e0 - K*L*L/2e0;
+        M12 = L - K*L*L*L/6e0;
+        M21 = 0e0 - K*L;
+        return;
+    } else if (K > 0e0) {
+        // Focusing.
+        sqrtK = sqrt(K);
+        psi = sqrtK*L;
+        cs = ::cos(psi);
+        sn = ::sin(psi);
+        M21 = (sqrtK != 0e0) ? -sqrtK*sn : 0e0;
+    } else {
+        // Defocusing.
+        sqrtK = sqrt(-K);
+        psi = sqrtK*L;
+        cs = ::cosh(psi);
+        sn = ::sinh(psi);
+        M21 = (sqrtK != 0e0) ? sqrtK*sn : 0e0;
+    }
+    M11 = cs;
+    M12 = (sqrtK != 0e0) ? sn/sqrtK : L;
+}
+
+template<typename T>
+void GetQuadMatrix(const T L, const T K, const unsigned ind, typename moment_matrix<T>::type &M);
 
 void GetSextMatrix(const double L, const double K, double Dx, double Dy,
                    const double D2x, const double D2y, const double D2xy, const bool thinlens, const bool dstkick, typename MomentElementBase::value_t &M);
 
-void GetEdgeMatrix(const double rho, const double phi, typename MomentElementBase::value_t &M);
+template<typename T>
+void GetEdgeMatrix(const T rho, const T phi, typename moment_matrix<T>::type &M);
 
 void GetEEdgeMatrix(const double fringe_x, const double fringe_y, const double kappa, typename MomentElementBase::value_t &M);
 
-void GetSBendMatrix(const double L, const double phi, const double phi1, const double phi2, const double K,
+template<typename T>
+void GetSBendMatrix(const T L, const T phi, const T phi1, const T phi2, const T K,
                     const double IonEs, const double ref_gamma, const double qmrel,
-                    const double dip_beta, const double dip_gamma, const double d, const double dip_IonK, typename MomentElementBase::value_t &M);
+                    const double dip_beta, const double dip_gamma, const double d, const double dip_IonK, typename moment_matrix<T>::type &M);
 
-void GetSolMatrix(const double L, const double K, typename MomentElementBase::value_t &M);
+template<typename T>
+void GetSolMatrix(const T L, const T K, typename moment_matrix<T>::type &M);
 
 
 void GetEBendMatrix(const double L, const double phi, const double fringe_x, const double fringe_y, const double kappa,
@@ -35,4 +77,17 @@ void GetEBendMatrix(const double L, const double phi, const double fringe_x, con
 
 void GetCurveData(const Config &c, const unsigned ncurve, std::vector<double> &Scales, std::vector<std::vector<double> > &Curves);
 
+//! Field profile of a curve input element (ncurve!=0).
+//! Sum of scl_facN*curveN at each sample, with runs of equal samples merged
+//! so that each run may be treated as one hard-edge slice.
+struct CurveProfile {
+    std::vector<double> field;   //!< field of each run
+    std::vector<unsigned> count; //!< # of samples in each run
+    size_t nsample;              //!< total # of samples
+
+    CurveProfile() :nsample(0) {}
+    //! Read curve data with GetCurveData() and build the profile
+    void load(const Config &c, const unsigned ncurve);
+};
+
 #endif // MOMENT2_SUP_H
@@ -0,0 +1,107 @@
+#ifndef FLAME_PIPELINE_H
+#define FLAME_PIPELINE_H
+
+#include <vector>
+#include <string>
+#include <climits>
+
+#include <boost/noncopyable.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include "base.h"
+
+/** @brief Propagate a stream of States with one thread per lattice segment
+ *
+ * The elements [start, start+max) are divided into contiguous segments, each owned by a worker thread.
+ * A State passes through the segments in turn, handed between threads by single producer,
+ * single consumer lock-free queues.  So each element (and its cached transfer matrices)
+ * is only used by one thread, and segments work on successive States concurrently.
+ *
+ * States leave in the order they were pushed.  A State stopped early by ElementVoid::check_loss()
+ * is passed through the remaining segments unchanged.
+ *
+ * push() must be called from only one thread, and pop() from only one thread (maybe the same).
+ * The Machine must not be changed, or propagated by other means, while a Pipeline exists.
+ * Observers are called from the worker threads.  A trace stream (Machine::set_trace()) should not be used.
+ *
+ @code
+ Machine M(...);
+ Pipeline P(M, 4);
+ for(size_t i=0; i<states.size(); i++) {
+     P.push(states[i]);
+     ...
+     StateBase *done = P.pop(); // states[0], states[1], ...
+ }
+ @endcode
+ */
+class Pipeline : public boost::noncopyable
+{
+public:
+    /** Start worker threads
+     *
+     * @param M The Machine.
+     * @param nsegments Number of segments.  0 selects boost::thread::hardware_concurrency().
+     *                  Limited to the number of elements.
+     * @param start Index of the first element.
+     * @param max Number of elements.  Must not be negative.
+     * @param depth Capacity of each queue.
+     * @throws std::invalid_argument for an out of range start, a negative max, or zero depth.
+     */
+    Pipeline(const Machine& M, unsigned nsegments=0, size_t start=0, int max=INT_MAX, size_t depth=64);
+    //! Stop and join worker threads.  States in flight are abandoned, not deleted.
+    ~Pipeline();
+
+    //! Index of the first element of each segment, followed by the index after the last element.
+    inline const std::vector<size_t>& segments() const { return bounds; }
+
+    //! Enter a State, which the caller continues to own.  Waits while the first queue is full.
+    void push(StateBase* S);
+    //! Enter a State if the first queue has room.
+    bool try_push(StateBase* S);
+
+    /** Wait for the next State to leave
+     *
+     * @throws std::runtime_error if propagation of this State failed.  The State is not modified further.
+     * @throws std::logic_error if no States are pending.
+     */
+    StateBase* pop();
+    //! Take the next State if one has left.  Throws as pop()
+    bool try_pop(StateBase*& S);
+
+    //! Number of States pushed, and not yet popped.
+    //! Changes as push() and pop() are called from other threads.
+    inline size_t pending() const { return npending; }
+
+    /** Propagate all of 'states' from a single thread, and wait for completion.
+     *
+     * @throws std::runtime_error for the first failed propagation, after all states have left.
+     * @throws std::logic_error if States are already pending.
+     */
+    void propagate(const std::vector<StateBase*>& states);
+
+    struct Item {
+        StateBase *state; //!< NULL to stop a worker
+        bool stopped;     //!< stopped early by ElementVoid::check_loss()
+        std::string error;
+        Item() :state(0), stopped(false) {}
+        explicit Item(StateBase *S) :state(S), stopped(false) {}
+    };
+    typedef boost::lockfree::spsc_queue<Item> queue_t;
+
+private:
+    struct Worker;
+
+    std::vector<size_t> bounds;
+    // queues[i] feeds segment i.  queues.back() is read by pop()
+    std::vector<queue_t*> queues;
+    boost::thread_group workers;
+    // changed by push() and pop(), which may be called from different threads
+    boost::atomic<size_t> npending;
+
+    StateBase* take(const Item& I);
+    void stop();
+};
+
+#endif // FLAME_PIPELINE_H
@@ -0,0 +1,178 @@
+#ifndef FLAME_RESPONSE_H
+#define FLAME_RESPONSE_H
+
+#include <vector>
+#include <string>
+
+#include "base.h"
+#include "moment.h"
+
+/** @brief Response of the beam centroid to small changes of element parameters
+ *
+ * eg. the orbit response matrix of "orbtrim" elements "theta_x" and "theta_y"
+ * observed at "bpm" elements.
+ *
+ * The response of moment0_env at the exit of each observation element
+ * to each knob is found with a single propagation when the knob element,
+ * and all elements from it to the last observation, are MomentElementBase::Linear (or LinearPhase).
+ * The knob element is evaluated with its parameter changed by +-step,
+ * and the difference of its output moment0 is then multiplied through
+ * the cached transfer matrices of the following elements.
+ *
+ * Other knobs fall back to a central finite difference by propagation
+ * from the knob element with the parameter changed by +-step.
+ * These are divided between a pool of threads, each with a private copy of the Machine.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ ResponseMatrix R;
+ R.knobs.push_back(ResponseMatrix::Knob(5, "theta_x"));
+ R.observe.push_back(10);
+ R.compute(M, static_cast<MomentState&>(*ST));
+ double dxdtheta = R(0, MomentState::PS_X, 0);
+ @endcode
+ */
+struct ResponseMatrix
+{
+    //! A numeric element parameter, changed as by Machine::setParam()
+    struct Knob {
+        size_t index;
+        std::string name;
+        //! Change of the parameter for the difference
+        double step;
+        Knob() :index(0), step(1e-6) {}
+        Knob(size_t index, const std::string& name, double step=1e-6)
+            :index(index), name(name), step(step) {}
+    };
+
+    //! Parameters to vary
+    std::vector<Knob> knobs;
+    //! Element indices where moment0_env is observed.  At the element exit.
+    std::vector<size_t> observe;
+    //! Number of threads for finite differences.  0 selects boost::thread::hardware_concurrency()
+    unsigned nthreads;
+
+    //! Result of compute(), with shape [observe.size()][MomentState::maxsize][knobs.size()]
+    std::vector<double> response;
+    //! Result of compute().  For each knob, true if found with transfer matrices, false if by finite difference.
+    std::vector<bool> analytic;
+
+    ResponseMatrix() :nthreads(0) {}
+
+    /** Compute response[] and analytic[]
+     *
+     * @param M The Machine.  Parameters are restored before return, but cached results of knob elements are lost.
+     * @param ST The state at the entrance of element 0.  Not modified.
+     * @throws std::invalid_argument if an index is out of range, or an element is not a MomentMatrix element
+     * @throws std::runtime_error if a finite difference fails
+     * @note No other thread may use M during this call.
+     */
+    void compute(Machine& M, const MomentState& ST);
+
+    //! d moment0_env[j] at observe[obs] / d knobs[knob]
+    inline double operator()(size_t obs, size_t j, size_t knob) const
+    {
+        return response[(obs*MomentState::maxsize + j)*knobs.size() + knob];
+    }
+};
+
+/** @brief Derivatives of the beam envelope with respect to element parameters
+ *
+ * Forward mode automatic differentiation.  During one propagation, the derivative
+ * of moment0 and moment1 of each charge state with respect to each parameter
+ * is carried along.  At the element of a parameter this is seeded with the derivative of its
+ * transfer matrix, found by MomentElementBase::transfer_derivative() using the Dual scalar type.
+ * At each following element it is multiplied by the transfer matrix.
+ *
+ * Supported are "L", "B2" of quadrupole (with ncurve=0), "L", "B" of solenoid (with ncurve=0),
+ * "L", "phi", "phi1", "phi2", "K" of sbend, "L" of drift, "theta_x", "theta_y",
+ * "tm_xkick", "tm_ykick", "xyrotate" of orbtrim,
+ * and the misalignments "dx", "dy", "pitch", "yaw", "roll" of these elements (excepting drift).
+ * All elements after the first parameter must be MomentElementBase::Linear (or LinearPhase),
+ * or rfcavity with EmitGrowth=0, whose step-wise transfer matrix is held fixed for the present
+ * charge state phases.  So a parameter which may change these phases (any "L", or one moving the
+ * orbit through an sbend) can't be followed by a cavity.  Cavity parameters are not supported.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ MomentGradient G;
+ G.params.push_back(MomentGradient::Param(5, "B2"));
+ G.compute(M, static_cast<MomentState&>(*ST));
+ double dxdB2 = G.dmoment0_env[0][MomentState::PS_X];
+ @endcode
+ */
+struct MomentGradient
+{
+    //! A parameter to differentiate, by element index and name
+    struct Param {
+        size_t index;
+        std::string name;
+        Param() :index(0) {}
+        Param(size_t index, const std::string& name) :index(index), name(name) {}
+    };
+
+    //! Parameters to differentiate
+    std::vector<Param> params;
+
+    //! Result of compute().  d moment0_env / d params[j]
+    std::vector<MomentState::vector_t> dmoment0_env;
+    //! Result of compute().  d moment1_env / d params[j]
+    std::vector<MomentState::matrix_t> dmoment1_env;
+
+    /** Propagate ST, as by Machine::propagate(), and compute dmoment0_env[] and dmoment1_env[] at the end.
+     *
+     * @param M The Machine
+     * @param ST The state at the entrance of element 'start', updated with the final state.
+     * @param start Index of the first element
+     * @param max Maximum number of elements to pass.  Forward propagation only.
+     * @throws std::invalid_argument if a parameter can't be differentiated, or an element after it is not linear
+     */
+    void compute(Machine& M, MomentState& ST, size_t start=0, int max=INT_MAX);
+};
+
+/** @brief Derivatives of one scalar objective with respect to many element parameters
+ *
+ * Reverse mode (adjoint) differentiation of the linear objective
+ @code
+ J = sum(weight0 .* moment0_env) + sum(weight1 .* moment1_env)
+ @endcode
+ * at the end of propagation.  For a nonlinear figure of merit f(moment0_env, moment1_env)
+ * (eg. an rms size or emittance) set the weights to the partial derivatives of f at the final state.
+ *
+ * The forward pass records the transfer matrix of each element, and the derivatives
+ * of the transfer matrices of the parameter elements (MomentElementBase::transfer_derivative()).
+ * A single backward sweep then gives the gradient for all parameters.
+ * Parameters and elements are restricted as for MomentGradient.
+ */
+struct MomentAdjoint
+{
+    //! Parameters to differentiate
+    std::vector<MomentGradient::Param> params;
+
+    //! dJ / d moment0_env
+    MomentState::vector_t weight0;
+    //! dJ / d moment1_env
+    MomentState::matrix_t weight1;
+
+    //! Result of compute().  dJ / d params[j]
+    std::vector<double> gradient;
+
+    MomentAdjoint()
+        :weight0(boost::numeric::ublas::zero_vector<double>(MomentState::maxsize))
+        ,weight1(boost::numeric::ublas::zero_matrix<double>(MomentState::maxsize))
+    {}
+
+    /** Propagate ST, as by Machine::propagate(), and compute gradient[]
+     *
+     * @param M The Machine
+     * @param ST The state at the entrance of element 'start', updated with the final state.
+     * @param start Index of the first element
+     * @param max Maximum number of elements to pass.  Forward propagation only.
+     * @throws std::invalid_argument as MomentGradient::compute()
+     */
+    void compute(Machine& M, MomentState& ST, size_t start=0, int max=INT_MAX);
+};
+
+#endif // FLAME_RESPONSE_H
@@ -95,8 +95,14 @@ struct ElementRFCavity : public MomentElementBase
     unsigned MpoleLevel,
              EmitGrowth;
 
+    double phi,      // "phi" [deg], same as IonFys
+           scl_fac,  // Electric field scale factor
+           syncflag; // >=1 if phi is the synchronous phase, otherwise the driven phase
+
     ElementRFCavity(const Config& c);
 
+    virtual void bind(ParamBinder& P);
+
     void LoadCavityFile(const Config& c);
 
     void GetCavMatParams(const int cavi,
@@ -118,6 +124,23 @@ struct ElementRFCavity : public MomentElementBase
 
     void PropagateLongRFCav(Particle &ref, double &phi_ref) const;
 
+    // Longitudinal tracking of the reference particle for a given driven phase [rad].
+    void PropagateLongRFCavPhase(Particle &ref, const double caviFy, const double EfieldScl) const;
+
+    /** Cavity phase scan.
+     *
+     * Track the reference particle 'in' through the cavity once for each driven phase
+     * in 'phases' [deg] (same meaning as "phi" with syncflag=0), using only the
+     * longitudinal model.  Does not touch the cached transfer matrices.
+     *
+     * @param in Reference particle at the cavity entrance
+     * @param phases Driven phases [deg]
+     * @param IonEk Output kinetic energies [eV].  Resized to match 'phases'
+     * @param phis Output absolute phases [rad].  Resized to match 'phases'
+     */
+    void scanPhase(const Particle& in, const std::vector<double>& phases,
+                   std::vector<double>& IonEk, std::vector<double>& phis) const;
+
     void calRFcaviEmitGrowth(const state_t::matrix_t &matIn, Particle &state, const int n,
                              const double betaf, const double gamaf,
                              const double aveX2i, const double cenX, const double aveY2i, const double cenY,
@@ -152,6 +175,21 @@ struct ElementRFCavity : public MomentElementBase
         cRm           = O->cRm;
         cavi          = O->cavi;
         forcettfcalc  = O->forcettfcalc;
+        CavType       = O->CavType;
+        DataPath      = O->DataPath;
+        DataFile      = O->DataFile;
+        SynAccTab     = O->SynAccTab;
+        have_RefNrm   = O->have_RefNrm;
+        have_SynComplex = O->have_SynComplex;
+        have_EkLim    = O->have_EkLim;
+        have_NrLim    = O->have_NrLim;
+        RefNrm        = O->RefNrm;
+        SynComplex    = O->SynComplex;
+        EkLim         = O->EkLim;
+        NrLim         = O->NrLim;
+        phi           = O->phi;
+        scl_fac       = O->scl_fac;
+        syncflag      = O->syncflag;
     }
 
     virtual void advance(StateBase& s)
@@ -165,35 +203,9 @@ struct ElementRFCavity : public MomentElementBase
         ST.recalc();
 
         if(!check_cache(ST) && !ST.retreat) {
-            last_ref_in = ST.ref;
-            last_real_in = ST.real;
-            resize_cache(ST);
             // need to re-calculate energy dependent terms
-
-            std::string newtype = conf().get<std::string>("cavtype");
-            if (CavType != newtype){
-                lattice.clear();
-                SynAccTab.clear();
-                LoadCavityFile(conf());
-            } else if (CavType == "Generic") {
-                std::string newfile = conf().get<std::string>("Eng_Data_Dir", defpath);
-                newfile += "/" + conf().get<std::string>("datafile");
-                if (DataFile != newfile) {
-                    lattice.clear();
-                    SynAccTab.clear();
-                    LoadCavityFile(conf());
-                }
-            }
-
-            recompute_matrix(ST); // updates transfer and last_Kenergy_out
-
-            for(size_t i=0; i<last_real_in.size(); i++)
-                get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
-
-            ST.recalc();
-
-            last_ref_out = ST.ref;
-            last_real_out = ST.real;
+            cache_misses++;
+            update_cache(ST);
         } else if(ST.retreat){
             if (!check_backward(ST))
                 throw std::runtime_error(SB()<<
@@ -289,6 +301,37 @@ struct ElementRFCavity : public MomentElementBase
         ST.calc_rms();
     }
 
+    virtual void update_cache(state_t& ST)
+    {
+        last_ref_in = ST.ref;
+        last_real_in = ST.real;
+        resize_cache(ST);
+
+        recompute_matrix(ST); // updates transfer and last_Kenergy_out
+
+        for(size_t i=0; i<last_real_in.size(); i++)
+            get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
+
+        ST.recalc();
+
+        last_ref_out = ST.ref;
+        last_real_out = ST.real;
+    }
+
+    virtual bool advance_long(Particle& ref, std::vector<Particle>& real)
+    {
+        double caviFy = 0e0;
+
+        ref.recalc();
+        PropagateLongRFCav(ref, caviFy);
+
+        for(size_t i=0; i<real.size(); i++) {
+            real[i].recalc();
+            PropagateLongRFCavPhase(real[i], caviFy, scl_fac);
+        }
+        return true;
+    }
+
     virtual void recompute_matrix(state_t& ST)
     {
         // Re-initialize transport matrix. and update ST.ref and ST.real[]
@@ -0,0 +1,170 @@
+#ifndef FLAME_SCAN_H
+#define FLAME_SCAN_H
+
+#include <vector>
+#include <string>
+
+#include <boost/cstdint.hpp>
+
+#include "base.h"
+
+/** @brief Propagate the same initial state with different element parameter values
+ *
+ * Each axis is a numeric element parameter (changed as by Machine::setParam()) and a list of values.
+ * With 'zip' false, the scan points are the grid of all combinations of axis values,
+ * with the last axis changing fastest.  With 'zip' true, all axes have the same number
+ * of values, and point n takes the n'th value of each.
+ *
+ * The initial state is propagated once through the elements upstream of the first scanned element.
+ * Scan points are then divided between a pool of threads.  The calling thread uses the given Machine,
+ * others a private copy, whose element caches are reused between the points handled by that thread.
+ *
+ * Fields are state arrays by name, as returned by StateBase::getArray() (eg. "moment0_env").
+ * The result of each field is a dense array of shape [npoints()][observe.size()][field shape].
+ * Points where propagation stopped early (see ElementVoid::check_loss()) are NaN
+ * for the following observations.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ Scan S;
+ S.axes.push_back(Scan::Axis(5, "B2"));
+ S.axes.back().values.push_back(1.0);
+ S.axes.back().values.push_back(1.1);
+ S.observe.push_back(10);
+ S.fields.push_back("moment0_env");
+ S.compute(M, *ST);
+ // S.results[0] has shape [2][1][7]
+ @endcode
+ */
+struct Scan
+{
+    //! A numeric element parameter, and its values
+    struct Axis {
+        size_t index;
+        std::string name;
+        std::vector<double> values;
+        Axis() :index(0) {}
+        Axis(size_t index, const std::string& name) :index(index), name(name) {}
+    };
+
+    std::vector<Axis> axes;
+    //! true to scan the axes together, false for the grid of all combinations
+    bool zip;
+    //! Element indices where fields are observed.  At the element exit.
+    std::vector<size_t> observe;
+    //! State field names
+    std::vector<std::string> fields;
+    //! Number of threads.  0 selects boost::thread::hardware_concurrency()
+    unsigned nthreads;
+
+    //! Result of compute().  For each field, an array of shape [npoints()][observe.size()][shapes[f]]
+    std::vector<std::vector<double> > results;
+    //! Result of compute().  The shape of each field
+    std::vector<std::vector<size_t> > shapes;
+
+    Scan() :zip(false), nthreads(0) {}
+
+    //! Number of scan points
+    size_t npoints() const;
+
+    /** Compute results[] and shapes[]
+     *
+     * @param M The Machine.  Parameters are restored before return, but cached results of scanned elements are lost.
+     * @param ST The state at the entrance of element 0.  Not modified.
+     * @throws std::invalid_argument for an out of range index, an unknown parameter or field,
+     *         or mismatched zip axes.
+     * @throws std::runtime_error if a propagation fails, or a field changes shape between observations.
+     * @note No other thread may use M during this call.
+     */
+    void compute(Machine& M, const StateBase& ST);
+};
+
+/** @brief Statistics of observed state fields over random element errors
+ *
+ * Each error is a numeric element parameter (eg. "dx" or "roll", see MomentElementBase),
+ * changed from its nominal value by a random amount.
+ * The errors of each sample are drawn from a counter based random number generator
+ * keyed by (seed, sample number), so a sample is reproduced by draw() regardless of
+ * how samples are divided between threads.
+ *
+ * Samples are propagated in parallel, as for Scan, and their observed fields
+ * are accumulated as they complete (in sample order).  Only the running statistics are kept:
+ * mean and variance (Welford's method), minimum, maximum,
+ * and quantiles (the P-square estimator of Jain and Chlamtac).
+ * So memory does not depend on nsamples.
+ *
+ @code
+ Machine M(...);
+ std::auto_ptr<StateBase> ST(M.allocState());
+ ErrorStudy S;
+ S.errors.push_back(ErrorStudy::Error(5, "dx", 1e-4));
+ S.observe.push_back(10);
+ S.fields.push_back("moment0_env");
+ S.nsamples = 1000;
+ S.compute(M, *ST);
+ double meanx = S.stats[0].mean[MomentState::PS_X];
+ @endcode
+ */
+struct ErrorStudy
+{
+    //! A random change of a numeric element parameter
+    struct Error {
+        size_t index;
+        std::string name;
+        enum dist_t {
+            Gaussian, //!< Normal distribution with standard deviation 'width'
+            Uniform,  //!< Uniform distribution in [-width, width]
+        } dist;
+        double width;
+        //! For Gaussian, truncate at +-cut*width.  0 for no truncation.
+        double cut;
+        Error() :index(0), dist(Gaussian), width(0e0), cut(0e0) {}
+        Error(size_t index, const std::string& name, double width, dist_t dist=Gaussian, double cut=0e0)
+            :index(index), name(name), dist(dist), width(width), cut(cut) {}
+    };
+
+    std::vector<Error> errors;
+    //! Element indices where fields are observed.  At the element exit.
+    std::vector<size_t> observe;
+    //! State field names, as for Scan
+    std::vector<std::string> fields;
+    //! Probabilities of the quantiles to estimate, each in (0, 1)
+    std::vector<double> probabilities;
+    //! Number of samples
+    size_t nsamples;
+    boost::uint64_t seed;
+    //! Number of threads.  0 selects boost::thread::hardware_concurrency()
+    unsigned nthreads;
+
+    //! Statistics of one field.  Each of shape [observe.size()][field shape]
+    struct Stats {
+        std::vector<double> mean, var, min, max;
+        //! shape [probabilities.size()][observe.size()][field shape]
+        std::vector<double> quantile;
+    };
+    //! Result of compute().  For each field.
+    std::vector<Stats> stats;
+    //! Result of compute().  The shape of each field
+    std::vector<std::vector<size_t> > shapes;
+    //! Result of compute().  The number of samples which reached each observation
+    std::vector<size_t> count;
+
+    ErrorStudy() :nsamples(0), seed(0), nthreads(0) {}
+
+    //! The errors of one sample, to be added to the nominal values
+    void draw(size_t sample, std::vector<double>& delta) const;
+
+    /** Compute stats[], shapes[] and count[]
+     *
+     * @param M The Machine.  Parameters are restored before return, but cached results of changed elements are lost.
+     * @param ST The state at the entrance of element 0.  Not modified.
+     * @throws std::invalid_argument for an out of range index, an unknown parameter or field,
+     *         or a probability not in (0, 1).
+     * @throws std::runtime_error if a propagation fails, or a field changes shape between observations.
+     * @note No other thread may use M during this call.
+     */
+    void compute(Machine& M, const StateBase& ST);
+};
+
+#endif // FLAME_SCAN_H
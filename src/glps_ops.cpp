@@ -95,13 +95,14 @@ int binary_div(parse_context* ctxt, expr_value_t *R, const expr_t * const *A)
 
 int unary_bl_negate(parse_context* ctxt, expr_value_t *R, const expr_t * const *A)
 {
-    // reverse the order of the beamline
-    const std::vector<std::string>& line = boost::get<std::vector<std::string> >(A[0]->value);
-    std::vector<std::string> ret(line.size());
-    std::copy(line.rbegin(),
-              line.rend(),
-              ret.begin());
-    *R = ret;
+    // reverse the order of the beamline, without expanding it
+    const beamline_ptr& line = boost::get<beamline_ptr>(A[0]->value);
+    boost::shared_ptr<beamline_t> ret(new beamline_t);
+    beamline_t::item_t I;
+    I.line = line;
+    I.reverse = true;
+    ret->append(I);
+    *R = beamline_ptr(ret);
     return 0;
 }
 
@@ -120,20 +121,29 @@ int binary_bl_mult(parse_context* ctxt, expr_value_t *R, const expr_t * const *A
     }
     unsigned factori = (unsigned)factor;
 
-    const std::vector<std::string>& line = boost::get<std::vector<std::string> >(A[LINE]->value);
+    const beamline_ptr& line = boost::get<beamline_ptr>(A[LINE]->value);
 
-    std::vector<std::string> ret(line.size()*factori);
+    // the repetition is kept, not expanded
+    boost::shared_ptr<beamline_t> ret(new beamline_t);
 
-    if(factori>0)
+    if(factori>0 && line->size>0)
     {
-        std::vector<std::string>::iterator outi = ret.begin();
-
-        while(factori--)
-            outi = std::copy(line.begin(),
-                             line.end(),
-                             outi);
+        beamline_t::item_t I;
+        I.line = line;
+        I.count = factori;
+        if(line->items.size()==1 && line->items[0].count==1) {
+            // eg. 3*D1
+            I = line->items[0];
+            I.count = factori;
+        }
+        try {
+            ret->append(I);
+        } catch(std::length_error& e) {
+            ctxt->last_error = e.what();
+            return 1;
+        }
     }
-    *R = ret;
+    *R = beamline_ptr(ret);
     return 0;
 }
 
@@ -148,6 +158,8 @@ int unary_parse(parse_context* ctxt, expr_value_t *R, const expr_t * const *A)
 
     boost::shared_ptr<Config> ret(P.parse_file(name.native().c_str()));
     *R = ret;
+    ctxt->depends.push_back(name.native());
+    ctxt->depends.insert(ctxt->depends.end(), P.dependencies().begin(), P.dependencies().end());
     return 0;
 }
 
@@ -164,6 +176,8 @@ int unary_file(parse_context* ctxt, expr_value_t *R, const expr_t * const *A)
         return 1;
     }
 
+    if(is_regular_file(ret))
+        ctxt->depends.push_back(ret.native());
     *R = ret.native();
     return 0;
 }
@@ -188,6 +202,8 @@ int unary_h5file(parse_context* ctxt, expr_value_t *R, const expr_t * const *A)
         path fname(absolute(inp.substr(0, sep), ctxt->cwd));
 
         if(exists(fname)) {
+            if(is_regular_file(fname))
+                ctxt->depends.push_back(canonical(fname).native());
             *R = canonical(fname).native() + inp.substr(sep);
             return 0;
         } else if(sep==inp.npos) {
@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include <algorithm>
+#include <limits>
 #include <memory>
 #include <stdexcept>
 #include <sstream>
@@ -25,10 +26,29 @@ parse_element::parse_element(std::string L, std::string E, kvlist_t::map_t &M)
     props.swap(M);
 }
 
-parse_line::parse_line(std::string L, std::string E, strlist_t::list_t& N)
+parse_line::parse_line(std::string L, std::string E, beamline_t& N)
     :label(L), etype(E)
 {
-    names.swap(N);
+    boost::shared_ptr<beamline_t> B(new beamline_t);
+    B->items.swap(N.items);
+    B->size = N.size;
+    line = B;
+}
+
+void beamline_t::append(const item_t& I)
+{
+    const size_t n = I.line ? I.line->size : 1;
+    if(n && I.count > (std::numeric_limits<size_t>::max()-size)/n)
+        throw std::length_error("Beamline too long");
+    size += I.count*n;
+    items.push_back(I);
+}
+
+namespace {
+struct collect_names {
+    std::vector<std::string> names;
+    void operator()(const std::string& name) { names.push_back(name); }
+};
 }
 
 operation_t::operation_t(const char *name, eval_t fn, glps_expr_type R, unsigned N, va_list args)
@@ -81,7 +101,9 @@ void glps_expr_debug(FILE *fp, const expr_t *E)
     fprintf(fp, "%p type %s", E, glps_expr_type_name(E->etype));
     if(E->etype==glps_expr_line) {
         try{
-            const strlist_t::list_t& L(boost::get<strlist_t::list_t>(E->value));
+            collect_names C;
+            boost::get<beamline_ptr>(E->value)->expand(C);
+            const std::vector<std::string>& L(C.names);
             fprintf(fp, " [%u] (", (unsigned)L.size());
             for(size_t i=0, N=L.size(); i<N; i++)
                 fprintf(fp, "%s, ", L[i].c_str());
@@ -155,19 +177,25 @@ strlist_t* glps_append_expr(parse_context *ctxt, strlist_t* list, expr_t *expr)
 
         switch(expr->etype) {
         case glps_expr_elem:
+        {
             // prepend a single element (append, the result will be reversed in glps_add_line)
-            L->list.push_back(boost::get<std::string>(expr->value));
+            beamline_t::item_t I;
+            I.name = boost::get<std::string>(expr->value);
+            L->line.append(I);
+        }
             break;
         case glps_expr_line:
         {
-            // prepend another line (append in reversed order)
-            std::vector<std::string>& N(boost::get<std::vector<std::string> >(expr->value));
-
-            size_t orig = L->list.size();
-            L->list.resize(L->list.size()+N.size());
-            std::copy(N.rbegin(),
-                      N.rend(),
-                      L->list.begin()+orig);
+            // prepend another line, without expanding it
+            const beamline_ptr& N(boost::get<beamline_ptr>(expr->value));
+
+            if(N->items.size()==1) {
+                L->line.append(N->items[0]);
+            } else if(N->size) {
+                beamline_t::item_t I;
+                I.line = N;
+                L->line.append(I);
+            }
         }
             break;
         default:
@@ -241,17 +269,19 @@ expr_t *glps_add_value(parse_context *ctxt, glps_expr_type t, ...)
                 ret->value = E.value;
 
             } else if(ctxt->element_idx.find(name->str)!=ctxt->element_idx.end()) {
-                // expand element
-                strlist_t::list_t T(1);
-                T[0] = name->str;
+                // a beamline of one element
+                boost::shared_ptr<beamline_t> T(new beamline_t);
+                beamline_t::item_t I;
+                I.name = name->str;
+                T->append(I);
                 ret->etype = glps_expr_line;
-                ret->value = T;
+                ret->value = beamline_ptr(T);
 
             } else if((it=ctxt->line_idx.find(name->str))!=ctxt->line_idx.end()) {
-                // expand beamline
+                // reference beamline, not copied
                 parse_line &L = ctxt->line[it->second];
                 ret->etype = glps_expr_line;
-                ret->value = L.names;
+                ret->value = L.line;
 
             } else if(name->str=="pi") {
                 ret->etype = glps_expr_number;
@@ -464,9 +494,9 @@ void glps_add_line(parse_context *ctxt, string_t *label, string_t *etype, strlis
             glps_error(ctxt->scanner, ctxt, "Name '%s' already used", label->str.c_str());
 
         } else {
-            // reverse order of elements
-            std::reverse(names->list.begin(), names->list.end());
-            ctxt->line.push_back(parse_line(label->str, etype->str, names->list));
+            // reverse order of items
+            std::reverse(names->line.items.begin(), names->line.items.end());
+            ctxt->line.push_back(parse_line(label->str, etype->str, names->line));
             ctxt->line_idx[label->str] = ctxt->line.size()-1;
         }
 
@@ -507,7 +537,9 @@ void glps_call1(parse_context *ctxt, string_t *func, expr_t *arg)
             break;
         case glps_expr_line: {
             std::ostream_iterator<std::string> it(strm, ", ");
-            const std::vector<std::string>& vect = boost::get<std::vector<std::string> >(arg->value);
+            collect_names C;
+            boost::get<beamline_ptr>(arg->value)->expand(C);
+            const std::vector<std::string>& vect = C.names;
             strm<<"(";
             std::copy(vect.begin(), vect.end(), it);
             strm<<")";
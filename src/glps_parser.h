@@ -80,11 +80,50 @@ expr_t *glps_add_op(parse_context *ctxt, string_t *, unsigned N, expr_t **);
 
 class Config;
 
+struct beamline_t;
+typedef boost::shared_ptr<const beamline_t> beamline_ptr;
+
+/** A beamline.  Repetitions (n*line), reversals (-line), and nested lines
+ *  are kept, and are only expanded by expand().
+ */
+struct beamline_t {
+    struct item_t {
+        std::string name;  //!< element label, if 'line' is NULL
+        beamline_ptr line; //!< nested beamline
+        size_t count;      //!< number of repetitions
+        bool reverse;      //!< pass 'line' in reverse order
+        item_t() :count(1), reverse(false) {}
+    };
+    std::vector<item_t> items;
+    //! Number of elements when expanded
+    size_t size;
+
+    beamline_t() :size(0) {}
+
+    //! @throws std::length_error if the expanded size overflows
+    void append(const item_t& I);
+
+    //! Call fn(label) for each element, in order
+    template<typename F>
+    void expand(F& fn, bool rev=false) const
+    {
+        for(size_t n=0; n<items.size(); n++) {
+            const item_t& I = items[rev ? items.size()-1-n : n];
+            for(size_t c=0; c<I.count; c++) {
+                if(I.line)
+                    I.line->expand(fn, rev!=I.reverse);
+                else
+                    fn(I.name);
+            }
+        }
+    }
+};
+
 typedef boost::variant<
     double, // glps_expr_number
     std::vector<double>, // glps_expr_vector
     std::string, // glps_expr_string,
-    std::vector<std::string>, // glps_expr_line
+    beamline_ptr, // glps_expr_line
     boost::shared_ptr<Config> // glps_expr_config
 > expr_value_t;
 
@@ -114,8 +153,8 @@ struct kvlist_t {
 };
 
 struct strlist_t {
-    typedef std::vector<std::string> list_t;
-    list_t list;
+    //! in reverse order until glps_add_line()
+    beamline_t line;
 };
 
 struct parse_var {
@@ -135,9 +174,9 @@ struct parse_element {
 
 struct parse_line {
     std::string label, etype;
-    strlist_t::list_t names;
+    beamline_ptr line;
 
-    parse_line(std::string L, std::string E, strlist_t::list_t& N);
+    parse_line(std::string L, std::string E, beamline_t& N);
 };
 
 struct operation_t {
@@ -182,6 +221,9 @@ struct parse_context {
     //! Used to expand relative paths
     boost::filesystem::path cwd;
 
+    //! Files referenced by parse(), file(), or h5file()
+    std::vector<std::string> depends;
+
     //! Initialize context, including populating operations table
     parse_context(const char *path=NULL);
     ~parse_context();
@@ -0,0 +1,593 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <algorithm>
+
+#include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "flame/latcache.h"
+
+/* Entry layout.  Integers are native byte order, checked by 'order'.
+ *
+ * header  : char magic[8], u32 version, u32 order, u64 key, i64 stored
+ * depends : u32 count, { u32 len, char path[len], u64 size, i64 mtime, u64 hash }...
+ * output  : u32 len, char[len]
+ * keys    : u32 count, { u32 len, char[len] }...
+ * strings : u32 count, { u32 len, char[len] }...
+ *           zero padding to a multiple of 8 bytes
+ * frames  : u32 count, u32 0, { u32 next, u32 0, scope }...
+ * root    : config
+ *
+ * config  : u32 frame, u32 0, scope
+ * scope   : u32 count, u32 0, { u32 key, u32 type, value }...
+ * value   : double                         (type 0)
+ *         | u32 count, u32 0, double[count] (type 1)
+ *         | u32 string, u32 0               (type 2)
+ *         | u32 count, u32 0, config[count] (type 3)
+ *
+ * stored and mtime are seconds since the epoch.
+ * frame is 0 for none, or 1 + the index of an earlier frame.
+ * Everything from 'frames' on is a multiple of 8 bytes, so arrays are 8 byte aligned.
+ */
+
+namespace {
+
+const char magic[8] = {'F','L','A','M','E','L','A','T'};
+const boost::uint32_t version = 2, order = 0x01020304;
+
+// 64-bit FNV-1a
+struct FNV {
+    boost::uint64_t h;
+    FNV() :h(0xcbf29ce484222325ULL) {}
+    void operator()(const void *buf, size_t len)
+    {
+        const unsigned char *B = (const unsigned char*)buf;
+        for(size_t i=0; i<len; i++) {
+            h ^= B[i];
+            h *= 0x100000001b3ULL;
+        }
+    }
+};
+
+template<typename T>
+void put(std::string& out, T v)
+{
+    out.append((const char*)&v, sizeof(v));
+}
+
+void put_string(std::string& out, const std::string& s)
+{
+    put<boost::uint32_t>(out, s.size());
+    out += s;
+}
+
+enum type_t {
+    type_double = 0,
+    type_vector = 1,
+    type_string = 2,
+    type_config = 3,
+};
+
+struct entry_id_less {
+    bool operator()(const Config::entry_t& lhs, const Config::entry_t& rhs) const
+    { return lhs.first.id()<rhs.first.id(); }
+};
+
+} // namespace
+
+struct LatticeCache::Writer : public boost::static_visitor<void>
+{
+    typedef std::map<std::string, boost::uint32_t> index_t;
+    index_t keys, strings;
+    std::vector<const std::string*> key_list, string_list;
+
+    // new_scope() creates a Frame for each element, all sharing one enclosing scope
+    typedef std::map<std::pair<const Config::values_t*, boost::uint32_t>, boost::uint32_t> frame_index_t;
+    frame_index_t frame_index;
+    std::string frames;
+    boost::uint32_t nframes;
+
+    std::string *out; // current value output for visitor
+
+    Writer() :nframes(0), out(0) {}
+
+    static boost::uint32_t intern(index_t& I, std::vector<const std::string*>& L, const std::string& s)
+    {
+        std::pair<index_t::iterator, bool> ret(I.insert(std::make_pair(s, L.size())));
+        if(ret.second)
+            L.push_back(&ret.first->first);
+        return ret.first->second;
+    }
+
+    boost::uint32_t frame(const Config::Frame *F)
+    {
+        if(!F)
+            return 0;
+        // enclosing frames, and frames of Configs within this one, are written first
+        boost::uint32_t next = frame(F->next.get());
+
+        const frame_index_t::key_type fkey(F->values.get(), next);
+        frame_index_t::const_iterator it(frame_index.find(fkey));
+        if(it!=frame_index.end())
+            return it->second;
+
+        std::string temp;
+        scope(temp, *F->values);
+
+        put<boost::uint32_t>(frames, next);
+        put<boost::uint32_t>(frames, 0);
+        frames += temp;
+        boost::uint32_t id = ++nframes;
+        frame_index[fkey] = id;
+        return id;
+    }
+
+    void config(std::string& dest, const Config& C)
+    {
+        boost::uint32_t F = frame(C.implicit_values.get());
+        put<boost::uint32_t>(dest, F);
+        put<boost::uint32_t>(dest, 0);
+        scope(dest, *C.values);
+    }
+
+    void scope(std::string& dest, const Config::values_t& V)
+    {
+        put<boost::uint32_t>(dest, V.size());
+        put<boost::uint32_t>(dest, 0);
+        for(Config::values_t::const_iterator it=V.begin(), end=V.end(); it!=end; ++it) {
+            put<boost::uint32_t>(dest, intern(keys, key_list, it->first.name()));
+            put<boost::uint32_t>(dest, it->second.which());
+            std::string *prev = out;
+            out = &dest;
+            boost::apply_visitor(*this, it->second);
+            out = prev;
+        }
+    }
+
+    void operator()(double v)
+    {
+        put(*out, v);
+    }
+    void operator()(const std::vector<double>& v)
+    {
+        put<boost::uint32_t>(*out, v.size());
+        put<boost::uint32_t>(*out, 0);
+        if(!v.empty())
+            out->append((const char*)&v[0], v.size()*sizeof(double));
+    }
+    void operator()(const std::string& v)
+    {
+        put<boost::uint32_t>(*out, intern(strings, string_list, v));
+        put<boost::uint32_t>(*out, 0);
+    }
+    void operator()(const Config::vector_t& v)
+    {
+        std::string& dest = *out;
+        put<boost::uint32_t>(dest, v.size());
+        put<boost::uint32_t>(dest, 0);
+        for(size_t i=0; i<v.size(); i++)
+            config(dest, v[i]);
+    }
+};
+
+struct LatticeCache::Reader
+{
+    const char *pos, *end;
+    std::vector<ConfigKey> keys;
+    std::vector<std::string> strings;
+    std::vector<Config::frame_pointer> frames;
+
+    Reader(const char *buf, size_t len) :pos(buf), end(buf+len) {}
+
+    const char* take(size_t n)
+    {
+        if(size_t(end-pos)<n)
+            throw std::runtime_error("Truncated lattice cache entry");
+        const char *ret = pos;
+        pos += n;
+        return ret;
+    }
+
+    // each of 'count' items occupies at least 'size' bytes
+    void check_count(size_t count, size_t size) const
+    {
+        if(count > size_t(end-pos)/size)
+            throw std::runtime_error("Truncated lattice cache entry");
+    }
+
+    template<typename T>
+    T get()
+    {
+        T ret;
+        memcpy(&ret, take(sizeof(ret)), sizeof(ret));
+        return ret;
+    }
+
+    void get_string(std::string& s)
+    {
+        boost::uint32_t len = get<boost::uint32_t>();
+        s.assign(take(len), len);
+    }
+
+    void config(Config& C)
+    {
+        boost::uint32_t F = get<boost::uint32_t>();
+        get<boost::uint32_t>();
+        if(F>frames.size())
+            throw std::runtime_error("Invalid frame in lattice cache entry");
+        if(F)
+            C.implicit_values = frames[F-1];
+        Config::values_pointer V(new Config::values_t);
+        scope(*V);
+        C.values = V;
+    }
+
+    void scope(Config::values_t& V)
+    {
+        boost::uint32_t count = get<boost::uint32_t>();
+        get<boost::uint32_t>();
+        check_count(count, 16);
+        V.reserve(count);
+        for(boost::uint32_t i=0; i<count; i++) {
+            boost::uint32_t K = get<boost::uint32_t>(),
+                            T = get<boost::uint32_t>();
+            if(K>=keys.size())
+                throw std::runtime_error("Invalid key in lattice cache entry");
+            V.push_back(Config::entry_t(keys[K], 0.0));
+            Config::value_t& val = V.back().second;
+
+            switch(T) {
+            case type_double:
+                val = get<double>();
+                break;
+            case type_vector: {
+                boost::uint32_t N = get<boost::uint32_t>();
+                get<boost::uint32_t>();
+                const double *arr = (const double*)take(size_t(N)*sizeof(double));
+                val = std::vector<double>(N);
+                if(N)
+                    memcpy(&boost::get<std::vector<double> >(val)[0], arr, N*sizeof(double));
+            }
+                break;
+            case type_string: {
+                boost::uint32_t S = get<boost::uint32_t>();
+                get<boost::uint32_t>();
+                if(S>=strings.size())
+                    throw std::runtime_error("Invalid string in lattice cache entry");
+                val = strings[S];
+            }
+                break;
+            case type_config: {
+                boost::uint32_t N = get<boost::uint32_t>();
+                get<boost::uint32_t>();
+                check_count(N, 16);
+                val = Config::vector_t(N);
+                Config::vector_t& list = boost::get<Config::vector_t>(val);
+                for(boost::uint32_t n=0; n<N; n++)
+                    config(list[n]);
+            }
+                break;
+            default:
+                throw std::runtime_error("Invalid value type in lattice cache entry");
+            }
+        }
+        // atoms are assigned in a different order by each process
+        std::sort(V.begin(), V.end(), entry_id_less());
+    }
+};
+
+const size_t LatticeCache::min_size;
+const boost::uint64_t LatticeCache::default_max_bytes;
+
+LatticeCache::LatticeCache(const std::string& dir, boost::uint64_t max_bytes)
+    :p_dir(dir)
+    ,p_max_bytes(max_bytes)
+{}
+
+std::string LatticeCache::default_dir()
+{
+    const char *env = getenv("FLAME_LATTICE_CACHE");
+    return env ? env : std::string();
+}
+
+boost::uint64_t LatticeCache::key(const char *src, size_t len, const std::string& cwd,
+                                  bool have_lattice, const Config& vars)
+{
+    std::string temp;
+    put(temp, version);
+    put<boost::uint8_t>(temp, have_lattice);
+    put_string(temp, cwd);
+    put<boost::uint64_t>(temp, len);
+
+    // in order of name.  Config iterates in order of ConfigKey atoms, which depends on the history of the process.
+    typedef std::map<std::string, const Config::value_t*> sorted_t;
+    sorted_t sorted;
+    for(Config::const_iterator it=vars.begin(), end=vars.end(); it!=end; ++it)
+        sorted[it->first.name()] = &it->second;
+
+    put<boost::uint32_t>(temp, sorted.size());
+    for(sorted_t::const_iterator it=sorted.begin(), end=sorted.end(); it!=end; ++it) {
+        Config one;
+        one.setAny(it->first, *it->second);
+        encode(temp, 0, one, depends_t(), std::string());
+    }
+
+    FNV H;
+    H(temp.data(), temp.size());
+    H(src, len);
+    return H.h;
+}
+
+std::string LatticeCache::entry(boost::uint64_t key) const
+{
+    std::ostringstream name;
+    name<<std::hex;
+    name.width(16);
+    name.fill('0');
+    name<<key<<".flc";
+    return (boost::filesystem::path(p_dir) / name.str()).native();
+}
+
+bool LatticeCache::stat_file(const std::string& path, boost::uint64_t& size, boost::int64_t& mtime)
+{
+    boost::system::error_code err;
+    size = boost::filesystem::file_size(path, err);
+    if(err)
+        return false;
+    mtime = boost::filesystem::last_write_time(path, err);
+    return !err;
+}
+
+bool LatticeCache::hash_file(const std::string& path, boost::uint64_t& size, boost::uint64_t& hash)
+{
+    std::ifstream strm(path.c_str(), std::ios::binary);
+    if(!strm.is_open())
+        return false;
+
+    FNV H;
+    size = 0;
+    std::vector<char> buf(64*1024);
+    while(strm) {
+        strm.read(&buf[0], buf.size());
+        H(&buf[0], strm.gcount());
+        size += strm.gcount();
+    }
+    if(strm.bad())
+        return false;
+    hash = H.h;
+    return true;
+}
+
+void LatticeCache::encode(std::string& out, boost::uint64_t key, const Config& conf,
+                          const depends_t& depends, const std::string& output, boost::int64_t stored)
+{
+    Writer W;
+    std::string root;
+    W.config(root, conf);
+
+    out.append(magic, sizeof(magic));
+    put(out, version);
+    put(out, order);
+    put(out, key);
+    put(out, stored);
+
+    put<boost::uint32_t>(out, depends.size());
+    for(size_t i=0; i<depends.size(); i++) {
+        put_string(out, depends[i].path);
+        put(out, depends[i].size);
+        put(out, depends[i].mtime);
+        put(out, depends[i].hash);
+    }
+
+    put_string(out, output);
+
+    put<boost::uint32_t>(out, W.key_list.size());
+    for(size_t i=0; i<W.key_list.size(); i++)
+        put_string(out, *W.key_list[i]);
+    put<boost::uint32_t>(out, W.string_list.size());
+    for(size_t i=0; i<W.string_list.size(); i++)
+        put_string(out, *W.string_list[i]);
+
+    out.resize((out.size()+7)&~size_t(7), '\0');
+
+    put<boost::uint32_t>(out, W.nframes);
+    put<boost::uint32_t>(out, 0);
+    out += W.frames;
+    out += root;
+}
+
+Config* LatticeCache::decode(const char *buf, size_t len, boost::uint64_t key,
+                             depends_t& depends, std::string& output, boost::int64_t& stored)
+{
+    Reader R(buf, len);
+
+    if(memcmp(R.take(sizeof(magic)), magic, sizeof(magic))!=0
+            || R.get<boost::uint32_t>()!=version
+            || R.get<boost::uint32_t>()!=order
+            || R.get<boost::uint64_t>()!=key)
+        throw std::runtime_error("Not a lattice cache entry for this key");
+    stored = R.get<boost::int64_t>();
+
+    depends.resize(R.get<boost::uint32_t>());
+    for(size_t i=0; i<depends.size(); i++) {
+        R.get_string(depends[i].path);
+        depends[i].size = R.get<boost::uint64_t>();
+        depends[i].mtime = R.get<boost::int64_t>();
+        depends[i].hash = R.get<boost::uint64_t>();
+    }
+
+    R.get_string(output);
+
+    boost::uint32_t N = R.get<boost::uint32_t>();
+    R.keys.reserve(N);
+    std::string temp;
+    for(boost::uint32_t i=0; i<N; i++) {
+        R.get_string(temp);
+        R.keys.push_back(ConfigKey(temp));
+    }
+    R.strings.resize(R.get<boost::uint32_t>());
+    for(size_t i=0; i<R.strings.size(); i++)
+        R.get_string(R.strings[i]);
+
+    R.take((8-(R.pos-buf)%8)%8);
+
+    N = R.get<boost::uint32_t>();
+    R.get<boost::uint32_t>();
+    R.frames.reserve(N);
+    for(boost::uint32_t i=0; i<N; i++) {
+        boost::uint32_t next = R.get<boost::uint32_t>();
+        R.get<boost::uint32_t>();
+        if(next>i)
+            throw std::runtime_error("Invalid frame in lattice cache entry");
+        Config::values_pointer V(new Config::values_t);
+        R.scope(*V);
+        R.frames.push_back(Config::frame_pointer(new Config::Frame(V, next ? R.frames[next-1] : Config::frame_pointer())));
+    }
+
+    std::auto_ptr<Config> ret(new Config);
+    R.config(*ret);
+    if(R.pos!=R.end)
+        throw std::runtime_error("Trailing bytes in lattice cache entry");
+    return ret.release();
+}
+
+Config* LatticeCache::load(boost::uint64_t key, std::vector<std::string>& depends, std::string& output) const
+{
+    using namespace boost::interprocess;
+    if(!enabled())
+        return NULL;
+    try {
+        const std::string fname(entry(key));
+        boost::system::error_code err;
+        if(!boost::filesystem::is_regular_file(fname, err))
+            return NULL;
+
+        file_mapping F(fname.c_str(), read_only);
+        mapped_region R(F, read_only);
+
+        depends_t D;
+        boost::int64_t stored;
+        std::auto_ptr<Config> ret(decode((const char*)R.get_address(), R.get_size(), key, D, output, stored));
+
+        for(size_t i=0; i<D.size(); i++) {
+            boost::uint64_t size, hash;
+            boost::int64_t mtime;
+            if(!stat_file(D[i].path, size, mtime) || size!=D[i].size)
+                return NULL; // stale
+            // a change within the second in which the entry was written might not change mtime
+            if(mtime==D[i].mtime && mtime<stored)
+                continue;
+            if(!hash_file(D[i].path, size, hash) || size!=D[i].size || hash!=D[i].hash)
+                return NULL; // stale
+        }
+
+        depends.resize(D.size());
+        for(size_t i=0; i<D.size(); i++)
+            depends[i] = D[i].path;
+
+        // mark as recently used, for prune()
+        boost::filesystem::last_write_time(fname, time(NULL), err);
+        return ret.release();
+    } catch(std::exception&) {
+        // missing, unreadable, or corrupt entries are ignored
+        return NULL;
+    }
+}
+
+bool LatticeCache::store(boost::uint64_t key, const Config& conf,
+                         const std::vector<std::string>& depends, const std::string& output) const
+{
+    namespace fs = boost::filesystem;
+    if(!enabled())
+        return false;
+
+    // before the files are hashed, so that later changes are not hidden by an equal mtime
+    const boost::int64_t stored = time(NULL);
+
+    depends_t D(depends.size());
+    for(size_t i=0; i<D.size(); i++) {
+        D[i].path = depends[i];
+        boost::uint64_t size;
+        if(!stat_file(D[i].path, size, D[i].mtime) || !hash_file(D[i].path, D[i].size, D[i].hash))
+            return false;
+    }
+
+    std::string buf;
+    encode(buf, key, conf, D, output, stored);
+
+    // write a temporary file and rename, so that readers never see a partial entry
+    // unique, as other threads or processes may store the same key
+    const std::string fname(entry(key));
+    boost::system::error_code err;
+    const fs::path tname(fs::unique_path(fname+".%%%%-%%%%-%%%%-%%%%.tmp", err));
+    if(err)
+        return false;
+
+    fs::create_directories(p_dir, err);
+    if(err)
+        return false;
+
+    {
+        std::ofstream strm(tname.native().c_str(), std::ios::binary|std::ios::trunc);
+        strm.write(buf.data(), buf.size());
+        strm.close();
+        if(!strm) {
+            fs::remove(tname, err);
+            return false;
+        }
+    }
+    fs::rename(tname, fname, err);
+    if(err) {
+        fs::remove(tname, err);
+        return false;
+    }
+    prune(fname);
+    return true;
+}
+
+namespace {
+struct cache_file {
+    time_t mtime;
+    boost::uint64_t size;
+    boost::filesystem::path path;
+    bool operator<(const cache_file& o) const { return mtime<o.mtime; }
+};
+}
+
+void LatticeCache::prune(const std::string& keep) const
+{
+    namespace fs = boost::filesystem;
+    boost::system::error_code err;
+
+    std::vector<cache_file> files;
+    boost::uint64_t total = 0;
+    for(fs::directory_iterator it(p_dir, err), end; !err && it!=end; it.increment(err)) {
+        cache_file F;
+        F.path = it->path();
+        if(F.path.extension()!=".flc")
+            continue;
+        F.size = fs::file_size(F.path, err);
+        if(err)
+            continue;
+        total += F.size;
+        if(F.path==keep)
+            continue; // just stored
+        F.mtime = fs::last_write_time(F.path, err);
+        if(!err)
+            files.push_back(F);
+    }
+    err.clear();
+
+    // least recently used first
+    std::sort(files.begin(), files.end());
+    for(size_t i=0; i<files.size() && total>p_max_bytes; i++) {
+        if(fs::remove(files[i].path, err))
+            total -= files[i].size;
+    }
+}
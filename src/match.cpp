@@ -0,0 +1,369 @@
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+#include <boost/numeric/ublas/matrix.hpp>
+#include <boost/numeric/ublas/lu.hpp>
+
+#include "flame/match.h"
+#include "flame/scan.h"
+#include "flame/moment.h"
+#include "flame/response.h"
+
+Matcher::Knob::Knob()
+    :index(0)
+    ,lower(-std::numeric_limits<double>::infinity())
+    ,upper(std::numeric_limits<double>::infinity())
+    ,step(1e-6)
+{}
+
+Matcher::Knob::Knob(size_t index, const std::string& name, double lower, double upper, double step)
+    :index(index), name(name), lower(lower), upper(upper), step(step)
+{}
+
+namespace {
+
+typedef boost::numeric::ublas::matrix<double> matrix_t;
+typedef std::vector<double> vector_t;
+
+// Residuals of the targets for sets of knob values
+struct Problem {
+    Machine& M;
+    const StateBase& ST;
+    const Matcher& X;
+    Scan S;
+    std::vector<size_t> tobs,   // observation number of each target
+                        tfield, // field number of each target
+                        tflat;  // offset within the field of each target
+    bool have_flat;
+
+    Problem(Machine& M, const StateBase& ST, const Matcher& X)
+        :M(M), ST(ST), X(X), have_flat(false)
+    {
+        const size_t nelem = M.size(), ntarg = X.targets.size();
+        if(X.knobs.empty() || ntarg==0)
+            throw std::invalid_argument("Matcher needs at least one knob and one target");
+        tobs.resize(ntarg);
+        tfield.resize(ntarg);
+
+        S.zip = true;
+        S.nthreads = X.nthreads;
+        for(size_t k=0; k<X.knobs.size(); k++) {
+            const Matcher::Knob& K = X.knobs[k];
+            if(K.index>=nelem)
+                throw std::invalid_argument(SB()<<"Knob element index out of range: "<<K.index);
+            if(!(K.lower<=K.upper))
+                throw std::invalid_argument(SB()<<"Knob "<<k<<" has empty bounds ["<<K.lower<<", "<<K.upper<<"]");
+            if(K.step==0e0)
+                throw std::invalid_argument(SB()<<"Knob "<<k<<" has zero step");
+            S.axes.push_back(Scan::Axis(K.index, K.name));
+        }
+
+        for(size_t t=0; t<ntarg; t++) {
+            const Matcher::Target& T = X.targets[t];
+            if(T.index>=nelem)
+                throw std::invalid_argument(SB()<<"Target element index out of range: "<<T.index);
+
+            std::vector<size_t>::iterator it = std::find(S.observe.begin(), S.observe.end(), T.index);
+            tobs[t] = it-S.observe.begin();
+            if(it==S.observe.end())
+                S.observe.push_back(T.index);
+
+            std::vector<std::string>::iterator fit = std::find(S.fields.begin(), S.fields.end(), T.field);
+            tfield[t] = fit-S.fields.begin();
+            if(fit==S.fields.end())
+                S.fields.push_back(T.field);
+        }
+    }
+
+    // Offset of each target within its field, once field shapes are known
+    void map_targets()
+    {
+        if(have_flat)
+            return;
+        tflat.resize(X.targets.size());
+        for(size_t t=0; t<X.targets.size(); t++) {
+            const Matcher::Target& T = X.targets[t];
+            const std::vector<size_t>& shape = S.shapes[tfield[t]];
+            if(T.at.size()!=shape.size())
+                throw std::invalid_argument(SB()<<"Target "<<t<<" has "<<T.at.size()<<" indices for field '"
+                                            <<T.field<<"' of rank "<<shape.size());
+            size_t flat = 0;
+            for(size_t d=0; d<shape.size(); d++) {
+                if(T.at[d]>=shape[d])
+                    throw std::invalid_argument(SB()<<"Target "<<t<<" index "<<T.at[d]<<" out of range for field '"
+                                                <<T.field<<"'");
+                flat = flat*shape[d] + T.at[d];
+            }
+            tflat[t] = flat;
+        }
+        have_flat = true;
+    }
+
+    // Residuals at each of 'points' (knob values).  NaN where the beam did not reach a target.
+    void evaluate(const std::vector<vector_t>& points, std::vector<vector_t>& R)
+    {
+        const size_t npts = points.size(), nknob = X.knobs.size(), nobs = S.observe.size();
+        for(size_t k=0; k<nknob; k++) {
+            S.axes[k].values.resize(npts);
+            for(size_t p=0; p<npts; p++)
+                S.axes[k].values[p] = points[p][k];
+        }
+        S.compute(M, ST);
+        map_targets();
+
+        R.resize(npts);
+        for(size_t p=0; p<npts; p++) {
+            R[p].resize(X.targets.size());
+            for(size_t t=0; t<X.targets.size(); t++) {
+                const Matcher::Target& T = X.targets[t];
+                const size_t f = tfield[t];
+                size_t count = 1;
+                for(size_t d=0; d<S.shapes[f].size(); d++)
+                    count *= S.shapes[f][d];
+                const double val = S.results[f][(p*nobs+tobs[t])*count + tflat[t]];
+                R[p][t] = T.weight*(val-T.value);
+            }
+        }
+    }
+
+    void set(const vector_t& x)
+    {
+        std::vector<Machine::ParamUpdate> U;
+        for(size_t k=0; k<x.size(); k++)
+            U.push_back(Machine::ParamUpdate(X.knobs[k].index, X.knobs[k].name, x[k]));
+        M.setParams(U);
+    }
+
+    // Can targets be differentiated by MomentGradient?
+    bool analytic_targets() const
+    {
+        if(!dynamic_cast<const MomentState*>(&ST))
+            return false;
+        for(size_t f=0; f<S.fields.size(); f++) {
+            if(S.fields[f]!="moment0_env" && S.fields[f]!="moment1_env")
+                return false;
+        }
+        return true;
+    }
+
+    // Jacobian with MomentGradient.  One propagation for each target element.
+    void jacobian_analytic(const vector_t& x, matrix_t& J)
+    {
+        const size_t nknob = X.knobs.size();
+        J.resize(X.targets.size(), nknob, false);
+        J.clear();
+        set(x);
+
+        for(size_t o=0; o<S.observe.size(); o++) {
+            const size_t elem = S.observe[o];
+
+            MomentGradient G;
+            std::vector<size_t> col;
+            for(size_t k=0; k<nknob; k++) {
+                if(X.knobs[k].index>elem)
+                    continue; // downstream, no effect
+                G.params.push_back(MomentGradient::Param(X.knobs[k].index, X.knobs[k].name));
+                col.push_back(k);
+            }
+            if(col.empty())
+                continue;
+
+            std::auto_ptr<StateBase> S0(ST.clone());
+            G.compute(M, static_cast<MomentState&>(*S0), 0, elem+1);
+
+            for(size_t t=0; t<X.targets.size(); t++) {
+                if(tobs[t]!=o)
+                    continue;
+                const Matcher::Target& T = X.targets[t];
+                const bool env0 = S.fields[tfield[t]]=="moment0_env";
+                for(size_t j=0; j<col.size(); j++) {
+                    double d;
+                    if(env0)
+                        d = G.dmoment0_env[j][tflat[t]];
+                    else
+                        d = G.dmoment1_env[j](tflat[t]/MomentState::maxsize, tflat[t]%MomentState::maxsize);
+                    J(t, col[j]) = T.weight*d;
+                }
+            }
+        }
+    }
+
+    // Jacobian by forward differences, stepping backward at an upper bound.  One scan point for each knob.
+    void jacobian_fd(const vector_t& x, const vector_t& r, matrix_t& J)
+    {
+        const size_t nknob = X.knobs.size();
+        std::vector<vector_t> points(nknob, x);
+        vector_t h(nknob);
+        for(size_t k=0; k<nknob; k++) {
+            const Matcher::Knob& K = X.knobs[k];
+            h[k] = std::fabs(K.step);
+            if(x[k]+h[k]>K.upper)
+                h[k] = -h[k];
+            points[k][k] += h[k];
+        }
+
+        std::vector<vector_t> R;
+        evaluate(points, R);
+
+        J.resize(X.targets.size(), nknob, false);
+        for(size_t k=0; k<nknob; k++) {
+            for(size_t t=0; t<X.targets.size(); t++) {
+                J(t, k) = (R[k][t]-r[t])/h[k];
+                if(!std::isfinite(J(t, k)))
+                    throw std::runtime_error(SB()<<"Beam lost at target "<<t<<" when knob "<<k<<" changed");
+            }
+        }
+    }
+};
+
+// half the sum of squares.  inf if any residual is not finite
+double cost_of(const vector_t& r)
+{
+    double C = 0e0;
+    for(size_t i=0; i<r.size(); i++)
+        C += r[i]*r[i];
+    return std::isfinite(C) ? C/2e0 : std::numeric_limits<double>::infinity();
+}
+
+// Solve A*d = b in place of b.  false if singular
+bool solve(matrix_t A, vector_t& b)
+{
+    using namespace boost::numeric::ublas;
+    permutation_matrix<size_t> pm(A.size1());
+    if(lu_factorize(A, pm)!=0)
+        return false;
+    vector<double> B(b.size());
+    std::copy(b.begin(), b.end(), B.begin());
+    lu_substitute(A, pm, B);
+    std::copy(B.begin(), B.end(), b.begin());
+    for(size_t i=0; i<b.size(); i++) {
+        if(!std::isfinite(b[i]))
+            return false;
+    }
+    return true;
+}
+
+} // namespace
+
+void Matcher::compute(Machine& M, const StateBase& ST)
+{
+    const size_t nknob = knobs.size(), ntarg = targets.size();
+
+    Problem P(M, ST, *this);
+
+    x.resize(nknob);
+    for(size_t k=0; k<nknob; k++)
+        x[k] = std::max(knobs[k].lower, std::min(knobs[k].upper, M.getParam(knobs[k].index, knobs[k].name)));
+
+    iterations = 0;
+    converged = false;
+    stalled = false;
+    analytic = jacobian!=FiniteDifference && P.analytic_targets();
+    if(jacobian==Analytic && !analytic)
+        throw std::invalid_argument("Analytic Jacobian needs a MomentState, and targets of moment0_env or moment1_env");
+
+    {
+        std::vector<vector_t> R;
+        P.evaluate(std::vector<vector_t>(1, x), R);
+        residual = R[0];
+    }
+    cost = cost_of(residual);
+    if(!std::isfinite(cost))
+        throw std::runtime_error("Beam lost before a target with the initial knob values");
+
+    double lambda = 1e-3;
+    matrix_t J, A(nknob, nknob);
+    vector_t g(nknob), d(nknob), xn(nknob);
+
+    while(cost>0e0 && iterations<maxiter) {
+        if(analytic) {
+            try {
+                P.jacobian_analytic(x, J);
+            } catch(std::invalid_argument&) {
+                if(jacobian==Analytic)
+                    throw;
+                analytic = false; // eg. a knob or element which can't be differentiated
+            }
+        }
+        if(!analytic)
+            P.jacobian_fd(x, residual, J);
+        iterations++;
+
+        // normal equations.  A = J^T J,  g = J^T r
+        for(size_t i=0; i<nknob; i++) {
+            g[i] = 0e0;
+            for(size_t t=0; t<ntarg; t++)
+                g[i] += J(t, i)*residual[t];
+            for(size_t j=0; j<nknob; j++) {
+                double s = 0e0;
+                for(size_t t=0; t<ntarg; t++)
+                    s += J(t, i)*J(t, j);
+                A(i, j) = s;
+            }
+        }
+
+        // knobs held at a bound by the gradient are fixed for this iteration
+        std::vector<bool> fixed(nknob);
+        for(size_t k=0; k<nknob; k++)
+            fixed[k] = (x[k]<=knobs[k].lower && g[k]>0e0) || (x[k]>=knobs[k].upper && g[k]<0e0) || A(k,k)==0e0;
+
+        bool accepted = false;
+        while(lambda<1e16) {
+            matrix_t B(A);
+            for(size_t k=0; k<nknob; k++) {
+                d[k] = -g[k];
+                if(fixed[k]) {
+                    for(size_t j=0; j<nknob; j++)
+                        B(k, j) = B(j, k) = 0e0;
+                    B(k, k) = 1e0;
+                    d[k] = 0e0;
+                } else {
+                    B(k, k) += lambda*A(k, k);
+                }
+            }
+            if(!solve(B, d)) {
+                lambda *= 10e0;
+                continue;
+            }
+
+            double dx = 0e0, xx = 0e0;
+            for(size_t k=0; k<nknob; k++) {
+                xn[k] = std::max(knobs[k].lower, std::min(knobs[k].upper, x[k]+d[k]));
+                dx += (xn[k]-x[k])*(xn[k]-x[k]);
+                xx += x[k]*x[k];
+            }
+            if(dx==0e0)
+                break; // can't move
+
+            std::vector<vector_t> R;
+            P.evaluate(std::vector<vector_t>(1, xn), R);
+            const double cn = cost_of(R[0]);
+
+            if(cn<cost) {
+                const double decrease = (cost-cn)/cost;
+                x = xn;
+                residual = R[0];
+                cost = cn;
+                lambda = std::max(lambda/10e0, 1e-12);
+                accepted = true;
+                converged = decrease<tol || std::sqrt(dx)<tol*(std::sqrt(xx)+tol);
+                break;
+            }
+            lambda *= 10e0;
+        }
+
+        if(!accepted) {
+            stalled = true; // no step reduces the cost
+            break;
+        }
+        if(converged)
+            break;
+    }
+    if(cost==0e0) {
+        converged = true;
+        stalled = false;
+    }
+
+    P.set(x);
+}
@@ -1,9 +1,13 @@
 
 #include <fstream>
+#include <cmath>
+#include <string.h>
 
 #include <limits>
 
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include <boost/numeric/ublas/vector_proxy.hpp>
 #include <boost/numeric/ublas/matrix_proxy.hpp>
@@ -22,6 +26,39 @@ namespace ub = boost::numeric::ublas;
 
 namespace {
 
+// For templated transfer matrix calculations.  true if the parameter 'name' is to be seeded (see dual_param())
+inline bool is_active(const char *active, const char *name)
+{
+    return active && strcmp(active, name)==0;
+}
+
+// MomentElementBase::transfer_derivative() for elements with a method
+//   template<typename T> void transfer_t(const Particle& ref, const Particle& real, const char *active,
+//                                        typename moment_matrix<T>::type& M,
+//                                        typename moment_matrix<T>::type& misalign,
+//                                        typename moment_matrix<T>::type& misalign_inv) const;
+template<typename E>
+void dual_transfer(const E& elem, const std::string& name, std::vector<MomentElementBase::value_t>& dT)
+{
+    moment_matrix<Dual>::type M, mis, mis_inv;
+
+    dT.resize(elem.last_real_in.size());
+    for(size_t i=0; i<elem.last_real_in.size(); i++) {
+        elem.template transfer_t<Dual>(elem.last_ref_in, elem.last_real_in[i], name.c_str(), M, mis, mis_inv);
+        dual_deriv(M, dT[i]);
+    }
+}
+
+// M = misalign_inv . M . misalign
+template<typename T>
+void apply_misalign(typename moment_matrix<T>::type& M,
+                    const typename moment_matrix<T>::type& misalign,
+                    const typename moment_matrix<T>::type& misalign_inv)
+{
+    const typename moment_matrix<T>::type scratch(prod(M, misalign));
+    noalias(M) = prod(misalign_inv, scratch);
+}
+
 // ARR should be an array-like object (std::vector or or ublas vector or matrix storage)
 // fill 'to' using config.get<>(name)
 // 'T' selects throw error (true) or return boolean (false)
@@ -193,6 +230,9 @@ MomentState::MomentState(const Config& c)
     }
 
     last_caviphi0 = 0e0;
+    aper_nsigma = c.get<double>("aper_nsigma", 0e0);
+    lost = 0;
+    lost_elem = 0;
     calc_rms();
 }
 
@@ -243,6 +283,9 @@ MomentState::MomentState(const MomentState& o, clone_tag t)
     ,moment0_rms(o.moment0_rms)
     ,moment1_env(o.moment1_env)
     ,last_caviphi0(o.last_caviphi0)
+    ,aper_nsigma(o.aper_nsigma)
+    ,lost(o.lost)
+    ,lost_elem(o.lost_elem)
 {}
 
 void MomentState::assign(const StateBase& other)
@@ -259,6 +302,9 @@ void MomentState::assign(const StateBase& other)
     moment0_rms = O->moment0_rms;
     moment1_env = O->moment1_env;
     last_caviphi0 = O->last_caviphi0;
+    aper_nsigma = O->aper_nsigma;
+    lost = O->lost;
+    lost_elem = O->lost_elem;
     StateBase::assign(other);
 }
 
@@ -542,20 +588,65 @@ bool MomentState::getArray(unsigned idx, ArrayInfo& Info) {
         Info.ndim = 0;
         // driven phase [degree]
         return true;
+    } else if(idx==I++) {
+        Info.name = "aper_nsigma";
+        Info.ptr = &aper_nsigma;
+        Info.type = ArrayInfo::Double;
+        Info.ndim = 0;
+        return true;
+    } else if(idx==I++) {
+        Info.name = "lost";
+        Info.ptr = &lost;
+        Info.type = ArrayInfo::Sizet;
+        Info.ndim = 0;
+        return true;
+    } else if(idx==I++) {
+        Info.name = "lost_elem";
+        Info.ptr = &lost_elem;
+        Info.type = ArrayInfo::Sizet;
+        Info.ndim = 0;
+        return true;
     }
     return StateBase::getArray(idx-I, Info);
 }
 
+namespace {
+// parameters bound by elements
+const ConfigKey key_dx("dx"), key_dy("dy"), key_pitch("pitch"), key_yaw("yaw"), key_roll("roll"), key_skipcache("skipcache"),
+                key_aper("aper"), key_L("L"), key_theta_x("theta_x"), key_theta_y("theta_y"), key_tm_xkick("tm_xkick"), key_tm_ykick("tm_ykick"),
+                key_xyrotate("xyrotate"), key_realpara("realpara"), key_phi("phi"), key_phi1("phi1"), key_phi2("phi2"), key_K("K"),
+                key_HdipoleFitMode("HdipoleFitMode"), key_bg("bg"), key_ncurve("ncurve"), key_B2("B2"), key_B3("B3"), key_step("step"),
+                key_step_tol("step_tol"), key_step_max("step_max"), key_thinlens("thinlens"), key_dstkick("dstkick"), key_B("B"), key_ver("ver"),
+                key_fringe_x("fringe_x"), key_fringe_y("fringe_y"), key_asym_fac("asym_fac"), key_spher("spher"), key_beta("beta"), key_V("V"),
+                key_radius("radius");
+}
+
 MomentElementBase::MomentElementBase(const Config& c)
     :ElementVoid(c)
-    ,dx   (c.get<double>("dx",    0e0)*MtoMM)
-    ,dy   (c.get<double>("dy",    0e0)*MtoMM)
-    ,pitch(c.get<double>("pitch", 0e0))
-    ,yaw  (c.get<double>("yaw",   0e0))
-    ,roll (c.get<double>("roll",  0e0))
-    ,skipcache(c.get<double>("skipcache", 0.0)!=0.0)
+    ,dx(0e0), dy(0e0), pitch(0e0), yaw(0e0), roll(0e0)
+    ,skipcache(false)
+    ,cache_misses(0)
+    ,aper(0e0)
     ,scratch(state_t::maxsize, state_t::maxsize)
 {
+    ParamBinder P(c);
+    MomentElementBase::bind(P);
+}
+
+void MomentElementBase::bind(ParamBinder& P)
+{
+    ElementVoid::bind(P);
+    P(key_dx,    dx,    0e0);
+    P(key_dy,    dy,    0e0);
+    P(key_pitch, pitch, 0e0);
+    P(key_yaw,   yaw,   0e0);
+    P(key_roll,  roll,  0e0);
+
+    double skip = skipcache ? 1.0 : 0.0;
+    P(key_skipcache, skip, 0.0);
+    skipcache = skip!=0.0;
+
+    P(key_aper,  aper,  0e0);
 }
 
 MomentElementBase::~MomentElementBase() {}
@@ -576,6 +667,7 @@ void MomentElementBase::assign(const ElementVoid *other)
     yaw   = O->yaw;
     roll  = O->roll;
     skipcache = O->skipcache;
+    aper  = O->aper;
     ElementVoid::assign(other);
 }
 
@@ -592,26 +684,42 @@ void MomentElementBase::show(std::ostream& strm, int level) const
 
 void MomentElementBase::get_misalign(const state_t &ST, const Particle &real, value_t &M, value_t &IM) const
 {
-    state_t::matrix_t R,
-              scl     = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize),
-              scl_inv = scl,
-              T       = scl,
-              T_inv   = scl,
-              R_inv   = scl;
+    get_misalign_t<double>(ST.ref, real, NULL, M, IM);
+}
+
+template<typename T>
+void MomentElementBase::get_misalign_t(const Particle& ref, const Particle &real, const char *active,
+                                       typename moment_matrix<T>::type &M, typename moment_matrix<T>::type &IM) const
+{
+    typedef typename moment_matrix<T>::type matrix_t;
+
+    const T length = dual_param<T>(this->length, is_active(active, "L")),
+            dx     = dual_param<T>(this->dx,     is_active(active, "dx")),
+            dy     = dual_param<T>(this->dy,     is_active(active, "dy")),
+            pitch  = dual_param<T>(this->pitch,  is_active(active, "pitch")),
+            yaw    = dual_param<T>(this->yaw,    is_active(active, "yaw")),
+            roll   = dual_param<T>(this->roll,   is_active(active, "roll"));
+
+    matrix_t R,
+             scl     = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize),
+             scl_inv = scl,
+             T_      = scl,
+             T_inv   = scl,
+             R_inv   = scl;
 
     scl(state_t::PS_S, state_t::PS_S)   /= -real.SampleIonK;
-    scl(state_t::PS_PS, state_t::PS_PS) /= sqr(real.beta)*real.gamma*ST.ref.IonEs/MeVtoeV;
+    scl(state_t::PS_PS, state_t::PS_PS) /= sqr(real.beta)*real.gamma*ref.IonEs/MeVtoeV;
 
     inverse(scl_inv, scl);
 
     // Translate to center of element.
-    T(state_t::PS_S,  6) = -length/2e0*MtoMM;
-    T(state_t::PS_PS, 6) = 1e0;
-    inverse(T_inv, T);
+    T_(state_t::PS_S,  6) = -length/2e0*MtoMM;
+    T_(state_t::PS_PS, 6) = 1e0;
+    inverse(T_inv, T_);
 
-    RotMat(dx, dy, pitch, yaw, roll, R);
+    RotMat(dx*MtoMM, dy*MtoMM, pitch, yaw, roll, R);
 
-    M = prod(T, scl);
+    M = prod(T_, scl);
     M = prod(R, M);
     M = prod(T_inv, M);
     M = prod(scl_inv, M);
@@ -619,39 +727,61 @@ void MomentElementBase::get_misalign(const state_t &ST, const Particle &real, va
     inverse(R_inv, R);
 
     // Translate to center of element.
-    T(state_t::PS_S,  6) = length/2e0*MtoMM;
-    T(state_t::PS_PS, 6) = 1e0;
-    inverse(T_inv, T);
+    T_(state_t::PS_S,  6) = length/2e0*MtoMM;
+    T_(state_t::PS_PS, 6) = 1e0;
+    inverse(T_inv, T_);
 
-    IM = prod(T, scl);
+    IM = prod(T_, scl);
     IM = prod(R_inv, IM);
     IM = prod(T_inv, IM);
     IM = prod(scl_inv, IM);
 }
 
-unsigned MomentElementBase::get_flag(const Config& c, const std::string& name, const unsigned& def_value)
+bool MomentElementBase::is_misalign_param(const std::string& name)
 {
-    unsigned read_value;
-    double check_value;
+    return name=="dx" || name=="dy" || name=="pitch" || name=="yaw" || name=="roll";
+}
 
-    try {
-        check_value = boost::lexical_cast<double>(c.get<std::string>(name));
-    }catch (std::exception&){
-        try {
-            check_value = c.get<double>(name);
-        }catch (std::exception&){
-            check_value = boost::lexical_cast<double>(def_value);
+bool MomentElementBase::transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+{
+    return false;
+}
+
+bool MomentElementBase::check_loss(StateBase& s) const
+{
+    state_t& ST = static_cast<state_t&>(s);
+
+    if(aper<=0e0 || ST.aper_nsigma<=0e0)
+        return false;
+
+    const double A = aper*MtoMM;
+    const unsigned planes[2] = {state_t::PS_X, state_t::PS_Y};
+
+    for(unsigned i=0; i<2; i++) {
+        const unsigned j = planes[i];
+        // also catches NaN
+        if(!(fabs(ST.moment0_env[j]) + ST.aper_nsigma*ST.moment0_rms[j] <= A)) {
+            ST.lost = 1;
+            ST.lost_elem = index;
+            return true;
         }
     }
+    return false;
+}
 
-    //Check the value is an unsigned integer
-    try {
-        read_value = boost::lexical_cast<unsigned>(check_value);
-        if (boost::lexical_cast<double>(read_value) != check_value)
-            throw std::runtime_error(SB()<< name << " must be an unsigned integer");
-    }catch (std::exception&){
-        throw  std::runtime_error(SB()<< name << " must be an unsigned integer");
-    }
+void MomentElementBase::invalidate()
+{
+    last_real_in.clear();
+    last_real_out.clear();
+    last_ref_in  = Particle();
+    last_ref_out = Particle();
+}
+
+unsigned MomentElementBase::get_flag(const Config& c, const std::string& name, const unsigned& def_value)
+{
+    unsigned read_value;
+    ParamBinder P(c);
+    P.flag(name, read_value, def_value);
     return read_value;
 }
 
@@ -665,26 +795,8 @@ void MomentElementBase::advance(StateBase& s)
 
     if(!check_cache(ST)){
         // need to re-calculate energy dependent terms
-        last_ref_in = ST.ref;
-        last_real_in = ST.real;
-        resize_cache(ST);
-
-        recompute_matrix(ST); // updates transfer and last_Kenergy_out
-
-        ST.recalc();
-
-        if(!ST.retreat){
-            ST.ref.phis += ST.ref.SampleIonK*length*MtoMM;
-            for(size_t k=0; k<last_real_in.size(); k++)
-                ST.real[k].phis += ST.real[k].SampleIonK*length*MtoMM;
-        } else {
-            ST.ref.phis -= ST.ref.SampleIonK*length*MtoMM;
-            for(size_t k=0; k<last_real_in.size(); k++)
-                ST.real[k].phis -= ST.real[k].SampleIonK*length*MtoMM;
-        }
-
-        last_ref_out = ST.ref;
-        last_real_out = ST.real;
+        cache_misses++;
+        update_cache(ST);
     } else {
         ST.ref = last_ref_out;
         assert(last_real_out.size()==ST.real.size()); // should be true if check_cache() -> true
@@ -725,6 +837,53 @@ void MomentElementBase::advance(StateBase& s)
     ST.calc_rms();
 }
 
+void MomentElementBase::update_cache(state_t& ST)
+{
+    last_ref_in = ST.ref;
+    last_real_in = ST.real;
+    resize_cache(ST);
+
+    recompute_matrix(ST); // updates transfer and last_Kenergy_out
+
+    ST.recalc();
+
+    if(!ST.retreat){
+        ST.ref.phis += ST.ref.SampleIonK*length*MtoMM;
+        for(size_t k=0; k<last_real_in.size(); k++)
+            ST.real[k].phis += ST.real[k].SampleIonK*length*MtoMM;
+    } else {
+        ST.ref.phis -= ST.ref.SampleIonK*length*MtoMM;
+        for(size_t k=0; k<last_real_in.size(); k++)
+            ST.real[k].phis -= ST.real[k].SampleIonK*length*MtoMM;
+    }
+
+    last_ref_out = ST.ref;
+    last_real_out = ST.real;
+}
+
+void MomentElementBase::batch_begin(const ParticleSet& in)
+{
+    last_ref_in = in.ref;
+    last_real_in = in.real;
+
+    transfer.resize(in.real.size(), boost::numeric::ublas::identity_matrix<double>(state_t::maxsize));
+    misalign.resize(in.real.size(), boost::numeric::ublas::identity_matrix<double>(state_t::maxsize));
+    misalign_inv.resize(in.real.size(), boost::numeric::ublas::identity_matrix<double>(state_t::maxsize));
+}
+
+void MomentElementBase::batch_end()
+{
+    last_ref_out = last_ref_in;
+    last_real_out = last_real_in;
+
+    last_ref_out.recalc();
+    last_ref_out.phis += last_ref_out.SampleIonK*length*MtoMM;
+    for(size_t k=0; k<last_real_out.size(); k++) {
+        last_real_out[k].recalc();
+        last_real_out[k].phis += last_real_out[k].SampleIonK*length*MtoMM;
+    }
+}
+
 bool MomentElementBase::check_cache(const state_t& ST) const
 {
     return !skipcache
@@ -766,6 +925,469 @@ void MomentElementBase::recompute_matrix(state_t& ST)
     }
 }
 
+bool MomentElementBase::advance_long(Particle& ref, std::vector<Particle>& real)
+{
+    ref.recalc();
+    ref.phis += ref.SampleIonK*length*MtoMM;
+    for(size_t k=0; k<real.size(); k++) {
+        real[k].recalc();
+        real[k].phis += real[k].SampleIonK*length*MtoMM;
+    }
+    // advance() of a LinearPhase element also adds the change of moment0[PS_S]
+    return linearity()!=LinearPhase;
+}
+
+bool propagate_long(Machine& M, MomentState& ST, size_t start, size_t max,
+                    std::vector<ParticleSet>* inputs, bool stop_inexact)
+{
+    const size_t nelem = M.size();
+    bool exact = true;
+
+    if(inputs)
+        inputs->clear();
+
+    ST.next_elem = start;
+    ST.retreat = false;
+
+    for(size_t i=0; ST.next_elem<nelem && i<max && (exact || !stop_inexact); i++)
+    {
+        MomentElementBase* E = dynamic_cast<MomentElementBase*>(M[ST.next_elem]);
+        if(!E)
+            throw std::invalid_argument(SB()<<"Element "<<ST.next_elem<<" is not a MomentMatrix element");
+        ST.next_elem++;
+
+        if(inputs) {
+            inputs->push_back(ParticleSet());
+            inputs->back().ref  = ST.ref;
+            inputs->back().real = ST.real;
+        }
+
+        exact &= E->advance_long(ST.ref, ST.real);
+    }
+
+    return exact;
+}
+
+namespace {
+
+// Elements per batch_update_t call
+const size_t warmup_batch = 32;
+
+// A run of elems[] and inputs[] to be updated together
+struct WarmupTask {
+    batch_update_t batch; // NULL for a single element, updated with update_cache()
+    size_t first, count;
+};
+
+// Shared by all warmup() worker threads
+struct WarmupQueue {
+    // grouped by batch_update()
+    std::vector<MomentElementBase*> elems;
+    std::vector<const ParticleSet*> inputs;
+    std::vector<WarmupTask> tasks;
+    const MomentState *proto;
+
+    boost::mutex lock;
+    size_t next;      // guarded by lock
+    std::string error; // guarded by lock. First error seen
+};
+
+struct WarmupWorker {
+    WarmupQueue *Q;
+
+    void operator()() const
+    {
+        std::auto_ptr<MomentState> ST(Q->proto->clone());
+        ST->retreat = false;
+
+        while(true) {
+            size_t i;
+            {
+                boost::mutex::scoped_lock L(Q->lock);
+                if(Q->next>=Q->tasks.size() || !Q->error.empty())
+                    return;
+                i = Q->next++;
+            }
+            const WarmupTask& T = Q->tasks[i];
+            try {
+                if(T.batch) {
+                    (*T.batch)(&Q->elems[T.first], &Q->inputs[T.first], T.count, *ST);
+                    ST->retreat = false;
+                } else {
+                    ST->ref  = Q->inputs[T.first]->ref;
+                    ST->real = Q->inputs[T.first]->real;
+                    Q->elems[T.first]->update_cache(*ST);
+                }
+            } catch(std::exception& e) {
+                boost::mutex::scoped_lock L(Q->lock);
+                if(Q->error.empty())
+                    Q->error = SB()<<"Element "<<Q->elems[T.first]->index<<" : "<<e.what();
+            }
+        }
+    }
+};
+
+// Update the caches of elements [first, first+inputs.size()) given their input particles
+void warmup_run(Machine& M, const MomentState& ST, size_t first, const std::vector<ParticleSet>& inputs)
+{
+    WarmupQueue Q;
+    Q.proto = &ST;
+    Q.next = 0;
+
+    // group elements of the same type so that each may be updated in batches
+    typedef std::map<batch_update_t, std::vector<size_t> > groups_t;
+    groups_t groups;
+
+    Q.elems.reserve(inputs.size());
+    Q.inputs.reserve(inputs.size());
+    for(size_t i=0; i<inputs.size(); i++) {
+        MomentElementBase *E = static_cast<MomentElementBase*>(M[first+i]); // propagate_long() checked type
+        batch_update_t batch = E->batch_update();
+        if(batch) {
+            groups[batch].push_back(i);
+        } else {
+            WarmupTask T = {NULL, Q.elems.size(), 1};
+            Q.tasks.push_back(T);
+            Q.elems.push_back(E);
+            Q.inputs.push_back(&inputs[i]);
+        }
+    }
+
+    for(groups_t::const_iterator it=groups.begin(), end=groups.end(); it!=end; ++it) {
+        const std::vector<size_t>& G = it->second;
+        for(size_t i=0; i<G.size(); i+=warmup_batch) {
+            WarmupTask T = {it->first, Q.elems.size(), std::min(warmup_batch, G.size()-i)};
+            Q.tasks.push_back(T);
+            for(size_t j=i; j<i+T.count; j++) {
+                Q.elems.push_back(static_cast<MomentElementBase*>(M[first+G[j]]));
+                Q.inputs.push_back(&inputs[G[j]]);
+            }
+        }
+    }
+
+    size_t nthreads = std::max(1u, boost::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, Q.tasks.size());
+
+    WarmupWorker W;
+    W.Q = &Q;
+
+    if(nthreads<=1) {
+        // eg. a short run between bends.  Not worth a thread.
+        W();
+
+    } else {
+        boost::thread_group workers;
+        try {
+            for(size_t t=0; t<nthreads; t++)
+                workers.create_thread(W);
+        } catch(...) {
+            {
+                boost::mutex::scoped_lock L(Q.lock);
+                Q.next = Q.tasks.size();
+            }
+            workers.join_all();
+            throw;
+        }
+        workers.join_all();
+    }
+
+    if(!Q.error.empty())
+        throw std::runtime_error(Q.error);
+}
+
+} // namespace
+
+void warmup(Machine& M, const MomentState& ST, size_t start, size_t max)
+{
+    const size_t nelem = M.size();
+    std::auto_ptr<MomentState> temp(ST.clone());
+    std::vector<ParticleSet> inputs;
+
+    for(size_t first=start, remaining=max; first<nelem && remaining>0; ) {
+        propagate_long(M, *temp, first, remaining, &inputs, true);
+        if(inputs.empty())
+            break;
+
+        warmup_run(M, ST, first, inputs);
+
+        // Pass the full state through the run to find the exact input of the next.
+        // All but the caches which depend on the moments are hit.  Not counted as misses.
+        temp->ref  = inputs[0].ref;
+        temp->real = inputs[0].real;
+        for(size_t i=0; i<inputs.size(); i++) {
+            MomentElementBase *E = static_cast<MomentElementBase*>(M[first+i]);
+            temp->next_elem = first+i+1;
+
+            const size_t misses = E->cache_misses;
+            E->advance(*temp);
+            E->cache_misses = misses;
+
+            if(E->check_loss(*temp))
+                return; // propagate() stops here
+        }
+
+        first     += inputs.size();
+        remaining -= inputs.size();
+    }
+}
+
+namespace {
+
+// One-turn map of a charge state.  moment0 extended with real[].phis as the 8th element.
+typedef boost::numeric::ublas::matrix<double> turnmap_t;
+
+struct TurnMap {
+    std::vector<turnmap_t> A;  // per charge state
+    std::vector<double> dphis; // per charge state, constant part of real[].phis advance
+    double dref, dpos;         // advance of ref.phis and pos
+};
+
+// Pass ST once through elements [start, end), calling Observers if 'observe'.
+// If maps!=NULL, also accumulate the one-turn map of each charge state.
+// Returns false if the beam was lost.
+bool track_turn(Machine& M, MomentState& ST, size_t start, size_t end, bool observe,
+                std::vector<turnmap_t>* maps)
+{
+    using namespace boost::numeric::ublas;
+
+    ST.next_elem = start;
+    ST.retreat = false;
+
+    turnmap_t T(MomentState::maxsize+1, MomentState::maxsize+1), temp(T.size1(), T.size2());
+
+    while(ST.next_elem<end)
+    {
+        MomentElementBase* E = static_cast<MomentElementBase*>(M[ST.next_elem]); // caller checked type
+        ST.next_elem++;
+
+        E->advance(ST);
+
+        if(observe && E->observer())
+            E->observer()->view(E, &ST);
+
+        if(E->check_loss(ST))
+            return false;
+
+        if(maps) {
+            assert(maps->size()==ST.size()); // Linear elements don't change the charge states
+            const bool phase = E->linearity()==MomentElementBase::LinearPhase;
+
+            for(size_t k=0; k<ST.size(); k++) {
+                T = identity_matrix<double>(MomentState::maxsize+1);
+                project(T, range(0, MomentState::maxsize), range(0, MomentState::maxsize)) = ST.transmat[k];
+                if(phase) {
+                    // real[].phis += moment0[PS_S] (out) - moment0[PS_S] (in)
+                    for(size_t j=0; j<MomentState::maxsize; j++)
+                        T(MomentState::maxsize, j) = ST.transmat[k](MomentState::PS_S, j);
+                    T(MomentState::maxsize, MomentState::PS_S) -= 1e0;
+                }
+                noalias(temp) = prod(T, (*maps)[k]);
+                (*maps)[k].swap(temp);
+            }
+        }
+    }
+    return true;
+}
+
+// A^n by repeated squaring
+turnmap_t map_power(const turnmap_t& A, size_t n)
+{
+    turnmap_t R(boost::numeric::ublas::identity_matrix<double>(A.size1())), B(A), temp(A.size1(), A.size2());
+
+    while(n) {
+        if(n&1) {
+            noalias(temp) = prod(B, R);
+            R.swap(temp);
+        }
+        n >>= 1;
+        if(n) {
+            noalias(temp) = prod(B, B);
+            B.swap(temp);
+        }
+    }
+    return R;
+}
+
+// Advance ST by n turns using the one-turn map
+void apply_turns(MomentState& ST, const TurnMap& map, size_t n)
+{
+    using namespace boost::numeric::ublas;
+
+    for(size_t k=0; k<ST.size(); k++) {
+        const turnmap_t P(map_power(map.A[k], n));
+        const MomentState::matrix_t T(project(P, range(0, MomentState::maxsize), range(0, MomentState::maxsize)));
+
+        double dphis = 0e0;
+        for(size_t j=0; j<MomentState::maxsize; j++)
+            dphis += P(MomentState::maxsize, j)*ST.moment0[k][j];
+        ST.real[k].phis += n*map.dphis[k] + dphis;
+
+        ST.moment0[k] = prod(T, ST.moment0[k]);
+
+        MomentState::matrix_t scratch(prod(T, ST.moment1[k]));
+        ST.moment1[k] = prod(scratch, trans(T));
+    }
+
+    ST.ref.phis += n*map.dref;
+    ST.pos += n*map.dpos;
+
+    ST.calc_rms();
+}
+
+// Pass ST once through the Linear elements [start, end), finding the map of this pass.
+// Returns false if the energy of any particle changed, so the map may not be reused.
+bool track_map(Machine& M, MomentState& ST, size_t start, size_t end, bool observe, TurnMap& map)
+{
+    using namespace boost::numeric::ublas;
+
+    const Particle ref0(ST.ref);
+    const std::vector<Particle> real0(ST.real);
+    const std::vector<MomentState::vector_t> moment0(ST.moment0);
+    const double pos0 = ST.pos;
+
+    map.A.clear();
+    map.A.resize(ST.size(), identity_matrix<double>(MomentState::maxsize+1));
+
+    track_turn(M, ST, start, end, observe, &map.A);
+
+    bool same = ST.ref<=ref0;
+    for(size_t k=0; same && k<ST.size(); k++)
+        same &= ST.real[k]<=real0[k];
+    if(!same)
+        return false;
+
+    map.dref = ST.ref.phis - ref0.phis;
+    map.dpos = ST.pos - pos0;
+    map.dphis.resize(ST.size());
+    for(size_t k=0; k<ST.size(); k++) {
+        map.dphis[k] = ST.real[k].phis - real0[k].phis;
+        for(size_t j=0; j<MomentState::maxsize; j++)
+            map.dphis[k] -= map.A[k](MomentState::maxsize, j)*moment0[k][j];
+    }
+    return true;
+}
+
+} // namespace
+
+bool propagate_turns(Machine& M, MomentState& ST, size_t nturns,
+                     size_t start, size_t observe_every)
+{
+    using namespace boost::numeric::ublas;
+    const size_t nelem = M.size();
+
+    bool linear = true;
+    for(size_t i=start; i<nelem; i++) {
+        MomentElementBase* E = dynamic_cast<MomentElementBase*>(M[i]);
+        if(!E)
+            throw std::invalid_argument(SB()<<"Element "<<i<<" is not a MomentMatrix element");
+        linear &= E->linearity()!=MomentElementBase::NonLinear;
+        // losses are only checked while tracking
+        linear &= E->aper<=0e0 || ST.aper_nsigma<=0e0;
+    }
+
+#define OBSERVED(T) (observe_every && (T)%observe_every==0)
+
+    size_t t = 0;
+
+    if(linear && nturns>0) {
+        TurnMap map;
+        linear &= track_map(M, ST, start, nelem, OBSERVED(1), map);
+        t++;
+
+        if(linear) {
+            while(t<nturns) {
+                // next turn to be tracked, or past the end
+                const size_t next = observe_every ? (t/observe_every+1)*observe_every : nturns+1;
+                const size_t jump = std::min(next-1, nturns) - t;
+
+                if(jump) {
+                    apply_turns(ST, map, jump);
+                    ST.next_elem = nelem;
+                    t += jump;
+                }
+                if(t<nturns) {
+                    track_turn(M, ST, start, nelem, true, NULL);
+                    t++;
+                }
+            }
+
+            for(size_t k=0; k<ST.size(); k++)
+                ST.transmat[k] = project(map.A[k], range(0, MomentState::maxsize), range(0, MomentState::maxsize));
+
+            return true;
+        }
+    }
+
+    for(; t<nturns; t++) {
+        if(!track_turn(M, ST, start, nelem, OBSERVED(t+1), NULL))
+            break;
+    }
+
+#undef OBSERVED
+
+    return false;
+}
+
+size_t propagate_repeats(Machine& M, MomentState& ST, size_t start, size_t max)
+{
+    const size_t nelem = M.size(),
+                 end = start + std::min(max, nelem>start ? nelem-start : 0);
+
+    for(size_t i=start; i<end; i++) {
+        if(!dynamic_cast<MomentElementBase*>(M[i]))
+            throw std::invalid_argument(SB()<<"Element "<<i<<" is not a MomentMatrix element");
+    }
+
+    ST.next_elem = start;
+    ST.retreat = false;
+
+    const Machine::repeats_t& R = M.repeats();
+    size_t i = start, // next element to be tracked
+           nmapped = 0;
+
+    for(Machine::repeats_t::const_iterator it=R.begin(), rend=R.end(); it!=rend && i<end; ++it) {
+        const size_t len = it->length;
+        if(it->first+len*it->count<=i)
+            continue;
+
+        // the whole cells in [i, end)
+        const size_t skip = i>it->first ? (i-it->first+len-1)/len : 0,
+                     first = it->first+skip*len,
+                     ncells = first<end ? std::min(it->count-skip, (end-first)/len) : 0;
+        if(ncells<2)
+            continue;
+
+        bool linear = true;
+        for(size_t j=first; linear && j<first+len; j++) {
+            const MomentElementBase* E = static_cast<const MomentElementBase*>(M[j]);
+            linear &= E->linearity()!=MomentElementBase::NonLinear;
+            // Observers must see each repetition, and losses are only checked while tracking
+            linear &= !E->observer();
+            linear &= E->aper<=0e0 || ST.aper_nsigma<=0e0;
+        }
+        if(!linear)
+            continue;
+
+        if(!track_turn(M, ST, i, first, true, NULL))
+            return nmapped;
+
+        TurnMap map;
+        i = first+len;
+        if(track_map(M, ST, first, i, false, map)) {
+            apply_turns(ST, map, ncells-1);
+            i += (ncells-1)*len;
+            ST.next_elem = i;
+            nmapped += ncells-1;
+        }
+        // otherwise the other cells are tracked with the following elements
+    }
+
+    if(i<end)
+        track_turn(M, ST, i, end, true, NULL);
+
+    return nmapped;
+}
+
 namespace {
 
 struct ElementSource : public MomentElementBase
@@ -774,23 +1396,40 @@ struct ElementSource : public MomentElementBase
     typedef MomentElementBase        base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementSource(const Config& c): base_t(c), istate(c) {}
+    ElementSource(const Config& c): base_t(c), istate(new state_t(c)) {}
 
     virtual void advance(StateBase& s)
     {
         state_t& ST = static_cast<state_t&>(s);
-        if (!ST.retreat)
-            // Replace state with our initial values
-            ST.assign(istate);
+        if (!ST.retreat) {
+            // Replace state with our initial values.
+            // The state vectors are copied in place, without re-allocation, unless the # of charge states changes.
+            // This copy is kept deliberately.  The caller's State is the result, and is modified by every
+            // following element, so copy-on-write would copy at the next element instead.  A swap would
+            // hand away istate, which is shared and re-used on each pass.
+            // The aperture setting belongs to the caller, and a new beam is not lost.
+            const double nsigma = ST.aper_nsigma;
+            ST.assign(*istate);
+            ST.aper_nsigma = nsigma;
+            ST.lost = 0;
+        }
+    }
+
+    virtual bool advance_long(Particle& ref, std::vector<Particle>& real)
+    {
+        ref  = istate->ref;
+        real = istate->real;
+        return true;
     }
 
     virtual void show(std::ostream& strm, int level) const
     {
         ElementVoid::show(strm, level);
-        strm<<"Initial: "<<istate.moment0_env<<"\n";
+        strm<<"Initial: "<<istate->moment0_env<<"\n";
     }
 
-    state_t istate;
+    //! Initial state.  Never modified, so may be shared between copies of this element.
+    boost::shared_ptr<const state_t> istate;
     // note that 'transfer' is not used by this element type
 
     virtual ~ElementSource() {}
@@ -800,7 +1439,7 @@ struct ElementSource : public MomentElementBase
     virtual void assign(const ElementVoid *other) {
         base_t::assign(other);
         const self_t* O=static_cast<const self_t*>(other);
-        istate.assign(O->istate);
+        istate = O->istate;
     }
 };
 
@@ -814,6 +1453,7 @@ struct ElementMark : public MomentElementBase
     ElementMark(const Config& c): base_t(c) {length = 0e0;}
     virtual ~ElementMark() {}
     virtual const char* type_name() const {return "marker";}
+    virtual linearity_t linearity() const { return Linear; }
 
     virtual void assign(const ElementVoid *other) { base_t::assign(other); }
 };
@@ -828,6 +1468,7 @@ struct ElementBPM : public MomentElementBase
     ElementBPM(const Config& c): base_t(c) {length = 0e0;}
     virtual ~ElementBPM() {}
     virtual const char* type_name() const {return "bpm";}
+    virtual linearity_t linearity() const { return Linear; }
 
     virtual void assign(const ElementVoid *other) { base_t::assign(other); }
 };
@@ -842,22 +1483,81 @@ struct ElementDrift : public MomentElementBase
     ElementDrift(const Config& c) : base_t(c) {}
     virtual ~ElementDrift() {}
     virtual const char* type_name() const {return "drift";}
+    virtual linearity_t linearity() const { return Linear; }
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L, length, 0e0);
+    }
 
     virtual void assign(const ElementVoid *other) { base_t::assign(other); }
 
+    virtual batch_update_t batch_update() const { return &batch_recompute; }
+
+    // Same as recompute_matrix() for each of elems[]
+    static void batch_recompute(MomentElementBase* const *elems, const ParticleSet* const *inputs,
+                                size_t n, state_t& ST)
+    {
+        // flatten (element, charge state) pairs
+        std::vector<double> L, S;
+        for(size_t i=0; i<n; i++) {
+            self_t *E = static_cast<self_t*>(elems[i]);
+            E->batch_begin(*inputs[i]);
+
+            const double Lmm = E->length*MtoMM;
+            const std::vector<Particle>& real = inputs[i]->real;
+            for(size_t k=0; k<real.size(); k++) {
+                L.push_back(Lmm);
+                S.push_back(real[k].SampleLambda*real[k].IonEs/MeVtoeV*cube(real[k].bg));
+            }
+        }
+
+        for(size_t j=0; j<L.size(); j++)
+            S[j] = -2e0*M_PI/S[j]*L[j];
+
+        for(size_t i=0, j=0; i<n; i++) {
+            self_t *E = static_cast<self_t*>(elems[i]);
+            for(size_t k=0; k<E->last_real_in.size(); k++, j++) {
+                value_t& T = E->transfer[k];
+                T = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+                T(state_t::PS_X, state_t::PS_PX) = L[j];
+                T(state_t::PS_Y, state_t::PS_PY) = L[j];
+                T(state_t::PS_S, state_t::PS_PS) = S[j];
+            }
+            E->batch_end();
+        }
+    }
+
     virtual void recompute_matrix(state_t& ST)
+    {
+        for(size_t i=0; i<last_real_in.size(); i++)
+            transfer_t<double>(ST.ref, ST.real[i], NULL, transfer[i], misalign[i], misalign_inv[i]);
+    }
+
+    // misalignment is not applied
+    template<typename T>
+    void transfer_t(const Particle& ref, const Particle& real, const char *active,
+                    typename moment_matrix<T>::type& M,
+                    typename moment_matrix<T>::type& misalign,
+                    typename moment_matrix<T>::type& misalign_inv) const
     {
         // Re-initialize transport matrix.
 
-        const double L = length*MtoMM; // Convert from [m] to [mm].
+        const T L = dual_param<T>(length, is_active(active, "L"))*MtoMM; // Convert from [m] to [mm].
 
-        for(size_t i=0; i<last_real_in.size(); i++) {
-            transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-            transfer[i](state_t::PS_X, state_t::PS_PX) = L;
-            transfer[i](state_t::PS_Y, state_t::PS_PY) = L;
-            transfer[i](state_t::PS_S, state_t::PS_PS) =
-                -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*L;
-        }
+        M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
+        M(state_t::PS_X, state_t::PS_PX) = L;
+        M(state_t::PS_Y, state_t::PS_PY) = L;
+        M(state_t::PS_S, state_t::PS_PS) =
+            -2e0*M_PI/(real.SampleLambda*real.IonEs/MeVtoeV*cube(real.bg))*L;
+    }
+
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+    {
+        if(name!="L")
+            return false;
+        dual_transfer(*this, name, dT);
+        return true;
     }
 };
 
@@ -868,47 +1568,90 @@ struct ElementOrbTrim : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementOrbTrim(const Config& c) : base_t(c) {length = 0e0;}
+    ElementOrbTrim(const Config& c)
+        :base_t(c)
+        ,theta_x(0e0), theta_y(0e0), tm_xkick(0e0), tm_ykick(0e0), xyrotate(0e0), realpara(0e0)
+    {
+        ParamBinder P(c);
+        bind(P);
+    }
     virtual ~ElementOrbTrim() {}
     virtual const char* type_name() const {return "orbtrim";}
+    virtual linearity_t linearity() const { return Linear; }
+
+    double theta_x, theta_y,   // [rad]
+           tm_xkick, tm_ykick, // [T*m]
+           xyrotate,           // [deg]
+           realpara;
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        length = 0e0;
+        P(key_theta_x,  theta_x,  0e0);
+        P(key_theta_y,  theta_y,  0e0);
+        P(key_tm_xkick, tm_xkick, 0e0);
+        P(key_tm_ykick, tm_ykick, 0e0);
+        P(key_xyrotate, xyrotate, 0e0);
+        P(key_realpara, realpara, 0e0);
+    }
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        theta_x  = O->theta_x;
+        theta_y  = O->theta_y;
+        tm_xkick = O->tm_xkick;
+        tm_ykick = O->tm_ykick;
+        xyrotate = O->xyrotate;
+        realpara = O->realpara;
+    }
 
     virtual void recompute_matrix(state_t& ST)
+    {
+        for(size_t i=0; i<last_real_in.size(); i++)
+            transfer_t<double>(ST.ref, ST.real[i], NULL, transfer[i], misalign[i], misalign_inv[i]);
+    }
+
+    template<typename T>
+    void transfer_t(const Particle& ref, const Particle& real, const char *active,
+                    typename moment_matrix<T>::type& M,
+                    typename moment_matrix<T>::type& misalign,
+                    typename moment_matrix<T>::type& misalign_inv) const
     {
         // Re-initialize transport matrix.
-        double theta_x = conf().get<double>("theta_x", 0e0),
-               theta_y = conf().get<double>("theta_y", 0e0);
-        const double tm_xkick = conf().get<double>("tm_xkick", 0e0),
-                     tm_ykick = conf().get<double>("tm_ykick", 0e0),
-                     xyrotate = conf().get<double>("xyrotate", 0e0)*M_PI/180e0;
-        const bool   realpara = conf().get<double>("realpara", 0e0) == 1e0;
-
-        if (realpara) {
-            double ecpi = ST.ref.IonZ*C0/sqrt(sqr(ST.ref.IonW) - sqr(ST.ref.IonEs));
-            theta_x = tm_xkick*ecpi;
-            theta_y = tm_ykick*ecpi;
+        T theta_x = dual_param<T>(this->theta_x, is_active(active, "theta_x")),
+          theta_y = dual_param<T>(this->theta_y, is_active(active, "theta_y"));
+        const T xyrotate = dual_param<T>(this->xyrotate, is_active(active, "xyrotate"))*M_PI/180e0;
+
+        if (realpara == 1e0) {
+            double ecpi = ref.IonZ*C0/sqrt(sqr(ref.IonW) - sqr(ref.IonEs));
+            theta_x = dual_param<T>(tm_xkick, is_active(active, "tm_xkick"))*ecpi;
+            theta_y = dual_param<T>(tm_ykick, is_active(active, "tm_ykick"))*ecpi;
         }
 
-        for(size_t i=0; i<last_real_in.size(); i++) {
-            transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-            transfer[i](state_t::PS_PX, 6) = theta_x*ST.real[i].IonZ/ST.ref.IonZ;
-            transfer[i](state_t::PS_PY, 6) = theta_y*ST.real[i].IonZ/ST.ref.IonZ;
-
-            get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
+        M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
+        M(state_t::PS_PX, 6) = theta_x*real.IonZ/ref.IonZ;
+        M(state_t::PS_PY, 6) = theta_y*real.IonZ/ref.IonZ;
 
-            noalias(scratch)  = prod(transfer[i], misalign[i]);
-            noalias(transfer[i]) = prod(misalign_inv[i], scratch);
-
-            if (xyrotate != 0e0) {
-                state_t::matrix_t R;
-                RotMat(0e0, 0e0, 0e0, 0e0, xyrotate, R);
-                noalias(scratch)  = transfer[i];
-                noalias(transfer[i]) = prod(scratch, R);
-            }
+        get_misalign_t<T>(ref, real, active, misalign, misalign_inv);
+        apply_misalign<T>(M, misalign, misalign_inv);
 
+        if (xyrotate != 0e0 || is_active(active, "xyrotate")) {
+            typename moment_matrix<T>::type R;
+            RotMat<T>(0e0, 0e0, 0e0, 0e0, xyrotate, R);
+            const typename moment_matrix<T>::type scratch(M);
+            noalias(M) = prod(scratch, R);
         }
     }
+
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+    {
+        if(name!="theta_x" && name!="theta_y" && name!="tm_xkick" && name!="tm_ykick"
+                && name!="xyrotate" && !is_misalign_param(name))
+            return false;
+        dual_transfer(*this, name, dT);
+        return true;
+    }
 };
 
 struct ElementSBend : public MomentElementBase
@@ -921,20 +1664,44 @@ struct ElementSBend : public MomentElementBase
     typedef typename base_t::state_t state_t;
 
     unsigned HdipoleFitMode;
+    double phi, phi1, phi2, // [deg]
+           K,               // [1/m^2]
+           bg;              // dipole reference beta*gamma, if HdipoleFitMode==0
 
-    ElementSBend(const Config& c) : base_t(c), HdipoleFitMode(0) {
-
-        HdipoleFitMode = get_flag(c, "HdipoleFitMode", 1);
-        if (HdipoleFitMode != 0 && HdipoleFitMode != 1)
-            throw std::runtime_error(SB()<< "Undefined HdipoleFitMode: " << HdipoleFitMode);
+    ElementSBend(const Config& c)
+        :base_t(c), HdipoleFitMode(0)
+        ,phi(0e0), phi1(0e0), phi2(0e0), K(0e0), bg(0e0)
+    {
+        ParamBinder P(c);
+        bind(P);
     }
     virtual ~ElementSBend() {}
     virtual const char* type_name() const {return "sbend";}
+    virtual linearity_t linearity() const { return LinearPhase; }
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L,    length);
+        P(key_phi,  phi);
+        P(key_phi1, phi1);
+        P(key_phi2, phi2);
+        P(key_K,    K, 0e0);
+        P.flag(key_HdipoleFitMode, HdipoleFitMode, 1);
+        if (HdipoleFitMode != 0 && HdipoleFitMode != 1)
+            throw std::runtime_error(SB()<< "Undefined HdipoleFitMode: " << HdipoleFitMode);
+        if (!HdipoleFitMode)
+            P(key_bg, bg);
+    }
 
     virtual void assign(const ElementVoid *other) {
         base_t::assign(other);
         const self_t* O=static_cast<const self_t*>(other);
         HdipoleFitMode = O->HdipoleFitMode;
+        phi  = O->phi;
+        phi1 = O->phi1;
+        phi2 = O->phi2;
+        K    = O->K;
+        bg   = O->bg;
     }
 
     virtual void advance(StateBase& s)
@@ -947,15 +1714,8 @@ struct ElementSBend : public MomentElementBase
 
         if(!check_cache(ST)) {
             // need to re-calculate energy dependent terms
-            last_ref_in = ST.ref;
-            last_real_in = ST.real;
-            resize_cache(ST);
-
-            recompute_matrix(ST); // updates transfer and last_Kenergy_out
-
-            ST.recalc();
-            last_ref_out = ST.ref;
-            last_real_out = ST.real;
+            cache_misses++;
+            update_cache(ST);
         } else {
             ST.ref = last_ref_out;
             assert(last_real_out.size()==ST.real.size()); // should be true if check_cache() -> true
@@ -1007,44 +1767,73 @@ struct ElementSBend : public MomentElementBase
         ST.calc_rms();
     }
 
-    virtual void recompute_matrix(state_t& ST)
+    virtual void update_cache(state_t& ST)
     {
-        // Re-initialize transport matrix.
-
-        double L     = conf().get<double>("L")*MtoMM,
-               phi   = conf().get<double>("phi")*M_PI/180e0,
-               phi1  = conf().get<double>("phi1")*M_PI/180e0,
-               phi2  = conf().get<double>("phi2")*M_PI/180e0,
-               K     = conf().get<double>("K", 0e0)/sqr(MtoMM);
+        // phase advance is applied in advance()
+        last_ref_in = ST.ref;
+        last_real_in = ST.real;
+        resize_cache(ST);
 
-        for(size_t i=0; i<last_real_in.size(); i++) {
-            double qmrel = (ST.real[i].IonZ-ST.ref.IonZ)/ST.ref.IonZ;
+        recompute_matrix(ST); // updates transfer and last_Kenergy_out
 
-            transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+        ST.recalc();
+        last_ref_out = ST.ref;
+        last_real_out = ST.real;
+    }
 
-            if (L != 0.0) {
-                if (!HdipoleFitMode) {
-                    double dip_bg    = conf().get<double>("bg"),
-                           // Dipole reference energy.
-                           dip_Ek    = (sqrt(sqr(dip_bg)+1e0)-1e0)*ST.ref.IonEs,
-                           dip_gamma = (dip_Ek+ST.ref.IonEs)/ST.ref.IonEs,
-                           dip_beta  = sqrt(1e0-1e0/sqr(dip_gamma)),
-                           d         = (ST.ref.gamma-dip_gamma)/(sqr(dip_beta)*dip_gamma) - qmrel,
-                           dip_IonK  = 2e0*M_PI/(dip_beta*ST.ref.SampleLambda);
-
-                    GetSBendMatrix(L, phi, phi1, phi2, K, ST.ref.IonEs, ST.ref.gamma, qmrel,
-                                   dip_beta, dip_gamma, d, dip_IonK, transfer[i]);
-                } else
-                    GetSBendMatrix(L, phi, phi1, phi2, K, ST.ref.IonEs, ST.ref.gamma, qmrel,
-                                   ST.ref.beta, ST.ref.gamma, - qmrel, ST.ref.SampleIonK, transfer[i]);
+    virtual void recompute_matrix(state_t& ST)
+    {
+        for(size_t i=0; i<last_real_in.size(); i++)
+            transfer_t<double>(ST.ref, ST.real[i], NULL, transfer[i], misalign[i], misalign_inv[i]);
+    }
 
-                get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
+    template<typename T>
+    void transfer_t(const Particle& ref, const Particle& real, const char *active,
+                    typename moment_matrix<T>::type& M,
+                    typename moment_matrix<T>::type& misalign,
+                    typename moment_matrix<T>::type& misalign_inv) const
+    {
+        // Re-initialize transport matrix.
 
-                noalias(scratch)     = prod(transfer[i], misalign[i]);
-                noalias(transfer[i]) = prod(misalign_inv[i], scratch);
-            }
+        const T L    = dual_param<T>(length,     is_active(active, "L"))*MtoMM,
+                phi  = dual_param<T>(this->phi,  is_active(active, "phi"))*M_PI/180e0,
+                phi1 = dual_param<T>(this->phi1, is_active(active, "phi1"))*M_PI/180e0,
+                phi2 = dual_param<T>(this->phi2, is_active(active, "phi2"))*M_PI/180e0,
+                K    = dual_param<T>(this->K,    is_active(active, "K"))/sqr(MtoMM);
+
+        double qmrel = (real.IonZ-ref.IonZ)/ref.IonZ;
+
+        M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
+
+        if (L != 0.0) {
+            if (!HdipoleFitMode) {
+                double dip_bg    = bg,
+                       // Dipole reference energy.
+                       dip_Ek    = (sqrt(sqr(dip_bg)+1e0)-1e0)*ref.IonEs,
+                       dip_gamma = (dip_Ek+ref.IonEs)/ref.IonEs,
+                       dip_beta  = sqrt(1e0-1e0/sqr(dip_gamma)),
+                       d         = (ref.gamma-dip_gamma)/(sqr(dip_beta)*dip_gamma) - qmrel,
+                       dip_IonK  = 2e0*M_PI/(dip_beta*ref.SampleLambda);
+
+                GetSBendMatrix<T>(L, phi, phi1, phi2, K, ref.IonEs, ref.gamma, qmrel,
+                                  dip_beta, dip_gamma, d, dip_IonK, M);
+            } else
+                GetSBendMatrix<T>(L, phi, phi1, phi2, K, ref.IonEs, ref.gamma, qmrel,
+                                  ref.beta, ref.gamma, - qmrel, ref.SampleIonK, M);
+
+            get_misalign_t<T>(ref, real, active, misalign, misalign_inv);
+            apply_misalign<T>(M, misalign, misalign_inv);
         }
     }
+
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+    {
+        if(name!="L" && name!="phi" && name!="phi1" && name!="phi2" && name!="K"
+                && !is_misalign_param(name))
+            return false;
+        dual_transfer(*this, name, dT);
+        return true;
+    }
 };
 
 struct ElementQuad : public MomentElementBase
@@ -1054,38 +1843,112 @@ struct ElementQuad : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementQuad(const Config& c) : base_t(c) {}
+    ElementQuad(const Config& c) : base_t(c), ncurve(0), B2(0e0) {
+        ParamBinder P(c);
+        bind(P);
+        if (ncurve != 0)
+            curve.load(c, ncurve);
+    }
     virtual ~ElementQuad() {}
     virtual const char* type_name() const {return "quadrupole";}
+    virtual linearity_t linearity() const { return Linear; }
+
+    unsigned ncurve;
+    CurveProfile curve; // integrated B2 profile, if ncurve!=0
+    double B2; // [T/m], if ncurve==0
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L, length);
+        P.flag(key_ncurve, ncurve, 0);
+        if (ncurve == 0)
+            P(key_B2, B2);
+    }
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        ncurve = O->ncurve;
+        curve  = O->curve;
+        B2     = O->B2;
+    }
+
+    virtual batch_update_t batch_update() const { return ncurve==0 ? &batch_recompute : NULL; }
+
+    // Same as recompute_matrix() for each of elems[], which must all have ncurve==0
+    static void batch_recompute(MomentElementBase* const *elems, const ParticleSet* const *inputs,
+                                size_t n, state_t& ST)
+    {
+        // flatten (element, charge state) pairs
+        std::vector<double> L, K, S;
+        for(size_t i=0; i<n; i++) {
+            self_t *E = static_cast<self_t*>(elems[i]);
+            E->batch_begin(*inputs[i]);
+
+            const double Lmm = E->length*MtoMM;
+            const std::vector<Particle>& real = inputs[i]->real;
+            for(size_t k=0; k<real.size(); k++) {
+                L.push_back(Lmm);
+                K.push_back(E->B2/real[k].Brho()/sqr(MtoMM));
+                S.push_back(real[k].SampleLambda*real[k].IonEs/MeVtoeV*cube(real[k].bg));
+            }
+        }
+
+        const size_t N = L.size();
+        // 2x2 blocks of horizontal and vertical planes
+        std::vector<double> X(3*N), Y(3*N);
+        for(size_t j=0; j<N; j++)
+            GetQuadBlock(L[j],  K[j], X[3*j], X[3*j+1], X[3*j+2]);
+        for(size_t j=0; j<N; j++)
+            GetQuadBlock(L[j], -K[j], Y[3*j], Y[3*j+1], Y[3*j+2]);
+        for(size_t j=0; j<N; j++)
+            S[j] = -2e0*M_PI/S[j]*L[j];
+
+        for(size_t i=0, j=0; i<n; i++) {
+            self_t *E = static_cast<self_t*>(elems[i]);
+            ST.ref = inputs[i]->ref; // get_misalign() uses ST.ref
+            for(size_t k=0; k<E->last_real_in.size(); k++, j++) {
+                value_t& T = E->transfer[k];
+                T = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+                T(state_t::PS_X,  state_t::PS_X)  = T(state_t::PS_PX, state_t::PS_PX) = X[3*j];
+                T(state_t::PS_X,  state_t::PS_PX) = X[3*j+1];
+                T(state_t::PS_PX, state_t::PS_X)  = X[3*j+2];
+                T(state_t::PS_Y,  state_t::PS_Y)  = T(state_t::PS_PY, state_t::PS_PY) = Y[3*j];
+                T(state_t::PS_Y,  state_t::PS_PY) = Y[3*j+1];
+                T(state_t::PS_PY, state_t::PS_Y)  = Y[3*j+2];
+                T(state_t::PS_S,  state_t::PS_PS) = S[j];
+
+                E->get_misalign(ST, inputs[i]->real[k], E->misalign[k], E->misalign_inv[k]);
+                noalias(E->scratch) = prod(T, E->misalign[k]);
+                noalias(T)          = prod(E->misalign_inv[k], E->scratch);
+            }
+            E->batch_end();
+        }
+    }
 
     virtual void recompute_matrix(state_t& ST)
     {
-        const double L = conf().get<double>("L")*MtoMM;
-        const unsigned ncurve = get_flag(conf(), "ncurve", 0);
+        const double L = length*MtoMM;
 
         if (ncurve != 0) {
-            std::vector<std::vector<double> > Curves;
-            std::vector<double> Scales;
-            GetCurveData(conf(), ncurve, Scales, Curves);
+            const double dL = L/double(curve.nsample);
 
             for(size_t i=0; i<last_real_in.size(); i++) {
-                double K;
-                double dL = L/double(Curves[0].size()),
-                       Brho = ST.real[i].Brho();
+                const double Brho = ST.real[i].Brho();
                 transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-                for (size_t j=0; j<Curves[0].size(); j++){
-                    K = 0.0;
-                    for (size_t n=0; n<Curves.size(); n++) K += Scales[n]*Curves[n][j]/Brho/sqr(MtoMM);
+                // one slice for each run of equal field
+                for (size_t j=0; j<curve.field.size(); j++){
+                    const double K  = curve.field[j]/Brho/sqr(MtoMM),
+                                 Lj = dL*curve.count[j];
                     value_t tmstep = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-                    GetQuadMatrix(dL,  K, (unsigned)state_t::PS_X, tmstep);
-                    GetQuadMatrix(dL, -K, (unsigned)state_t::PS_Y, tmstep);
+                    GetQuadMatrix(Lj,  K, (unsigned)state_t::PS_X, tmstep);
+                    GetQuadMatrix(Lj, -K, (unsigned)state_t::PS_Y, tmstep);
 
                     tmstep(state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*dL;
+                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*Lj;
 
-                    transfer[i] = prod(tmstep, transfer[i]);
+                    noalias(scratch) = prod(tmstep, transfer[i]);
+                    transfer[i] = scratch;
                 }
                 get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
                 noalias(scratch)     = prod(transfer[i], misalign[i]);
@@ -1093,28 +1956,45 @@ struct ElementQuad : public MomentElementBase
             }
 
         } else {
-            const double B2= conf().get<double>("B2");
-            for(size_t i=0; i<last_real_in.size(); i++) {
-                // Re-initialize transport matrix.
-                transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+            for(size_t i=0; i<last_real_in.size(); i++)
+                transfer_t<double>(ST.ref, ST.real[i], NULL, transfer[i], misalign[i], misalign_inv[i]);
+        }
+    }
 
-                double Brho = ST.real[i].Brho(),
-                       K = B2/Brho/sqr(MtoMM);
+    // for ncurve==0
+    template<typename T>
+    void transfer_t(const Particle& ref, const Particle& real, const char *active,
+                    typename moment_matrix<T>::type& M,
+                    typename moment_matrix<T>::type& misalign,
+                    typename moment_matrix<T>::type& misalign_inv) const
+    {
+        // Re-initialize transport matrix.
+        M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
 
-                // Horizontal plane.
-                GetQuadMatrix(L,  K, (unsigned)state_t::PS_X, transfer[i]);
-                // Vertical plane.
-                GetQuadMatrix(L, -K, (unsigned)state_t::PS_Y, transfer[i]);
-                // Longitudinal plane.
+        const T L = dual_param<T>(length, is_active(active, "L"))*MtoMM;
 
-                transfer[i](state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*L;
+        double Brho = real.Brho();
+        T K = dual_param<T>(B2, is_active(active, "B2"))/Brho/sqr(MtoMM);
 
-                get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
-                noalias(scratch)     = prod(transfer[i], misalign[i]);
-                noalias(transfer[i]) = prod(misalign_inv[i], scratch);
-            }
-        }
+        // Horizontal plane.
+        GetQuadMatrix<T>(L,  K, (unsigned)state_t::PS_X, M);
+        // Vertical plane.
+        GetQuadMatrix<T>(L, -K, (unsigned)state_t::PS_Y, M);
+        // Longitudinal plane.
+
+        M(state_t::PS_S, state_t::PS_PS) =
+                -2e0*M_PI/(real.SampleLambda*real.IonEs/MeVtoeV*cube(real.bg))*L;
+
+        get_misalign_t<T>(ref, real, active, misalign, misalign_inv);
+        apply_misalign<T>(M, misalign, misalign_inv);
+    }
+
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+    {
+        if(ncurve!=0 || (name!="L" && name!="B2" && !is_misalign_param(name)))
+            return false;
+        dual_transfer(*this, name, dT);
+        return true;
     }
 };
 
@@ -1125,20 +2005,112 @@ struct ElementSext : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementSext(const Config& c) : base_t(c) {}
+    ElementSext(const Config& c)
+        :base_t(c), last_step(0)
+        ,B3(0e0), step(1.0), step_tol(0e0), step_max(1024.0), thinlens(0e0), dstkick(1.0)
+    {
+        ParamBinder P(c);
+        bind(P);
+    }
 
     virtual ~ElementSext() {}
     virtual const char* type_name() const {return "sextupole";}
 
-    virtual void assign(const ElementVoid *other) {base_t::assign(other); }
+    //! # of sub-steps used by the last advance(), max. over charge states
+    unsigned last_step;
+
+    double B3, // [T/m^2]
+           step, step_tol, step_max,
+           thinlens, dstkick;
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L,        length);
+        P(key_B3,       B3);
+        P(key_step,     step,     1.0);
+        P(key_step_tol, step_tol, 0.0);
+        P(key_step_max, step_max, 1024.0);
+        P(key_thinlens, thinlens, 0.0);
+        P(key_dstkick,  dstkick,  1.0);
+    }
+
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        last_step = O->last_step;
+        B3        = O->B3;
+        step      = O->step;
+        step_tol  = O->step_tol;
+        step_max  = O->step_max;
+        thinlens  = O->thinlens;
+        dstkick   = O->dstkick;
+    }
+
+    virtual void show(std::ostream& strm, int level) const
+    {
+        base_t::show(strm, level);
+        strm<<"Steps used: "<<last_step<<"\n";
+    }
+
+    //! Integrate one charge state through 'step' sub-steps.
+    //! M0, M1 are updated in place, and the product of the sub-step matrices is stored in TM.
+    void integrate(const Particle& real, const double K, const double L, const unsigned step,
+                   const bool thinlens, const bool dstkick,
+                   state_t::vector_t& M0, state_t::matrix_t& M1, state_t::matrix_t& TM)
+    {
+        using namespace boost::numeric::ublas;
+
+        const double dL = L/step;
+        // not reset between sub-steps.  GetSextMatrix() only assigns some elements.
+        value_t tmstep = identity_matrix<double>(state_t::maxsize);
+
+        TM = identity_matrix<double>(state_t::maxsize);
+
+        for(unsigned i=0; i<step; i++){
+            double Dx = M0[state_t::PS_X],
+                   Dy = M0[state_t::PS_Y],
+                   D2x = M1(state_t::PS_X, state_t::PS_X),
+                   D2y = M1(state_t::PS_Y, state_t::PS_Y),
+                   D2xy = M1(state_t::PS_X, state_t::PS_Y);
+
+            GetSextMatrix(dL, K, Dx, Dy, D2x, D2y, D2xy, thinlens, dstkick, tmstep);
+
+            tmstep(state_t::PS_S, state_t::PS_PS) =
+                    -2e0*M_PI/(real.SampleLambda*real.IonEs/MeVtoeV*cube(real.bg))*dL;
+
+            M0 = prod(tmstep, M0);
+
+            scratch = prod(tmstep, M1);
+            M1 = prod(scratch, trans(tmstep));
+
+            TM = prod(tmstep, TM);
+        }
+    }
+
+    //! Difference between two results in units of the rms beam size of the second
+    static double step_error(const state_t::vector_t& M0a, const state_t::matrix_t& M1a,
+                             const state_t::vector_t& M0b, const state_t::matrix_t& M1b)
+    {
+        double err = 0e0;
+        for(unsigned j=0; j<6; j++) {
+            if(M1b(j,j)<=0e0) continue;
+            err = std::max(err, fabs(M0a[j]-M0b[j])/sqrt(M1b(j,j)));
+            for(unsigned l=0; l<6; l++) {
+                if(M1b(l,l)<=0e0) continue;
+                err = std::max(err, fabs(M1a(j,l)-M1b(j,l))/sqrt(M1b(j,j)*M1b(l,l)));
+            }
+        }
+        return err;
+    }
 
     virtual void advance(StateBase& s)
     {
-        const double B3= conf().get<double>("B3"),
-                     L = conf().get<double>("L")*MtoMM;
-        const int    step = conf().get<double>("step", 1.0);
-        const bool   thinlens = conf().get<double>("thinlens", 0.0) == 1.0,
-                     dstkick = conf().get<double>("dstkick", 1.0) == 1.0;
+        const double L = length*MtoMM,
+                     tol = step_tol;
+        const int    step = this->step,
+                     step_max = this->step_max;
+        const bool   thinlens = this->thinlens == 1.0,
+                     dstkick = this->dstkick == 1.0;
 
         state_t&  ST = static_cast<state_t&>(s);
         using namespace boost::numeric::ublas;
@@ -1151,14 +2123,13 @@ struct ElementSext : public MomentElementBase
 
         if(ST.retreat) throw std::runtime_error(SB()<<
             "Backward propagation error: Backward propagation does not support sextupole.");
+        if(step<1) throw std::runtime_error(SB()<<"sextupole step must be >= 1");
+        if(tol>0e0 && step_max<1) throw std::runtime_error(SB()<<"sextupole step_max must be >= 1");
 
-        const double dL = L/step;
+        last_step = 0;
 
         for(size_t k=0; k<last_real_in.size(); k++) {
 
-            transfer[k] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-            ST.transmat[k] = transfer[k];
-
             double Brho = ST.real[k].Brho(),
                    K = B3/Brho/cube(MtoMM);
 
@@ -1168,26 +2139,49 @@ struct ElementSext : public MomentElementBase
             scratch = prod(misalign[k], ST.moment1[k]);
             ST.moment1[k] = prod(scratch, trans(misalign[k]));
 
-            for(int i=0; i<step; i++){
-                double Dx = ST.moment0[k][state_t::PS_X],
-                       Dy = ST.moment0[k][state_t::PS_Y],
-                       D2x = ST.moment1[k](state_t::PS_X, state_t::PS_X),
-                       D2y = ST.moment1[k](state_t::PS_Y, state_t::PS_Y),
-                       D2xy = ST.moment1[k](state_t::PS_X, state_t::PS_Y);
-
-
-                GetSextMatrix(dL, K, Dx, Dy, D2x, D2y, D2xy, thinlens, dstkick, transfer[k]);
+            unsigned nstep = step;
+            if(tol>0e0) // the finer of the first pair of integrations uses at most step_max steps
+                nstep = std::min(nstep, unsigned(std::max(step_max, 2)/2));
+
+            if(tol<=0e0 || int(2*nstep)>step_max) {
+                // fixed # of steps
+                integrate(ST.real[k], K, L, nstep, thinlens, dstkick, ST.moment0[k], ST.moment1[k], ST.transmat[k]);
+
+            } else {
+                // step doubling.  Compare N and 2N sub-steps until the difference is within tolerance.
+                state_t::vector_t M0 = ST.moment0[k], M0f;
+                state_t::matrix_t M1 = ST.moment1[k], M1f, TM, TMf;
+
+                integrate(ST.real[k], K, L, nstep, thinlens, dstkick, M0, M1, TM);
+
+                while(true) {
+                    M0f = ST.moment0[k];
+                    M1f = ST.moment1[k];
+                    integrate(ST.real[k], K, L, 2*nstep, thinlens, dstkick, M0f, M1f, TMf);
+                    nstep *= 2;
+
+                    double err = step_error(M0, M1, M0f, M1f);
+                    if(err<=tol)
+                        break;
+                    if(int(2*nstep)>step_max) {
+                        FLAME_LOG(WARN)<<"sextupole "<<name<<" charge state "<<k<<" not converged with "<<nstep
+                                       <<" steps (error "<<err<<" > step_tol "<<tol<<")\n";
+                        break;
+                    }
+                    M0 = M0f;
+                    M1 = M1f;
+                }
 
-                transfer[k](state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[k].SampleLambda*ST.real[k].IonEs/MeVtoeV*cube(ST.real[k].bg))*dL;
+                ST.moment0[k] = M0f;
+                ST.moment1[k] = M1f;
+                ST.transmat[k] = TMf;
+            }
 
-                ST.moment0[k] = prod(transfer[k], ST.moment0[k]);
+            last_step = std::max(last_step, nstep);
+            FLAME_LOG(DEBUG)<<"sextupole "<<name<<" charge state "<<k<<" used "<<nstep<<" steps\n";
 
-                scratch = prod(transfer[k], ST.moment1[k]);
-                ST.moment1[k] = prod(scratch, trans(transfer[k]));
+            transfer[k] = ST.transmat[k];
 
-                ST.transmat[k] = prod(transfer[k], ST.transmat[k]);
-            }
             ST.moment0[k] = prod(misalign_inv[k], ST.moment0[k]);
             scratch = prod(misalign_inv[k], ST.moment1[k]);
             ST.moment1[k] = prod(scratch, trans(misalign_inv[k]));
@@ -1218,63 +2212,100 @@ struct ElementSolenoid : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementSolenoid(const Config& c) : base_t(c) {}
+    ElementSolenoid(const Config& c) : base_t(c), ncurve(0), B(0e0) {
+        ParamBinder P(c);
+        bind(P);
+        if (ncurve != 0)
+            curve.load(c, ncurve);
+    }
     virtual ~ElementSolenoid() {}
     virtual const char* type_name() const {return "solenoid";}
+    virtual linearity_t linearity() const { return Linear; }
+
+    unsigned ncurve;
+    CurveProfile curve; // B profile, if ncurve!=0
+    double B; // [T], if ncurve==0
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L, length);
+        P.flag(key_ncurve, ncurve, 0);
+        if (ncurve == 0)
+            P(key_B, B);
+    }
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        ncurve = O->ncurve;
+        curve  = O->curve;
+        B      = O->B;
+    }
 
     virtual void recompute_matrix(state_t& ST)
     {
-        const double L = conf().get<double>("L")*MtoMM;      // Convert from [m] to [mm].
-        const unsigned ncurve = get_flag(conf(), "ncurve", 0);
+        const double L = length*MtoMM;      // Convert from [m] to [mm].
 
         if (ncurve != 0) {
-            std::vector<std::vector<double> > Curves;
-            std::vector<double> Scales;
-            GetCurveData(conf(), ncurve, Scales, Curves);
+            const double dL = L/double(curve.nsample);
 
             for(size_t i=0; i<last_real_in.size(); i++) {
-                double K;
-                double dL = L/double(Curves[0].size()),
-                       Brho = ST.real[i].Brho();
+                const double Brho = ST.real[i].Brho();
                 transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-                for (size_t j=0; j<Curves[0].size(); j++){
-                    K = 0.0;
-                    for (size_t n=0; n<Curves.size(); n++) K += Scales[n]*Curves[n][j]/(2e0*Brho)/MtoMM;
+                // one slice for each run of equal field
+                for (size_t j=0; j<curve.field.size(); j++){
+                    const double K  = curve.field[j]/(2e0*Brho)/MtoMM,
+                                 Lj = dL*curve.count[j];
                     value_t tmstep = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
 
-                    GetSolMatrix(dL, K, tmstep);
+                    GetSolMatrix(Lj, K, tmstep);
 
                     tmstep(state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*dL;
+                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*Lj;
 
-                    transfer[i] = prod(tmstep, transfer[i]);
+                    noalias(scratch) = prod(tmstep, transfer[i]);
+                    transfer[i] = scratch;
                 }
                 get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
                 noalias(scratch)     = prod(transfer[i], misalign[i]);
                 noalias(transfer[i]) = prod(misalign_inv[i], scratch);
             }
         } else {
-            const double B = conf().get<double>("B");
-            for(size_t i=0; i<last_real_in.size(); i++) {
-                // Re-initialize transport matrix.
-                transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+            for(size_t i=0; i<last_real_in.size(); i++)
+                transfer_t<double>(ST.ref, ST.real[i], NULL, transfer[i], misalign[i], misalign_inv[i]);
+        }
+    }
 
-                double Brho = ST.real[i].Brho(),
-                       K    = B/(2e0*Brho)/MtoMM;
+    // for ncurve==0
+    template<typename T>
+    void transfer_t(const Particle& ref, const Particle& real, const char *active,
+                    typename moment_matrix<T>::type& M,
+                    typename moment_matrix<T>::type& misalign,
+                    typename moment_matrix<T>::type& misalign_inv) const
+    {
+        // Re-initialize transport matrix.
+        M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
 
-                GetSolMatrix(L, K, transfer[i]);
+        const T L = dual_param<T>(length, is_active(active, "L"))*MtoMM; // Convert from [m] to [mm].
 
-                transfer[i](state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*L;
+        double Brho = real.Brho();
+        T K = dual_param<T>(B, is_active(active, "B"))/(2e0*Brho)/MtoMM;
 
-                get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
+        GetSolMatrix<T>(L, K, M);
 
-                noalias(scratch)     = prod(transfer[i], misalign[i]);
-                noalias(transfer[i]) = prod(misalign_inv[i], scratch);
-            }
-        }
+        M(state_t::PS_S, state_t::PS_PS) =
+                -2e0*M_PI/(real.SampleLambda*real.IonEs/MeVtoeV*cube(real.bg))*L;
+
+        get_misalign_t<T>(ref, real, active, misalign, misalign_inv);
+        apply_misalign<T>(M, misalign, misalign_inv);
+    }
+
+    virtual bool transfer_derivative(const std::string& name, std::vector<value_t>& dT)
+    {
+        if(ncurve!=0 || (name!="L" && name!="B" && !is_misalign_param(name)))
+            return false;
+        dual_transfer(*this, name, dT);
+        return true;
     }
 };
 
@@ -1285,11 +2316,52 @@ struct ElementEDipole : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementEDipole(const Config& c) : base_t(c) {}
+    ElementEDipole(const Config& c)
+        :base_t(c), HdipoleFitMode(1)
+        ,ver(0e0), phi(0e0), fringe_x(0e0), fringe_y(0e0), asym_fac(0e0), spher(0e0)
+        ,beta(std::numeric_limits<double>::quiet_NaN())
+    {
+        ParamBinder P(c);
+        bind(P);
+    }
     virtual ~ElementEDipole() {}
     virtual const char* type_name() const {return "edipole";}
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    unsigned HdipoleFitMode;
+    double ver,
+           phi,                // [deg]
+           fringe_x, fringe_y, // [1/m]
+           asym_fac,
+           spher,
+           beta;               // NaN to use the reference beta
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L,        length);
+        P(key_ver,      ver);
+        P(key_phi,      phi);
+        P(key_fringe_x, fringe_x, 0e0);
+        P(key_fringe_y, fringe_y, 0e0);
+        P(key_asym_fac, asym_fac, 0e0);
+        P(key_spher,    spher);
+        P(key_beta,     beta, std::numeric_limits<double>::quiet_NaN());
+        P.flag(key_HdipoleFitMode, HdipoleFitMode, 1);
+        if (HdipoleFitMode != 0 && HdipoleFitMode != 1)
+            throw std::runtime_error(SB()<< "Undefined HdipoleFitMode: " << HdipoleFitMode);
+    }
+
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        HdipoleFitMode = O->HdipoleFitMode;
+        ver      = O->ver;
+        phi      = O->phi;
+        fringe_x = O->fringe_x;
+        fringe_y = O->fringe_y;
+        asym_fac = O->asym_fac;
+        spher    = O->spher;
+        beta     = O->beta;
+    }
 
     virtual void recompute_matrix(state_t& ST)
     {
@@ -1297,23 +2369,18 @@ struct ElementEDipole : public MomentElementBase
 
         //value_mat R;
 
-        bool   ver         = conf().get<double>("ver") == 1.0;
-        double L           = conf().get<double>("L")*MtoMM,
-               phi         = conf().get<double>("phi")*M_PI/180e0,
+        bool   ver         = this->ver == 1.0;
+        double L           = length*MtoMM,
+               phi         = this->phi*M_PI/180e0,
                // fit to TLM unit.
-               fringe_x    = conf().get<double>("fringe_x", 0e0)/MtoMM,
-               fringe_y    = conf().get<double>("fringe_y", 0e0)/MtoMM,
-               kappa       = conf().get<double>("asym_fac", 0e0),
+               fringe_x    = this->fringe_x/MtoMM,
+               fringe_y    = this->fringe_y/MtoMM,
+               kappa       = asym_fac,
                // spher: cylindrical - 0, spherical - 1.
-               spher       = conf().get<double>("spher"),
+               spher       = this->spher,
                // magnetic - 0, electrostatic - 1.
                h           = 1e0,
-               dip_beta    = conf().get<double>("beta", ST.ref.beta);
-
-        unsigned HdipoleFitMode = get_flag(conf(), "HdipoleFitMode", 1);
-
-        if (HdipoleFitMode != 0 && HdipoleFitMode != 1)
-            throw std::runtime_error(SB()<< "Undefined HdipoleFitMode: " << HdipoleFitMode);
+               dip_beta    = std::isnan(beta) ? ST.ref.beta : beta;
 
         if (HdipoleFitMode) dip_beta = ST.ref.beta;
 
@@ -1369,38 +2436,62 @@ struct ElementEQuad : public MomentElementBase
     typedef MomentElementBase       base_t;
     typedef typename base_t::state_t state_t;
 
-    ElementEQuad(const Config& c) : base_t(c) {}
+    ElementEQuad(const Config& c) : base_t(c), ncurve(0), V(0e0), radius(0e0) {
+        ParamBinder P(c);
+        bind(P);
+        if (ncurve != 0)
+            curve.load(c, ncurve);
+    }
     virtual ~ElementEQuad() {}
     virtual const char* type_name() const {return "equad";}
 
-    virtual void assign(const ElementVoid *other) { base_t::assign(other); }
+    unsigned ncurve;
+    CurveProfile curve; // V/R^2 profile, if ncurve!=0
+    double V,      // [V], if ncurve==0
+           radius; // [m], if ncurve==0
+
+    virtual void bind(ParamBinder& P) {
+        base_t::bind(P);
+        P(key_L, length);
+        P.flag(key_ncurve, ncurve, 0);
+        if (ncurve == 0) {
+            P(key_V,      V);
+            P(key_radius, radius);
+        }
+    }
+
+    virtual void assign(const ElementVoid *other) {
+        base_t::assign(other);
+        const self_t* O=static_cast<const self_t*>(other);
+        ncurve = O->ncurve;
+        curve  = O->curve;
+        V      = O->V;
+        radius = O->radius;
+    }
 
     virtual void recompute_matrix(state_t& ST)
     {
-        const double   L      = conf().get<double>("L")*MtoMM;
-        const unsigned ncurve = get_flag(conf(), "ncurve", 0);
+        const double   L      = length*MtoMM;
 
         if (ncurve != 0) {
-            std::vector<std::vector<double> > Curves;
-            std::vector<double> Scales;
-            GetCurveData(conf(), ncurve, Scales, Curves);
+            const double dL = L/double(curve.nsample);
 
             for(size_t i=0; i<last_real_in.size(); i++) {
-                double K;
-                double dL = L/double(Curves[0].size()),
-                       Brho = ST.real[i].Brho();
+                const double Brho = ST.real[i].Brho();
                 transfer[i] = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-                for (size_t j=0; j<Curves[0].size(); j++){
-                    K = 0.0;
-                    for (size_t n=0; n<Curves.size(); n++) K += 2e0*Scales[n]*Curves[n][j]/(C0*ST.real[i].beta)/Brho/sqr(MtoMM);
+                // one slice for each run of equal field
+                for (size_t j=0; j<curve.field.size(); j++){
+                    const double K  = 2e0*curve.field[j]/(C0*ST.real[i].beta)/Brho/sqr(MtoMM),
+                                 Lj = dL*curve.count[j];
                     value_t tmstep = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
-                    GetQuadMatrix(dL,  K, (unsigned)state_t::PS_X, tmstep);
-                    GetQuadMatrix(dL, -K, (unsigned)state_t::PS_Y, tmstep);
+                    GetQuadMatrix(Lj,  K, (unsigned)state_t::PS_X, tmstep);
+                    GetQuadMatrix(Lj, -K, (unsigned)state_t::PS_Y, tmstep);
 
                     tmstep(state_t::PS_S, state_t::PS_PS) =
-                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*dL;
+                        -2e0*M_PI/(ST.real[i].SampleLambda*ST.real[i].IonEs/MeVtoeV*cube(ST.real[i].bg))*Lj;
 
-                    transfer[i] = prod(tmstep, transfer[i]);
+                    noalias(scratch) = prod(tmstep, transfer[i]);
+                    transfer[i] = scratch;
                 }
                 get_misalign(ST, ST.real[i], misalign[i], misalign_inv[i]);
                 noalias(scratch)     = prod(transfer[i], misalign[i]);
@@ -1408,8 +2499,8 @@ struct ElementEQuad : public MomentElementBase
             }
 
         } else {
-            const double V0 = conf().get<double>("V"),
-                         R  = conf().get<double>("radius");
+            const double V0 = V,
+                         R  = radius;
 
             for(size_t i=0; i<last_real_in.size(); i++) {
                 // Re-initialize transport matrix.
@@ -1448,6 +2539,7 @@ struct ElementTMatrix : public MomentElementBase
     ElementTMatrix(const Config& c) : base_t(c) {}
     virtual ~ElementTMatrix() {}
     virtual const char* type_name() const {return "tmatrix";}
+    virtual linearity_t linearity() const { return Linear; }
 
     virtual void assign(const ElementVoid *other) { base_t::assign(other); }
 
@@ -2,9 +2,11 @@
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/numeric/ublas/lu.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "flame/constants.h"
 #include "flame/moment.h"
+#include "flame/moment_sup.h"
 
 #define sqr(x)  ((x)*(x))
 #define cube(x) ((x)*(x)*(x))
@@ -16,6 +18,8 @@
 #endif
 
 std::map<std::string,boost::shared_ptr<Config> > CurveMap;
+// guards CurveMap
+static boost::mutex CurveMapLock;
 
 // http://www.crystalclearsoftware.com/cgi-bin/boost_wiki/wiki.pl?LU_Matrix_Inversion
 // by LU-decomposition.
@@ -35,19 +39,50 @@ void inverse(MomentElementBase::value_t& out, const MomentElementBase::value_t&
     lu_substitute(scratch, pm, out);
 }
 
-void RotMat(const double dx, const double dy,
-            const double theta_x, const double theta_y, const double theta_z,
-            typename MomentElementBase::value_t &R)
+void inverse(moment_matrix<Dual>::type& out, const moment_matrix<Dual>::type& in)
+{
+    const size_t N = in.size1();
+    MomentElementBase::value_t V(N, N), D(N, N), VI(N, N), scratch(N, N);
+
+    for(size_t i=0; i<N; i++) {
+        for(size_t j=0; j<N; j++) {
+            V(i,j) = in(i,j).v;
+            D(i,j) = in(i,j).d;
+        }
+    }
+
+    inverse(VI, V);
+    noalias(scratch) = prod(D, VI);
+    noalias(D)       = prod(VI, scratch);
+
+    out.resize(N, N);
+    for(size_t i=0; i<N; i++)
+        for(size_t j=0; j<N; j++)
+            out(i,j) = Dual(VI(i,j), -D(i,j));
+}
+
+void dual_deriv(const moment_matrix<Dual>::type& in, MomentElementBase::value_t& out)
+{
+    out.resize(in.size1(), in.size2());
+    for(size_t i=0; i<in.size1(); i++)
+        for(size_t j=0; j<in.size2(); j++)
+            out(i,j) = in(i,j).d;
+}
+
+template<typename T>
+void RotMat(const T dx, const T dy,
+            const T theta_x, const T theta_y, const T theta_z,
+            typename moment_matrix<T>::type &R)
 {
     typedef typename MomentElementBase::state_t state_t;
 
-    MomentState::matrix_t T = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+    typename moment_matrix<T>::type M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
 
-    R = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+    R = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
 
     // Left-handed coordinate system => theta_y -> -theta_y.
 
-    double m11 =  cos(-theta_y)*cos(theta_z),
+    T   m11 =  cos(-theta_y)*cos(theta_z),
            m12 =  sin(theta_x)*sin(-theta_y)*cos(theta_z) + cos(theta_x)*sin(theta_z),
            m13 = -cos(theta_x)*sin(-theta_y)*cos(theta_z) + sin(theta_x)*sin(theta_z),
 
@@ -67,53 +102,23 @@ void RotMat(const double dx, const double dy,
     R(3, 1) = m21, R(3, 3) = m22, R(3, 5) = m23;
     R(5, 1) = m31, R(5, 3) = m32, R(5, 5) = m33;
 
-    T(0, 6) = -dx, T(2, 6) = -dy;
+    M(0, 6) = -dx, M(2, 6) = -dy;
 
-    R = prod(R, T);
+    R = prod(R, M);
 }
 
 
-void GetQuadMatrix(const double L, const double K, const unsigned ind, typename MomentElementBase::value_t &M)
+template<typename T>
+void GetQuadMatrix(const T L, const T K, const unsigned ind, typename moment_matrix<T>::type &M)
 {
     // 2D quadrupole transport matrix.
-    double sqrtK,
-           psi,
-           cs,
-           sn;
-
-    if (K > 0e0) {
-        // Focusing.
-        sqrtK = sqrt(K);
-        psi = sqrtK*L;
-        cs = ::cos(psi);
-        sn = ::sin(psi);
+    T M11, M12, M21;
 
-        M(ind, ind) = M(ind+1, ind+1) = cs;
-        if (sqrtK != 0e0)
-            M(ind, ind+1) = sn/sqrtK;
-        else
-            M(ind, ind+1) = L;
-        if (sqrtK != 0e0)
-            M(ind+1, ind) = -sqrtK*sn;
-        else
-            M(ind+1, ind) = 0e0;
-    } else {
-        // Defocusing.
-        sqrtK = sqrt(-K);
-        psi = sqrtK*L;
-        cs = ::cosh(psi);
-        sn = ::sinh(psi);
-
-        M(ind, ind) = M(ind+1, ind+1) = cs;
-        if (sqrtK != 0e0)
-            M(ind, ind+1) = sn/sqrtK;
-        else
-            M(ind, ind+1) = L;
-        if (sqrtK != 0e0)
-            M(ind+1, ind) = sqrtK*sn;
-        else
-            M(ind+1, ind) = 0e0;
-    }
+    GetQuadBlock(L, K, M11, M12, M21);
+
+    M(ind, ind) = M(ind+1, ind+1) = M11;
+    M(ind, ind+1) = M12;
+    M(ind+1, ind) = M21;
 }
 
 void GetSextMatrix(const double L, const double K3, double Dx, double Dy,
@@ -189,11 +194,12 @@ void GetSextMatrix(const double L, const double K3, double Dx, double Dy,
     }
 }
 
-void GetEdgeMatrix(const double rho, const double phi, typename MomentElementBase::value_t &M)
+template<typename T>
+void GetEdgeMatrix(const T rho, const T phi, typename moment_matrix<T>::type &M)
 {
     typedef typename MomentElementBase::state_t state_t;
 
-    M = boost::numeric::ublas::identity_matrix<double>(state_t::maxsize);
+    M = boost::numeric::ublas::identity_matrix<T>(state_t::maxsize);
 
     M(state_t::PS_PX, state_t::PS_X) =  tan(phi)/rho;
     M(state_t::PS_PY, state_t::PS_Y) = -tan(phi)/rho;
@@ -214,15 +220,16 @@ void GetEEdgeMatrix(const double fringe_x, const double fringe_y, const double k
 }
 
 
-void GetSBendMatrix(const double L, const double phi, const double phi1, const double phi2, const double K,
+template<typename T>
+void GetSBendMatrix(const T L, const T phi, const T phi1, const T phi2, const T K,
                     const double IonEs, const double ref_gamma, const double qmrel,
-                    const double dip_beta, const double dip_gamma, const double d, const double dip_IonK, typename MomentElementBase::value_t &M)
+                    const double dip_beta, const double dip_gamma, const double d, const double dip_IonK, typename moment_matrix<T>::type &M)
 {
     typedef typename MomentElementBase::state_t state_t;
 
-    MomentState::matrix_t edge1, edge2, R;
+    typename moment_matrix<T>::type edge1, edge2;
 
-    double  rho = L/phi,
+    T       rho = L/phi,
             Kx  = K + 1e0/sqr(rho),
             Ky  = -K,
             dx  = 0e0,
@@ -273,12 +280,13 @@ void GetSBendMatrix(const double L, const double phi, const double phi1, const d
 }
 
 
-void GetSolMatrix(const double L, const double K, typename MomentElementBase::value_t &M)
+template<typename T>
+void GetSolMatrix(const T L, const T K, typename moment_matrix<T>::type &M)
 {
     typedef typename MomentElementBase::state_t state_t;
 
-    double C = ::cos(K*L),
-           S = ::sin(K*L);
+    T C = ::cos(K*L),
+      S = ::sin(K*L);
 
     M(state_t::PS_X, state_t::PS_X)
             = M(state_t::PS_PX, state_t::PS_PX)
@@ -294,7 +302,7 @@ void GetSolMatrix(const double L, const double K, typename MomentElementBase::va
     if (K != 0e0)
         M(state_t::PS_X, state_t::PS_PY) = sqr(S)/K;
     else
-        M(state_t::PS_X, state_t::PS_PY) = 0e0;
+        M(state_t::PS_X, state_t::PS_PY) = K*sqr(L); // ie. 0, written in terms of K for the derivative
 
     M(state_t::PS_PX, state_t::PS_X)  = -K*S*C;
     M(state_t::PS_PX, state_t::PS_Y)  = -K*sqr(S);
@@ -304,7 +312,7 @@ void GetSolMatrix(const double L, const double K, typename MomentElementBase::va
     if (K != 0e0)
         M(state_t::PS_Y, state_t::PS_PX) = -sqr(S)/K;
     else
-        M(state_t::PS_Y, state_t::PS_PX) = 0e0;
+        M(state_t::PS_Y, state_t::PS_PX) = 0e0 - K*sqr(L);
     if (K != 0e0)
         M(state_t::PS_Y, state_t::PS_PY) = S*C/K;
     else
@@ -319,6 +327,19 @@ void GetSolMatrix(const double L, const double K, typename MomentElementBase::va
 //        M(state_t::PS_S, state_t::PS_S) = L;
 }
 
+#define INST_KERNELS(T) \
+template void RotMat<T>(const T, const T, const T, const T, const T, moment_matrix<T>::type&); \
+template void GetQuadMatrix<T>(const T, const T, const unsigned, moment_matrix<T>::type&); \
+template void GetEdgeMatrix<T>(const T, const T, moment_matrix<T>::type&); \
+template void GetSBendMatrix<T>(const T, const T, const T, const T, const T, \
+                                const double, const double, const double, \
+                                const double, const double, const double, const double, moment_matrix<T>::type&); \
+template void GetSolMatrix<T>(const T, const T, moment_matrix<T>::type&);
+
+INST_KERNELS(double)
+INST_KERNELS(Dual)
+
+#undef INST_KERNELS
 
 void GetEBendMatrix(const double L, const double phi, const double fringe_x, const double fringe_y, const double kappa,
                     const double Kx, const double Ky, const double IonEs, const double real_gamma, const double eta0, const double h,
@@ -396,6 +417,7 @@ void GetCurveData(const Config &c, const unsigned ncurve, std::vector<double> &S
         std::string CurveFile =  c.get<std::string>("Eng_Data_Dir", defpath);
         CurveFile += "/" + filename;
         std::string key(SB()<<CurveFile<<"|"<<boost::filesystem::last_write_time(CurveFile));
+        boost::mutex::scoped_lock L(CurveMapLock);
         if ( CurveMap.find(key) == CurveMap.end() ) {
             // not found in CurveMap
             try {
@@ -451,4 +473,27 @@ void GetCurveData(const Config &c, const unsigned ncurve, std::vector<double> &S
 
         Scales.push_back(c.get<double>("scl_fac"+num, 0.0));
     }
-}
\ No newline at end of file
+}
+
+void CurveProfile::load(const Config &c, const unsigned ncurve)
+{
+    std::vector<std::vector<double> > Curves;
+    std::vector<double> Scales;
+    GetCurveData(c, ncurve, Scales, Curves);
+
+    field.clear();
+    count.clear();
+    nsample = Curves[0].size();
+
+    for (size_t j=0; j<nsample; j++) {
+        double F = 0.0;
+        for (size_t n=0; n<Curves.size(); n++) F += Scales[n]*Curves[n][j];
+
+        if (!field.empty() && field.back() == F) {
+            count.back()++;
+        } else {
+            field.push_back(F);
+            count.push_back(1);
+        }
+    }
+}
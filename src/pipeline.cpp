@@ -0,0 +1,233 @@
+#include <algorithm>
+
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include "flame/pipeline.h"
+
+namespace {
+
+// Spin, then yield, then sleep while waiting on a queue
+struct Backoff {
+    unsigned n;
+    Backoff() :n(0) {}
+    void operator()()
+    {
+        if(n<64) {
+            n++;
+        } else if(n<128) {
+            n++;
+            boost::this_thread::yield();
+        } else {
+            boost::this_thread::sleep(boost::posix_time::microseconds(50));
+        }
+    }
+};
+
+void wait_push(Pipeline::queue_t& Q, const Pipeline::Item& I)
+{
+    Backoff wait;
+    while(!Q.push(I))
+        wait();
+}
+
+void wait_pop(Pipeline::queue_t& Q, Pipeline::Item& I)
+{
+    Backoff wait;
+    while(!Q.pop(I))
+        wait();
+}
+
+} // namespace
+
+struct Pipeline::Worker {
+    const Machine *M;
+    size_t first, last;
+    queue_t *in, *out;
+
+    void operator()()
+    {
+        Item I;
+        do {
+            wait_pop(*in, I);
+
+            if(I.state && !I.stopped && I.error.empty()) {
+                try {
+                    Propagation P(*M, I.state, first, last-first);
+                    P.step((size_t)-1);
+                    I.stopped = I.state->next_elem!=last || (*M)[last-1]->check_loss(*I.state);
+                } catch(std::exception& e) {
+                    I.error = SB()<<"Propagation failed in elements ["<<first<<", "<<last<<") : "<<e.what();
+                }
+            }
+
+            wait_push(*out, I);
+        } while(I.state);
+    }
+};
+
+Pipeline::Pipeline(const Machine& M, unsigned nsegments, size_t start, int max, size_t depth)
+    :npending(0)
+{
+    const size_t nelem = M.size();
+    if(start>=nelem)
+        throw std::invalid_argument(SB()<<"Pipeline start element index out of range: "<<start);
+    if(max<0)
+        throw std::invalid_argument("Pipeline supports only forward propagation");
+    if(depth==0)
+        throw std::invalid_argument("Pipeline queue depth must not be zero");
+
+    const size_t count = std::min(size_t(max), nelem-start);
+    if(count==0)
+        throw std::invalid_argument("Pipeline has no elements");
+
+    size_t N = nsegments ? nsegments : std::max(1u, boost::thread::hardware_concurrency());
+    N = std::min(N, count);
+
+    bounds.resize(N+1);
+    for(size_t i=0; i<=N; i++)
+        bounds[i] = start + i*count/N;
+
+    try {
+        for(size_t i=0; i<=N; i++)
+            queues.push_back(new queue_t(depth));
+
+        for(size_t i=0; i<N; i++) {
+            Worker W;
+            W.M = &M;
+            W.first = bounds[i];
+            W.last = bounds[i+1];
+            W.in = queues[i];
+            W.out = queues[i+1];
+            workers.create_thread(W);
+        }
+    } catch(...) {
+        // workers are interrupted while waiting for the first State
+        workers.interrupt_all();
+        workers.join_all();
+        for(size_t i=0; i<queues.size(); i++)
+            delete queues[i];
+        throw;
+    }
+}
+
+Pipeline::~Pipeline()
+{
+    stop();
+    for(size_t i=0; i<queues.size(); i++)
+        delete queues[i];
+}
+
+void Pipeline::stop()
+{
+    // pass a NULL State through each segment, discarding any States in flight
+    const Item end;
+    queue_t& out = *queues.back();
+    Backoff wait;
+    bool pushed = false;
+    Item I;
+    while(true) {
+        if(!pushed)
+            pushed = queues[0]->push(end);
+        if(out.pop(I)) {
+            if(!I.state)
+                break;
+        } else {
+            wait();
+        }
+    }
+    workers.join_all();
+    npending = 0;
+}
+
+StateBase* Pipeline::take(const Item& I)
+{
+    npending--;
+    if(!I.error.empty())
+        throw std::runtime_error(I.error);
+    return I.state;
+}
+
+void Pipeline::push(StateBase* S)
+{
+    if(!S)
+        throw std::invalid_argument("Pipeline can't propagate NULL");
+    // counted first, so a State is never taken before it is counted
+    npending++;
+    try {
+        wait_push(*queues[0], Item(S));
+    } catch(...) {
+        npending--;
+        throw;
+    }
+}
+
+bool Pipeline::try_push(StateBase* S)
+{
+    if(!S)
+        throw std::invalid_argument("Pipeline can't propagate NULL");
+    npending++;
+    if(!queues[0]->push(Item(S))) {
+        npending--;
+        return false;
+    }
+    return true;
+}
+
+StateBase* Pipeline::pop()
+{
+    if(npending==0)
+        throw std::logic_error("Pipeline::pop() with no States pending");
+    Item I;
+    wait_pop(*queues.back(), I);
+    return take(I);
+}
+
+bool Pipeline::try_pop(StateBase*& S)
+{
+    Item I;
+    if(!queues.back()->pop(I))
+        return false;
+    S = take(I);
+    return true;
+}
+
+void Pipeline::propagate(const std::vector<StateBase*>& states)
+{
+    if(npending!=0)
+        throw std::logic_error("Pipeline::propagate() with States pending");
+
+    std::string error;
+    size_t in = 0, out = 0;
+    Backoff wait;
+
+    // alternate, so that a full queue can't block the single caller
+    while(out<states.size()) {
+        bool progress = false;
+
+        if(in<states.size() && try_push(states[in])) {
+            in++;
+            progress = true;
+        }
+
+        try {
+            StateBase *S;
+            if(try_pop(S)) {
+                out++;
+                progress = true;
+            }
+        } catch(std::runtime_error& e) {
+            out++;
+            progress = true;
+            if(error.empty())
+                error = e.what();
+        }
+
+        if(progress)
+            wait.n = 0;
+        else
+            wait();
+    }
+
+    if(!error.empty())
+        throw std::runtime_error(error);
+}
@@ -0,0 +1,656 @@
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/numeric/ublas/matrix_proxy.hpp>
+
+#include "flame/response.h"
+#include "flame/moment_sup.h"
+#include "flame/rf_cavity.h"
+
+namespace {
+
+typedef ResponseMatrix::Knob Knob;
+typedef boost::shared_ptr<MomentState> state_ptr;
+// observation numbers at each element index
+typedef std::vector<std::vector<size_t> > obs_map_t;
+
+// Change a knob parameter, and restore it when destroyed
+struct KnobChange {
+    Machine& M;
+    const Knob& K;
+    const double base;
+    KnobChange(Machine& M, const Knob& K, double base, double delta)
+        :M(M), K(K), base(base)
+    {
+        M.setParam(K.index, K.name, base+delta);
+    }
+    ~KnobChange()
+    {
+        try {
+            M.setParam(K.index, K.name, base);
+        } catch(std::exception& e) {
+            FLAME_LOG(ERROR)<<"Failed to restore element "<<K.index<<" "<<K.name<<" : "<<e.what();
+        }
+    }
+};
+
+// Pass ST through elements [ST.next_elem, last].  Store moment0_env after observation elements in env[]
+void track_env(Machine& M, MomentState& ST, size_t last, const obs_map_t& obs,
+               std::vector<MomentState::vector_t>& env)
+{
+    ST.retreat = false;
+    while(ST.next_elem<=last) {
+        const size_t i = ST.next_elem++;
+        M[i]->advance(ST);
+
+        for(size_t o=0; o<obs[i].size(); o++)
+            env[obs[i][o]] = ST.moment0_env;
+    }
+}
+
+// Finite difference knobs shared by all threads
+struct FDQueue {
+    ResponseMatrix *R;
+    const std::vector<size_t> *todo; // knob numbers
+    const std::vector<state_ptr> *inputs; // by element index
+    const std::vector<double> *base; // by knob number
+    const obs_map_t *obs;
+    size_t last;
+    Config conf; // for private Machine copies
+
+    boost::mutex lock;
+    size_t next;       // guarded by lock
+    std::string error; // guarded by lock. First error seen
+};
+
+struct FDWorker {
+    FDQueue *Q;
+    Machine *M; // NULL to construct a private copy
+
+    void operator()() const
+    {
+        ResponseMatrix& R = *Q->R;
+        const size_t nobs = R.observe.size(), nknobs = R.knobs.size();
+
+        std::auto_ptr<Machine> copy;
+        Machine *M = this->M;
+
+        std::vector<MomentState::vector_t> plus(nobs), minus(nobs);
+
+        while(true) {
+            size_t j;
+            {
+                boost::mutex::scoped_lock L(Q->lock);
+                if(Q->next>=Q->todo->size() || !Q->error.empty())
+                    return;
+                j = (*Q->todo)[Q->next++];
+            }
+            const Knob& K = R.knobs[j];
+            try {
+                if(!M) {
+                    copy.reset(new Machine(Q->conf));
+                    M = copy.get();
+                }
+                const MomentState& in = *(*Q->inputs)[K.index];
+
+                for(int sign=-1; sign<=1; sign+=2) {
+                    KnobChange C(*M, K, (*Q->base)[j], sign*K.step);
+
+                    std::auto_ptr<MomentState> ST(in.clone());
+                    ST->next_elem = K.index;
+                    track_env(*M, *ST, Q->last, *Q->obs, sign<0 ? minus : plus);
+                }
+
+                // each thread writes distinct columns
+                std::vector<double>& resp = R.response;
+                for(size_t o=0; o<nobs; o++) {
+                    if(R.observe[o]<K.index)
+                        continue;
+                    for(size_t i=0; i<MomentState::maxsize; i++)
+                        resp[(o*MomentState::maxsize + i)*nknobs + j] = (plus[o][i]-minus[o][i])/(2e0*K.step);
+                }
+            } catch(std::exception& e) {
+                boost::mutex::scoped_lock L(Q->lock);
+                if(Q->error.empty())
+                    Q->error = SB()<<"Knob "<<j<<" element "<<K.index<<" '"<<K.name<<"' : "<<e.what();
+            }
+        }
+    }
+};
+
+// Response of moment0 of each charge state to one knob, propagated with transfer matrices
+struct Column {
+    size_t knob;
+    std::vector<MomentState::vector_t> dm;
+};
+
+} // namespace
+
+void ResponseMatrix::compute(Machine& M, const MomentState& ST)
+{
+    using namespace boost::numeric::ublas;
+
+    const size_t nobs = observe.size(), nknobs = knobs.size(), nelem = M.size();
+
+    response.assign(nobs*MomentState::maxsize*nknobs, 0e0);
+    analytic.assign(nknobs, true);
+
+    if(nobs==0 || nknobs==0)
+        return;
+
+    size_t last = 0;
+    for(size_t o=0; o<nobs; o++) {
+        if(observe[o]>=nelem)
+            throw std::invalid_argument(SB()<<"Observation element index out of range: "<<observe[o]);
+        last = std::max(last, observe[o]);
+    }
+
+    obs_map_t obs(last+1);
+    for(size_t o=0; o<nobs; o++)
+        obs[observe[o]].push_back(o);
+
+    // linear[i] if elements [i, last] are all Linear
+    std::vector<bool> linear(last+2, true);
+    for(size_t i=last+1; i>0; i--) {
+        MomentElementBase* E = dynamic_cast<MomentElementBase*>(M[i-1]);
+        if(!E)
+            throw std::invalid_argument(SB()<<"Element "<<(i-1)<<" is not a MomentMatrix element");
+        linear[i-1] = linear[i] && E->linearity()!=MomentElementBase::NonLinear;
+    }
+
+    std::vector<std::vector<size_t> > knobs_at(last+1);
+    std::vector<double> base(nknobs);
+    std::vector<size_t> todo;
+    for(size_t j=0; j<nknobs; j++) {
+        const Knob& K = knobs[j];
+        if(K.index>=nelem)
+            throw std::invalid_argument(SB()<<"Knob element index out of range: "<<K.index);
+        if(K.step==0e0)
+            throw std::invalid_argument(SB()<<"Knob "<<j<<" has zero step");
+        if(K.index>last)
+            continue; // not observed
+        base[j] = M.getParam(K.index, K.name);
+        knobs_at[K.index].push_back(j);
+        if(!linear[K.index]) {
+            analytic[j] = false;
+            todo.push_back(j);
+        }
+    }
+
+    // The reference propagation.  Start analytic columns, and save the input of finite difference knobs.
+    std::vector<state_ptr> inputs(last+1);
+    std::vector<Column> active;
+    {
+        std::auto_ptr<MomentState> S(ST.clone());
+        S->next_elem = 0;
+        S->retreat = false;
+
+        std::auto_ptr<MomentState> P;
+
+        for(size_t i=0; i<=last; i++) {
+            if(!knobs_at[i].empty())
+                inputs[i].reset(S->clone());
+
+            S->next_elem = i+1;
+            M[i]->advance(*S);
+
+            for(size_t c=0; c<active.size(); c++) {
+                Column& C = active[c];
+                for(size_t k=0; k<C.dm.size(); k++)
+                    C.dm[k] = prod(S->transmat[k], C.dm[k]);
+            }
+
+            for(size_t n=0; n<knobs_at[i].size(); n++) {
+                const size_t j = knobs_at[i][n];
+                if(!analytic[j])
+                    continue;
+                const Knob& K = knobs[j];
+
+                active.push_back(Column());
+                Column& C = active.back();
+                C.knob = j;
+
+                for(int sign=-1; sign<=1; sign+=2) {
+                    KnobChange change(M, K, base[j], sign*K.step);
+                    P.reset(inputs[i]->clone());
+                    P->next_elem = i+1;
+                    M[i]->advance(*P);
+
+                    if(sign<0) {
+                        C.dm = P->moment0;
+                    } else {
+                        for(size_t k=0; k<C.dm.size(); k++)
+                            C.dm[k] = (P->moment0[k] - C.dm[k])/(2e0*K.step);
+                    }
+                }
+            }
+
+            if(obs[i].empty() || active.empty())
+                continue;
+
+            // weighted as MomentState::calc_rms()
+            double totQ = 0e0;
+            for(size_t k=0; k<S->size(); k++)
+                totQ += S->real[k].IonQ;
+
+            for(size_t c=0; c<active.size(); c++) {
+                const Column& C = active[c];
+                MomentState::vector_t denv(zero_vector<double>(MomentState::maxsize));
+                for(size_t k=0; k<C.dm.size(); k++)
+                    denv += C.dm[k]*S->real[k].IonQ;
+                denv /= totQ;
+
+                for(size_t n=0; n<obs[i].size(); n++) {
+                    const size_t o = obs[i][n];
+                    for(size_t r=0; r<MomentState::maxsize; r++)
+                        response[(o*MomentState::maxsize + r)*nknobs + C.knob] = denv[r];
+                }
+            }
+        }
+    }
+
+    if(todo.empty())
+        return;
+
+    FDQueue Q;
+    Q.R = this;
+    Q.todo = &todo;
+    Q.inputs = &inputs;
+    Q.base = &base;
+    Q.obs = &obs;
+    Q.last = last;
+    Q.next = 0;
+
+    size_t nthreads = this->nthreads ? this->nthreads : std::max(1u, boost::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, todo.size());
+
+    if(nthreads>1) {
+        // Machine copies only need elements [0, last]
+        Config::vector_t elems(last+1);
+        for(size_t i=0; i<=last; i++)
+            elems[i] = M[i]->conf();
+        Q.conf = M.conf();
+        Q.conf.set<Config::vector_t>("elements", elems);
+    }
+
+    FDWorker W;
+    W.Q = &Q;
+    W.M = NULL;
+
+    boost::thread_group workers;
+    try {
+        for(size_t t=1; t<nthreads; t++)
+            workers.create_thread(W);
+    } catch(...) {
+        {
+            boost::mutex::scoped_lock L(Q.lock);
+            Q.next = todo.size();
+        }
+        workers.join_all();
+        throw;
+    }
+
+    // this thread uses M
+    W.M = &M;
+    W();
+
+    workers.join_all();
+
+    if(!Q.error.empty())
+        throw std::runtime_error(Q.error);
+}
+
+namespace {
+typedef MomentGradient::Param Param;
+
+// Element index of each parameter.  Returns the end of propagation
+size_t param_map(Machine& M, const std::vector<Param>& params, size_t start, int max,
+                 std::vector<std::vector<size_t> >& params_at)
+{
+    const size_t nelem = M.size();
+    if(max<0)
+        throw std::invalid_argument("Derivatives are supported only for forward propagation");
+    const size_t end = std::min(nelem, start+std::min(size_t(max), nelem));
+
+    params_at.clear();
+    params_at.resize(nelem);
+    for(size_t j=0; j<params.size(); j++) {
+        if(params[j].index<start || params[j].index>=end)
+            throw std::invalid_argument(SB()<<"Parameter "<<j<<" element index "<<params[j].index<<" not propagated");
+        params_at[params[j].index].push_back(j);
+    }
+    return end;
+}
+
+// An rfcavity which derivatives may pass, or NULL
+const ElementRFCavity* diff_cavity(const MomentElementBase* E)
+{
+    const ElementRFCavity *C = dynamic_cast<const ElementRFCavity*>(E);
+    return C && !C->EmitGrowth ? C : NULL;
+}
+
+// Element i, which must be linear, or a diff_cavity(), if 'seeded' (after a parameter)
+MomentElementBase* diff_element(Machine& M, size_t i, bool seeded)
+{
+    MomentElementBase* E = dynamic_cast<MomentElementBase*>(M[i]);
+    if(!E)
+        throw std::invalid_argument(SB()<<"Element "<<i<<" is not a MomentMatrix element");
+    if(seeded && E->linearity()==MomentElementBase::NonLinear && !diff_cavity(E))
+        throw std::invalid_argument(SB()<<"Element "<<i<<" '"<<E->name<<"' can't be differentiated through");
+    return E;
+}
+
+// Map of d moment0 through element E, which has just advanced ST.
+// ST.transmat, except for a cavity, which replaces moment0[PS_S] and [PS_PS] with the
+// phase and energy of each charge state, so these don't depend on the input moments.
+void moment0_map(const MomentElementBase* E, const MomentState& ST, std::vector<MomentState::matrix_t>& T0)
+{
+    using namespace boost::numeric::ublas;
+    T0.assign(ST.transmat.begin(), ST.transmat.begin()+ST.size());
+    if(E->linearity()!=MomentElementBase::NonLinear)
+        return;
+    for(size_t k=0; k<ST.size(); k++) {
+        MomentState::matrix_t A(prod(E->transfer[k], E->misalign[k]));
+        row(A, MomentState::PS_S)  = zero_vector<double>(MomentState::maxsize);
+        row(A, MomentState::PS_PS) = zero_vector<double>(MomentState::maxsize);
+        T0[k] = prod(E->misalign_inv[k], A);
+    }
+}
+
+/* The transfer matrix of a cavity depends on the phases of the charge states,
+ * which are changed by "L", and by a change of moment0[PS_S] across a bend (see LinearPhase).
+ * For each parameter, follow which components of its moment0 derivative may be non-zero,
+ * and refuse to pass a cavity once the phases may have changed.
+ */
+struct PhaseTrack {
+    std::vector<unsigned> mask; // bit n set if d moment0[n] may be non-zero
+    std::vector<bool> seeded, phase;
+
+    explicit PhaseTrack(size_t nparams) :mask(nparams, 0), seeded(nparams, false), phase(nparams, false) {}
+
+    // derivatives of parameter j are seeded after its element E
+    void seed(size_t j, const MomentElementBase* E, const std::string& name,
+              const std::vector<MomentState::vector_t>& dm0)
+    {
+        unsigned m = 0;
+        for(size_t k=0; k<dm0.size(); k++)
+            for(size_t n=0; n<MomentState::maxsize; n++)
+                if(dm0[k][n]!=0e0)
+                    m |= 1u<<n;
+        seeded[j] = true;
+        mask[j] = m;
+        phase[j] = name=="L" || (E->linearity()==MomentElementBase::LinearPhase && (m & (1u<<MomentState::PS_S)));
+    }
+
+    // element i has passed the derivatives with the maps T0 (see moment0_map())
+    void advance(size_t i, const MomentElementBase* E, const std::vector<MomentState::matrix_t>& T0)
+    {
+        for(size_t j=0; j<mask.size(); j++) {
+            if(!seeded[j])
+                continue;
+            if(phase[j] && E->linearity()==MomentElementBase::NonLinear)
+                throw std::invalid_argument(SB()<<"Parameter "<<j<<" may change the phase of the charge states,"
+                                            " so can't be differentiated through element "<<i<<" '"<<E->name<<"'");
+            unsigned out = 0;
+            for(size_t k=0; k<T0.size(); k++)
+                for(size_t r=0; r<MomentState::maxsize; r++)
+                    for(size_t c=0; c<MomentState::maxsize; c++)
+                        if((mask[j] & (1u<<c)) && T0[k](r, c)!=0e0)
+                            out |= 1u<<r;
+            if(E->linearity()==MomentElementBase::LinearPhase && ((mask[j]|out) & (1u<<MomentState::PS_S)))
+                phase[j] = true;
+            mask[j] = out;
+        }
+    }
+};
+
+void param_derivative(MomentElementBase* E, const Param& P, std::vector<MomentElementBase::value_t>& dT)
+{
+    if(!E->transfer_derivative(P.name, dT))
+        throw std::invalid_argument(SB()<<"Element "<<P.index<<" '"<<E->name<<"' can't differentiate '"<<P.name<<"'");
+}
+
+// Derivatives of the moments of each charge state with respect to one parameter
+struct Tangent {
+    std::vector<MomentState::vector_t> dm0;
+    std::vector<MomentState::matrix_t> dm1;
+    bool seeded;
+    Tangent() :seeded(false) {}
+};
+} // namespace
+
+void MomentGradient::compute(Machine& M, MomentState& ST, size_t start, int max)
+{
+    using namespace boost::numeric::ublas;
+    typedef MomentState::matrix_t matrix_t;
+    typedef MomentState::vector_t vector_t;
+
+    const size_t nparams = params.size();
+    std::vector<std::vector<size_t> > params_at;
+    const size_t end = param_map(M, params, start, max, params_at);
+
+    std::vector<Tangent> tangents(nparams);
+    std::vector<MomentElementBase::value_t> dT;
+    std::vector<matrix_t> T0;
+    PhaseTrack track(nparams);
+    bool seeded = false;
+
+    ST.retreat = false;
+    for(size_t i=start; i<end; i++) {
+        MomentElementBase* E = diff_element(M, i, seeded);
+
+        std::vector<vector_t> m0_in;
+        std::vector<matrix_t> m1_in;
+        if(!params_at[i].empty()) {
+            m0_in = ST.moment0;
+            m1_in = ST.moment1;
+        }
+
+        ST.next_elem = i+1;
+        M[i]->advance(ST);
+
+        if(seeded) {
+            moment0_map(E, ST, T0);
+            track.advance(i, E, T0);
+        }
+
+        for(size_t j=0; j<nparams; j++) {
+            Tangent& D = tangents[j];
+            if(!D.seeded)
+                continue;
+            for(size_t k=0; k<D.dm0.size(); k++) {
+                const matrix_t& T = ST.transmat[k];
+                D.dm0[k] = prod(T0[k], D.dm0[k]);
+                const matrix_t scratch(prod(T, D.dm1[k]));
+                D.dm1[k] = prod(scratch, trans(T));
+            }
+        }
+
+        for(size_t n=0; n<params_at[i].size(); n++) {
+            const size_t j = params_at[i][n];
+            Tangent& D = tangents[j];
+
+            param_derivative(E, params[j], dT);
+
+            D.dm0.resize(ST.size());
+            D.dm1.resize(ST.size());
+            for(size_t k=0; k<ST.size(); k++) {
+                const matrix_t& T = ST.transmat[k];
+                D.dm0[k] = prod(dT[k], m0_in[k]);
+                // d(T M1 T^t) = dT M1 T^t + T M1 dT^t
+                const matrix_t A(prod(dT[k], m1_in[k])),
+                               B(prod(A, trans(T)));
+                D.dm1[k] = B + trans(B);
+            }
+            D.seeded = seeded = true;
+            track.seed(j, E, params[j].name, D.dm0);
+        }
+    }
+
+    // as MomentState::calc_rms()
+    double totQ = 0e0;
+    for(size_t k=0; k<ST.size(); k++)
+        totQ += ST.real[k].IonQ;
+
+    dmoment0_env.assign(nparams, zero_vector<double>(MomentState::maxsize));
+    dmoment1_env.assign(nparams, zero_matrix<double>(MomentState::maxsize));
+
+    slice S(0, 1, 6);
+    for(size_t j=0; j<nparams; j++) {
+        const Tangent& D = tangents[j];
+        if(!D.seeded)
+            continue;
+        if(D.dm0.size()!=ST.size())
+            throw std::invalid_argument(SB()<<"Number of charge states changed after parameter "<<j);
+
+        vector_t& denv = dmoment0_env[j];
+        for(size_t k=0; k<ST.size(); k++)
+            denv += D.dm0[k]*ST.real[k].IonQ;
+        denv /= totQ;
+
+        matrix_t& dM = dmoment1_env[j];
+        for(size_t k=0; k<ST.size(); k++) {
+            const vector_t diff(ST.moment0[k]-ST.moment0_env),
+                           ddiff(D.dm0[k]-denv);
+            const matrix_t dd(outer_prod(ddiff, diff));
+            project(dM, S, S) += project(ST.real[k].IonQ*(D.dm1[k] + dd + trans(dd)), S, S);
+        }
+        dM /= totQ;
+    }
+}
+
+namespace {
+// Saved by the forward pass of MomentAdjoint, for each element
+struct Tape {
+    std::vector<MomentState::vector_t> m0;   // input moment0 of each charge state, if a parameter element
+    std::vector<MomentState::matrix_t> m1;   // input moment1 of each charge state, if a parameter element
+    std::vector<MomentState::matrix_t> T;    // transfer matrix of each charge state
+    std::vector<MomentState::matrix_t> T0;   // moment0_map(), if different from T (a cavity)
+    std::vector<std::vector<MomentElementBase::value_t> > dT; // for each parameter of this element
+};
+
+// sum(A.*B)
+double inner(const MomentState::matrix_t& A, const MomentState::matrix_t& B)
+{
+    double ret = 0e0;
+    for(size_t r=0; r<A.size1(); r++)
+        for(size_t c=0; c<A.size2(); c++)
+            ret += A(r,c)*B(r,c);
+    return ret;
+}
+} // namespace
+
+void MomentAdjoint::compute(Machine& M, MomentState& ST, size_t start, int max)
+{
+    using namespace boost::numeric::ublas;
+    typedef MomentState::matrix_t matrix_t;
+    typedef MomentState::vector_t vector_t;
+
+    const size_t nparams = params.size();
+    std::vector<std::vector<size_t> > params_at;
+    const size_t end = param_map(M, params, start, max, params_at);
+
+    if(weight0.size()!=MomentState::maxsize || weight1.size1()!=MomentState::maxsize || weight1.size2()!=MomentState::maxsize)
+        throw std::invalid_argument("MomentAdjoint weights must have size 7");
+
+    gradient.assign(nparams, 0e0);
+
+    // Forward pass.  Record from the first parameter
+    size_t first = end;
+    for(size_t j=0; j<nparams; j++)
+        first = std::min(first, params[j].index);
+
+    std::vector<Tape> tape(end-std::min(first, end));
+    PhaseTrack track(nparams);
+    std::vector<matrix_t> T0;
+    std::vector<vector_t> dm0;
+
+    ST.retreat = false;
+    for(size_t i=start; i<end; i++) {
+        MomentElementBase* E = diff_element(M, i, i>first);
+
+        Tape *rec = i>=first ? &tape[i-first] : NULL;
+        if(rec && !params_at[i].empty()) {
+            rec->m0 = ST.moment0;
+            rec->m1 = ST.moment1;
+        }
+
+        ST.next_elem = i+1;
+        M[i]->advance(ST);
+
+        if(!rec)
+            continue;
+
+        rec->T.assign(ST.transmat.begin(), ST.transmat.begin()+ST.size());
+        moment0_map(E, ST, T0);
+        if(E->linearity()==MomentElementBase::NonLinear)
+            rec->T0 = T0;
+        track.advance(i, E, T0);
+
+        rec->dT.resize(params_at[i].size());
+        for(size_t n=0; n<params_at[i].size(); n++) {
+            const size_t j = params_at[i][n];
+            param_derivative(E, params[j], rec->dT[n]);
+
+            dm0.resize(ST.size());
+            for(size_t k=0; k<ST.size(); k++)
+                dm0[k] = prod(rec->dT[n][k], rec->m0[k]);
+            track.seed(j, E, params[j].name, dm0);
+        }
+
+        if(i>first && rec->T.size()!=tape[i-first-1].T.size())
+            throw std::invalid_argument(SB()<<"Number of charge states changed at element "<<i);
+    }
+
+    if(first>=end)
+        return;
+
+    // Adjoints of the final moments of each charge state.  From MomentState::calc_rms(),
+    //   J = weight0.env + sum(weight1 .* moment1_env)
+    // where the 7th row and column of moment1_env are zero.
+    double totQ = 0e0;
+    for(size_t k=0; k<ST.size(); k++)
+        totQ += ST.real[k].IonQ;
+
+    matrix_t P(weight1);
+    for(size_t n=0; n<MomentState::maxsize; n++)
+        P(6, n) = P(n, 6) = 0e0;
+    const matrix_t Psym(P + trans(P));
+
+    std::vector<vector_t> adj0(ST.size());
+    std::vector<matrix_t> adj1(ST.size());
+    for(size_t k=0; k<ST.size(); k++) {
+        const double w = ST.real[k].IonQ/totQ;
+        // env terms cancel as sum(Q*(m0-env))==0
+        const vector_t diff(ST.moment0[k]-ST.moment0_env);
+        adj0[k] = w*(weight0 + prod(Psym, diff));
+        adj1[k] = w*P;
+    }
+
+    // Backward pass
+    for(size_t i=end; i>first; i--) {
+        const Tape& rec = tape[i-1-first];
+
+        for(size_t n=0; n<rec.dT.size(); n++) {
+            const size_t j = params_at[i-1][n];
+            double sum = 0e0;
+            for(size_t k=0; k<rec.T.size(); k++) {
+                const matrix_t& dT = rec.dT[n][k];
+                // d(T m0) = dT m0
+                sum += inner_prod(adj0[k], prod(dT, rec.m0[k]));
+                // d(T M1 T^t) = dT M1 T^t + T M1 dT^t
+                const matrix_t A(prod(dT, rec.m1[k])),
+                               B(prod(A, trans(rec.T[k])));
+                sum += inner(adj1[k], B) + inner(trans(adj1[k]), B);
+            }
+            gradient[j] += sum;
+        }
+
+        for(size_t k=0; k<rec.T.size(); k++) {
+            const matrix_t& T = rec.T[k];
+            adj0[k] = prod(trans(rec.T0.empty() ? T : rec.T0[k]), adj0[k]);
+            const matrix_t scratch(prod(trans(T), adj1[k]));
+            adj1[k] = prod(scratch, T);
+        }
+    }
+}
@@ -3,6 +3,8 @@
 
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 #include "flame/constants.h"
 #include "flame/moment.h"
@@ -20,6 +22,8 @@
 #endif
 
 std::map<std::string,boost::shared_ptr<Config> > ElementRFCavity::CavConfMap;
+// guards CavConfMap
+static boost::mutex CavConfMapLock;
 
 // RF Cavity beam dynamics functions.
 
@@ -689,30 +693,51 @@ void EvalGapModel(const double dis, const double IonW0, const Particle &real, co
 }
 
 
+namespace {
+// parameters bound by elements
+const ConfigKey key_f("f"), key_phi("phi"), key_scl_fac("scl_fac"), key_syncflag("syncflag"), key_Rm("Rm"), key_forcettfcalc("forcettfcalc"),
+                key_MpoleLevel("MpoleLevel"), key_EmitGrowth("EmitGrowth"), key_cavtype("cavtype");
+}
+
 ElementRFCavity::ElementRFCavity(const Config& c)
     :base_t(c)
+    ,have_RefNrm(false), have_SynComplex(false), have_EkLim(false), have_NrLim(false), RefNrm(0e0)
+    ,fRF(0e0), IonFys(0e0), phi_ref(std::numeric_limits<double>::quiet_NaN()), cRm(0e0)
+    ,cavi(0), forcettfcalc(false), MpoleLevel(2), EmitGrowth(0)
+    ,phi(0e0), scl_fac(0e0), syncflag(1.0)
 {
+    ParamBinder P(c);
+    bind(P);
     ElementRFCavity::LoadCavityFile(c);
 }
 
-
-void  ElementRFCavity::LoadCavityFile(const Config& c)
+void ElementRFCavity::bind(ParamBinder& P)
 {
-    fRF = c.get<double>("f");
-    IonFys = c.get<double>("phi")*M_PI/180e0;
-    phi_ref = std::numeric_limits<double>::quiet_NaN();
-    cRm = c.get<double>("Rm", 0.0);
-    forcettfcalc = c.get<double>("forcettfcalc", 0.0)!=0.0;
-    MpoleLevel = get_flag(c, "MpoleLevel", 2);
-    EmitGrowth = get_flag(c, "EmitGrowth", 0);
+    base_t::bind(P);
+    P(key_f,        fRF);
+    P(key_phi,      phi);
+    P(key_scl_fac,  scl_fac);
+    P(key_syncflag, syncflag, 1.0);
+    P(key_Rm,       cRm, 0.0);
+    double ttf = forcettfcalc ? 1.0 : 0.0;
+    P(key_forcettfcalc, ttf, 0.0);
+    forcettfcalc = ttf!=0.0;
+    P.flag(key_MpoleLevel, MpoleLevel, 2);
+    P.flag(key_EmitGrowth, EmitGrowth, 0);
+    P(key_cavtype,  CavType);
+
+    IonFys = phi*M_PI/180e0;
 
     if (MpoleLevel != 0 && MpoleLevel != 1 && MpoleLevel != 2)
         throw std::runtime_error(SB()<< "Undefined MpoleLevel: " << MpoleLevel);
 
     if (EmitGrowth != 0 && EmitGrowth != 1)
         throw std::runtime_error(SB()<< "Undefined EmitGrowth: " << EmitGrowth);
+}
 
-    CavType = c.get<std::string>("cavtype");
+void  ElementRFCavity::LoadCavityFile(const Config& c)
+{
+    // scalar parameters, including CavType, are set by bind()
     std::string cavfile(c.get<std::string>("Eng_Data_Dir", defpath)),
                 fldmap(cavfile),
                 mlpfile(cavfile);
@@ -806,6 +831,7 @@ void  ElementRFCavity::LoadCavityFile(const Config& c)
     {
         boost::shared_ptr<Config> conf;
         std::string key(SB()<<DataFile<<"|"<<boost::filesystem::last_write_time(DataFile));
+        boost::mutex::scoped_lock L(CavConfMapLock);
         if ( CavConfMap.find(key) == CavConfMap.end() ) {
             // not found in CavConfMap
             try {
@@ -1509,11 +1535,11 @@ void ElementRFCavity::GetCavBoost(const numeric_table &CavData, Particle &state,
 
 void ElementRFCavity::PropagateLongRFCav(Particle &ref, double& phi_ref) const
 {
-    double multip, EfieldScl, caviFy, IonFy_i, IonFy_o;
-    double fsync = conf().get<double>("syncflag", 1.0);
+    double multip, EfieldScl, caviFy;
+    const double fsync = syncflag;
 
     multip    = fRF/ref.SampleFreq;
-    EfieldScl = conf().get<double>("scl_fac");         // Electric field scale factor.
+    EfieldScl = scl_fac;         // Electric field scale factor.
 
     if (cavi == 0 && have_EkLim) {
         if (ref.IonEk/MeVtoeV < EkLim[0] || ref.IonEk/MeVtoeV > EkLim[1])
@@ -1536,11 +1562,20 @@ void ElementRFCavity::PropagateLongRFCav(Particle &ref, double& phi_ref) const
             caviFy = GetCavPhase(cavi, ref, IonFys, multip, SynAccTab);
         }
     } else {
-        caviFy = conf().get<double>("phi")*M_PI/180e0;
+        caviFy = IonFys;
     }
 
-    IonFy_i = multip*ref.phis + caviFy;
     phi_ref = caviFy;
+
+    PropagateLongRFCavPhase(ref, caviFy, EfieldScl);
+}
+
+void ElementRFCavity::PropagateLongRFCavPhase(Particle &ref, const double caviFy, const double EfieldScl) const
+{
+    double multip, IonFy_i, IonFy_o;
+
+    multip  = fRF/ref.SampleFreq;
+    IonFy_i = multip*ref.phis + caviFy;
     FLAME_LOG(DEBUG)<<"RF long phase"
                " caviFy="<<caviFy
              <<" multip="<<multip
@@ -1558,6 +1593,80 @@ void ElementRFCavity::PropagateLongRFCav(Particle &ref, double& phi_ref) const
     ref.phis       += (IonFy_o-IonFy_i)/multip;
 }
 
+namespace {
+// Handles a contiguous range of phase scan points
+struct PhaseScanWorker {
+    const ElementRFCavity *cav;
+    const Particle *in;
+    const double *phases;
+    double *IonEk, *phis;
+    double EfieldScl;
+    size_t first, last;
+
+    void operator()() const
+    {
+        for(size_t i=first; i<last; i++) {
+            Particle ref(*in);
+            cav->PropagateLongRFCavPhase(ref, phases[i]*M_PI/180e0, EfieldScl);
+            IonEk[i] = ref.IonEk;
+            phis[i]  = ref.phis;
+        }
+    }
+};
+}
+
+void ElementRFCavity::scanPhase(const Particle& in, const std::vector<double>& phases,
+                                std::vector<double>& IonEk, std::vector<double>& phis) const
+{
+    const size_t npoints = phases.size();
+    IonEk.resize(npoints);
+    phis.resize(npoints);
+    if(npoints==0)
+        return;
+
+    Particle ref(in);
+    ref.recalc();
+
+    if (cavi == 0 && have_EkLim) {
+        if (ref.IonEk/MeVtoeV < EkLim[0] || ref.IonEk/MeVtoeV > EkLim[1])
+            FLAME_LOG(WARN)<< "Warning: RF cavity incident energy (" << ref.IonEk/MeVtoeV
+                << " [MeV]) is out of range (" << EkLim[0] << " ~ " << EkLim[1] << ").\n";
+    }
+
+    PhaseScanWorker W;
+    W.cav       = this;
+    W.in        = &ref;
+    W.phases    = &phases[0];
+    W.IonEk     = &IonEk[0];
+    W.phis      = &phis[0];
+    W.EfieldScl = scl_fac;
+
+    // each point is independent.  Split into contiguous blocks, one per thread.
+    // Debug logging isn't safe to emit from worker threads, so stay serial then.
+    size_t nthreads = std::max(1u, boost::thread::hardware_concurrency());
+    nthreads = std::min(nthreads, npoints/16u);
+
+    if(nthreads<=1 || FLAME_LOG_CHECK(DEBUG)) {
+        W.first = 0;
+        W.last  = npoints;
+        W();
+        return;
+    }
+
+    boost::thread_group workers;
+    try {
+        for(size_t t=0; t<nthreads; t++) {
+            W.first = (npoints*t)/nthreads;
+            W.last  = (npoints*(t+1))/nthreads;
+            workers.create_thread(W);
+        }
+    } catch(...) {
+        workers.join_all();
+        throw;
+    }
+    workers.join_all();
+}
+
 
 void ElementRFCavity::calRFcaviEmitGrowth(const state_t::matrix_t &matIn, Particle &state, const int n, const double betaf, const double gamaf,
                                           const double aveX2i, const double cenX, const double aveY2i, const double cenY,
@@ -1659,7 +1768,7 @@ void ElementRFCavity::InitRFCav(Particle &real, state_t::matrix_t &M, CavTLMLine
     Ek_i      = real.IonEk;
     real.IonW = real.IonEk + real.IonEs;
 
-    EfieldScl = conf().get<double>("scl_fac");         // Electric field scale factor.
+    EfieldScl = scl_fac;         // Electric field scale factor.
     ElementRFCavity::GetCavBoost(CavData, real, IonFy_i, EfieldScl, IonFy_o); // updates IonW
 
     real.IonEk       = real.IonW - real.IonEs;
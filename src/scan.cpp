@@ -0,0 +1,667 @@
+#include <limits>
+#include <cmath>
+#include <map>
+#include <algorithm>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "flame/scan.h"
+
+namespace {
+
+// field values at one observation, empty if not reached
+typedef std::vector<std::vector<double> > obs_fields_t;
+// for each observation
+typedef std::vector<obs_fields_t> point_t;
+// observation numbers at each element index
+typedef std::vector<std::vector<size_t> > obs_map_t;
+
+// Common to Scan and ErrorStudy.  Propagation from a shared prefix state, recording fields at observations.
+struct Tracker {
+    const std::vector<std::string> *fields;
+    std::vector<unsigned> field_index;   // StateBase::getArray() index of each field
+    obs_map_t obs;
+    size_t nobs, first, last;
+    std::auto_ptr<StateBase> prefix;     // state at the entrance of element 'first'
+    point_t prefix_obs;                  // observations before 'first'
+    Config conf;                         // for private Machine copies
+
+    boost::mutex lock;
+    size_t next;                                     // guarded by lock
+    std::string error;                               // guarded by lock. First error seen
+    std::vector<std::vector<size_t> > shapes;        // guarded by lock
+    std::vector<bool> have_shape;                    // guarded by lock
+
+    Tracker() :fields(0), nobs(0), first(0), last(0), next(0) {}
+
+    // Check and map observations and fields.
+    void setup(const Machine& M, const StateBase& ST,
+               const std::vector<size_t>& observe, const std::vector<std::string>& fields)
+    {
+        this->fields = &fields;
+        nobs = observe.size();
+        shapes.resize(fields.size());
+        have_shape.resize(fields.size(), false);
+
+        last = 0;
+        for(size_t o=0; o<nobs; o++) {
+            if(observe[o]>=M.size())
+                throw std::invalid_argument(SB()<<"Observation element index out of range: "<<observe[o]);
+            last = std::max(last, observe[o]);
+        }
+        obs.resize(last+1);
+        for(size_t o=0; o<nobs; o++)
+            obs[observe[o]].push_back(o);
+
+        std::auto_ptr<StateBase> probe(ST.clone());
+        for(size_t f=0; f<fields.size(); f++) {
+            unsigned idx=0;
+            StateBase::ArrayInfo info;
+            bool found = false;
+            while(probe->getArray(idx++, info)) {
+                if(fields[f]==info.name) {
+                    found = true;
+                    break;
+                }
+            }
+            if(!found)
+                throw std::invalid_argument(SB()<<"State has no field '"<<fields[f]<<"'");
+            field_index.push_back(idx-1);
+        }
+    }
+
+    // Propagate ST through elements upstream of 'first', which are the same for all points
+    void start(Machine& M, const StateBase& ST, size_t first)
+    {
+        this->first = first;
+        prefix.reset(ST.clone());
+        prefix_obs.resize(nobs);
+
+        const size_t end = std::min(first, last+1);
+        if(end>0)
+            track(M, *prefix, 0, end-1, prefix_obs);
+        prefix->next_elem = first;
+    }
+
+    // Copy the observed fields of ST
+    void record(StateBase& ST, obs_fields_t& out)
+    {
+        out.resize(field_index.size());
+        for(size_t f=0; f<field_index.size(); f++) {
+            StateBase::ArrayInfo info;
+            if(!ST.getArray(field_index[f], info))
+                throw std::logic_error("State field index changed");
+
+            std::vector<size_t> shape(info.dim, info.dim+info.ndim);
+            {
+                boost::mutex::scoped_lock L(lock);
+                if(!have_shape[f]) {
+                    shapes[f] = shape;
+                    have_shape[f] = true;
+                } else if(shapes[f]!=shape) {
+                    throw std::invalid_argument(SB()<<"Field '"<<(*fields)[f]<<"' changes shape between observations");
+                }
+            }
+
+            size_t count = 1;
+            for(unsigned d=0; d<info.ndim; d++)
+                count *= info.dim[d];
+
+            std::vector<double>& val = out[f];
+            val.resize(count);
+
+            size_t idx[StateBase::ArrayInfo::maxdims] = {0, 0, 0};
+            for(size_t n=0; n<count; n++) {
+                // row major
+                size_t rem = n;
+                for(unsigned d=info.ndim; d>0; d--) {
+                    idx[d-1] = rem%info.dim[d-1];
+                    rem /= info.dim[d-1];
+                }
+                if(info.type==StateBase::ArrayInfo::Double)
+                    val[n] = *info.get<double>(idx);
+                else
+                    val[n] = *info.get<size_t>(idx);
+            }
+        }
+    }
+
+    // Propagate ST through [start, stop], recording observations
+    void track(Machine& M, StateBase& ST, size_t start, size_t stop, point_t& out)
+    {
+        if(start>stop)
+            return;
+        Propagation P(M, &ST, start, int(stop+1-start));
+        while(!P.done()) {
+            P.step(1);
+            const size_t i = ST.next_elem-1;
+            for(size_t n=0; n<obs[i].size(); n++)
+                record(ST, out[obs[i][n]]);
+        }
+    }
+
+    // Propagate a copy of the prefix state with the parameters of one point
+    void track_point(Machine& M, const std::vector<Machine::ParamUpdate>& updates, point_t& out)
+    {
+        M.setParams(updates);
+        out = prefix_obs;
+        std::auto_ptr<StateBase> ST(prefix->clone());
+        track(M, *ST, first, last, out);
+    }
+
+    // Take the next of npoints.  false when done
+    bool take(size_t npoints, size_t& p)
+    {
+        boost::mutex::scoped_lock L(lock);
+        if(next>=npoints || !error.empty())
+            return false;
+        p = next++;
+        return true;
+    }
+
+    void fail(size_t p, const std::exception& e)
+    {
+        boost::mutex::scoped_lock L(lock);
+        if(error.empty())
+            error = SB()<<"Point "<<p<<" : "<<e.what();
+    }
+
+    /* Run W() on nthreads threads, with W.M=NULL, and on this thread with W.M=&M.
+     * Worker threads use a private copy of elements [0, last] of M.
+     */
+    template<typename Worker>
+    void run(Worker& W, Machine& M, unsigned nthreads, size_t npoints)
+    {
+        size_t N = nthreads ? nthreads : std::max(1u, boost::thread::hardware_concurrency());
+        N = std::min(N, npoints);
+
+        if(N>1) {
+            // Machine copies only need elements [0, last]
+            Config::vector_t elems(last+1);
+            for(size_t i=0; i<=last; i++)
+                elems[i] = M[i]->conf();
+            conf = M.conf();
+            conf.set<Config::vector_t>("elements", elems);
+        }
+
+        W.M = NULL;
+
+        boost::thread_group workers;
+        try {
+            for(size_t t=1; t<N; t++)
+                workers.create_thread(W);
+        } catch(...) {
+            {
+                boost::mutex::scoped_lock L(lock);
+                next = npoints;
+            }
+            workers.join_all();
+            throw;
+        }
+
+        // this thread uses M
+        W.M = &M;
+        W();
+
+        workers.join_all();
+    }
+
+    // Number of values of field f
+    size_t field_size(size_t f) const
+    {
+        size_t count = 1;
+        for(size_t d=0; d<shapes[f].size(); d++)
+            count *= shapes[f][d];
+        return count;
+    }
+};
+
+// Restore parameters when destroyed
+struct RestoreParams {
+    Machine& M;
+    std::vector<Machine::ParamUpdate> base;
+    RestoreParams(Machine& M) :M(M) {}
+    ~RestoreParams()
+    {
+        try {
+            M.setParams(base);
+        } catch(std::exception& e) {
+            FLAME_LOG(ERROR)<<"Failed to restore parameters : "<<e.what();
+        }
+    }
+};
+
+struct ScanQueue : public Tracker {
+    const Scan *S;
+    std::vector<size_t> axes;            // axis numbers which change elements [first, last]
+    std::vector<point_t> points;         // each written by one thread
+};
+
+struct ScanWorker {
+    ScanQueue *Q;
+    Machine *M; // NULL to construct a private copy
+
+    void operator()() const
+    {
+        const Scan& S = *Q->S;
+        std::auto_ptr<Machine> copy;
+        Machine *M = this->M;
+
+        const size_t npoints = Q->points.size();
+        std::vector<Machine::ParamUpdate> updates(Q->axes.size());
+        for(size_t a=0; a<Q->axes.size(); a++) {
+            updates[a].index = S.axes[Q->axes[a]].index;
+            updates[a].name  = S.axes[Q->axes[a]].name;
+        }
+
+        size_t p;
+        while(Q->take(npoints, p)) {
+            try {
+                if(!M) {
+                    copy.reset(new Machine(Q->conf));
+                    M = copy.get();
+                }
+
+                if(S.zip) {
+                    for(size_t a=0; a<Q->axes.size(); a++)
+                        updates[a].value = S.axes[Q->axes[a]].values[p];
+                } else {
+                    // last axis fastest
+                    size_t rem = p;
+                    for(size_t a=S.axes.size(); a>0; a--) {
+                        const Scan::Axis& A = S.axes[a-1];
+                        const size_t n = rem%A.values.size();
+                        rem /= A.values.size();
+                        for(size_t u=0; u<Q->axes.size(); u++)
+                            if(Q->axes[u]==a-1)
+                                updates[u].value = A.values[n];
+                    }
+                }
+
+                Q->track_point(*M, updates, Q->points[p]);
+
+            } catch(std::exception& e) {
+                Q->fail(p, e);
+            }
+        }
+    }
+};
+
+// counter based random numbers.  The SplitMix64 output function applied to key + n*gamma
+struct CounterRNG {
+    boost::uint64_t key, counter;
+
+    static boost::uint64_t mix(boost::uint64_t z)
+    {
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    CounterRNG(boost::uint64_t seed, boost::uint64_t stream)
+        :key(mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ULL))), counter(0)
+    {}
+
+    boost::uint64_t next() { return mix(key + (++counter)*0x9e3779b97f4a7c15ULL); }
+
+    //! uniform in (0, 1)
+    double uniform() { return ((next()>>11) + 0.5) * (1.0/9007199254740992.0); }
+
+    //! standard normal, by Box-Muller
+    double normal()
+    {
+        const double u1 = uniform(), u2 = uniform();
+        return sqrt(-2e0*log(u1))*cos(2e0*M_PI*u2);
+    }
+};
+
+/* Streaming estimate of one quantile with five markers.
+ * The P-square algorithm of R. Jain and I. Chlamtac, Comm. ACM 28 (1985) 1076.
+ */
+struct P2Quantile {
+    double p, q[5], n[5], np[5], dn[5];
+    size_t count;
+
+    P2Quantile(double p=0.5) :p(p), count(0)
+    {
+        dn[0] = 0e0; dn[1] = p/2e0; dn[2] = p; dn[3] = (1e0+p)/2e0; dn[4] = 1e0;
+    }
+
+    void add(double x)
+    {
+        if(count<5) {
+            q[count++] = x;
+            if(count==5) {
+                std::sort(q, q+5);
+                for(unsigned i=0; i<5; i++)
+                    n[i] = i;
+                np[0] = 0e0; np[1] = 2e0*p; np[2] = 4e0*p; np[3] = 2e0+2e0*p; np[4] = 4e0;
+            }
+            return;
+        }
+        count++;
+
+        unsigned k;
+        if(x<q[0]) {
+            q[0] = x;
+            k = 0;
+        } else if(x>=q[4]) {
+            q[4] = x;
+            k = 3;
+        } else {
+            for(k=0; k<3 && x>=q[k+1]; k++) {}
+        }
+
+        for(unsigned i=k+1; i<5; i++)
+            n[i] += 1e0;
+        for(unsigned i=0; i<5; i++)
+            np[i] += dn[i];
+
+        for(unsigned i=1; i<4; i++) {
+            const double d = np[i]-n[i];
+            if((d>=1e0 && n[i+1]-n[i]>1e0) || (d<=-1e0 && n[i-1]-n[i]<-1e0)) {
+                const double s = d<0e0 ? -1e0 : 1e0;
+                // parabolic
+                double qp = q[i] + s/(n[i+1]-n[i-1])*((n[i]-n[i-1]+s)*(q[i+1]-q[i])/(n[i+1]-n[i])
+                                                      + (n[i+1]-n[i]-s)*(q[i]-q[i-1])/(n[i]-n[i-1]));
+                if(!(q[i-1]<qp && qp<q[i+1])) {
+                    // linear
+                    const unsigned j = s<0e0 ? i-1 : i+1;
+                    qp = q[i] + s*(q[j]-q[i])/(n[j]-n[i]);
+                }
+                q[i] = qp;
+                n[i] += s;
+            }
+        }
+    }
+
+    double value() const
+    {
+        if(count==0)
+            return std::numeric_limits<double>::quiet_NaN();
+        if(count<5) {
+            double s[5];
+            std::copy(q, q+count, s);
+            std::sort(s, s+count);
+            return s[std::min(count-1, size_t(p*count))];
+        }
+        return q[2];
+    }
+};
+
+// Streaming statistics of one quantity
+struct Accumulator {
+    size_t n;
+    double mean, M2, min, max; // Welford
+    std::vector<P2Quantile> quantiles;
+
+    Accumulator() :n(0), mean(0e0), M2(0e0), min(0e0), max(0e0) {}
+
+    void add(double x)
+    {
+        if(n==0)
+            min = max = x;
+        min = std::min(min, x);
+        max = std::max(max, x);
+        n++;
+        const double delta = x-mean;
+        mean += delta/n;
+        M2 += delta*(x-mean);
+        for(size_t i=0; i<quantiles.size(); i++)
+            quantiles[i].add(x);
+    }
+};
+
+struct ErrorQueue : public Tracker {
+    const ErrorStudy *S;
+    std::vector<size_t> errors; // error numbers which change elements [first, last]
+    std::vector<double> base;   // nominal value of each error
+
+    // Samples are accumulated in order, so the results do not depend on the number of threads
+    std::map<size_t, point_t> pending;                // guarded by lock
+    size_t next_accum;                                // guarded by lock
+    std::vector<std::vector<Accumulator> > accum;     // [field][observation*field size]. guarded by lock
+    std::vector<size_t> count;                        // guarded by lock
+
+    void accumulate(size_t p, point_t& out)
+    {
+        boost::mutex::scoped_lock L(lock);
+        pending[p].swap(out);
+
+        std::map<size_t, point_t>::iterator it;
+        while((it=pending.find(next_accum))!=pending.end()) {
+            const point_t& pt = it->second;
+            for(size_t o=0; o<nobs; o++) {
+                if(pt[o].empty())
+                    continue; // lost
+                count[o]++;
+                for(size_t f=0; f<pt[o].size(); f++) {
+                    const std::vector<double>& val = pt[o][f];
+                    std::vector<Accumulator>& A = accum[f];
+                    if(A.empty()) {
+                        A.resize(nobs*val.size());
+                        for(size_t i=0; i<A.size(); i++)
+                            for(size_t q=0; q<S->probabilities.size(); q++)
+                                A[i].quantiles.push_back(P2Quantile(S->probabilities[q]));
+                    }
+                    for(size_t i=0; i<val.size(); i++)
+                        A[o*val.size()+i].add(val[i]);
+                }
+            }
+            pending.erase(it);
+            next_accum++;
+        }
+    }
+};
+
+struct ErrorWorker {
+    ErrorQueue *Q;
+    Machine *M; // NULL to construct a private copy
+
+    void operator()() const
+    {
+        const ErrorStudy& S = *Q->S;
+        std::auto_ptr<Machine> copy;
+        Machine *M = this->M;
+
+        std::vector<Machine::ParamUpdate> updates(Q->errors.size());
+        for(size_t u=0; u<Q->errors.size(); u++) {
+            updates[u].index = S.errors[Q->errors[u]].index;
+            updates[u].name  = S.errors[Q->errors[u]].name;
+        }
+        std::vector<double> delta;
+        point_t out;
+
+        size_t p = 0;
+        while(Q->take(S.nsamples, p)) {
+            try {
+                if(!M) {
+                    copy.reset(new Machine(Q->conf));
+                    M = copy.get();
+                }
+
+                S.draw(p, delta);
+                for(size_t u=0; u<Q->errors.size(); u++)
+                    updates[u].value = Q->base[Q->errors[u]] + delta[Q->errors[u]];
+
+                Q->track_point(*M, updates, out);
+                Q->accumulate(p, out);
+
+            } catch(std::exception& e) {
+                Q->fail(p, e);
+            }
+        }
+    }
+};
+
+} // namespace
+
+size_t Scan::npoints() const
+{
+    if(axes.empty())
+        return 0;
+    size_t N = zip ? axes[0].values.size() : 1;
+    if(!zip) {
+        for(size_t a=0; a<axes.size(); a++)
+            N *= axes[a].values.size();
+    }
+    return N;
+}
+
+void Scan::compute(Machine& M, const StateBase& ST)
+{
+    const size_t nobs = observe.size(), nfields = fields.size(), nelem = M.size(),
+                 npoints = this->npoints();
+
+    results.assign(nfields, std::vector<double>());
+    shapes.assign(nfields, std::vector<size_t>());
+
+    ScanQueue Q;
+    Q.S = this;
+    Q.setup(M, ST, observe, fields);
+
+    RestoreParams restore(M);
+    size_t first = nelem;
+    for(size_t a=0; a<axes.size(); a++) {
+        const Axis& A = axes[a];
+        if(A.index>=nelem)
+            throw std::invalid_argument(SB()<<"Scan axis element index out of range: "<<A.index);
+        if(zip && A.values.size()!=axes[0].values.size())
+            throw std::invalid_argument(SB()<<"Zipped scan axis "<<a<<" has "<<A.values.size()
+                                        <<" values, not "<<axes[0].values.size());
+        restore.base.push_back(Machine::ParamUpdate(A.index, A.name, M.getParam(A.index, A.name)));
+        first = std::min(first, A.index);
+        if(A.index<=Q.last)
+            Q.axes.push_back(a);
+    }
+
+    if(npoints==0)
+        return;
+
+    Q.start(M, ST, first);
+    Q.points.resize(npoints);
+
+    ScanWorker W;
+    W.Q = &Q;
+    Q.run(W, M, nthreads, npoints);
+
+    if(!Q.error.empty())
+        throw std::runtime_error(Q.error);
+
+    // assemble dense results
+    for(size_t f=0; f<nfields; f++) {
+        shapes[f] = Q.shapes[f];
+        const size_t count = Q.field_size(f);
+
+        std::vector<double>& R = results[f];
+        R.assign(npoints*nobs*count, std::numeric_limits<double>::quiet_NaN());
+
+        for(size_t p=0; p<npoints; p++) {
+            for(size_t o=0; o<nobs; o++) {
+                const obs_fields_t& val = Q.points[p][o];
+                if(val.empty())
+                    continue; // not reached
+                std::copy(val[f].begin(), val[f].end(), R.begin()+(p*nobs+o)*count);
+            }
+        }
+    }
+}
+
+void ErrorStudy::draw(size_t sample, std::vector<double>& delta) const
+{
+    CounterRNG R(seed, sample);
+
+    delta.resize(errors.size());
+    for(size_t e=0; e<errors.size(); e++) {
+        const Error& E = errors[e];
+        double x;
+        switch(E.dist) {
+        case Error::Uniform:
+            x = 2e0*R.uniform()-1e0;
+            break;
+        case Error::Gaussian:
+            do {
+                x = R.normal();
+            } while(E.cut>0e0 && fabs(x)>E.cut);
+            break;
+        default:
+            throw std::invalid_argument(SB()<<"Error "<<e<<" has unknown distribution");
+        }
+        delta[e] = x*E.width;
+    }
+}
+
+void ErrorStudy::compute(Machine& M, const StateBase& ST)
+{
+    const size_t nobs = observe.size(), nfields = fields.size(), nelem = M.size(),
+                 nprob = probabilities.size();
+
+    stats.assign(nfields, Stats());
+    shapes.assign(nfields, std::vector<size_t>());
+    count.assign(nobs, 0);
+
+    for(size_t q=0; q<nprob; q++)
+        if(!(probabilities[q]>0e0 && probabilities[q]<1e0))
+            throw std::invalid_argument(SB()<<"Quantile probability "<<probabilities[q]<<" not in (0, 1)");
+
+    ErrorQueue Q;
+    Q.S = this;
+    Q.setup(M, ST, observe, fields);
+    Q.next_accum = 0;
+    Q.accum.resize(nfields);
+    Q.count.resize(nobs, 0);
+
+    RestoreParams restore(M);
+    size_t first = nelem;
+    for(size_t e=0; e<errors.size(); e++) {
+        const Error& E = errors[e];
+        if(E.index>=nelem)
+            throw std::invalid_argument(SB()<<"Error element index out of range: "<<E.index);
+        Q.base.push_back(M.getParam(E.index, E.name));
+        restore.base.push_back(Machine::ParamUpdate(E.index, E.name, Q.base.back()));
+        first = std::min(first, E.index);
+        if(E.index<=Q.last)
+            Q.errors.push_back(e);
+    }
+
+    if(nsamples==0)
+        return;
+
+    Q.start(M, ST, first);
+
+    ErrorWorker W;
+    W.Q = &Q;
+    Q.run(W, M, nthreads, nsamples);
+
+    if(!Q.error.empty())
+        throw std::runtime_error(Q.error);
+
+    count = Q.count;
+
+    for(size_t f=0; f<nfields; f++) {
+        shapes[f] = Q.shapes[f];
+        const size_t N = nobs*Q.field_size(f);
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+
+        Stats& R = stats[f];
+        R.mean.assign(N, nan);
+        R.var.assign(N, nan);
+        R.min.assign(N, nan);
+        R.max.assign(N, nan);
+        R.quantile.assign(nprob*N, nan);
+
+        const std::vector<Accumulator>& A = Q.accum[f];
+        for(size_t i=0; i<A.size(); i++) {
+            if(A[i].n==0)
+                continue;
+            R.mean[i] = A[i].mean;
+            R.var[i]  = A[i].n>1 ? A[i].M2/(A[i].n-1) : 0e0;
+            R.min[i]  = A[i].min;
+            R.max[i]  = A[i].max;
+            for(size_t q=0; q<nprob; q++)
+                R.quantile[q*N+i] = A[i].quantiles[q].value();
+        }
+    }
+}
@@ -4,7 +4,16 @@
 
 #include <math.h>
 
+#include <fstream>
+#include <sstream>
+#include <set>
+
+#include <boost/filesystem.hpp>
+
 #include "flame/config.h"
+#include "flame/latcache.h"
+#include "flame/base.h"
+#include "flame/pipeline.h"
 
 BOOST_AUTO_TEST_CASE(config_getset)
 {
@@ -19,6 +28,112 @@ BOOST_AUTO_TEST_CASE(config_getset)
     BOOST_CHECK_CLOSE(C.get<double>("world", 5.2), 5.2, 0.1);
 }
 
+BOOST_AUTO_TEST_CASE(config_key)
+{
+    const ConfigKey A("config_key_A"), A2(std::string("config_key_A")), B("config_key_B");
+    BOOST_CHECK(A==A2);
+    BOOST_CHECK(A!=B);
+    BOOST_CHECK_EQUAL(A.name(), "config_key_A");
+    BOOST_CHECK(ConfigKey::find("config_key_A")!=NULL);
+    BOOST_CHECK(ConfigKey::find("config_key_never_used")==NULL);
+
+    Config C;
+    C.set<double>(B, 2.0);
+    C.set<double>("config_key_A", 1.0);
+    BOOST_CHECK_EQUAL(C.get<double>(A), 1.0);
+    BOOST_CHECK_EQUAL(C.get<double>("config_key_B"), 2.0);
+    BOOST_CHECK_THROW(C.get<std::string>(A), key_error);
+    BOOST_CHECK_EQUAL(C.get<double>("config_key_never_used", 3.0), 3.0);
+
+    // inner scope shadows outer
+    Config D(C.new_scope());
+    D.set<double>(A, 4.0);
+    BOOST_CHECK_EQUAL(D.get<double>(A), 4.0);
+    BOOST_CHECK_EQUAL(D.get<double>(B), 2.0);
+    BOOST_CHECK_EQUAL(C.get<double>(A), 1.0);
+
+    D.flatten();
+    BOOST_CHECK_EQUAL(D.get<double>(A), 4.0);
+    BOOST_CHECK_EQUAL(D.get<double>(B), 2.0);
+    size_t n = 0;
+    for(Config::const_iterator it=D.begin(), end=D.end(); it!=end; ++it, ++n) {}
+    BOOST_CHECK_EQUAL(n, 2u);
+}
+
+namespace {
+struct InternAll {
+    unsigned seed;
+    std::vector<unsigned> *ids;
+    void operator()() const
+    {
+        for(unsigned i=0; i<ids->size(); i++) {
+            // each thread visits the names in a different order
+            const unsigned n = (i*7u+seed)%ids->size();
+            std::ostringstream strm;
+            strm<<"config_key_thread_"<<n;
+            (*ids)[n] = ConfigKey(strm.str()).id();
+            const ConfigKey *K = ConfigKey::find(strm.str());
+            if(!K || K->id()!=(*ids)[n] || K->name()!=strm.str())
+                (*ids)[n] = unsigned(-1);
+        }
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(config_key_threads)
+{
+    // names interned concurrently are each assigned exactly one atom
+    std::vector<std::vector<unsigned> > ids(4, std::vector<unsigned>(500));
+    boost::thread_group threads;
+    for(unsigned t=0; t<ids.size(); t++) {
+        InternAll worker = {t*131u, &ids[t]};
+        threads.create_thread(worker);
+    }
+    threads.join_all();
+
+    for(unsigned t=1; t<ids.size(); t++)
+        BOOST_CHECK(ids[t]==ids[0]);
+    std::set<unsigned> distinct(ids[0].begin(), ids[0].end());
+    BOOST_CHECK_EQUAL(distinct.size(), ids[0].size());
+    BOOST_CHECK(distinct.find(unsigned(-1))==distinct.end());
+}
+
+BOOST_AUTO_TEST_CASE(config_scope_chain)
+{
+    Config A;
+    A.set<double>("x", 1.0);
+    A.set<double>("y", 1.0);
+
+    Config B(A.new_scope());
+    B.set<double>("y", 2.0);
+    B.set<double>("z", 2.0);
+    A.set<double>("x", 10.0); // outer scopes are not changed by their owner
+
+    Config C(B.new_scope());
+    C.set<double>("z", 3.0);
+    C.push_scope();
+    C.set<double>("w", 4.0);
+
+    BOOST_CHECK_EQUAL(C.get<double>("x"), 1.0);
+    BOOST_CHECK_EQUAL(C.get<double>("y"), 2.0);
+    BOOST_CHECK_EQUAL(C.get<double>("z"), 3.0);
+    BOOST_CHECK_EQUAL(C.get<double>("w"), 4.0);
+    BOOST_CHECK_EQUAL(B.get<double>("z"), 2.0);
+    BOOST_CHECK_EQUAL(A.get<double>("x"), 10.0);
+
+    size_t n = 0;
+    for(Config::const_iterator it=C.begin(), end=C.end(); it!=end; ++it, ++n) {}
+    BOOST_CHECK_EQUAL(n, 1u);
+
+    C.flatten();
+    n = 0;
+    for(Config::const_iterator it=C.begin(), end=C.end(); it!=end; ++it, ++n) {}
+    BOOST_CHECK_EQUAL(n, 4u);
+    BOOST_CHECK_EQUAL(C.get<double>("x"), 1.0);
+    BOOST_CHECK_EQUAL(C.get<double>("y"), 2.0);
+    BOOST_CHECK_EQUAL(C.get<double>("z"), 3.0);
+}
+
 static const char config_print_stmt_input[] =
 "X = 14;\n"
 "print(X);\n"
@@ -37,3 +152,435 @@ BOOST_AUTO_TEST_CASE(config_print_stmt)
 
     BOOST_CHECK_EQUAL(strm.str(), "On line 2 : 14\n" "On line 4 : \"test\"\n");
 }
+
+BOOST_AUTO_TEST_CASE(config_param_binder)
+{
+    Config C;
+    C.set<double>("L", 0.5);
+    C.set<std::string>("ncurve", "3");
+    C.set<std::string>("type", "quadrupole");
+
+    double L = 0.0, B2 = 1.0;
+    unsigned ncurve = 0;
+    std::string type;
+
+    {
+        ParamBinder P(C);
+        P("L", L);
+        P("B2", B2, 2.0);
+        P.flag("ncurve", ncurve, 0);
+        P("type", type);
+
+        BOOST_CHECK_CLOSE(L, 0.5, 0.1);
+        BOOST_CHECK_CLOSE(B2, 2.0, 0.1);
+        BOOST_CHECK_EQUAL(ncurve, 3u);
+        BOOST_CHECK_EQUAL(type, "quadrupole");
+
+        BOOST_CHECK_EQUAL(P.params().size(), 4u);
+        BOOST_REQUIRE(P.find("L"));
+        BOOST_CHECK(P.find("L")->required);
+        BOOST_CHECK(!P.find("B2")->required);
+        BOOST_CHECK_EQUAL(std::string(P.find("ncurve")->type), "flag");
+        BOOST_CHECK(!P.find("missing"));
+
+        BOOST_CHECK_THROW(P("missing", L), key_error);
+    }
+
+    {
+        // declarations only
+        ParamBinder P;
+        double X = 4.0;
+        P("L", X);
+        BOOST_CHECK(!P.binding());
+        BOOST_CHECK_CLOSE(X, 4.0, 0.1);
+        BOOST_CHECK_EQUAL(P.params().size(), 1u);
+    }
+
+    C.set<double>("ncurve", 1.5);
+    {
+        ParamBinder P(C);
+        BOOST_CHECK_THROW(P.flag("ncurve", ncurve, 0), std::runtime_error);
+    }
+
+    {
+        // pre-resolved names, binding only one
+        const ConfigKey key_L("L"), key_B2("B2");
+        C.set<double>("L", 0.75);
+        C.set<double>("B2", 3.0);
+        ParamBinder P(C, key_B2);
+        P(key_L, L);
+        P(key_B2, B2, 2.0);
+        BOOST_CHECK_CLOSE(L, 0.5, 0.1);
+        BOOST_CHECK_CLOSE(B2, 3.0, 0.1);
+        BOOST_REQUIRE(P.find("B2"));
+        BOOST_CHECK(P.find("B2")->key==key_B2);
+        BOOST_CHECK_EQUAL(P.params().size(), 2u);
+    }
+}
+
+namespace {
+struct StoreEntry {
+    const LatticeCache *cache;
+    boost::uint64_t key;
+    const Config *conf;
+    const std::vector<std::string> *depends;
+    std::string output;
+    bool *ok;
+    void operator()() const
+    {
+        for(unsigned i=0; i<50; i++)
+            *ok &= cache->store(key, *conf, *depends, output);
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(config_lattice_cache)
+{
+    namespace fs = boost::filesystem;
+    const fs::path dir(fs::canonical(fs::temp_directory_path()) / fs::unique_path("flame-latcache-%%%%-%%%%"));
+    fs::create_directories(dir);
+    {
+        std::ofstream inc((dir/"inc.lat").native().c_str());
+        inc<<"a: drift, L=1;\nfoo: LINE = (a);\n";
+    }
+
+    std::ostringstream src;
+    src<<"G = 1;\nx0: drift, L=1, nest = parse(\"inc.lat\");\n";
+    for(unsigned i=1; i<100; i++)
+        src<<"x"<<i<<": quadrupole, L = "<<i<<", V = [1, 2, "<<i<<"], label = \"q\";\n";
+    src<<"print(G);\nfoo: LINE = (x0";
+    for(unsigned i=1; i<100; i++)
+        src<<", x"<<i;
+    src<<");\n";
+    const std::string text(src.str());
+    BOOST_REQUIRE(text.size()>=LatticeCache::min_size);
+
+    GLPSParser P;
+    P.setCacheDir(dir.native());
+
+    std::ostringstream out1, print1;
+    P.setPrinter(&out1);
+    std::auto_ptr<Config> first(P.parse_byte(text, dir.native().c_str()));
+    GLPSPrint(print1, *first);
+    BOOST_REQUIRE_EQUAL(P.dependencies().size(), 1u);
+    BOOST_CHECK_EQUAL(P.dependencies()[0], (dir/"inc.lat").native());
+
+    // the entry written by the first parse is valid
+    const boost::uint64_t key = LatticeCache::key(text.c_str(), text.size(), dir.native(), true, Config());
+    LatticeCache cache(dir.native());
+    BOOST_CHECK(fs::exists(cache.entry(key)));
+    {
+        std::vector<std::string> depends;
+        std::string output;
+        std::auto_ptr<Config> cached(cache.load(key, depends, output));
+        BOOST_REQUIRE(cached.get()!=NULL);
+        BOOST_CHECK_EQUAL(output, out1.str());
+        BOOST_CHECK(depends==P.dependencies());
+    }
+
+    std::ostringstream out2, print2;
+    P.setPrinter(&out2);
+    std::auto_ptr<Config> second(P.parse_byte(text, dir.native().c_str()));
+    GLPSPrint(print2, *second);
+    BOOST_CHECK_EQUAL(print1.str(), print2.str());
+    BOOST_CHECK_EQUAL(out1.str(), out2.str());
+    BOOST_CHECK(P.dependencies().size()==1u);
+
+    const Config::vector_t& elems = second->get<Config::vector_t>("elements");
+    BOOST_REQUIRE_EQUAL(elems.size(), 100u);
+    BOOST_CHECK_EQUAL(elems[5].get<double>("G"), 1.0); // enclosing scope is kept
+    BOOST_CHECK_EQUAL(elems[5].get<std::vector<double> >("V")[2], 5.0);
+    BOOST_CHECK_EQUAL(elems[5].get<std::string>("label"), "q");
+    BOOST_CHECK_EQUAL(elems[0].get<Config::vector_t>("nest")[0].get<std::string>("name"), "foo");
+
+    // changing a referenced file invalidates the entry
+    {
+        std::ofstream inc((dir/"inc.lat").native().c_str());
+        inc<<"b: drift, L=1;\nbar: LINE = (b);\n";
+    }
+    {
+        std::vector<std::string> depends;
+        std::string output;
+        std::auto_ptr<Config> cached(cache.load(key, depends, output));
+        BOOST_CHECK(cached.get()==NULL);
+    }
+    std::auto_ptr<Config> third(P.parse_byte(text, dir.native().c_str()));
+    BOOST_CHECK_EQUAL(third->get<Config::vector_t>("elements")[0].get<Config::vector_t>("nest")[0].get<std::string>("name"), "bar");
+
+    // a dependency is hashed only if its mtime changed, or is not older than the entry
+    {
+        const fs::path inc(dir/"inc.lat");
+        const std::time_t old = fs::last_write_time(inc) - 10;
+        fs::last_write_time(inc, old);
+        BOOST_REQUIRE(cache.store(key, *third, P.dependencies(), ""));
+        {
+            std::ofstream strm(inc.native().c_str());
+            strm<<"c: drift, L=1;\nbaz: LINE = (c);\n"; // same size
+        }
+        fs::last_write_time(inc, old);
+
+        std::vector<std::string> depends;
+        std::string output;
+        std::auto_ptr<Config> cached(cache.load(key, depends, output));
+        BOOST_CHECK(cached.get()!=NULL); // not hashed
+
+        fs::last_write_time(inc, old+1);
+        cached.reset(cache.load(key, depends, output));
+        BOOST_CHECK(cached.get()==NULL); // hashed, and changed
+    }
+
+    // threads storing the same key each use their own temporary file
+    {
+        bool ok[4] = {true, true, true, true};
+        boost::thread_group threads;
+        for(unsigned i=0; i<4; i++) {
+            StoreEntry W;
+            W.cache = &cache;
+            W.key = key;
+            W.conf = third.get();
+            W.depends = &P.dependencies();
+            W.output = std::string(1000*(i+1), 'a'+i); // entries of different sizes
+            W.ok = &ok[i];
+            threads.create_thread(W);
+        }
+        threads.join_all();
+        for(unsigned i=0; i<4; i++)
+            BOOST_CHECK(ok[i]);
+
+        std::vector<std::string> depends;
+        std::string output;
+        std::auto_ptr<Config> cached(cache.load(key, depends, output));
+        BOOST_CHECK(cached.get()!=NULL);
+        BOOST_CHECK_EQUAL(output, std::string(output.size(), output.empty() ? 'a' : output[0]));
+        BOOST_CHECK_EQUAL(output.size(), 1000u*(output[0]-'a'+1));
+
+        size_t nfiles = 0;
+        for(fs::directory_iterator it(dir), end; it!=end; ++it)
+            nfiles++;
+        BOOST_CHECK_EQUAL(nfiles, 2u); // inc.lat and the entry
+    }
+
+    // the least recently used entries are removed when the total exceeds max_bytes
+    {
+        const boost::uint64_t esize = fs::file_size(cache.entry(key));
+        LatticeCache small(dir.native(), 2*esize+esize/2); // room for two entries
+        const std::time_t now = time(NULL);
+
+        // key, key+1 and key+2 all hold the same Config
+        BOOST_REQUIRE(small.store(key+1, *third, P.dependencies(), ""));
+        fs::last_write_time(small.entry(key), now-100);
+        fs::last_write_time(small.entry(key+1), now-50);
+
+        std::vector<std::string> depends;
+        std::string output;
+        std::auto_ptr<Config> cached(small.load(key, depends, output)); // now most recently used
+        BOOST_REQUIRE(cached.get()!=NULL);
+
+        BOOST_REQUIRE(small.store(key+2, *third, P.dependencies(), ""));
+        BOOST_CHECK(fs::exists(small.entry(key)));
+        BOOST_CHECK(!fs::exists(small.entry(key+1)));
+        BOOST_CHECK(fs::exists(small.entry(key+2)));
+    }
+
+    fs::remove_all(dir);
+}
+
+static const char config_stream_input[] =
+"sim_type = \"Vector\";\n"
+"S: source, initial = [1, 1e-3, 1, 1e-3, 1, 1e-3];\n"
+"D1: drift, L=1;\n"
+"D2: drift, L=2;\n"
+"Q: quadrupole, L=0.5, K=2;\n"
+"cell: LINE = (D1, Q, D2);\n"
+"test: LINE = (S, 3*cell, D1);\n";
+
+namespace {
+struct CountSink : public GLPSParser::Sink {
+    std::string name;
+    size_t count;
+    std::vector<std::string> names;
+    bool ended;
+    CountSink() :count(0), ended(false) {}
+    virtual ~CountSink() {}
+    virtual void begin(const Config& top, size_t c) { name = top.get<std::string>("name"); count = c; }
+    virtual void element(const Config& conf) { names.push_back(conf.get<std::string>("name")); }
+    virtual void end() { ended = true; }
+};
+}
+
+BOOST_AUTO_TEST_CASE(config_stream)
+{
+    registerLinear();
+
+    GLPSParser P;
+    {
+        CountSink S;
+        P.parse_stream(S, config_stream_input, sizeof(config_stream_input)-1);
+        BOOST_CHECK_EQUAL(S.name, "test");
+        BOOST_CHECK_EQUAL(S.count, 11u);
+        BOOST_REQUIRE_EQUAL(S.names.size(), 11u);
+        BOOST_CHECK_EQUAL(S.names[0], "S");
+        BOOST_CHECK_EQUAL(S.names[2], "Q");
+        BOOST_CHECK_EQUAL(S.names[10], "D1");
+        BOOST_CHECK(S.ended);
+    }
+
+    std::auto_ptr<Config> conf(P.parse_byte(config_stream_input, sizeof(config_stream_input)-1));
+    Machine M1(*conf);
+
+    MachineBuilder B;
+    BOOST_CHECK_THROW(B.release(), std::logic_error);
+    P.parse_stream(B, config_stream_input, sizeof(config_stream_input)-1);
+    std::auto_ptr<Machine> M2(B.release());
+
+    BOOST_REQUIRE_EQUAL(M1.size(), M2->size());
+    for(size_t i=0; i<M1.size(); i++) {
+        BOOST_CHECK_EQUAL(M1[i]->name, (*M2)[i]->name);
+        BOOST_CHECK_EQUAL((*M2)[i]->index, i);
+    }
+    BOOST_CHECK_EQUAL(M2->find("Q", 2)->index, 8u);
+
+    std::ostringstream conf1, conf2;
+    GLPSPrint(conf1, M1.conf());
+    GLPSPrint(conf2, M2->conf());
+    BOOST_CHECK_EQUAL(conf1.str(), conf2.str());
+
+    std::auto_ptr<StateBase> S1(M1.allocState()), S2(M2->allocState());
+    M1.propagate(S1.get());
+    M2->propagate(S2.get());
+    std::ostringstream state1, state2;
+    state1<<*S1;
+    state2<<*S2;
+    BOOST_CHECK_EQUAL(state1.str(), state2.str());
+
+    // errors from element construction are passed through
+    static const char bad[] = "sim_type = \"Vector\";\nX: nosuchtype;\ntest: LINE = (X);\n";
+    MachineBuilder B2;
+    BOOST_CHECK_THROW(P.parse_stream(B2, bad, sizeof(bad)-1), key_error);
+    BOOST_CHECK_THROW(B2.release(), std::logic_error);
+
+    Machine::registeryCleanup();
+}
+
+static const char config_repeats_input[] =
+"sim_type = \"Vector\";\n"
+"S: source, initial = [1, 1e-3, 1, 1e-3, 1, 1e-3];\n"
+"D1: drift, L=1;\n"
+"D2: drift, L=2;\n"
+"Q: quadrupole, L=0.5, K=2;\n"
+"cell: LINE = (D1, Q, D2);\n"
+"pair: LINE = (D2, 2*cell);\n"
+"test: LINE = (S, -cell, 2*pair, 3*D1);\n";
+
+BOOST_AUTO_TEST_CASE(config_repeats)
+{
+    registerLinear();
+
+    GLPSParser P;
+    {
+        static const char *expect[] = {"S", "D2", "Q", "D1",
+                                       "D2", "D1", "Q", "D2", "D1", "Q", "D2",
+                                       "D2", "D1", "Q", "D2", "D1", "Q", "D2",
+                                       "D1", "D1", "D1"};
+        const size_t nexpect = sizeof(expect)/sizeof(expect[0]);
+        CountSink S;
+        P.parse_stream(S, config_repeats_input, sizeof(config_repeats_input)-1);
+        BOOST_CHECK_EQUAL(S.count, nexpect);
+        BOOST_REQUIRE_EQUAL(S.names.size(), nexpect);
+        for(size_t i=0; i<nexpect; i++)
+            BOOST_CHECK_EQUAL(S.names[i], expect[i]);
+    }
+    {
+        std::auto_ptr<Config> conf(P.parse_byte(config_stream_input, sizeof(config_stream_input)-1));
+        Machine M(*conf);
+        const Machine::repeats_t& R = M.repeats();
+        BOOST_REQUIRE_EQUAL(R.size(), 1u);
+        BOOST_CHECK_EQUAL(R[0].first, 1u);
+        BOOST_CHECK_EQUAL(R[0].length, 3u);
+        BOOST_CHECK_EQUAL(R[0].count, 3u);
+
+        // a changed occurrence is a different definition
+        M.setParam(4, "L", 1.5);
+        BOOST_REQUIRE_EQUAL(M.repeats().size(), 1u);
+        BOOST_CHECK_EQUAL(M.repeats()[0].first, 5u);
+        BOOST_CHECK_EQUAL(M.repeats()[0].count, 2u);
+    }
+    {
+        // many variants of one name, as after setParam() of each occurrence
+        Config conf;
+        conf.set<std::string>("sim_type", "Vector");
+        Config::vector_t elems;
+        for(size_t i=0; i<3000; i++) {
+            Config E;
+            E.set<std::string>("name", "D");
+            E.set<std::string>("type", "drift");
+            E.set<double>("L", i<1000 ? 1.0+i : 1.0+i%2);
+            elems.push_back(E);
+        }
+        conf.set<Config::vector_t>("elements", elems);
+        Machine M(conf);
+        const Machine::repeats_t& R = M.repeats();
+        BOOST_REQUIRE_EQUAL(R.size(), 1u);
+        BOOST_CHECK_EQUAL(R[0].first, 1000u);
+        BOOST_CHECK_EQUAL(R[0].length, 2u);
+        BOOST_CHECK_EQUAL(R[0].count, 1000u);
+    }
+
+    Machine::registeryCleanup();
+}
+
+namespace {
+struct PushAll {
+    Pipeline *P;
+    std::vector<StateBase*> *states;
+    void operator()() const
+    {
+        for(size_t i=0; i<states->size(); i++)
+            P->push((*states)[i]);
+    }
+};
+}
+
+BOOST_AUTO_TEST_CASE(config_pipeline_threads)
+{
+    registerLinear();
+    {
+        GLPSParser P;
+        std::auto_ptr<Config> conf(P.parse_byte(config_stream_input, sizeof(config_stream_input)-1));
+        Machine M(*conf);
+
+        std::auto_ptr<StateBase> expect(M.allocState());
+        M.propagate(expect.get());
+        std::ostringstream expect_str;
+        expect_str<<*expect;
+
+        // push() and pop() from different threads
+        std::vector<StateBase*> states(500);
+        for(size_t i=0; i<states.size(); i++)
+            states[i] = M.allocState();
+
+        {
+            Pipeline pipe(M, 3, 0, INT_MAX, 4);
+            PushAll pusher;
+            pusher.P = &pipe;
+            pusher.states = &states;
+            boost::thread T(pusher);
+
+            for(size_t i=0; i<states.size(); i++) {
+                while(pipe.pending()==0)
+                    boost::this_thread::yield();
+                BOOST_CHECK_EQUAL(pipe.pop(), states[i]);
+            }
+            T.join();
+            BOOST_CHECK_EQUAL(pipe.pending(), 0u);
+        }
+
+        for(size_t i=0; i<states.size(); i++) {
+            std::ostringstream strm;
+            strm<<*states[i];
+            BOOST_CHECK_EQUAL(strm.str(), expect_str.str());
+            delete states[i];
+        }
+    }
+    Machine::registeryCleanup();
+}
@@ -17,6 +17,7 @@
 #include <flame/state/vector.h>
 #include <flame/state/matrix.h>
 #include <flame/moment.h>
+#include <flame/scan.h>
 
 #ifdef USE_HDF5
 #include <flame/h5writer.h>
@@ -76,6 +77,13 @@ void getargs(int argc, char *argv[], po::variables_map& args)
             ("select-name,N", po::value<std::vector<std::string> >()->composing()->value_name("ENAME"),
                 "Select all elements with the given name for output")
             ("select-last,L", "Select last element for output")
+            ("scan", po::value<std::vector<std::string> >()->composing()->value_name("ELEM,PARAM,START,STOP,N"),
+                "Scan an element parameter over N values.  ELEM is an index or name.  Repeat for more axes.")
+            ("scan-zip", "Scan all axes together, instead of the grid of all combinations")
+            ("scan-field", po::value<std::vector<std::string> >()->composing()->value_name("NAME"),
+                "State field to output at the selected elements for each scan point (default moment0_env)")
+            ("scan-threads", po::value<unsigned>()->default_value(0)->value_name("NUM"),
+                "Number of threads for --scan.  (default is all cores)")
 #ifdef CLOCK_MONOTONIC
             ("timeit", "Measure execution time")
 #endif
@@ -100,6 +108,11 @@ void getargs(int argc, char *argv[], po::variables_map& args)
                    "        eg. '--format hdf5,file=out.h5'\n"
                    "\n"
 #endif
+                   "Scans:\n\n"
+                   " With --scan, the selected elements are observed for each scan point\n"
+                   " and printed as '<point> [<index>] <name> <field> <values...>'.\n"
+                   " eg. '--scan q1,B2,1.0,2.0,11 --select-type bpm --scan-field moment0_env'\n"
+                   "\n"
                    "Definitions:\n\n"
                    " Variable defintions made by arguments must specify a name, type, and value\n"
                    " The type may be: 'str'' or 'double', which may be abbreviated as 'S' or 'D'.\n"
@@ -349,6 +362,88 @@ struct H5Observer : public Observer
 };
 #endif
 
+// Build a Scan from --scan options.  Observe the selected elements, which are no longer selected.
+void setup_scan(Machine& sim, const po::variables_map& args, Scan& S)
+{
+    BOOST_FOREACH(const std::string& spec, args["scan"].as<std::vector<std::string> >()) {
+        strvect parts(tokenize(spec));
+        if(parts.size()!=5)
+            throw std::invalid_argument(SB()<<"--scan "<<spec<<" expects ELEM,PARAM,START,STOP,N");
+
+        size_t index;
+        try {
+            index = boost::lexical_cast<size_t>(parts[0]);
+        } catch(boost::bad_lexical_cast&) {
+            std::pair<Machine::lookup_iterator, Machine::lookup_iterator> R(sim.equal_range(parts[0]));
+            if(R.first==R.second)
+                throw std::invalid_argument(SB()<<"--scan "<<spec<<" element not found");
+            index = (*R.first)->index;
+        }
+
+        Scan::Axis A(index, parts[1]);
+        const double start = boost::lexical_cast<double>(parts[2]),
+                     stop  = boost::lexical_cast<double>(parts[3]);
+        const size_t N = boost::lexical_cast<size_t>(parts[4]);
+        for(size_t n=0; n<N; n++)
+            A.values.push_back(N>1 ? start + (stop-start)*n/(N-1) : start);
+        S.axes.push_back(A);
+    }
+
+    S.zip = args.count("scan-zip")>0;
+    S.nthreads = args["scan-threads"].as<unsigned>();
+
+    if(args.count("scan-field"))
+        S.fields = args["scan-field"].as<std::vector<std::string> >();
+    else
+        S.fields.push_back("moment0_env");
+
+    for(size_t i=0; i<sim.size(); i++) {
+        ElementVoid *elem = sim[i];
+        if(elem->observer()) {
+            S.observe.push_back(i);
+            delete elem->observer();
+            elem->set_observer(NULL);
+        }
+    }
+}
+
+void print_scan(Machine& sim, const Scan& S)
+{
+    const size_t npoints = S.npoints(), nobs = S.observe.size();
+
+    for(size_t p=0; p<npoints; p++) {
+        std::cout<<"# point "<<p;
+        size_t rem = p;
+        std::vector<double> vals(S.axes.size());
+        for(size_t a=S.axes.size(); a>0; a--) {
+            const Scan::Axis& A = S.axes[a-1];
+            if(S.zip) {
+                vals[a-1] = A.values[p];
+            } else {
+                vals[a-1] = A.values[rem%A.values.size()];
+                rem /= A.values.size();
+            }
+        }
+        for(size_t a=0; a<S.axes.size(); a++)
+            std::cout<<" ["<<S.axes[a].index<<"] "<<S.axes[a].name<<"="<<vals[a];
+        std::cout<<"\n";
+
+        for(size_t o=0; o<nobs; o++) {
+            for(size_t f=0; f<S.fields.size(); f++) {
+                size_t count = 1;
+                for(size_t d=0; d<S.shapes[f].size(); d++)
+                    count *= S.shapes[f][d];
+
+                std::cout<<p<<" ["<<S.observe[o]<<"] "<<sim[S.observe[o]]->name<<" "<<S.fields[f];
+                const double *val = &S.results[f][(p*nobs+o)*count];
+                for(size_t n=0; n<count; n++)
+                    std::cout<<" "<<std::scientific<<std::setprecision(16)<<val[n];
+                std::cout<<"\n";
+            }
+        }
+    }
+}
+
 struct Timer {
     timespec ts;
     Timer() {
@@ -551,6 +646,20 @@ try {
         }
     }
 
+    if(args.count("scan")) {
+        Scan S;
+        setup_scan(sim, args, S);
+
+        std::auto_ptr<StateBase> state(sim.allocState());
+        S.compute(sim, *state);
+        if(showtime) timeit.showdelta("Scan");
+
+        print_scan(sim, S);
+
+        Machine::registeryCleanup();
+        return 0;
+    }
+
     ofact->before_sim(sim);
 
     if(verb) {
@@ -9,11 +9,15 @@
 
 SimGlobal_t SimGlobal;
 
+// # of elements propagated between releases of Sim::lock
+static const size_t sim_step = 32;
+
 Sim::Sim(const std::string& n)
     :name(n)
     ,stop(false)
     ,doSim(false)
     ,valid(false)
+    ,running(false)
     ,level(0)
     ,worker(*this, "flame",
             epicsThreadGetStackSize(epicsThreadStackSmall),
@@ -51,17 +55,35 @@ void Sim::run()
         epicsTimeStamp start;
         epicsTimeGetCurrent(&start);
 
+        bool cancelled = false;
         try {
             std::auto_ptr<StateBase> state(machine->allocState());
 
-            machine->propagate(state.get());
+            cancel.reset();
+            Propagation P(*machine, state.get(), 0, INT_MAX, &cancel);
+
+            running = true;
+            while(P.step(sim_step)) {
+                // settings may be changed between steps, which cancels this propagation
+                UnGuard U(G);
+            }
+            running = false;
+            cancelled = P.cancelled();
 
             valid = true;
         }catch(std::exception& e){
+            running = false;
             last_msg = e.what();
             valid = false;
         }
 
+        if(cancelled) {
+            // abandon the stale result.  doSim is already set again
+            if(test_debug(1))
+                errlogPrintf("%s: sim restarted\n", name.c_str());
+            continue;
+        }
+
         epicsTimeGetCurrent(&last_run);
         last_duration = epicsTimeDiffInSeconds(&last_run, &start);
 
@@ -71,6 +93,8 @@ void Sim::run()
 
 void Sim::queueSim()
 {
+    cancel.cancel();
+
     if(!doSim) {
         if(test_debug(1))
             errlogPrintf("%s: do sim\n", name.c_str());
@@ -83,6 +107,12 @@ void Sim::queueSim()
     }
 }
 
+void Sim::settingChanged()
+{
+    if(running)
+        queueSim();
+}
+
 bool Sim::test_debug(unsigned lvl)
 {
     return lvl<=level;
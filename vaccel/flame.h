@@ -52,8 +52,12 @@ struct Sim : public epicsThreadRunable {
     bool stop;
     bool doSim;
     bool valid;
+    bool running; //!< a propagation is in progress, and lock may be released between steps
     unsigned level;
 
+    //! cancels the propagation in progress
+    CancelToken cancel;
+
     epicsMutex lock;
     epicsEvent event;
     epicsThread worker;
@@ -74,6 +78,8 @@ struct Sim : public epicsThreadRunable {
     virtual void run();
 
     void queueSim();
+    //! Called after a setting is changed.  Restarts any propagation in progress.
+    void settingChanged();
 
     bool test_debug(unsigned level);
 
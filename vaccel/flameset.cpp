@@ -98,13 +98,9 @@ long setting_change_ao(aoRecord *prec)
                         priv->param.c_str(),
                         value);
 
-        {
-            ElementVoid* elem = priv->sim->machine->at(priv->element_index);
-            Config conf(elem->conf());
-            conf.set<double>(priv->param, value);
-
-            priv->sim->machine->reconfigure(priv->element_index, conf);
-        }
+        // updates in place when possible, avoiding a full element rebuild
+        priv->sim->machine->setParam(priv->element_index, priv->param, value);
+        priv->sim->settingChanged();
 
         return 0;
     }CATCH_ALARM()